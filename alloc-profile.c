@@ -0,0 +1,393 @@
+/* The allocation profiler of --alloc-prof.
+ *
+ * Every allocation of the object heap is counted, with its size, by the
+ * class allocated and by the site allocating it: the method, and the pc the
+ * interpreter stored in its frame at the instruction allocating, which is the
+ * call for what the methods the VM implements allocate. The exceptions the VM
+ * raises at other instructions count at the last of those. Every thread
+ * counts into a hash table of its own, so counting takes no lock, and the
+ * reports add the tables up.
+ *
+ * Objects are never freed before the VM exits, see object-heap.c, so the
+ * instances allocated are the live ones, and the heap histogram is their
+ * count by class: the heap is not walked, and its blocks do not record their
+ * type anyway. The histogram is printed on exit, with the sites allocating
+ * the most, and whenever the VM receives SIGUSR1. The handler only wakes a
+ * thread of the profiler, which stops the world so that the tables hold
+ * still while it adds them up.
+ */
+
+/* for SA_RESTART */
+#define _DEFAULT_SOURCE
+
+#include <assert.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "alloc-profile.h"
+#include "output.h"
+#include "thread.h"
+
+#define TOP_SITES 30   /* printed on exit */
+#define SITES_SIZE 256 /* initial capacity of the table of a thread */
+
+/* What a site allocated, and how much of it */
+typedef struct {
+    const char *class_name; /* NULL while the slot is free */
+    u1 dimensions;          /* 0 unless an array */
+    u4 pc;
+    method_t *method; /* NULL outside of Java code */
+    class_file_t *clazz;
+    u8 count;
+    u8 bytes;
+} allocation_site_t;
+
+/* The sites a thread allocated from */
+typedef struct allocation_table {
+    allocation_site_t *sites;
+    u4 count, capacity;
+    struct allocation_table *next;
+} allocation_table_t;
+
+bool profiling_allocations;
+
+static __thread allocation_table_t *current_table;
+
+/* Guards the list of the tables */
+static pthread_mutex_t tables_lock = PTHREAD_MUTEX_INITIALIZER;
+static allocation_table_t *tables;
+
+static sem_t report_requested;
+static bool reports_stopped;
+static pthread_t reporter;
+
+static allocation_table_t *get_table()
+{
+    if (current_table)
+        return current_table;
+    allocation_table_t *table = calloc(1, sizeof(allocation_table_t));
+    assert(table && "Failed to allocate allocation profile");
+    pthread_mutex_lock(&tables_lock);
+    table->next = tables;
+    tables = table;
+    pthread_mutex_unlock(&tables_lock);
+    return current_table = table;
+}
+
+static u4 hash_site(const allocation_site_t *site)
+{
+    u8 hash = (uintptr_t) site->class_name;
+    hash = hash * 31 + site->dimensions;
+    hash = hash * 31 + (uintptr_t) site->method;
+    hash = hash * 31 + site->pc;
+    return (hash * 0x9e3779b97f4a7c15ULL) >> 32;
+}
+
+static bool same_site(const allocation_site_t *a, const allocation_site_t *b)
+{
+    return a->class_name == b->class_name && a->dimensions == b->dimensions &&
+           a->method == b->method && a->pc == b->pc;
+}
+
+static void insert_site(allocation_site_t *sites,
+                        u4 capacity,
+                        const allocation_site_t *site)
+{
+    u4 i = hash_site(site) & (capacity - 1);
+    while (sites[i].class_name)
+        i = (i + 1) & (capacity - 1);
+    sites[i] = *site;
+}
+
+/**
+ * Count objects the current thread allocated.
+ *
+ * @param class_name the binary name of their class, or of the elements for
+ * arrays, which must live until the VM exits
+ * @param dimensions the dimensions of the arrays, 0 for other objects
+ * @param count the number of objects
+ * @param size their size in bytes
+ */
+void count_allocation(const char *class_name,
+                      u1 dimensions,
+                      u8 count,
+                      size_t size)
+{
+    allocation_table_t *table = get_table();
+    if (2 * (table->count + 1) > table->capacity) {
+        u4 capacity = table->capacity ? 2 * table->capacity : SITES_SIZE;
+        allocation_site_t *sites = calloc(capacity, sizeof(allocation_site_t));
+        assert(sites && "Failed to grow allocation profile");
+        for (u4 i = 0; i < table->capacity; i++) {
+            if (table->sites[i].class_name)
+                insert_site(sites, capacity, &table->sites[i]);
+        }
+        free(table->sites);
+        table->sites = sites;
+        table->capacity = capacity;
+    }
+
+    thread_t *thread = current_thread;
+    java_frame_t *frame = thread ? thread->frame : NULL;
+    allocation_site_t key = {
+        .class_name = class_name,
+        .dimensions = dimensions,
+        .pc = frame ? frame->pc : 0,
+        .method = frame ? frame->method : NULL,
+        .clazz = frame ? frame->clazz : NULL,
+    };
+    u4 i = hash_site(&key) & (table->capacity - 1);
+    for (; table->sites[i].class_name; i = (i + 1) & (table->capacity - 1)) {
+        if (same_site(&table->sites[i], &key))
+            break;
+    }
+    allocation_site_t *site = &table->sites[i];
+    if (!site->class_name) {
+        *site = key;
+        table->count++;
+    }
+    site->count += count;
+    site->bytes += size;
+}
+
+static int compare_classes(const allocation_site_t *a,
+                           const allocation_site_t *b)
+{
+    int order = strcmp(a->class_name, b->class_name);
+    if (order)
+        return order;
+    return (int) a->dimensions - (int) b->dimensions;
+}
+
+/* By class, then by site */
+static int compare_keys(const void *a, const void *b)
+{
+    const allocation_site_t *x = a, *y = b;
+    int order = compare_classes(x, y);
+    if (order)
+        return order;
+    if (x->method != y->method)
+        return (uintptr_t) x->method < (uintptr_t) y->method ? -1 : 1;
+    return x->pc < y->pc ? -1 : x->pc > y->pc;
+}
+
+/* The most bytes first */
+static int compare_sizes(const void *a, const void *b)
+{
+    const allocation_site_t *x = a, *y = b;
+    if (x->bytes != y->bytes)
+        return x->bytes < y->bytes ? 1 : -1;
+    return x->count < y->count ? 1 : x->count > y->count ? -1 : 0;
+}
+
+/**
+ * Add up the tables of all the threads, which must not allocate meanwhile.
+ *
+ * @param classes set to the counts by class, the largest first
+ * @param classes_count set to the number of classes
+ * @param sites set to the counts by site, the largest first
+ * @param sites_count set to the number of sites
+ */
+static void add_up_tables(allocation_site_t **classes,
+                          u4 *classes_count,
+                          allocation_site_t **sites,
+                          u4 *sites_count)
+{
+    pthread_mutex_lock(&tables_lock);
+    u4 count = 0;
+    for (allocation_table_t *table = tables; table; table = table->next)
+        count += table->count;
+    allocation_site_t *all = malloc((count + 1) * sizeof(allocation_site_t));
+    assert(all && "Failed to allocate allocation report");
+    count = 0;
+    for (allocation_table_t *table = tables; table; table = table->next) {
+        for (u4 i = 0; i < table->capacity; i++) {
+            if (table->sites[i].class_name)
+                all[count++] = table->sites[i];
+        }
+    }
+    pthread_mutex_unlock(&tables_lock);
+
+    /* the same site in several threads, then the sites of a class, are
+     * adjacent once sorted */
+    qsort(all, count, sizeof(allocation_site_t), compare_keys);
+    u4 merged = 0;
+    for (u4 i = 0; i < count; i++) {
+        if (merged && !compare_keys(&all[merged - 1], &all[i])) {
+            all[merged - 1].count += all[i].count;
+            all[merged - 1].bytes += all[i].bytes;
+        } else {
+            all[merged++] = all[i];
+        }
+    }
+
+    allocation_site_t *by_class =
+        malloc((merged + 1) * sizeof(allocation_site_t));
+    assert(by_class && "Failed to allocate allocation report");
+    u4 classes_merged = 0;
+    for (u4 i = 0; i < merged; i++) {
+        if (classes_merged &&
+            !compare_classes(&by_class[classes_merged - 1], &all[i])) {
+            by_class[classes_merged - 1].count += all[i].count;
+            by_class[classes_merged - 1].bytes += all[i].bytes;
+        } else {
+            by_class[classes_merged++] = all[i];
+        }
+    }
+
+    qsort(all, merged, sizeof(allocation_site_t), compare_sizes);
+    qsort(by_class, classes_merged, sizeof(allocation_site_t), compare_sizes);
+    *classes = by_class;
+    *classes_count = classes_merged;
+    *sites = all;
+    *sites_count = merged;
+}
+
+/* Print a binary class name the way Java source names it */
+static void print_class_name(const char *name, u1 dimensions)
+{
+    for (const char *c = name; *c; c++)
+        fputc(*c == '/' ? '.' : *c, stderr);
+    for (u1 i = 0; i < dimensions; i++)
+        fputs("[]", stderr);
+}
+
+/* Print the heap histogram, and the sites allocating the most if asked to */
+static void print_report(bool print_sites)
+{
+    allocation_site_t *classes, *sites;
+    u4 classes_count, sites_count;
+    add_up_tables(&classes, &classes_count, &sites, &sites_count);
+
+    u8 instances = 0, bytes = 0;
+    for (u4 i = 0; i < classes_count; i++) {
+        instances += classes[i].count;
+        bytes += classes[i].bytes;
+    }
+
+    lock_output();
+    flush_output();
+    fprintf(stderr,
+            "heap histogram: %" PRIu64 " instances, %" PRIu64 " bytes\n",
+            instances, bytes);
+    fprintf(stderr, "%14s %14s  %s\n", "instances", "bytes", "class");
+    for (u4 i = 0; i < classes_count; i++) {
+        fprintf(stderr, "%14" PRIu64 " %14" PRIu64 "  ", classes[i].count,
+                classes[i].bytes);
+        print_class_name(classes[i].class_name, classes[i].dimensions);
+        fputc('\n', stderr);
+    }
+    if (print_sites) {
+        fprintf(stderr, "allocation sites: %" PRIu32 "\n", sites_count);
+        fprintf(stderr, "%14s %14s  %s\n", "instances", "bytes",
+                "class at site");
+        for (u4 i = 0; i < sites_count && i < TOP_SITES; i++) {
+            allocation_site_t *site = &sites[i];
+            fprintf(stderr, "%14" PRIu64 " %14" PRIu64 "  ", site->count,
+                    site->bytes);
+            print_class_name(site->class_name, site->dimensions);
+            fputs(" at ", stderr);
+            if (site->method) {
+                print_class_name(find_class_name_from_index(
+                                     site->clazz->info->this_class,
+                                     site->clazz),
+                                 0);
+                fprintf(stderr, ".%s:%" PRIu32 "\n", site->method->name,
+                        site->pc);
+            } else {
+                fputs("[vm]\n", stderr);
+            }
+        }
+    }
+    unlock_output();
+
+    free(classes);
+    free(sites);
+}
+
+static void request_report(int signal)
+{
+    (void) signal;
+    sem_post(&report_requested);
+}
+
+static void *reporter_main(void *arg)
+{
+    (void) arg;
+    for (;;) {
+        while (sem_wait(&report_requested))
+            ; /* interrupted */
+        if (__atomic_load_n(&reports_stopped, __ATOMIC_ACQUIRE))
+            return NULL;
+
+        /* counts as a running thread while it stops the others */
+        leave_blocking();
+        stop_the_world();
+        print_report(false);
+        resume_the_world();
+        enter_blocking();
+    }
+}
+
+/**
+ * Print the heap histogram whenever the VM receives SIGUSR1.
+ *
+ * @return false if the thread printing it could not start
+ */
+bool start_allocation_reports()
+{
+    sem_init(&report_requested, 0, 0);
+
+    /* samples are taken from the threads running Java code */
+    sigset_t set, old_set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGPROF);
+    pthread_sigmask(SIG_BLOCK, &set, &old_set);
+    bool started = !pthread_create(&reporter, NULL, reporter_main, NULL);
+    pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+    if (!started) {
+        sem_destroy(&report_requested);
+        return false;
+    }
+
+    struct sigaction action = {.sa_handler = request_report};
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1, &action, NULL);
+    return true;
+}
+
+/* Stop printing the histogram on SIGUSR1, which is ignored from then on */
+void stop_allocation_reports()
+{
+    struct sigaction action = {.sa_handler = SIG_IGN};
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGUSR1, &action, NULL);
+
+    __atomic_store_n(&reports_stopped, true, __ATOMIC_RELEASE);
+    sem_post(&report_requested);
+    pthread_join(reporter, NULL);
+    sem_destroy(&report_requested);
+}
+
+/**
+ * Print the heap histogram and the sites allocating the most, then free the
+ * counts. Called on exit, once the other threads have ended or are stopped.
+ */
+void report_allocations()
+{
+    print_report(true);
+
+    while (tables) {
+        allocation_table_t *next = tables->next;
+        free(tables->sites);
+        free(tables);
+        tables = next;
+    }
+    current_table = NULL;
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+/* The allocation profiler of --alloc-prof, see alloc-profile.c */
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "type.h"
+
+extern bool profiling_allocations;
+
+void count_allocation(const char *class_name,
+                      u1 dimensions,
+                      u8 count,
+                      size_t size);
+bool start_allocation_reports();
+void stop_allocation_reports();
+void report_allocations();
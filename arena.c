@@ -0,0 +1,68 @@
+#include <assert.h>
+#include <stdlib.h>
+
+#include "arena.h"
+
+/* size of the first chunk of an arena which was not initialized */
+#define ARENA_MIN_CHUNK_SIZE 4096
+
+struct arena_chunk {
+    arena_chunk_t *next; /* the chunk filled before this one */
+    size_t size;
+    size_t used;
+    u8 data[]; /* aligned for any structure allocated from an arena */
+};
+
+static arena_chunk_t *new_chunk(size_t size, arena_chunk_t *next)
+{
+    arena_chunk_t *chunk = calloc(1, sizeof(arena_chunk_t) + size);
+    assert(chunk && "Failed to allocate arena");
+    chunk->next = next;
+    chunk->size = size;
+    return chunk;
+}
+
+/**
+ * Create an arena. Its first chunk should be large enough for everything
+ * allocated from it, further chunks are only added when it is not.
+ * A zeroed arena_t is a valid arena as well, which starts empty.
+ *
+ * @param arena the arena to initialize
+ * @param size the expected number of bytes allocated from the arena
+ */
+void init_arena(arena_t *arena, size_t size)
+{
+    arena->chunk = new_chunk(size, NULL);
+}
+
+/**
+ * Allocate zeroed memory that lives until the arena is freed.
+ *
+ * @param arena the arena to allocate from
+ * @param size number of bytes to allocate
+ * @return the allocated memory
+ */
+void *arena_alloc(arena_t *arena, size_t size)
+{
+    size = (size + sizeof(u8) - 1) & ~(sizeof(u8) - 1);
+    arena_chunk_t *chunk = arena->chunk;
+    if (!chunk || chunk->size - chunk->used < size) {
+        size_t chunk_size = chunk ? chunk->size : ARENA_MIN_CHUNK_SIZE;
+        chunk = new_chunk(size > chunk_size ? size : chunk_size, chunk);
+        arena->chunk = chunk;
+    }
+    void *ptr = (u1 *) chunk->data + chunk->used;
+    chunk->used += size;
+    return ptr;
+}
+
+void free_arena(arena_t *arena)
+{
+    arena_chunk_t *chunk = arena->chunk;
+    while (chunk) {
+        arena_chunk_t *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    arena->chunk = NULL;
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "type.h"
+
+typedef struct arena_chunk arena_chunk_t;
+
+/* Bump allocator whose allocations are all freed at once */
+typedef struct {
+    arena_chunk_t *chunk; /* the chunk allocations are taken from */
+} arena_t;
+
+void init_arena(arena_t *arena, size_t size);
+void *arena_alloc(arena_t *arena, size_t size);
+void free_arena(arena_t *arena);
@@ -0,0 +1,362 @@
+#include "bounds-check.h"
+#include "opcode.h"
+
+bounds_check_stats_t bounds_check_stats;
+
+/* Local variable read by an iload instruction, or -1 */
+static int iload_index(const u1 *code, uint32_t pc)
+{
+    if (code[pc] == i_iload)
+        return code[pc + 1];
+    if (code[pc] >= i_iload_0 && code[pc] <= i_iload_3)
+        return code[pc] - i_iload_0;
+    return -1;
+}
+
+/* Local variable read by an aload instruction, or -1 */
+static int aload_index(const u1 *code, uint32_t pc)
+{
+    if (code[pc] == i_aload)
+        return code[pc + 1];
+    if (code[pc] >= i_aload_0 && code[pc] <= i_aload_3)
+        return code[pc] - i_aload_0;
+    return -1;
+}
+
+/* Local variable written by a store or iinc instruction, or -1 */
+static int store_index(const u1 *code, uint32_t pc)
+{
+    u1 op = code[pc];
+    if ((op >= i_istore && op <= i_astore) || op == i_iinc)
+        return code[pc + 1];
+    /* istore_<n>, lstore_<n>, fstore_<n>, dstore_<n>, astore_<n> */
+    if (op >= i_istore_0 && op <= i_astore_3)
+        return (op - i_istore_0) % 4;
+    if (op == i_wide) {
+        u1 wide_op = code[pc + 1];
+        if ((wide_op >= i_istore && wide_op <= i_astore) || wide_op == i_iinc)
+            return code[pc + 2] << 8 | code[pc + 3];
+    }
+    return -1;
+}
+
+/* Whether a store instruction is lstore or dstore, which write the slot after
+ * theirs too */
+static bool stores_two_slots(const u1 *code, uint32_t pc)
+{
+    u1 op = code[pc] == i_wide ? code[pc + 1] : code[pc];
+    if (op == i_lstore || op == i_dstore)
+        return true;
+    /* <t>store_<n> by type: i, l, f, d, then a */
+    if (op >= i_istore_0 && op <= i_astore_3) {
+        int type = (op - i_istore_0) / 4;
+        return type == 1 || type == 3;
+    }
+    return false;
+}
+
+/* Whether a store or iinc instruction writes a local variable */
+static bool stores_to(const u1 *code, uint32_t pc, int local)
+{
+    int index = store_index(code, pc);
+    if (index < 0)
+        return false;
+    return index == local ||
+           (index + 1 == local && stores_two_slots(code, pc));
+}
+
+static bool is_istore(const u1 *code, uint32_t pc)
+{
+    return code[pc] == i_istore ||
+           (code[pc] >= i_istore_0 && code[pc] <= i_istore_3);
+}
+
+static bool pushes_non_negative(const u1 *code, uint32_t pc)
+{
+    switch (code[pc]) {
+    case i_iconst_0:
+    case i_iconst_1:
+    case i_iconst_2:
+    case i_iconst_3:
+    case i_iconst_4:
+    case i_iconst_5:
+        return true;
+    case i_bipush:
+        return (int8_t) code[pc + 1] >= 0;
+    case i_sipush:
+        return read_s2(code, pc + 1) >= 0;
+    default:
+        return false;
+    }
+}
+
+/* Instructions that push exactly one value without side effects */
+static bool is_simple_push(const u1 *code, uint32_t pc)
+{
+    u1 op = code[pc];
+    return (op >= i_iconst_m1 && op <= i_lconst_1) || op == i_bipush ||
+           op == i_sipush || op == i_ldc || op == i_ldc2_w ||
+           (op >= i_iload && op <= i_aload_3);
+}
+
+static u1 unchecked_form(u1 op)
+{
+    switch (op) {
+    case i_iaload:
+        return i_iaload_unchecked;
+    case i_laload:
+        return i_laload_unchecked;
+    case i_aaload:
+        return i_aaload_unchecked;
+    case i_baload:
+        return i_baload_unchecked;
+    case i_caload:
+        return i_caload_unchecked;
+    case i_saload:
+        return i_saload_unchecked;
+    case i_iastore:
+        return i_iastore_unchecked;
+    case i_lastore:
+        return i_lastore_unchecked;
+    case i_aastore:
+        return i_aastore_unchecked;
+    case i_bastore:
+        return i_bastore_unchecked;
+    case i_castore:
+        return i_castore_unchecked;
+    case i_sastore:
+        return i_sastore_unchecked;
+    default:
+        return 0;
+    }
+}
+
+static bool is_array_load(u1 op)
+{
+    return op >= i_iaload && op <= i_saload && unchecked_form(op);
+}
+
+static bool is_array_store(u1 op)
+{
+    return op >= i_iastore && op <= i_sastore && unchecked_form(op);
+}
+
+static uint32_t get_branch_target_count(const u1 *code, uint32_t pc)
+{
+    u1 op = code[pc];
+    if ((op >= i_ifeq && op <= i_jsr) || op == i_ifnull || op == i_ifnonnull ||
+        op == i_goto_w || op == i_jsr_w)
+        return 1;
+    uint32_t operands = (pc + 4) & ~3U;
+    if (op == i_tableswitch)
+        return 1 + (uint32_t) (read_s4(code, operands + 8) -
+                               read_s4(code, operands + 4) + 1);
+    if (op == i_lookupswitch)
+        return 1 + (uint32_t) read_s4(code, operands + 4);
+    return 0;
+}
+
+/* The n-th branch target of the instruction at pc. For switches the default
+ * target comes first.
+ */
+static uint32_t get_branch_target(const u1 *code, uint32_t pc, uint32_t n)
+{
+    u1 op = code[pc];
+    if (op == i_goto_w || op == i_jsr_w)
+        return pc + read_s4(code, pc + 1);
+    if (op != i_tableswitch && op != i_lookupswitch)
+        return pc + read_s2(code, pc + 1);
+
+    uint32_t operands = (pc + 4) & ~3U;
+    if (!n)
+        return pc + read_s4(code, operands);
+    if (op == i_tableswitch)
+        return pc + read_s4(code, operands + 12 + 4 * (n - 1));
+    return pc + read_s4(code, operands + 8 + 8 * (n - 1) + 4);
+}
+
+static bool branches_into(const u1 *code,
+                          uint32_t pc,
+                          uint32_t from,
+                          uint32_t to)
+{
+    uint32_t count = get_branch_target_count(code, pc);
+    for (uint32_t n = 0; n < count; n++) {
+        uint32_t target = get_branch_target(code, pc, n);
+        if (target >= from && target <= to)
+            return true;
+    }
+    return false;
+}
+
+/* Index of the instruction starting at pc, or count if there is none */
+static uint32_t find_instruction(uint32_t *starts, uint32_t count, uint32_t pc)
+{
+    uint32_t low = 0, high = count;
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        if (starts[mid] < pc)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low < count && starts[low] == pc ? low : count;
+}
+
+/**
+ * Try to prove the array accesses of a counted loop in bounds.
+ *
+ * The recognized shape is what javac emits for
+ * `for (int i = <non-negative>; i < a.length; i++)`:
+ *
+ *          iconst/bipush/sipush <non-negative>
+ *          istore k
+ *   header iload k; aload a; arraylength; if_icmpge end
+ *          <body>
+ *          iinc k 1
+ *          goto header
+ *   end
+ *
+ * If the istore is no branch target, the body never stores to k or a and the
+ * loop can only be entered through the header, then 0 <= k < a.length holds
+ * throughout the body, so `aload a; iload k; <t>aload` and
+ * `aload a; iload k; <push>; <t>astore` need no bounds check.
+ *
+ * @param code the method code, rewritten in place
+ * @param starts offsets of all instructions in the code
+ * @param count number of instructions in the code
+ * @param targets marks the instructions which are branch targets
+ * @param h index of the loop header instruction
+ * @param g index of the backward goto instruction
+ */
+static void analyze_loop(code_t *code,
+                         uint32_t *starts,
+                         uint32_t count,
+                         bool *targets,
+                         uint32_t h,
+                         uint32_t g)
+{
+    u1 *buf = code->code;
+    if (h < 2 || h + 4 >= g)
+        return;
+
+    int k = iload_index(buf, starts[h]);
+    int a = aload_index(buf, starts[h + 1]);
+    if (k < 0 || a < 0 || buf[starts[h + 2]] != i_arraylength ||
+        buf[starts[h + 3]] != i_if_icmpge ||
+        starts[h + 3] + read_s2(buf, starts[h + 3] + 1) != starts[g] + 3)
+        return;
+
+    /* the index starts non-negative: the store is only reached by falling
+     * through from the push, and not by a branch which brings the value of
+     * a conditional expression, like c ? -1 : 0 */
+    if (!is_istore(buf, starts[h - 1]) ||
+        store_index(buf, starts[h - 1]) != k || targets[h - 1] ||
+        !pushes_non_negative(buf, starts[h - 2]))
+        return;
+
+    /* and is only incremented by one, right before jumping back to the
+     * header: as k < a.length <= INT_MAX, k + 1 cannot overflow, while a
+     * larger step could wrap k around to a negative index */
+    uint32_t last = g - 1;
+    if (buf[starts[last]] != i_iinc || buf[starts[last] + 1] != k ||
+        buf[starts[last] + 2] != 1)
+        return;
+    for (uint32_t i = h + 4; i < last; i++) {
+        if (stores_to(buf, starts[i], k) || stores_to(buf, starts[i], a))
+            return;
+    }
+
+    /* the loop is only entered through the header */
+    for (uint32_t i = 0; i < count; i++) {
+        bool inside = i >= h && i <= g;
+        if (branches_into(buf, starts[i], inside ? starts[h] + 1 : starts[h],
+                          inside ? starts[h + 4] - 1 : starts[g]))
+            return;
+    }
+
+    /* nor by a handler for exceptions thrown where the bounds may not hold */
+    for (u2 i = 0; i < code->handlers_count; i++) {
+        exception_handler_t *handler = &code->handlers[i];
+        if (handler->handler_pc >= starts[h] &&
+            handler->handler_pc <= starts[g] &&
+            (handler->start_pc < starts[h + 4] ||
+             handler->end_pc > starts[g]))
+            return;
+    }
+
+    for (uint32_t i = h + 4; i + 2 < last; i++) {
+        if (aload_index(buf, starts[i]) != a ||
+            iload_index(buf, starts[i + 1]) != k || targets[i + 1] ||
+            targets[i + 2])
+            continue;
+
+        uint32_t access = i + 2;
+        if (!is_array_load(buf[starts[access]])) {
+            if (access + 1 >= last || !is_simple_push(buf, starts[access]) ||
+                targets[access + 1] || !is_array_store(buf[starts[access + 1]]))
+                continue;
+            access++;
+        }
+        buf[starts[access]] = unchecked_form(buf[starts[access]]);
+        bounds_check_stats.eliminated++;
+    }
+}
+
+/**
+ * Rewrite the array accesses of a method which are proven in bounds into
+ * their unchecked forms.
+ *
+ * @param code the method code, rewritten in place
+ */
+void eliminate_bounds_checks(code_t *code)
+{
+    u1 *buf = code->code;
+    uint32_t *starts = malloc(sizeof(uint32_t) * code->code_length);
+    uint32_t count = 0;
+    bool has_loop = false;
+
+    for (uint32_t pc = 0; pc < code->code_length; count++) {
+        uint32_t length = get_instruction_length(buf, pc);
+        /* leave code with undefined instructions alone */
+        if (!length) {
+            free(starts);
+            return;
+        }
+        starts[count] = pc;
+        if (is_array_load(buf[pc]) || is_array_store(buf[pc]))
+            bounds_check_stats.array_accesses++;
+        if (buf[pc] == i_goto && read_s2(buf, pc + 1) < 0)
+            has_loop = true;
+        pc += length;
+    }
+
+    if (has_loop) {
+        bool *targets = calloc(count, sizeof(bool));
+        for (uint32_t i = 0; i < count; i++) {
+            for (uint32_t n = get_branch_target_count(buf, starts[i]); n--;) {
+                uint32_t target = find_instruction(
+                    starts, count, get_branch_target(buf, starts[i], n));
+                if (target < count)
+                    targets[target] = true;
+            }
+        }
+        for (u2 i = 0; i < code->handlers_count; i++) {
+            uint32_t target = find_instruction(starts, count,
+                                               code->handlers[i].handler_pc);
+            if (target < count)
+                targets[target] = true;
+        }
+
+        for (uint32_t g = 0; g < count; g++) {
+            if (buf[starts[g]] != i_goto || read_s2(buf, starts[g] + 1) >= 0)
+                continue;
+            uint32_t h = find_instruction(
+                starts, count, starts[g] + read_s2(buf, starts[g] + 1));
+            if (h < count)
+                analyze_loop(code, starts, count, targets, h, g);
+        }
+        free(targets);
+    }
+    free(starts);
+}
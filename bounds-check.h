@@ -0,0 +1,12 @@
+#pragma once
+
+#include "classfile.h"
+
+typedef struct {
+    uint32_t array_accesses; /* array load/store instructions analyzed */
+    uint32_t eliminated;     /* of which proven to be in bounds */
+} bounds_check_stats_t;
+
+extern bounds_check_stats_t bounds_check_stats;
+
+void eliminate_bounds_checks(code_t *code);
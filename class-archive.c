@@ -0,0 +1,420 @@
+#include <fcntl.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "class-archive.h"
+#include "class-path.h"
+
+#define ARCHIVE_MAGIC "PVMCDS\0"
+#define ARCHIVE_VERSION 5
+
+class_archive_stats_t class_archive_stats;
+
+/* Archives are only valid for the VM build whose structure layout they use */
+static u4 get_archive_layout()
+{
+    return (u4) (sizeof(void *) | sizeof(class_file_t) << 8 |
+                 sizeof(method_t) << 16 | sizeof(field_t) << 24);
+}
+
+typedef struct {
+    u1 *data;
+    size_t size, capacity;
+    u8 *relocations;
+    size_t relocation_count, relocation_capacity;
+    /* open addressing table of the offsets of the interned strings */
+    size_t *strings;
+    size_t string_count, string_capacity;
+} archive_writer_t;
+
+/**
+ * Reserve zeroed space in the archive.
+ * The data may move, so only offsets stay valid across calls.
+ *
+ * @param writer the archive being written
+ * @param size number of bytes to reserve
+ * @return the offset of the space, aligned for any archived structure
+ */
+static size_t reserve(archive_writer_t *writer, size_t size)
+{
+    size_t offset = (writer->size + sizeof(u8) - 1) & ~(sizeof(u8) - 1);
+    if (offset + size > writer->capacity) {
+        size_t capacity = writer->capacity * 2;
+        while (offset + size > capacity)
+            capacity *= 2;
+        writer->data = realloc(writer->data, capacity);
+        assert(writer->data && "Failed to grow archive");
+        memset(writer->data + writer->capacity, 0,
+               capacity - writer->capacity);
+        writer->capacity = capacity;
+    }
+    writer->size = offset + size;
+    return offset;
+}
+
+static size_t write_bytes(archive_writer_t *writer,
+                          const void *src,
+                          size_t size)
+{
+    size_t offset = reserve(writer, size);
+    memcpy(writer->data + offset, src, size);
+    return offset;
+}
+
+/* Store a pointer to an archived object, and remember to relocate it */
+static void set_pointer(archive_writer_t *writer, size_t slot, size_t target)
+{
+    uintptr_t value = target;
+    memcpy(writer->data + slot, &value, sizeof(value));
+    if (!target)
+        return;
+
+    if (writer->relocation_count == writer->relocation_capacity) {
+        writer->relocation_capacity *= 2;
+        writer->relocations =
+            realloc(writer->relocations,
+                    sizeof(u8) * writer->relocation_capacity);
+        assert(writer->relocations && "Failed to grow relocation table");
+    }
+    writer->relocations[writer->relocation_count++] = slot;
+}
+
+static size_t hash_string(const char *str)
+{
+    /* FNV-1a */
+    size_t hash = 2166136261u;
+    for (; *str; str++)
+        hash = (hash ^ (u1) *str) * 16777619u;
+    return hash;
+}
+
+/* Write a string once, however many names and constants share it */
+static size_t intern_string(archive_writer_t *writer, const char *str)
+{
+    if (2 * (writer->string_count + 1) > writer->string_capacity) {
+        size_t capacity = writer->string_capacity * 2;
+        size_t *strings = calloc(capacity, sizeof(size_t));
+        assert(strings && "Failed to grow string table");
+        for (size_t i = 0; i < writer->string_capacity; i++) {
+            size_t offset = writer->strings[i];
+            if (!offset)
+                continue;
+            size_t j = hash_string((char *) writer->data + offset);
+            while (strings[j & (capacity - 1)])
+                j++;
+            strings[j & (capacity - 1)] = offset;
+        }
+        free(writer->strings);
+        writer->strings = strings;
+        writer->string_capacity = capacity;
+    }
+
+    size_t mask = writer->string_capacity - 1;
+    for (size_t i = hash_string(str);; i++) {
+        size_t offset = writer->strings[i & mask];
+        if (!offset) {
+            offset = write_bytes(writer, str, strlen(str) + 1);
+            writer->strings[i & mask] = offset;
+            writer->string_count++;
+            return offset;
+        }
+        if (!strcmp((char *) writer->data + offset, str))
+            return offset;
+    }
+}
+
+/* Write the payloads of a constant pool, whose tags are archived already */
+static size_t write_constant_pool(archive_writer_t *writer,
+                                  constant_pool_t *cp)
+{
+    size_t pool =
+        write_bytes(writer, cp->info, sizeof(const_pool_info) * cp->count);
+    for (u2 i = 0; i < cp->count; i++) {
+        if (cp->tags[i] != CONSTANT_Utf8)
+            continue;
+        size_t slot = pool + sizeof(const_pool_info) * i;
+        set_pointer(writer, slot + offsetof(const_pool_info, utf8),
+                    intern_string(writer, cp->info[i].utf8));
+    }
+    return pool;
+}
+
+static size_t write_methods(archive_writer_t *writer, class_file_t *clazz)
+{
+    u2 count = 0;
+    while (clazz->methods[count].name)
+        count++;
+
+    /* the NULL name marking the end of the array is already zeroed */
+    size_t methods = reserve(writer, sizeof(method_t) * (count + 1));
+    for (u2 i = 0; i < count; i++) {
+        method_t *method = &clazz->methods[i];
+        /* archive the code linked and ready to run */
+        if (!method->code.code)
+            load_method_code(method, clazz);
+
+        size_t slot = methods + sizeof(method_t) * i;
+        method_t copy = {
+            .code.max_stack = method->code.max_stack,
+            .code.max_locals = method->code.max_locals,
+            .code.code_length = method->code.code_length,
+            .code.handlers_count = method->code.handlers_count,
+            .access_flags = method->access_flags,
+        };
+        memcpy(writer->data + slot, &copy, sizeof(copy));
+        set_pointer(writer, slot + offsetof(method_t, name),
+                    intern_string(writer, method->name));
+        set_pointer(writer, slot + offsetof(method_t, descriptor),
+                    intern_string(writer, method->descriptor));
+        set_pointer(writer, slot + offsetof(method_t, code.code),
+                    write_bytes(writer, method->code.code,
+                                method->code.code_length));
+        set_pointer(writer, slot + offsetof(method_t, code.handlers),
+                    write_bytes(writer, method->code.handlers,
+                                sizeof(exception_handler_t) *
+                                    method->code.handlers_count));
+    }
+    return methods;
+}
+
+static size_t write_fields(archive_writer_t *writer, class_file_t *clazz)
+{
+    size_t fields =
+        reserve(writer, sizeof(field_t) * (clazz->fields_count + 1));
+    for (u2 i = 0; i < clazz->fields_count; i++) {
+        field_t *field = &clazz->fields[i];
+        size_t slot = fields + sizeof(field_t) * i;
+        set_pointer(writer, slot + offsetof(field_t, name),
+                    intern_string(writer, field->name));
+        set_pointer(writer, slot + offsetof(field_t, descriptor),
+                    intern_string(writer, field->descriptor));
+        /* static fields start out zeroed in every run */
+        set_pointer(writer, slot + offsetof(field_t, static_var),
+                    reserve(writer, sizeof(variable_t)));
+    }
+    return fields;
+}
+
+static size_t write_bootstrap(archive_writer_t *writer,
+                              bootmethods_attr_t *bootstrap)
+{
+    size_t attr = write_bytes(writer, bootstrap, sizeof(*bootstrap));
+    size_t methods = reserve(
+        writer, sizeof(bootmethods_t) * bootstrap->num_bootstrap_methods);
+    set_pointer(writer, attr + offsetof(bootmethods_attr_t, bootstrap_methods),
+                methods);
+    for (u2 i = 0; i < bootstrap->num_bootstrap_methods; i++) {
+        bootmethods_t *method = &bootstrap->bootstrap_methods[i];
+        size_t slot = methods + sizeof(bootmethods_t) * i;
+        bootmethods_t copy = {
+            .bootstrap_method_ref = method->bootstrap_method_ref,
+            .num_bootstrap_arguments = method->num_bootstrap_arguments,
+        };
+        memcpy(writer->data + slot, &copy, sizeof(copy));
+        set_pointer(writer, slot + offsetof(bootmethods_t, bootstrap_arguments),
+                    write_bytes(writer, method->bootstrap_arguments,
+                                sizeof(u2) * method->num_bootstrap_arguments));
+    }
+    return attr;
+}
+
+/**
+ * Archive a class as it is ready to run before initialization: method code
+ * is loaded, static fields are zeroed and the class is not initialized.
+ *
+ * @param writer the archive being written
+ * @param clazz the class to archive
+ * @return the offset of the archived class_file_t
+ */
+static size_t write_class(archive_writer_t *writer, class_file_t *clazz)
+{
+    size_t slot = reserve(writer, sizeof(class_file_t));
+    class_file_t copy = {
+        .constant_pool.count = clazz->constant_pool.count,
+        .fields_count = clazz->fields_count,
+        .initialized = false,
+    };
+    memcpy(writer->data + slot, &copy, sizeof(copy));
+
+    set_pointer(writer, slot + offsetof(class_file_t, constant_pool.tags),
+                write_bytes(writer, clazz->constant_pool.tags,
+                            clazz->constant_pool.count));
+    set_pointer(writer, slot + offsetof(class_file_t, constant_pool.info),
+                write_constant_pool(writer, &clazz->constant_pool));
+    /* constants are resolved anew in every run */
+    set_pointer(writer, slot + offsetof(class_file_t, resolved),
+                reserve(writer, sizeof(resolved_constant_t) *
+                                    clazz->constant_pool.count));
+    set_pointer(writer, slot + offsetof(class_file_t, info),
+                write_bytes(writer, clazz->info, sizeof(*clazz->info)));
+    set_pointer(writer, slot + offsetof(class_file_t, methods),
+                write_methods(writer, clazz));
+    set_pointer(writer, slot + offsetof(class_file_t, fields),
+                write_fields(writer, clazz));
+    if (clazz->bootstrap)
+        set_pointer(writer, slot + offsetof(class_file_t, bootstrap),
+                    write_bootstrap(writer, clazz->bootstrap));
+    return slot;
+}
+
+/**
+ * Write the loaded classes of the class heap into an archive file.
+ *
+ * @param path the archive file to create
+ * @param classes the class heap entries, those not loaded are skipped
+ * @param count number of entries
+ * @return true if the archive was written
+ */
+bool write_class_archive(const char *path,
+                         meta_class_t **classes,
+                         size_t count)
+{
+    archive_writer_t writer = {
+        .capacity = 1 << 16,
+        .relocation_capacity = 1 << 10,
+        .string_capacity = 1 << 10,
+    };
+    writer.data = calloc(1, writer.capacity);
+    writer.relocations = malloc(sizeof(u8) * writer.relocation_capacity);
+    writer.strings = calloc(writer.string_capacity, sizeof(size_t));
+    assert(writer.data && writer.relocations && writer.strings &&
+           "Failed to allocate archive");
+
+    /* offset 0 is taken by the header, so no object is at NULL */
+    reserve(&writer, sizeof(archive_header_t));
+
+    u8 class_count = 0;
+    for (size_t i = 0; i < count; i++)
+        class_count += classes[i]->state == CLASS_LOADED;
+    size_t table = reserve(&writer, sizeof(archive_class_t) * class_count);
+
+    for (size_t i = 0, j = 0; i < count; i++) {
+        if (classes[i]->state != CLASS_LOADED)
+            continue;
+        struct stat st;
+        archive_class_t record = {0};
+        if (stat_class(classes[i]->name, &st)) {
+            record.mtime = st.st_mtime;
+            record.file_size = st.st_size;
+        }
+        record.name = intern_string(&writer, classes[i]->name);
+        record.clazz = write_class(&writer, classes[i]->clazz);
+
+        memcpy(writer.data + table + sizeof(record) * j++, &record,
+               sizeof(record));
+    }
+
+    size_t relocations = write_bytes(&writer, writer.relocations,
+                                     sizeof(u8) * writer.relocation_count);
+    archive_header_t header = {
+        .magic = ARCHIVE_MAGIC,
+        .version = ARCHIVE_VERSION,
+        .layout = get_archive_layout(),
+        .size = writer.size,
+        .relocations = relocations,
+        .relocation_count = writer.relocation_count,
+        .classes = table,
+        .class_count = class_count,
+    };
+    memcpy(writer.data, &header, sizeof(header));
+
+    bool written = false;
+    FILE *file = fopen(path, "wb");
+    if (file) {
+        written = fwrite(writer.data, 1, writer.size, file) == writer.size;
+        written &= !fclose(file);
+    }
+
+    free(writer.data);
+    free(writer.relocations);
+    free(writer.strings);
+    return written;
+}
+
+/**
+ * Map an archive and relocate it to where it was mapped.
+ *
+ * The mapping is private and writable: relocations, static fields and class
+ * initialization only touch the pages they are on, and none of it reaches
+ * the file.
+ *
+ * @param path the archive file
+ * @param archive the mapped archive on return
+ * @return true if the archive was mapped, false if it is missing or was
+ * written by an incompatible VM
+ */
+bool map_class_archive(const char *path, class_archive_t *archive)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    u1 *base = MAP_FAILED;
+    if (!fstat(fd, &st) && (size_t) st.st_size >= sizeof(archive_header_t))
+        base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd,
+                    0);
+    close(fd);
+    if (base == MAP_FAILED)
+        return false;
+
+    archive_header_t *header = (archive_header_t *) base;
+    if (memcmp(header->magic, ARCHIVE_MAGIC, sizeof(header->magic)) ||
+        header->version != ARCHIVE_VERSION ||
+        header->layout != get_archive_layout() ||
+        header->size != (u8) st.st_size ||
+        header->relocations + sizeof(u8) * header->relocation_count >
+            header->size ||
+        header->classes + sizeof(archive_class_t) * header->class_count >
+            header->size) {
+        munmap(base, st.st_size);
+        return false;
+    }
+
+    u8 *relocations = (u8 *) (base + header->relocations);
+    for (u8 i = 0; i < header->relocation_count; i++) {
+        assert(relocations[i] + sizeof(void *) <= header->size &&
+               "Corrupted archive");
+        uintptr_t *slot = (uintptr_t *) (base + relocations[i]);
+        *slot += (uintptr_t) base;
+    }
+
+    archive->base = base;
+    archive->size = st.st_size;
+    archive->classes = (archive_class_t *) (base + header->classes);
+    archive->class_count = header->class_count;
+    return true;
+}
+
+void unmap_class_archive(class_archive_t *archive)
+{
+    munmap(archive->base, archive->size);
+}
+
+/**
+ * Get a class from an archive, unless its class file changed since the
+ * archive was written.
+ *
+ * @param archive the mapped archive
+ * @param index index of the class in the archive
+ * @param name the name of the class in the class heap on return
+ * @return the class, or NULL if it is out of date
+ */
+class_file_t *get_archived_class(class_archive_t *archive,
+                                 u8 index,
+                                 char **name)
+{
+    archive_class_t *entry = &archive->classes[index];
+    *name = (char *) (archive->base + entry->name);
+
+    struct stat st;
+    class_archive_stats.classes++;
+    if (!stat_class(*name, &st) || st.st_mtime != entry->mtime ||
+        (u8) st.st_size != entry->file_size) {
+        class_archive_stats.out_of_date++;
+        return NULL;
+    }
+    return (class_file_t *) (archive->base + entry->clazz);
+}
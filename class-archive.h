@@ -0,0 +1,49 @@
+#pragma once
+
+#include "classfile.h"
+
+/* An archive is a snapshot of parsed classes laid out exactly like the
+ * runtime structures. Pointers inside it are stored as offsets from the
+ * start of the archive, and the relocation table lists where they are, so
+ * the archive can be mapped anywhere.
+ */
+typedef struct {
+    char magic[8];
+    u4 version;
+    u4 layout; /* sizes of the archived structures, see get_archive_layout() */
+    u8 size;
+    u8 relocations; /* offset of the relocation table */
+    u8 relocation_count;
+    u8 classes; /* offset of the class table */
+    u8 class_count;
+} archive_header_t;
+
+typedef struct {
+    u8 name;  /* offset of the class name, as recorded in the class heap */
+    u8 clazz; /* offset of the class_file_t */
+    int64_t mtime;
+    u8 file_size; /* the class file the class was parsed from */
+} archive_class_t;
+
+typedef struct {
+    u1 *base;
+    size_t size;
+    archive_class_t *classes;
+    u8 class_count;
+} class_archive_t;
+
+typedef struct {
+    uint32_t classes;     /* archived classes looked up */
+    uint32_t out_of_date; /* of which parsed again from their class file */
+} class_archive_stats_t;
+
+extern class_archive_stats_t class_archive_stats;
+
+bool write_class_archive(const char *path,
+                         meta_class_t **classes,
+                         size_t count);
+bool map_class_archive(const char *path, class_archive_t *archive);
+void unmap_class_archive(class_archive_t *archive);
+class_file_t *get_archived_class(class_archive_t *archive,
+                                 u8 index,
+                                 char **name);
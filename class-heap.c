@@ -1,126 +1,308 @@
+#include <pthread.h>
+#include <unistd.h>
+
+#include "class-archive.h"
 #include "class-heap.h"
+#include "class-path.h"
 
-/* FIXME: use dynamic structure to grow heap size dynamically */
-#define MAX_HEAP_SIZE 100
+#define INITIAL_HEAP_SIZE 100
+#define MAX_PREFETCH_THREADS 4
 
 static class_heap_t class_heap;
 
+/* The class heap is shared with the prefetch threads, so every access to it
+ * holds this lock. The condition is broadcast whenever an entry is added or
+ * a class finishes loading.
+ */
+static pthread_mutex_t class_heap_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t class_heap_changed = PTHREAD_COND_INITIALIZER;
+
+static pthread_t prefetch_threads[MAX_PREFETCH_THREADS];
+static int prefetch_thread_count;
+static bool prefetch_stopping;
+
+static class_archive_t class_archive;
+static bool has_class_archive;
+
+/* Append an entry to the class heap, the lock must be held */
+static meta_class_t *append_class(class_file_t *clazz,
+                                  const char *name,
+                                  size_t name_length,
+                                  u1 state)
+{
+    if (class_heap.length == class_heap.capacity) {
+        class_heap.capacity *= 2;
+        class_heap.class_info =
+            realloc(class_heap.class_info,
+                    sizeof(meta_class_t *) * class_heap.capacity);
+        assert(class_heap.class_info && "Failed to grow class heap");
+    }
+
+    meta_class_t *meta_class = malloc(sizeof(meta_class_t));
+    meta_class->clazz = clazz;
+    meta_class->name = malloc(name_length + 1);
+    memcpy(meta_class->name, name, name_length);
+    meta_class->name[name_length] = '\0';
+    meta_class->state = state;
+    meta_class->archived = false;
+    class_heap.class_info[class_heap.length++] = meta_class;
+    pthread_cond_broadcast(&class_heap_changed);
+    return meta_class;
+}
+
+/* Find an entry in any state, the lock must be held */
+static meta_class_t *find_entry(const char *name)
+{
+    for (size_t i = 0; i < class_heap.length; ++i) {
+        if (!strcmp(class_heap.class_info[i]->name, name))
+            return class_heap.class_info[i];
+    }
+    return NULL;
+}
+
+/**
+ * Queue the classes referenced by the constant pool of a class for the
+ * prefetch threads, unless they are known already. The lock must be held.
+ *
+ * @param clazz the class which was just loaded
+ */
+static void queue_referenced_classes(class_file_t *clazz)
+{
+    for (u2 i = 0; i < clazz->constant_pool.count; i++) {
+        if (clazz->constant_pool.tags[i] != CONSTANT_Class)
+            continue;
+        /* constant pool indices start at 1 */
+        char *class_name = find_class_name_from_index(i + 1, clazz);
+        /* array classes have no class file */
+        if (class_name[0] == '[')
+            continue;
+
+        if (!find_entry(class_name))
+            append_class(NULL, class_name, strlen(class_name), CLASS_QUEUED);
+    }
+}
+
+/**
+ * Find a class file on the class path and parse it.
+ *
+ * @param class_name the binary name of the class
+ * @return the parsed class, or NULL if there is no such class file
+ */
+static class_file_t *load_class_file(const char *class_name)
+{
+    class_reader_t reader;
+    if (!open_class(class_name, &reader))
+        return NULL;
+
+    class_file_t *clazz = malloc(sizeof(class_file_t));
+    *clazz = get_class(&reader);
+    return clazz;
+}
+
+/* Publish a class which was loaded without the lock, the lock must be held */
+static void publish_class(meta_class_t *meta_class, class_file_t *clazz)
+{
+    meta_class->clazz = clazz;
+    meta_class->state = clazz ? CLASS_LOADED : CLASS_MISSING;
+    if (clazz)
+        queue_referenced_classes(clazz);
+    pthread_cond_broadcast(&class_heap_changed);
+}
+
+/* Body of the prefetch threads: load the queued classes in order until the
+ * class heap is freed.
+ */
+static void *prefetch_classes(void *arg)
+{
+    (void) arg;
+    pthread_mutex_lock(&class_heap_lock);
+    for (;;) {
+        while (!prefetch_stopping &&
+               class_heap.next_queued == class_heap.length)
+            pthread_cond_wait(&class_heap_changed, &class_heap_lock);
+        if (prefetch_stopping)
+            break;
+
+        meta_class_t *meta_class =
+            class_heap.class_info[class_heap.next_queued++];
+        if (meta_class->state != CLASS_QUEUED)
+            continue;
+        meta_class->state = CLASS_LOADING;
+
+        pthread_mutex_unlock(&class_heap_lock);
+        class_file_t *clazz = load_class_file(meta_class->name);
+        pthread_mutex_lock(&class_heap_lock);
+
+        publish_class(meta_class, clazz);
+    }
+    pthread_mutex_unlock(&class_heap_lock);
+    return NULL;
+}
+
+/**
+ * Set up the class heap, and start the threads which load the classes that
+ * loaded classes refer to ahead of their first use.
+ */
 void init_class_heap()
 {
-    /* max contain 100 class file */
-    class_heap.class_info = malloc(sizeof(meta_class_t *) * MAX_HEAP_SIZE);
+    class_heap.capacity = INITIAL_HEAP_SIZE;
+    class_heap.class_info =
+        malloc(sizeof(meta_class_t *) * class_heap.capacity);
     class_heap.length = 0;
+    class_heap.next_queued = 0;
+
+    /* leave one processor to the interpreter */
+    long threads = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+    if (threads < 1)
+        threads = 1;
+    if (threads > MAX_PREFETCH_THREADS)
+        threads = MAX_PREFETCH_THREADS;
+    prefetch_stopping = false;
+    for (prefetch_thread_count = 0; prefetch_thread_count < threads;
+         prefetch_thread_count++) {
+        if (pthread_create(&prefetch_threads[prefetch_thread_count], NULL,
+                           prefetch_classes, NULL))
+            break;
+    }
 }
 
-/* the name parameter should contain ".class" suffix and be cut in this function
+/* the name parameter is the binary name of the class, e.g. "java/lang/Object"
  */
 void add_class(class_file_t *clazz, char *name)
 {
-    meta_class_t *meta_class = malloc(sizeof(meta_class_t));
-    meta_class->clazz = clazz;
-    /* assume class file is in the same directory */
-    /* -6 mean clip ".class" in posfix */
-    meta_class->name = malloc((strlen(name) + 1 - 6));
-    strncpy(meta_class->name, name, strlen(name) - 6);
-    meta_class->name[strlen(name) - 6] = '\0';
-    class_heap.class_info[class_heap.length++] = meta_class;
+    pthread_mutex_lock(&class_heap_lock);
+    append_class(clazz, name, strlen(name), CLASS_LOADED);
+    queue_referenced_classes(clazz);
+    pthread_mutex_unlock(&class_heap_lock);
 }
 
 class_file_t *find_class_from_heap(char *value)
 {
-    for (int i = 0; i < class_heap.length; ++i) {
-        if (!strcmp(class_heap.class_info[i]->name, value))
-            return class_heap.class_info[i]->clazz;
+    pthread_mutex_lock(&class_heap_lock);
+    meta_class_t *meta_class = find_entry(value);
+    class_file_t *clazz = meta_class ? meta_class->clazz : NULL;
+    pthread_mutex_unlock(&class_heap_lock);
+    return clazz;
+}
+
+bool find_or_add_class_to_heap(char *class_name, class_file_t **target_class)
+{
+    pthread_mutex_lock(&class_heap_lock);
+    meta_class_t *meta_class = find_entry(class_name);
+
+    /* wait for a prefetch thread which is parsing the class right now */
+    while (meta_class && meta_class->state == CLASS_LOADING)
+        pthread_cond_wait(&class_heap_changed, &class_heap_lock);
+
+    if (meta_class && meta_class->state == CLASS_LOADED) {
+        pthread_mutex_unlock(&class_heap_lock);
+        *target_class = meta_class->clazz;
+        return false;
     }
-    return NULL;
+
+    /* if class is still not loaded, or still waiting for a prefetch thread,
+     * load it right away. */
+    if (meta_class)
+        meta_class->state = CLASS_LOADING;
+    else
+        meta_class = append_class(NULL, class_name, strlen(class_name),
+                                  CLASS_LOADING);
+    pthread_mutex_unlock(&class_heap_lock);
+
+    *target_class = load_class_file(class_name);
+    assert(*target_class && "Failed to open file");
+
+    pthread_mutex_lock(&class_heap_lock);
+    publish_class(meta_class, *target_class);
+    pthread_mutex_unlock(&class_heap_lock);
+    return true;
 }
 
-bool find_or_add_class_to_heap(char *class_name,
-                               char *prefix,
-                               class_file_t **target_class)
+/**
+ * Use the classes of an archive instead of parsing their class files. Classes
+ * whose class file changed since the archive was written are left out.
+ *
+ * @param path the archive file
+ * @return true if the archive could be used
+ */
+bool add_archived_classes(const char *path)
 {
-    bool added = false;
-    *target_class = find_class_from_heap(class_name);
-
-    /* if class is not found, adding specific class path and finding
-     * again. This can be removed by recording path infomation in class
-     * heap
-     */
-    if (!*target_class && prefix) {
-        char *tmp = malloc(strlen(class_name) + strlen(prefix) + 1);
-        strcpy(tmp, prefix);
-        strcat(tmp, class_name);
-        *target_class = find_class_from_heap(tmp);
-
-        free(tmp);
+    if (!map_class_archive(path, &class_archive))
+        return false;
+    has_class_archive = true;
+
+    pthread_mutex_lock(&class_heap_lock);
+    for (u8 i = 0; i < class_archive.class_count; i++) {
+        char *name;
+        class_file_t *clazz = get_archived_class(&class_archive, i, &name);
+        if (!clazz || find_entry(name))
+            continue;
+        append_class(clazz, name, strlen(name), CLASS_LOADED)->archived = true;
     }
+    pthread_mutex_unlock(&class_heap_lock);
+    return true;
+}
 
-    /* if class is still not found, meaning that this class is not
-     * loaded in class heap, so add it to the class heap. */
-    if (!*target_class) {
-        char *tmp;
-        if (prefix) {
-            tmp = malloc(
-                (strlen(class_name) + strlen(".class") + strlen(prefix) + 1));
-            strcpy(tmp, prefix);
-            strcat(tmp, class_name);
-        } else {
-            tmp = malloc(strlen(class_name) + strlen(".class") + 1);
-            strcpy(tmp, class_name);
-        }
-        /* attempt to read given class file */
-        FILE *class_file = fopen(strcat(tmp, ".class"), "r");
-        assert(class_file && "Failed to open file");
-
-        /* parse the class file */
-        *target_class = malloc(sizeof(class_file_t));
-        **target_class = get_class(class_file);
-        int error = fclose(class_file);
-        assert(!error && "Failed to close file");
-        add_class(*target_class, tmp);
-        free(tmp);
-        added = true;
+/**
+ * Load every class the loaded classes refer to, and write them all into an
+ * archive for later runs to start from.
+ *
+ * @param path the archive file to create
+ * @return true if the archive was written
+ */
+bool dump_class_heap(const char *path)
+{
+    pthread_mutex_lock(&class_heap_lock);
+    for (size_t i = 0; i < class_heap.length; ++i) {
+        meta_class_t *meta_class = class_heap.class_info[i];
+        /* wait for the prefetch threads, and do their work if there are
+         * none. Entries queued meanwhile are appended after this one. */
+        while (meta_class->state == CLASS_LOADING)
+            pthread_cond_wait(&class_heap_changed, &class_heap_lock);
+        if (meta_class->state != CLASS_QUEUED)
+            continue;
+        meta_class->state = CLASS_LOADING;
+        pthread_mutex_unlock(&class_heap_lock);
+        class_file_t *clazz = load_class_file(meta_class->name);
+        pthread_mutex_lock(&class_heap_lock);
+        publish_class(meta_class, clazz);
     }
 
-    return added;
+    bool written =
+        write_class_archive(path, class_heap.class_info, class_heap.length);
+    pthread_mutex_unlock(&class_heap_lock);
+    return written;
+}
+
+static void free_class(class_file_t *clazz)
+{
+    free_arena(&clazz->arena);
+    unmap_class_file(clazz->image, clazz->image_size);
+    free(clazz);
 }
 
 void free_class_heap()
 {
-    for (int i = 0; i < class_heap.length; ++i) {
-        const_pool_info *constant =
-            class_heap.class_info[i]->clazz->constant_pool.constant_pool;
-        for (u2 j = 0; j < class_heap.class_info[i]->clazz->constant_pool.count;
-             j++, constant++) {
-            free(constant->info);
-        }
-        free(class_heap.class_info[i]->clazz->constant_pool.constant_pool);
-        free(class_heap.class_info[i]->clazz->info);
-
-        field_t *field = class_heap.class_info[i]->clazz->fields;
-        for (u2 j = 0; j < class_heap.class_info[i]->clazz->fields_count;
-             j++, field++)
-            free(field->static_var);
-        free(class_heap.class_info[i]->clazz->fields);
-
-        for (method_t *method = class_heap.class_info[i]->clazz->methods;
-             method->name; method++) {
-            free(method->code.code);
-        }
-        free(class_heap.class_info[i]->clazz->methods);
-
-        bootmethods_attr_t *bootstrap =
-            class_heap.class_info[i]->clazz->bootstrap;
-        if (bootstrap) {
-            for (u2 j = 0; j < bootstrap->num_bootstrap_methods; j++)
-                free(bootstrap->bootstrap_methods[j].bootstrap_arguments);
-            free(bootstrap->bootstrap_methods);
-            free(bootstrap);
-        }
-
-        free(class_heap.class_info[i]->clazz);
+    /* stop the prefetch threads, letting them finish the class at hand */
+    pthread_mutex_lock(&class_heap_lock);
+    prefetch_stopping = true;
+    pthread_cond_broadcast(&class_heap_changed);
+    pthread_mutex_unlock(&class_heap_lock);
+    for (int i = 0; i < prefetch_thread_count; ++i)
+        pthread_join(prefetch_threads[i], NULL);
+
+    for (size_t i = 0; i < class_heap.length; ++i) {
+        class_file_t *clazz = class_heap.class_info[i]->clazz;
+        /* archived classes only own what was allocated while running */
+        if (clazz && class_heap.class_info[i]->archived)
+            free_arena(&clazz->arena);
+        else if (clazz)
+            free_class(clazz);
         free(class_heap.class_info[i]->name);
         free(class_heap.class_info[i]);
     }
     free(class_heap.class_info);
+
+    if (has_class_archive)
+        unmap_class_archive(&class_archive);
 }
@@ -3,17 +3,19 @@
 #include "classfile.h"
 
 typedef struct {
-    u2 length;
+    size_t length;
+    size_t capacity;
     meta_class_t **class_info;
+    size_t next_queued; /* first entry the prefetch threads have not seen */
 } class_heap_t;
 
 void init_class_heap();
 void free_class_heap();
 void add_class(class_file_t *clazz, char *name);
+bool add_archived_classes(const char *path);
+bool dump_class_heap(const char *path);
 class_file_t *find_class_from_heap(char *value);
-bool find_or_add_class_to_heap(char *class_name,
-                               char *prefix,
-                               class_file_t **target_class);
+bool find_or_add_class_to_heap(char *class_name, class_file_t **target_class);
 char *find_method_info_from_index(uint16_t idx,
                                   class_file_t *clazz,
                                   char **name_info,
@@ -0,0 +1,416 @@
+/* for MAP_ANONYMOUS */
+#define _DEFAULT_SOURCE
+
+#include <assert.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "class-path.h"
+#include "inflate.h"
+
+#define ZIP_STORED 0
+#define ZIP_DEFLATED 8
+
+#define ZIP_LOCAL_HEADER 0x04034b50
+#define ZIP_CENTRAL_HEADER 0x02014b50
+#define ZIP_END_OF_CENTRAL_DIRECTORY 0x06054b50
+
+typedef struct {
+    char *path; /* directory including the trailing '/', or JAR file */
+    u1 *jar;    /* the mapped JAR file, NULL for a directory */
+    size_t jar_size;
+    char **packages; /* package directories indexed so far */
+    size_t package_count;
+} class_path_entry_t;
+
+typedef struct {
+    const char *name; /* binary class name, not NUL-terminated in JAR files */
+    u2 name_length;
+    u2 source;       /* index of the class path entry */
+    u2 method;       /* compression method in a JAR file */
+    u4 local_header; /* offset of the local file header in a JAR file */
+    u4 compressed_size;
+    u4 size;
+} class_location_t;
+
+static class_path_entry_t *entries;
+static u2 entry_count;
+
+/* Open addressing hash table of the class files found so far. JAR files are
+ * indexed up front, directories one package at a time on first lookup.
+ */
+static class_location_t *locations;
+static size_t location_count, location_capacity;
+
+/* the prefetch threads look classes up concurrently */
+static pthread_mutex_t class_path_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static u2 read_le16(const u1 *p)
+{
+    return p[0] | p[1] << 8;
+}
+
+static u4 read_le32(const u1 *p)
+{
+    return (u4) p[0] | (u4) p[1] << 8 | (u4) p[2] << 16 | (u4) p[3] << 24;
+}
+
+static size_t hash_name(const char *name, size_t length)
+{
+    /* FNV-1a */
+    size_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++)
+        hash = (hash ^ (u1) name[i]) * 16777619u;
+    return hash;
+}
+
+static class_location_t *find_location(const char *name, size_t length)
+{
+    size_t mask = location_capacity - 1;
+    for (size_t i = hash_name(name, length);; i++) {
+        class_location_t *location = &locations[i & mask];
+        if (!location->name)
+            return location;
+        if (location->name_length == length &&
+            !memcmp(location->name, name, length))
+            return location;
+    }
+}
+
+/* Record a class file. If several class path entries have the class, the
+ * first one wins whatever the order they were indexed in.
+ */
+static void add_location(class_location_t *new_location)
+{
+    if (2 * (location_count + 1) > location_capacity) {
+        class_location_t *old = locations;
+        size_t old_capacity = location_capacity;
+        location_capacity *= 2;
+        locations = calloc(location_capacity, sizeof(class_location_t));
+        assert(locations && "Failed to grow class path index");
+        for (size_t i = 0; i < old_capacity; i++) {
+            if (old[i].name)
+                *find_location(old[i].name, old[i].name_length) = old[i];
+        }
+        free(old);
+    }
+
+    class_location_t *location =
+        find_location(new_location->name, new_location->name_length);
+    if (!location->name) {
+        *location = *new_location;
+        location_count++;
+    } else if (new_location->source < location->source) {
+        /* names read from directories are owned by the index */
+        if (!entries[location->source].jar)
+            free((char *) location->name);
+        *location = *new_location;
+    } else if (!entries[new_location->source].jar) {
+        free((char *) new_location->name);
+    }
+}
+
+/**
+ * Index the class files found in the central directory of a JAR file.
+ *
+ * @param source index of the class path entry of the JAR file
+ * @return false if the file is not a valid JAR file
+ */
+static bool index_jar(u2 source)
+{
+    const u1 *jar = entries[source].jar;
+    size_t size = entries[source].jar_size;
+
+    /* the end of central directory record is followed by a comment of at
+     * most 64 KiB
+     */
+    if (size < 22)
+        return false;
+    size_t end = size - 22;
+    while (read_le32(jar + end) != ZIP_END_OF_CENTRAL_DIRECTORY) {
+        if (!end || size - end > 22 + 0xffff)
+            return false;
+        end--;
+    }
+    u2 count = read_le16(jar + end + 10);
+    size_t pos = read_le32(jar + end + 16);
+
+    for (u2 i = 0; i < count; i++) {
+        if (pos + 46 > end || read_le32(jar + pos) != ZIP_CENTRAL_HEADER)
+            return false;
+        const u1 *header = jar + pos;
+        u2 name_length = read_le16(header + 28);
+        const char *name = (const char *) header + 46;
+        pos += 46 + name_length + read_le16(header + 30) +
+               read_le16(header + 32);
+        if (pos > end)
+            return false;
+
+        if (name_length <= 6 ||
+            memcmp(name + name_length - 6, ".class", 6))
+            continue;
+        class_location_t location = {
+            .name = name,
+            .name_length = name_length - 6,
+            .source = source,
+            .method = read_le16(header + 10),
+            .local_header = read_le32(header + 42),
+            .compressed_size = read_le32(header + 20),
+            .size = read_le32(header + 24),
+        };
+        add_location(&location);
+    }
+    return true;
+}
+
+/* Index the class files of a package directory, unless it is done already.
+ * The lock must be held.
+ */
+static void index_package(u2 source, const char *package, size_t length)
+{
+    class_path_entry_t *entry = &entries[source];
+    for (size_t i = 0; i < entry->package_count; i++) {
+        if (strlen(entry->packages[i]) == length &&
+            !memcmp(entry->packages[i], package, length))
+            return;
+    }
+
+    /* remember the package even if it has no directory */
+    char *indexed = malloc(length + 1);
+    memcpy(indexed, package, length);
+    indexed[length] = '\0';
+    entry->packages = realloc(entry->packages,
+                              sizeof(char *) * (entry->package_count + 1));
+    assert(entry->packages && "Failed to allocate package index");
+    entry->packages[entry->package_count++] = indexed;
+
+    char *path = malloc(strlen(entry->path) + length + 1);
+    strcpy(path, entry->path);
+    DIR *dir = opendir(strcat(path, indexed));
+    free(path);
+    if (!dir)
+        return;
+
+    for (struct dirent *file; (file = readdir(dir));) {
+        size_t file_length = strlen(file->d_name);
+        if (file_length <= 6 ||
+            strcmp(file->d_name + file_length - 6, ".class"))
+            continue;
+
+        /* the binary name is the package and the file name without suffix */
+        size_t name_length = length + !!length + file_length - 6;
+        char *name = malloc(name_length + 1);
+        memcpy(name, package, length);
+        if (length)
+            name[length] = '/';
+        memcpy(name + length + !!length, file->d_name, file_length - 6);
+        name[name_length] = '\0';
+
+        class_location_t location = {
+            .name = name,
+            .name_length = name_length,
+            .source = source,
+        };
+        add_location(&location);
+    }
+    closedir(dir);
+}
+
+/**
+ * Find where a class file is on the class path.
+ *
+ * @param class_name the binary name of the class, e.g. "java/lang/Object"
+ * @param location the location on return
+ * @return true if the class file was found
+ */
+static bool find_class(const char *class_name, class_location_t *location)
+{
+    size_t length = strlen(class_name);
+    const char *slash = strrchr(class_name, '/');
+    size_t package_length = slash ? (size_t) (slash - class_name) : 0;
+
+    pthread_mutex_lock(&class_path_lock);
+    for (u2 i = 0; i < entry_count; i++) {
+        if (!entries[i].jar)
+            index_package(i, class_name, package_length);
+    }
+    *location = *find_location(class_name, length);
+    pthread_mutex_unlock(&class_path_lock);
+    return location->name;
+}
+
+/**
+ * Set up the class path.
+ *
+ * @param class_path directories and JAR files separated by ':', searched in
+ * order. Entries which do not exist are ignored.
+ */
+void init_class_path(const char *class_path)
+{
+    location_capacity = 1 << 10;
+    locations = calloc(location_capacity, sizeof(class_location_t));
+    assert(locations && "Failed to allocate class path index");
+
+    for (const char *item = class_path; item;) {
+        const char *separator = strchr(item, ':');
+        size_t length = separator ? (size_t) (separator - item) : strlen(item);
+        char *path = malloc(length + 3);
+        /* an empty entry is the current directory */
+        if (length)
+            memcpy(path, item, length);
+        else
+            path[length++] = '.';
+        path[length] = '\0';
+        item = separator ? separator + 1 : NULL;
+
+        struct stat st;
+        if (stat(path, &st)) {
+            free(path);
+            continue;
+        }
+        entries = realloc(entries,
+                          sizeof(class_path_entry_t) * (entry_count + 1));
+        assert(entries && "Failed to allocate class path");
+        class_path_entry_t *entry = &entries[entry_count];
+        memset(entry, 0, sizeof(*entry));
+        entry->path = path;
+
+        if (S_ISDIR(st.st_mode)) {
+            if (path[length - 1] != '/')
+                strcat(path, "/");
+            entry_count++;
+            continue;
+        }
+
+        int fd = open(path, O_RDONLY);
+        void *jar = MAP_FAILED;
+        if (fd >= 0 && st.st_size > 0)
+            jar = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (fd >= 0)
+            close(fd);
+        if (jar != MAP_FAILED) {
+            entry->jar = jar;
+            entry->jar_size = st.st_size;
+            entry_count++;
+            if (index_jar(entry_count - 1))
+                continue;
+            entry_count--;
+            munmap(jar, st.st_size);
+        }
+        fprintf(stderr, "Ignoring invalid JAR file %s\n", path);
+        free(path);
+    }
+}
+
+void free_class_path()
+{
+    for (size_t i = 0; i < location_capacity; i++) {
+        if (locations[i].name && !entries[locations[i].source].jar)
+            free((char *) locations[i].name);
+    }
+    free(locations);
+
+    for (u2 i = 0; i < entry_count; i++) {
+        if (entries[i].jar)
+            munmap(entries[i].jar, entries[i].jar_size);
+        for (size_t j = 0; j < entries[i].package_count; j++)
+            free(entries[i].packages[j]);
+        free(entries[i].packages);
+        free(entries[i].path);
+    }
+    free(entries);
+}
+
+/* Decompress a class file from a JAR file into a mapping of its own */
+static bool read_jar_entry(class_location_t *location, class_reader_t *reader)
+{
+    const u1 *jar = entries[location->source].jar;
+    size_t size = entries[location->source].jar_size;
+    size_t pos = location->local_header;
+    if (pos + 30 > size || read_le32(jar + pos) != ZIP_LOCAL_HEADER)
+        return false;
+    pos += 30 + read_le16(jar + pos + 26) + read_le16(jar + pos + 28);
+    if (pos > size || size - pos < location->compressed_size ||
+        !location->size)
+        return false;
+
+    /* anonymous memory, so the class can unmap it like a class file */
+    u1 *data = mmap(NULL, location->size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (data == MAP_FAILED)
+        return false;
+
+    bool ok = false;
+    if (location->method == ZIP_STORED) {
+        ok = location->compressed_size == location->size;
+        if (ok)
+            memcpy(data, jar + pos, location->size);
+    } else if (location->method == ZIP_DEFLATED) {
+        ok = inflate(jar + pos, location->compressed_size, data,
+                     location->size);
+    }
+    if (!ok) {
+        munmap(data, location->size);
+        return false;
+    }
+
+    reader->data = data;
+    reader->size = location->size;
+    reader->pos = 0;
+    return true;
+}
+
+/**
+ * Open a class file found on the class path.
+ *
+ * @param class_name the binary name of the class
+ * @param reader the reader over the class file on return
+ * @return true if the class was found and could be read
+ */
+bool open_class(const char *class_name, class_reader_t *reader)
+{
+    class_location_t location;
+    if (!find_class(class_name, &location))
+        return false;
+    if (entries[location.source].jar)
+        return read_jar_entry(&location, reader);
+
+    char *path = malloc(strlen(entries[location.source].path) +
+                        strlen(class_name) + strlen(".class") + 1);
+    strcpy(path, entries[location.source].path);
+    strcat(path, class_name);
+    bool mapped = map_class_file(strcat(path, ".class"), reader);
+    free(path);
+    return mapped;
+}
+
+/**
+ * Get the status of the file a class is read from: the class file itself, or
+ * the JAR file containing it.
+ *
+ * @param class_name the binary name of the class
+ * @param st the status on return
+ * @return true if the class was found
+ */
+bool stat_class(const char *class_name, struct stat *st)
+{
+    class_location_t location;
+    if (!find_class(class_name, &location))
+        return false;
+    if (entries[location.source].jar)
+        return !stat(entries[location.source].path, st);
+
+    char *path = malloc(strlen(entries[location.source].path) +
+                        strlen(class_name) + strlen(".class") + 1);
+    strcpy(path, entries[location.source].path);
+    strcat(path, class_name);
+    bool found = !stat(strcat(path, ".class"), st);
+    free(path);
+    return found;
+}
@@ -0,0 +1,10 @@
+#pragma once
+
+#include <sys/stat.h>
+
+#include "class-reader.h"
+
+void init_class_path(const char *class_path);
+void free_class_path();
+bool open_class(const char *class_name, class_reader_t *reader);
+bool stat_class(const char *class_name, struct stat *st);
@@ -0,0 +1,86 @@
+#include <assert.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "class-reader.h"
+
+/**
+ * Map a class file into memory.
+ *
+ * The mapping is private and writable: the parser terminates UTF-8 constants
+ * in place and the optimizer rewrites bytecode in place, and neither must
+ * reach the file. Parsed constants and method code point into the mapping,
+ * so it has to live as long as the class does.
+ *
+ * @param path the class file to map
+ * @param reader the reader to set up at the start of the file
+ * @return true if the file was mapped
+ */
+bool map_class_file(const char *path, class_reader_t *reader)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    void *data = MAP_FAILED;
+    if (!fstat(fd, &st) && st.st_size > 0)
+        data = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd,
+                    0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return false;
+
+    reader->data = data;
+    reader->size = st.st_size;
+    reader->pos = 0;
+    return true;
+}
+
+void unmap_class_file(u1 *data, size_t size)
+{
+    munmap(data, size);
+}
+
+/* Read unsigned big-endian integers */
+u1 read_u1(class_reader_t *reader)
+{
+    assert(reader->pos < reader->size && "Reached end of file prematurely");
+    return reader->data[reader->pos++];
+}
+
+u2 read_u2(class_reader_t *reader)
+{
+    assert(reader->size - reader->pos >= 2 &&
+           "Reached end of file prematurely");
+    u1 *p = reader->data + reader->pos;
+    reader->pos += 2;
+    return (u2) p[0] << 8 | p[1];
+}
+
+u4 read_u4(class_reader_t *reader)
+{
+    assert(reader->size - reader->pos >= 4 &&
+           "Reached end of file prematurely");
+    u1 *p = reader->data + reader->pos;
+    reader->pos += 4;
+    return (u4) p[0] << 24 | (u4) p[1] << 16 | (u4) p[2] << 8 | p[3];
+}
+
+/**
+ * Consume bytes without copying them.
+ *
+ * @param reader the class file reader
+ * @param length number of bytes to consume
+ * @return pointer to the consumed bytes in the mapped file
+ */
+u1 *read_bytes(class_reader_t *reader, size_t length)
+{
+    assert(reader->size - reader->pos >= length &&
+           "Reached end of file prematurely");
+    u1 *p = reader->data + reader->pos;
+    reader->pos += length;
+    return p;
+}
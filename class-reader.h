@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "type.h"
+
+/* Cursor over a class file image mapped in memory */
+typedef struct {
+    u1 *data;
+    size_t size;
+    size_t pos;
+} class_reader_t;
+
+bool map_class_file(const char *path, class_reader_t *reader);
+void unmap_class_file(u1 *data, size_t size);
+u1 read_u1(class_reader_t *reader);
+u2 read_u2(class_reader_t *reader);
+u4 read_u4(class_reader_t *reader);
+u1 *read_bytes(class_reader_t *reader, size_t length);
@@ -1,22 +1,27 @@
+#include <pthread.h>
+
 #include "classfile.h"
+#include "bounds-check.h"
+
+pthread_mutex_t class_arena_lock = PTHREAD_MUTEX_INITIALIZER;
 
-class_header_t get_class_header(FILE *class_file)
+class_header_t get_class_header(class_reader_t *reader)
 {
     return (class_header_t){
-        .magic = read_u4(class_file),
-        .major_version = read_u2(class_file),
-        .minor_version = read_u2(class_file),
+        .magic = read_u4(reader),
+        .major_version = read_u2(reader),
+        .minor_version = read_u2(reader),
     };
 }
 
-class_info_t *get_class_info(FILE *class_file)
+class_info_t *get_class_info(class_reader_t *reader, arena_t *arena)
 {
-    class_info_t *info = malloc(sizeof(class_info_t));
-    info->access_flags = read_u2(class_file);
-    info->this_class = read_u2(class_file);
-    info->super_class = read_u2(class_file);
+    class_info_t *info = arena_alloc(arena, sizeof(class_info_t));
+    info->access_flags = read_u2(reader);
+    info->this_class = read_u2(reader);
+    info->super_class = read_u2(reader);
 
-    u2 interfaces_count = read_u2(class_file);
+    u2 interfaces_count = read_u2(reader);
     assert(!interfaces_count && "This VM does not support interfaces.");
     return info;
 }
@@ -29,6 +34,9 @@ uint16_t get_number_of_parameters(method_t *method)
 {
     uint16_t num_param = 0;
     for (size_t i = 1; method->descriptor[i] != ')'; ++i) {
+        /* an array is a single parameter whatever its element type is */
+        while (method->descriptor[i] == '[')
+            i++;
         /* if type is reference, skip class name */
         if (method->descriptor[i] == 'L') {
             while (method->descriptor[++i] != ';')
@@ -65,6 +73,7 @@ field_t *find_field(const char *name, const char *desc, class_file_t *clazz)
  * The descriptor is necessary because Java allows method overloading.
  * This needs to be called directly to invoke main(),
  * or to find method from specific class.
+ * The code of the method is loaded the first time it is found.
  *
  * @param name the method name, e.g. "factorial"
  * @param desc the method descriptor string, e.g. "(I)I"
@@ -74,12 +83,65 @@ field_t *find_field(const char *name, const char *desc, class_file_t *clazz)
 method_t *find_method(const char *name, const char *desc, class_file_t *clazz)
 {
     for (method_t *method = clazz->methods; method->name; method++) {
-        if (!(strcmp(name, method->name) || strcmp(desc, method->descriptor)))
+        if (!(strcmp(name, method->name) || strcmp(desc, method->descriptor))) {
+            if (!__atomic_load_n(&method->code.code, __ATOMIC_ACQUIRE))
+                load_method_code(method, clazz);
             return method;
+        }
     }
     return NULL;
 }
 
+/**
+ * Materialize the code of a method from the Code attribute recorded when its
+ * class was loaded, and optimize it.
+ *
+ * @param method the method whose code is not loaded yet
+ * @param clazz the class which declares the method
+ */
+void load_method_code(method_t *method, class_file_t *clazz)
+{
+    pthread_mutex_lock(&class_arena_lock);
+    /* another thread may have loaded it meanwhile */
+    if (method->code.code) {
+        pthread_mutex_unlock(&class_arena_lock);
+        return;
+    }
+
+    class_reader_t reader = {
+        .data = clazz->image,
+        .size = clazz->image_size,
+        .pos = method->code_offset,
+    };
+    code_t code;
+    code.max_stack = read_u2(&reader);
+    code.max_locals = read_u2(&reader);
+    code.code_length = read_u4(&reader);
+    code.code = read_bytes(&reader, code.code_length);
+
+    /* the first handler covering the instruction that throws is taken, so
+     * the handlers keep the order of the table */
+    code.handlers_count = read_u2(&reader);
+    code.handlers = arena_alloc(
+        &clazz->arena, sizeof(exception_handler_t) * code.handlers_count);
+    for (u2 i = 0; i < code.handlers_count; i++) {
+        exception_handler_t *handler = &code.handlers[i];
+        handler->start_pc = read_u2(&reader);
+        handler->end_pc = read_u2(&reader);
+        handler->handler_pc = read_u2(&reader);
+        handler->catch_type = read_u2(&reader);
+    }
+
+    eliminate_bounds_checks(&code);
+
+    /* the code is published last, as it tells the method is loaded */
+    u1 *bytes = code.code;
+    code.code = NULL;
+    method->code = code;
+    __atomic_store_n(&method->code.code, bytes, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&class_arena_lock);
+}
+
 /**
  * Find the method info corresponding to the given constant pool index.
  *
@@ -95,35 +157,21 @@ char *find_method_info_from_index(uint16_t idx,
                                   char **name_info,
                                   char **descriptor_info)
 {
-    CONSTANT_FieldOrMethodRef_info *method_ref =
-        get_methodref(&clazz->constant_pool, idx);
-    const_pool_info *name_and_type =
-        get_constant(&clazz->constant_pool, method_ref->name_and_type_index);
-    assert(name_and_type->tag == CONSTANT_NameAndType &&
-           "Expected a NameAndType");
-    const_pool_info *name = get_constant(
-        &clazz->constant_pool,
-        ((CONSTANT_NameAndType_info *) name_and_type->info)->name_index);
-    assert(name->tag == CONSTANT_Utf8 && "Expected a UTF8");
-    const_pool_info *descriptor = get_constant(
-        &clazz->constant_pool,
-        ((CONSTANT_NameAndType_info *) name_and_type->info)->descriptor_index);
-    assert(descriptor->tag == CONSTANT_Utf8 && "Expected a UTF8");
-    CONSTANT_Class_info *class_info =
-        get_class_name(&clazz->constant_pool, method_ref->class_index);
-    const_pool_info *class_name =
-        get_constant(&clazz->constant_pool, class_info->string_index);
-    *name_info = (char *) name->info;
-    *descriptor_info = (char *) descriptor->info;
-
-    return (char *) class_name->info;
+    constant_pool_t *cp = &clazz->constant_pool;
+    CONSTANT_FieldOrMethodRef_info *method_ref = get_methodref(cp, idx);
+    CONSTANT_NameAndType_info *name_and_type =
+        get_name_and_type(cp, method_ref->name_and_type_index);
+    *name_info = get_utf8(cp, name_and_type->name_index);
+    *descriptor_info = get_utf8(cp, name_and_type->descriptor_index);
+
+    return find_class_name_from_index(method_ref->class_index, clazz);
 }
 
 CONSTANT_FieldOrMethodRef_info *get_fieldref(constant_pool_t *cp, u2 idx)
 {
-    const_pool_info *field = get_constant(cp, idx);
-    assert(field->tag == CONSTANT_FieldRef && "Expected a FieldRef");
-    return (CONSTANT_FieldOrMethodRef_info *) field->info;
+    assert(get_constant_tag(cp, idx) == CONSTANT_FieldRef &&
+           "Expected a FieldRef");
+    return &get_constant(cp, idx)->ref;
 }
 
 /**
@@ -141,172 +189,161 @@ char *find_field_info_from_index(uint16_t idx,
                                  char **name_info,
                                  char **descriptor_info)
 {
-    CONSTANT_FieldOrMethodRef_info *field_ref =
-        get_fieldref(&clazz->constant_pool, idx);
-    const_pool_info *name_and_type =
-        get_constant(&clazz->constant_pool, field_ref->name_and_type_index);
-    assert(name_and_type->tag == CONSTANT_NameAndType &&
-           "Expected a NameAndType");
-    const_pool_info *name = get_constant(
-        &clazz->constant_pool,
-        ((CONSTANT_NameAndType_info *) name_and_type->info)->name_index);
-    assert(name->tag == CONSTANT_Utf8 && "Expected a UTF8");
-    const_pool_info *descriptor = get_constant(
-        &clazz->constant_pool,
-        ((CONSTANT_NameAndType_info *) name_and_type->info)->descriptor_index);
-    assert(descriptor->tag == CONSTANT_Utf8 && "Expected a UTF8");
-    CONSTANT_Class_info *class_info =
-        get_class_name(&clazz->constant_pool, field_ref->class_index);
-    const_pool_info *class_name =
-        get_constant(&clazz->constant_pool, class_info->string_index);
-    *name_info = (char *) name->info;
-    *descriptor_info = (char *) descriptor->info;
-
-    return (char *) class_name->info;
+    constant_pool_t *cp = &clazz->constant_pool;
+    CONSTANT_FieldOrMethodRef_info *field_ref = get_fieldref(cp, idx);
+    CONSTANT_NameAndType_info *name_and_type =
+        get_name_and_type(cp, field_ref->name_and_type_index);
+    *name_info = get_utf8(cp, name_and_type->name_index);
+    *descriptor_info = get_utf8(cp, name_and_type->descriptor_index);
+
+    return find_class_name_from_index(field_ref->class_index, clazz);
+}
+
+/**
+ * Get the resolution cache entry of a constant.
+ *
+ * @param idx the 1-indexed constant pool index
+ * @param clazz the class whose constant pool holds the constant
+ * @return the entry, zeroed if the constant was never resolved
+ */
+resolved_constant_t *get_resolved(uint16_t idx, class_file_t *clazz)
+{
+    assert(0 < idx && idx <= clazz->constant_pool.count &&
+           "Invalid constant pool index");
+    return &clazz->resolved[idx - 1];
 }
 
 char *find_class_name_from_index(uint16_t idx, class_file_t *clazz)
 {
     CONSTANT_Class_info *class = get_class_name(&clazz->constant_pool, idx);
-
-    const_pool_info *name =
-        get_constant(&clazz->constant_pool, class->string_index);
-    assert(name->tag == CONSTANT_Utf8 && "Expected a UTF8");
-    return (char *) name->info;
+    return get_utf8(&clazz->constant_pool, class->string_index);
 }
 
 bootmethods_t *find_bootstrap_method(uint16_t idx, class_file_t *clazz)
 {
-    const_pool_info *info = get_constant(&clazz->constant_pool, idx);
-    assert(info->tag == CONSTANT_InvokeDynamic && "Expected a InvokeDynanmic");
+    assert(get_constant_tag(&clazz->constant_pool, idx) ==
+               CONSTANT_InvokeDynamic &&
+           "Expected a InvokeDynanmic");
+    CONSTANT_InvokeDynamic_info *info =
+        &get_constant(&clazz->constant_pool, idx)->invoke_dynamic;
     return &clazz->bootstrap
-                ->bootstrap_methods[((CONSTANT_InvokeDynamic_info *) info->info)
-                                        ->bootstrap_method_attr_index];
+                ->bootstrap_methods[info->bootstrap_method_attr_index];
 }
 
-void read_field_attributes(FILE *class_file, field_info *info)
+void read_field_attributes(class_reader_t *reader, field_info *info)
 {
     for (u2 i = 0; i < info->attributes_count; i++) {
         attribute_info ainfo = {
-            .attribute_name_index = read_u2(class_file),
-            .attribute_length = read_u4(class_file),
+            .attribute_name_index = read_u2(reader),
+            .attribute_length = read_u4(reader),
         };
-        long attribute_end = ftell(class_file) + ainfo.attribute_length;
         /* Skip all the attribute */
-        fseek(class_file, attribute_end, SEEK_SET);
+        read_bytes(reader, ainfo.attribute_length);
     }
 }
 
-void read_method_attributes(FILE *class_file,
+void read_method_attributes(class_reader_t *reader,
                             method_info *info,
-                            code_t *code,
+                            method_t *method,
                             constant_pool_t *cp)
 {
     bool found_code = false;
     for (u2 i = 0; i < info->attributes_count; i++) {
         attribute_info ainfo = {
-            .attribute_name_index = read_u2(class_file),
-            .attribute_length = read_u4(class_file),
+            .attribute_name_index = read_u2(reader),
+            .attribute_length = read_u4(reader),
         };
-        long attribute_end = ftell(class_file) + ainfo.attribute_length;
-        const_pool_info *type_constant =
-            get_constant(cp, ainfo.attribute_name_index);
-        assert(type_constant->tag == CONSTANT_Utf8 && "Expected a UTF8");
-        if (!strcmp((char *) type_constant->info, "Code")) {
+        size_t attribute_end = reader->pos + ainfo.attribute_length;
+        if (!strcmp(get_utf8(cp, ainfo.attribute_name_index), "Code")) {
             assert(!found_code && "Duplicate method code");
             found_code = true;
 
-            code->max_stack = read_u2(class_file);
-            code->max_locals = read_u2(class_file);
-            code->code_length = read_u4(class_file);
-            code->code = malloc(code->code_length);
-            assert(code->code && "Failed to allocate method code");
-            size_t bytes_read =
-                fread(code->code, 1, code->code_length, class_file);
-            assert(bytes_read == code->code_length &&
-                   "Failed to read method code");
+            /* the code is only loaded when the method is first invoked */
+            method->code_offset = reader->pos;
+            method->code.code = NULL;
         }
         /* Skip the rest of the attribute */
-        fseek(class_file, attribute_end, SEEK_SET);
+        assert(attribute_end <= reader->size &&
+               "Reached end of file prematurely");
+        reader->pos = attribute_end;
     }
     assert(found_code && "Missing method code");
 }
 
-bootmethods_attr_t *read_bootstrap_attribute(FILE *class_file,
-                                             constant_pool_t *cp)
+bootmethods_attr_t *read_bootstrap_attribute(class_reader_t *reader,
+                                             constant_pool_t *cp,
+                                             arena_t *arena)
 {
-    u2 attributes_count = read_u2(class_file);
+    u2 attributes_count = read_u2(reader);
     for (u2 i = 0; i < attributes_count; i++) {
         attribute_info ainfo = {
-            .attribute_name_index = read_u2(class_file),
-            .attribute_length = read_u4(class_file),
+            .attribute_name_index = read_u2(reader),
+            .attribute_length = read_u4(reader),
         };
-        long attribute_end = ftell(class_file) + ainfo.attribute_length;
-        const_pool_info *type_constant =
-            get_constant(cp, ainfo.attribute_name_index);
-        assert(type_constant->tag == CONSTANT_Utf8 && "Expected a UTF8");
-        if (!strcmp((char *) type_constant->info, "BootstrapMethods")) {
-            bootmethods_attr_t *bootstrap = malloc(sizeof(*bootstrap));
-
-            bootstrap->num_bootstrap_methods = read_u2(class_file);
-            bootstrap->bootstrap_methods = malloc(
+        size_t attribute_end = reader->pos + ainfo.attribute_length;
+        if (!strcmp(get_utf8(cp, ainfo.attribute_name_index),
+                    "BootstrapMethods")) {
+            bootmethods_attr_t *bootstrap =
+                arena_alloc(arena, sizeof(*bootstrap));
+
+            bootstrap->num_bootstrap_methods = read_u2(reader);
+            bootstrap->bootstrap_methods = arena_alloc(
+                arena,
                 sizeof(bootmethods_t) * bootstrap->num_bootstrap_methods);
 
-            assert(bootstrap->bootstrap_methods &&
-                   "Failed to allocate bootstrap method");
             for (int j = 0; j < bootstrap->num_bootstrap_methods; ++j) {
                 bootstrap->bootstrap_methods[j].bootstrap_method_ref =
-                    read_u2(class_file);
+                    read_u2(reader);
                 bootstrap->bootstrap_methods[j].num_bootstrap_arguments =
-                    read_u2(class_file);
-                bootstrap->bootstrap_methods[j].bootstrap_arguments = malloc(
-                    sizeof(u2) *
-                    bootstrap->bootstrap_methods[j].num_bootstrap_arguments);
-                assert(bootstrap->bootstrap_methods[j].bootstrap_arguments &&
-                       "Failed to allocate bootstrap argument");
+                    read_u2(reader);
+                bootstrap->bootstrap_methods[j].bootstrap_arguments =
+                    arena_alloc(arena,
+                                sizeof(u2) * bootstrap->bootstrap_methods[j]
+                                                 .num_bootstrap_arguments);
                 for (int k = 0;
                      k <
                      bootstrap->bootstrap_methods[j].num_bootstrap_arguments;
                      ++k) {
                     bootstrap->bootstrap_methods[j].bootstrap_arguments[k] =
-                        read_u2(class_file);
+                        read_u2(reader);
                 }
             }
             return bootstrap;
         }
         /* Skip the rest of the attribute */
-        fseek(class_file, attribute_end, SEEK_SET);
+        assert(attribute_end <= reader->size &&
+               "Reached end of file prematurely");
+        reader->pos = attribute_end;
     }
     return NULL;
 }
 
-#define IS_STATIC 0x0008
-
-field_t *get_fields(FILE *class_file, constant_pool_t *cp, class_file_t *clazz)
+field_t *get_fields(class_reader_t *reader,
+                    constant_pool_t *cp,
+                    class_file_t *clazz)
 {
-    u2 fields_count = read_u2(class_file);
+    u2 fields_count = read_u2(reader);
     clazz->fields_count = fields_count;
-    field_t *fields = malloc(sizeof(*fields) * (fields_count + 1));
-    assert(fields && "Failed to allocate methods");
+    field_t *fields =
+        arena_alloc(&clazz->arena, sizeof(*fields) * (fields_count + 1));
+    /* the static fields of the class are stored together, zeroed */
+    variable_t *static_vars =
+        arena_alloc(&clazz->arena, sizeof(variable_t) * fields_count);
 
     field_t *field = fields;
     for (u2 i = 0; i < fields_count; i++, field++) {
         field_info info = {
-            .access_flags = read_u2(class_file),
-            .name_index = read_u2(class_file),
-            .descriptor_index = read_u2(class_file),
-            .attributes_count = read_u2(class_file),
+            .access_flags = read_u2(reader),
+            .name_index = read_u2(reader),
+            .descriptor_index = read_u2(reader),
+            .attributes_count = read_u2(reader),
         };
 
-        const_pool_info *name = get_constant(cp, info.name_index);
-        assert(name->tag == CONSTANT_Utf8 && "Expected a UTF8");
-        field->name = (char *) name->info;
-        const_pool_info *descriptor = get_constant(cp, info.descriptor_index);
-        assert(descriptor->tag == CONSTANT_Utf8 && "Expected a UTF8");
-        field->descriptor = (char *) descriptor->info;
-        field->static_var = malloc(sizeof(variable_t));
+        field->name = get_utf8(cp, info.name_index);
+        field->descriptor = get_utf8(cp, info.descriptor_index);
+        field->static_var = &static_vars[i];
 
-        read_field_attributes(class_file, &info);
+        read_field_attributes(reader, &info);
     }
 
     /* Mark end of array with NULL name */
@@ -314,29 +351,28 @@ field_t *get_fields(FILE *class_file, constant_pool_t *cp, class_file_t *clazz)
     return fields;
 }
 
-method_t *get_methods(FILE *class_file, constant_pool_t *cp)
+method_t *get_methods(class_reader_t *reader,
+                      constant_pool_t *cp,
+                      arena_t *arena)
 {
-    u2 method_count = read_u2(class_file);
-    method_t *methods = malloc(sizeof(*methods) * (method_count + 1));
-    assert(methods && "Failed to allocate methods");
+    u2 method_count = read_u2(reader);
+    method_t *methods =
+        arena_alloc(arena, sizeof(*methods) * (method_count + 1));
 
     method_t *method = methods;
     for (u2 i = 0; i < method_count; i++, method++) {
         method_info info = {
-            .access_flags = read_u2(class_file),
-            .name_index = read_u2(class_file),
-            .descriptor_index = read_u2(class_file),
-            .attributes_count = read_u2(class_file),
+            .access_flags = read_u2(reader),
+            .name_index = read_u2(reader),
+            .descriptor_index = read_u2(reader),
+            .attributes_count = read_u2(reader),
         };
 
-        const_pool_info *name = get_constant(cp, info.name_index);
-        assert(name->tag == CONSTANT_Utf8 && "Expected a UTF8");
-        method->name = (char *) name->info;
-        const_pool_info *descriptor = get_constant(cp, info.descriptor_index);
-        assert(descriptor->tag == CONSTANT_Utf8 && "Expected a UTF8");
-        method->descriptor = (char *) descriptor->info;
+        method->name = get_utf8(cp, info.name_index);
+        method->descriptor = get_utf8(cp, info.descriptor_index);
+        method->access_flags = info.access_flags;
 
-        read_method_attributes(class_file, &info, &method->code, cp);
+        read_method_attributes(reader, &info, method, cp);
     }
 
     /* Mark end of array with NULL name */
@@ -347,32 +383,46 @@ method_t *get_methods(FILE *class_file, constant_pool_t *cp)
 /**
  * Read an entire class file.
  * The end of the parsed methods array is marked by a method with a NULL name.
+ * Constants and method code point into the mapped file, which the class takes
+ * over. Everything else is allocated from the arena of the class, which is
+ * sized from the length of the file.
  *
- * @param class_file the open file to read
+ * @param reader the mapped class file to read
  * @return the parsed class file
  */
-class_file_t get_class(FILE *class_file)
+class_file_t get_class(class_reader_t *reader)
 {
     /* Read the leading header of the class file */
-    get_class_header(class_file);
+    get_class_header(reader);
+
+    /* Constants and method headers grow when parsed while attributes are
+     * skipped, so the metadata hardly ever needs more than twice the size of
+     * the class file. The arena adds chunks when it does.
+     */
+    class_file_t clazz = {.initialized = false};
+    init_arena(&clazz.arena, reader->size * 2);
 
     /* Read the constant pool */
-    class_file_t clazz = {.constant_pool = get_constant_pool(class_file)};
+    clazz.constant_pool = get_constant_pool(reader, &clazz.arena);
+    clazz.resolved =
+        arena_alloc(&clazz.arena, sizeof(resolved_constant_t) *
+                                      clazz.constant_pool.count);
 
     /* Read information about the class that was compiled. */
-    clazz.info = get_class_info(class_file);
+    clazz.info = get_class_info(reader, &clazz.arena);
 
     /* Read the list of fields */
-    clazz.fields = get_fields(class_file, &clazz.constant_pool, &clazz);
+    clazz.fields = get_fields(reader, &clazz.constant_pool, &clazz);
 
     /* Read the list of static methods */
-    clazz.methods = get_methods(class_file, &clazz.constant_pool);
+    clazz.methods = get_methods(reader, &clazz.constant_pool, &clazz.arena);
 
     /* Read the list of attributes */
     clazz.bootstrap =
-        read_bootstrap_attribute(class_file, &clazz.constant_pool);
+        read_bootstrap_attribute(reader, &clazz.constant_pool, &clazz.arena);
 
-    clazz.initialized = false;
+    clazz.image = reader->data;
+    clazz.image_size = reader->size;
 
     return clazz;
 }
\ No newline at end of file
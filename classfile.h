@@ -1,5 +1,8 @@
 #pragma once
 
+#include <pthread.h>
+
+#include "arena.h"
 #include "constant-pool.h"
 #include "type.h"
 
@@ -34,17 +37,36 @@ typedef struct {
     u4 attribute_length;
 } attribute_info;
 
+/* An entry of the exception table of a method */
+typedef struct {
+    u2 start_pc; /* the handler covers [start_pc, end_pc) */
+    u2 end_pc;
+    u2 handler_pc;
+    u2 catch_type; /* Class constant, 0 to catch everything */
+} exception_handler_t;
+
 typedef struct {
     u2 max_stack;
     u2 max_locals;
     u4 code_length;
     u1 *code;
+    u2 handlers_count;
+    exception_handler_t *handlers; /* in the order they are tried */
 } code_t;
 
+/* access flags the VM looks at */
+#define ACC_STATIC 0x0008
+#define ACC_SYNCHRONIZED 0x0020
+
 typedef struct {
     char *name;
     char *descriptor;
-    code_t code;
+    code_t code;    /* code.code is NULL until the method is first invoked */
+    u4 code_offset; /* offset of the Code attribute in the class file */
+    u2 access_flags;
+#ifdef PROFILE
+    u4 profile_id; /* see profile.c */
+#endif
 } method_t;
 
 typedef struct {
@@ -67,43 +89,84 @@ typedef struct {
     bootmethods_t *bootstrap_methods;
 } bootmethods_attr_t;
 
+/* What a constant refers to, recorded by the interpreter the first time the
+ * constant is used. Entries are zeroed until then.
+ */
+typedef struct {
+    struct class_file *clazz; /* the class, or the class declaring the member.
+                               * NULL for the classes the VM implements */
+    union {
+        method_t *method;         /* MethodRef */
+        field_t *field;           /* FieldRef */
+        struct string *string;    /* String */
+        struct concat_plan *plan; /* InvokeDynamic */
+        const struct native_method *native;      /* MethodRef in C */
+        const struct native_class *native_class; /* Class likewise */
+    } value;
+} resolved_constant_t;
+
 typedef struct class_file {
     constant_pool_t constant_pool;
+    resolved_constant_t *resolved; /* parallel to the constant pool */
     class_info_t *info;
     method_t *methods;
     field_t *fields;
     u2 fields_count;
     bootmethods_attr_t *bootstrap;
     bool initialized;
-    struct class_file *next;
-    struct class_file *prev;
+    lock_word_t initializer; /* lock_owner of the thread running <clinit> */
+    lock_word_t lock;        /* for the static synchronized methods */
+    arena_t arena; /* holds all the metadata, but what is archived */
+    u1 *image; /* the mapped class file */
+    size_t image_size;
 } class_file_t;
 
+typedef enum {
+    CLASS_LOADED,
+    CLASS_QUEUED,  /* waiting for a prefetch thread */
+    CLASS_LOADING, /* being parsed, by a prefetch thread or the interpreter */
+    CLASS_MISSING, /* prefetched, but there is no such class file */
+} class_state_t;
+
 typedef struct {
-    class_file_t *clazz;
+    class_file_t *clazz; /* NULL unless the class is loaded */
     char *name;
+    u1 state;      /* see class_state_t */
+    bool archived; /* the class lives in the class archive */
 } meta_class_t;
 
-class_header_t get_class_header(FILE *class_file);
-class_info_t *get_class_info(FILE *class_file);
-method_t *get_methods(FILE *class_file, constant_pool_t *cp);
-void read_method_attributes(FILE *class_file,
+/* Held while metadata is added to a class once threads may be running it,
+ * as it is allocated from the arena of the class.
+ */
+extern pthread_mutex_t class_arena_lock;
+
+class_header_t get_class_header(class_reader_t *reader);
+class_info_t *get_class_info(class_reader_t *reader, arena_t *arena);
+method_t *get_methods(class_reader_t *reader,
+                      constant_pool_t *cp,
+                      arena_t *arena);
+void read_method_attributes(class_reader_t *reader,
                             method_info *info,
-                            code_t *code,
+                            method_t *method,
                             constant_pool_t *cp);
 uint16_t get_number_of_parameters(method_t *method);
 field_t *find_field(const char *name, const char *desc, class_file_t *clazz);
 method_t *find_method(const char *name, const char *desc, class_file_t *clazz);
+void load_method_code(method_t *method, class_file_t *clazz);
 method_t *find_method_from_index(uint16_t idx, class_file_t *clazz);
-class_file_t get_class(FILE *class_file);
+resolved_constant_t *get_resolved(uint16_t idx, class_file_t *clazz);
+class_file_t get_class(class_reader_t *reader);
 char *find_class_name_from_index(uint16_t idx, class_file_t *clazz);
 CONSTANT_FieldOrMethodRef_info *get_fieldref(constant_pool_t *cp, u2 idx);
 char *find_field_info_from_index(uint16_t idx,
                                  class_file_t *clazz,
                                  char **name_info,
                                  char **descriptor_info);
-void read_field_attributes(FILE *class_file, field_info *info);
+void read_field_attributes(class_reader_t *reader, field_info *info);
 bootmethods_t *find_bootstrap_method(uint16_t idx, class_file_t *clazz);
-bootmethods_attr_t *read_bootstrap_attribute(FILE *class_file,
-                                             constant_pool_t *cp);
-field_t *get_fields(FILE *class_file, constant_pool_t *cp, class_file_t *clazz);
\ No newline at end of file
+bootmethods_attr_t *read_bootstrap_attribute(class_reader_t *reader,
+                                             constant_pool_t *cp,
+                                             arena_t *arena);
+field_t *get_fields(class_reader_t *reader,
+                    constant_pool_t *cp,
+                    class_file_t *clazz);
\ No newline at end of file
@@ -1,170 +1,154 @@
 #include "constant-pool.h"
 
-/* Read unsigned big-endian integers */
-u1 read_u1(FILE *class_file)
+/* Convert a 1-indexed constant pool index to a 0-indexed array index */
+static u2 to_array_index(constant_pool_t *constant_pool, u2 index)
 {
-    int result = fgetc(class_file);
-    assert(result != EOF && "Reached end of file prematurely");
-    return result;
-}
-
-u2 read_u2(FILE *class_file)
-{
-    return (u2) read_u1(class_file) << 8 | read_u1(class_file);
+    assert(0 < index && index <= constant_pool->count &&
+           "Invalid constant pool index");
+    return index - 1;
 }
 
-u4 read_u4(FILE *class_file)
+/**
+ * Get the tag of the constant at the given index in a constant pool.
+ * Assert that the index is valid (i.e. between 1 and the pool size).
+ *
+ * @param constant_pool the class's constant pool
+ * @param index the 1-indexed constant pool index
+ * @return the tag of the constant, or 0 for the slot after a Long
+ */
+u1 get_constant_tag(constant_pool_t *constant_pool, u2 index)
 {
-    return (u4) read_u2(class_file) << 16 | read_u2(class_file);
+    return constant_pool->tags[to_array_index(constant_pool, index)];
 }
 
 /**
- * Get the constant at the given index in a constant pool.
+ * Get the payload of the constant at the given index in a constant pool.
  * Assert that the index is valid (i.e. between 1 and the pool size).
  *
  * @param constant_pool the class's constant pool
  * @param index the 1-indexed constant pool index
- * @return the constant at the given index
+ * @return the payload of the constant at the given index
  */
 const_pool_info *get_constant(constant_pool_t *constant_pool, u2 index)
 {
-    assert(0 < index && index <= constant_pool->count &&
-           "Invalid constant pool index");
-    /* Convert 1-indexed index to 0-indexed index */
-    return &constant_pool->constant_pool[index - 1];
+    return &constant_pool->info[to_array_index(constant_pool, index)];
+}
+
+char *get_utf8(constant_pool_t *cp, u2 idx)
+{
+    assert(get_constant_tag(cp, idx) == CONSTANT_Utf8 && "Expected a UTF8");
+    return get_constant(cp, idx)->utf8;
 }
 
 CONSTANT_FieldOrMethodRef_info *get_methodref(constant_pool_t *cp, u2 idx)
 {
-    const_pool_info *method = get_constant(cp, idx);
-    assert(method->tag == CONSTANT_MethodRef && "Expected a MethodRef");
-    return (CONSTANT_FieldOrMethodRef_info *) method->info;
+    assert(get_constant_tag(cp, idx) == CONSTANT_MethodRef &&
+           "Expected a MethodRef");
+    return &get_constant(cp, idx)->ref;
 }
 
 CONSTANT_Class_info *get_class_name(constant_pool_t *cp, u2 idx)
 {
-    const_pool_info *class = get_constant(cp, idx);
-    assert(class->tag == CONSTANT_Class && "Expected a Class");
-    return (CONSTANT_Class_info *) class->info;
+    assert(get_constant_tag(cp, idx) == CONSTANT_Class && "Expected a Class");
+    return &get_constant(cp, idx)->class_info;
+}
+
+CONSTANT_NameAndType_info *get_name_and_type(constant_pool_t *cp, u2 idx)
+{
+    assert(get_constant_tag(cp, idx) == CONSTANT_NameAndType &&
+           "Expected a NameAndType");
+    return &get_constant(cp, idx)->name_and_type;
 }
 
 CONSTANT_MethodHandle_info *get_method_handle(constant_pool_t *cp, u2 idx)
 {
-    const_pool_info *handle = get_constant(cp, idx);
-    assert(handle->tag == CONSTANT_MethodHandle && "Expected a MethodHandle");
-    return (CONSTANT_MethodHandle_info *) handle->info;
+    assert(get_constant_tag(cp, idx) == CONSTANT_MethodHandle &&
+           "Expected a MethodHandle");
+    return &get_constant(cp, idx)->method_handle;
 }
 
 char *get_string_utf(constant_pool_t *cp, u2 idx)
 {
-    const_pool_info *str = get_constant(cp, idx);
-    assert(str->tag == CONSTANT_String && "Expected a String");
-    const_pool_info *utf8 =
-        get_constant(cp, ((CONSTANT_String_info *) str->info)->string_index);
-    assert(utf8->tag == CONSTANT_Utf8 && "Expected a UTF8");
-    return (char *) utf8->info;
+    assert(get_constant_tag(cp, idx) == CONSTANT_String && "Expected a String");
+    return get_utf8(cp, get_constant(cp, idx)->string.string_index);
 }
 
-constant_pool_t get_constant_pool(FILE *class_file)
+/**
+ * Read the constant pool of a class file.
+ *
+ * @param reader the class file, positioned at the constant pool count
+ * @param arena the arena of the class, which holds the tags and payloads
+ * @return the constant pool
+ */
+constant_pool_t get_constant_pool(class_reader_t *reader, arena_t *arena)
 {
     constant_pool_t cp = {
         /* Constant pool count includes unused constant at index 0 */
-        .count = read_u2(class_file) - 1,
-        .constant_pool = malloc(sizeof(const_pool_info) * cp.count),
+        .count = read_u2(reader) - 1,
     };
-    assert(cp.constant_pool && "Failed to allocate constant pool");
-
-    const_pool_info *constant = cp.constant_pool;
-    for (u2 i = 0; i < cp.count; i++, constant++) {
-        constant->tag = read_u1(class_file);
-        switch (constant->tag) {
+    cp.tags = arena_alloc(arena, sizeof(u1) * cp.count);
+    cp.info = arena_alloc(arena, sizeof(const_pool_info) * cp.count);
+
+    for (u2 i = 0; i < cp.count; i++) {
+        u1 tag = read_u1(reader);
+        const_pool_info *constant = &cp.info[i];
+        cp.tags[i] = tag;
+        switch (tag) {
         case CONSTANT_Utf8: {
-            u2 length = read_u2(class_file);
-            char *value = malloc(length + 1);
-            assert(value && "Failed to allocate UTF8 constant");
-            size_t bytes_read = fread(value, 1, length, class_file);
-            assert(bytes_read == length && "Failed to read UTF8 constant");
+            u2 length = read_u2(reader);
+            /* Terminate the string in place: slide it over its length
+             * prefix, which has already been read, to make room for NUL.
+             */
+            char *value = (char *) read_bytes(reader, length) - 2;
+            memmove(value, value + 2, length);
             value[length] = '\0';
-            constant->info = (u1 *) value;
+            constant->utf8 = value;
             break;
         }
 
-        case CONSTANT_Integer: {
-            CONSTANT_Integer_info *value = malloc(sizeof(*value));
-            assert(value && "Failed to allocate integer constant");
-            value->bytes = read_u4(class_file);
-            constant->info = (u1 *) value;
+        case CONSTANT_Integer:
+            constant->integer.bytes = read_u4(reader);
             break;
-        }
 
-        case CONSTANT_Long: {
-            CONSTANT_LongOrDouble_info *value = malloc(sizeof(*value));
-            assert(value && "Failed to allocate long constant");
-            value->high_bytes = read_u4(class_file);
-            value->low_bytes = read_u4(class_file);
-            constant->info = (u1 *) value;
-            constant++;
-            constant->info = NULL;
+        case CONSTANT_Long:
+            constant->long_or_double.high_bytes = read_u4(reader);
+            constant->long_or_double.low_bytes = read_u4(reader);
+            /* the next slot is unusable, its tag stays zeroed */
             i++;
             break;
-        }
 
-        case CONSTANT_Class: {
-            CONSTANT_Class_info *value = malloc(sizeof(*value));
-            assert(value && "Failed to allocate class constant");
-            value->string_index = read_u2(class_file);
-            constant->info = (u1 *) value;
+        case CONSTANT_Class:
+            constant->class_info.string_index = read_u2(reader);
             break;
-        }
 
         case CONSTANT_MethodRef:
-        case CONSTANT_FieldRef: {
-            CONSTANT_FieldOrMethodRef_info *value = malloc(sizeof(*value));
-            assert(value &&
-                   "Failed to allocate FieldRef or MethodRef constant");
-            value->class_index = read_u2(class_file);
-            value->name_and_type_index = read_u2(class_file);
-            constant->info = (u1 *) value;
+        case CONSTANT_FieldRef:
+            constant->ref.class_index = read_u2(reader);
+            constant->ref.name_and_type_index = read_u2(reader);
             break;
-        }
 
-        case CONSTANT_NameAndType: {
-            CONSTANT_NameAndType_info *value = malloc(sizeof(*value));
-            assert(value && "Failed to allocate NameAndType constant");
-            value->name_index = read_u2(class_file);
-            value->descriptor_index = read_u2(class_file);
-            constant->info = (u1 *) value;
+        case CONSTANT_NameAndType:
+            constant->name_and_type.name_index = read_u2(reader);
+            constant->name_and_type.descriptor_index = read_u2(reader);
             break;
-        }
 
-        case CONSTANT_String: {
-            CONSTANT_String_info *value = malloc(sizeof(*value));
-            assert(value && "Failed to allocate String constant");
-            value->string_index = read_u2(class_file);
-            constant->info = (u1 *) value;
+        case CONSTANT_String:
+            constant->string.string_index = read_u2(reader);
             break;
-        }
 
-        case CONSTANT_InvokeDynamic: {
-            CONSTANT_InvokeDynamic_info *value = malloc(sizeof(*value));
-            assert(value && "Failed to allocate InvokeDynamic constant");
-            value->bootstrap_method_attr_index = read_u2(class_file);
-            value->name_and_type_index = read_u2(class_file);
-            constant->info = (u1 *) value;
+        case CONSTANT_InvokeDynamic:
+            constant->invoke_dynamic.bootstrap_method_attr_index =
+                read_u2(reader);
+            constant->invoke_dynamic.name_and_type_index = read_u2(reader);
             break;
-        }
 
-        case CONSTANT_MethodHandle: {
-            CONSTANT_MethodHandle_info *value = malloc(sizeof(*value));
-            assert(value && "Failed to allocate MethodHandle constant");
-            value->reference_kind = read_u1(class_file);
-            value->reference_index = read_u2(class_file);
-            constant->info = (u1 *) value;
+        case CONSTANT_MethodHandle:
+            constant->method_handle.reference_kind = read_u1(reader);
+            constant->method_handle.reference_index = read_u2(reader);
             break;
-        }
 
         default:
-            fprintf(stderr, "Unknown constant type %d\n", constant->tag);
+            fprintf(stderr, "Unknown constant type %d\n", tag);
             exit(1);
         }
     }
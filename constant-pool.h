@@ -6,6 +6,8 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "arena.h"
+#include "class-reader.h"
 #include "type.h"
 
 typedef enum {
@@ -58,22 +60,34 @@ typedef struct {
     u2 reference_index;
 } CONSTANT_MethodHandle_info;
 
-typedef struct {
-    const_pool_tag_t tag;
-    u1 *info;
+/* Payload of a constant, stored inline whatever its type */
+typedef union {
+    char *utf8; /* NUL-terminated, in the mapped class file */
+    CONSTANT_Integer_info integer;
+    CONSTANT_LongOrDouble_info long_or_double;
+    CONSTANT_Class_info class_info;
+    CONSTANT_String_info string;
+    CONSTANT_FieldOrMethodRef_info ref;
+    CONSTANT_NameAndType_info name_and_type;
+    CONSTANT_InvokeDynamic_info invoke_dynamic;
+    CONSTANT_MethodHandle_info method_handle;
 } const_pool_info;
 
+/* The constants are stored as parallel arrays of tags and payloads, so that
+ * scanning the tags touches no payload.
+ */
 typedef struct {
     u2 count;
-    const_pool_info *constant_pool;
+    u1 *tags;              /* tag of each constant, 0 after a Long */
+    const_pool_info *info; /* payload of each constant */
 } constant_pool_t;
 
-u1 read_u1(FILE *class_file);
-u2 read_u2(FILE *class_file);
-u4 read_u4(FILE *class_file);
+u1 get_constant_tag(constant_pool_t *constant_pool, u2 index);
 const_pool_info *get_constant(constant_pool_t *constant_pool, u2 index);
-constant_pool_t get_constant_pool(FILE *class_file);
+constant_pool_t get_constant_pool(class_reader_t *reader, arena_t *arena);
+char *get_utf8(constant_pool_t *cp, u2 idx);
 CONSTANT_FieldOrMethodRef_info *get_methodref(constant_pool_t *cp, u2 idx);
 CONSTANT_Class_info *get_class_name(constant_pool_t *cp, u2 idx);
+CONSTANT_NameAndType_info *get_name_and_type(constant_pool_t *cp, u2 idx);
 CONSTANT_MethodHandle_info *get_method_handle(constant_pool_t *cp, u2 idx);
 char *get_string_utf(constant_pool_t *cp, u2 idx);
@@ -0,0 +1,116 @@
+/* Exceptions, thrown by athrow or raised by the VM itself.
+ *
+ * Throwing an exception only records it as pending. The interpreter then
+ * looks for a handler in the exception table of the running method, and
+ * returns to the caller when there is none, which looks again, and so on
+ * until the exception is caught or leaves main().
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "exception.h"
+#include "native.h"
+#include "output.h"
+
+__thread object_t *pending_exception;
+
+/**
+ * Throw an exception from the VM, or from a method the VM implements.
+ *
+ * @param class_name the binary name of the exception class, which must be
+ * a class the VM implements
+ * @param format the printf() format of the detail message, or NULL for an
+ * exception without a message
+ */
+void raise_exception(const char *class_name, const char *format, ...)
+{
+    const native_class_t *native = find_native_class(class_name);
+    assert(native && native->create && "Unknown exception class");
+    object_t *exception = native->create(native);
+
+    if (format) {
+        char message[128];
+        va_list args;
+        va_start(args, format);
+        vsnprintf(message, sizeof(message), format, args);
+        va_end(args);
+        set_exception_message(exception, create_string(message));
+    }
+    pending_exception = exception;
+}
+
+/**
+ * Get the name of the class of an object.
+ *
+ * @param obj the object, or one of its parts
+ * @return the binary name of the class of that part
+ */
+const char *get_object_class_name(object_t *obj)
+{
+    if (obj->class)
+        return find_class_name_from_index(obj->class->info->this_class,
+                                          obj->class);
+    return obj->native ? obj->native->name : "java/lang/Object";
+}
+
+/**
+ * Check whether an exception can be caught by a catch clause.
+ *
+ * @param exception the exception
+ * @param class_name the binary name of the class the clause catches
+ * @return true if the exception is an instance of the class
+ */
+bool is_exception_instance(object_t *exception, const char *class_name)
+{
+    object_t *part = exception;
+    for (;; part = part->parent) {
+        if (!strcmp(get_object_class_name(part), class_name))
+            return true;
+        if (!part->parent)
+            break;
+    }
+
+    /* the classes the VM implements above the first one */
+    for (const native_class_t *native = part->native;
+         native && native->super_name;
+         native = find_native_class(native->super_name)) {
+        if (!strcmp(native->super_name, class_name))
+            return true;
+    }
+    return false;
+}
+
+/* The detail message, NULL if there is none */
+string_t *get_exception_message(object_t *exception)
+{
+    return get_native_part(exception)->value[0].value.ptr_value;
+}
+
+void set_exception_message(object_t *exception, string_t *message)
+{
+    variable_t *var = &get_native_part(exception)->value[0];
+    var->value.ptr_value = message;
+    var->type = VAR_PTR;
+}
+
+/* Print the class and message of an exception to the standard error, the way
+ * Throwable.toString() describes it
+ */
+void print_exception(object_t *exception)
+{
+    /* keep the output of the program before the error */
+    lock_output();
+    flush_output();
+    for (const char *c = get_object_class_name(exception); *c; c++)
+        fputc(*c == '/' ? '.' : *c, stderr);
+
+    string_t *message = get_exception_message(exception);
+    if (message) {
+        fputs(": ", stderr);
+        print_java_string(stderr, message);
+    }
+    fputc('\n', stderr);
+    unlock_output();
+}
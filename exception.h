@@ -0,0 +1,19 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "java-string.h"
+#include "object-heap.h"
+
+/* The exception being thrown by the current thread, NULL while none is.
+ * Whatever raises one sets it and returns; the interpreter checks it after
+ * each call, so code running normally pays nothing for exceptions.
+ */
+extern __thread object_t *pending_exception;
+
+void raise_exception(const char *class_name, const char *format, ...);
+const char *get_object_class_name(object_t *obj);
+bool is_exception_instance(object_t *exception, const char *class_name);
+string_t *get_exception_message(object_t *exception);
+void set_exception_message(object_t *exception, string_t *message);
+void print_exception(object_t *exception);
@@ -0,0 +1,625 @@
+/* Fork/join pools, whose worker threads run the tasks of their own deque
+ * and steal those of the others.
+ *
+ * Every worker has a Chase-Lev deque: it pushes the tasks it forks at the
+ * bottom and takes them back from there, last in first out, without any lock
+ * but when a single task is left. The other workers steal from the top with
+ * a compare-and-swap, and so take the oldest tasks, which are the largest of
+ * a recursive computation. The tasks forked or invoked by the other threads
+ * go to the submission queue of the pool, which fork() picks the common pool
+ * for.
+ *
+ * A worker joining a task which is not done runs other tasks meanwhile: the
+ * ones left in its deque, then the ones it steals, and only blocks once there
+ * is nothing to steal. The other threads block right away. Idle workers sleep
+ * until a task is pushed. Like in java, the workers are daemons, which the VM
+ * does not wait for on exit.
+ *
+ * A task runs once, by whichever thread claims it first: it goes from
+ * pending to running, then is done, normally or by an exception.
+ */
+
+#include <assert.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "exception.h"
+#include "fork-join.h"
+#include "monitor.h"
+#include "native.h"
+#include "thread.h"
+
+#define DEQUE_SIZE 256 /* initial capacity of a deque */
+#define SUBMISSIONS_SIZE 16
+#define JOIN_SPINS 64 /* rounds of a worker finding nothing before it blocks */
+
+typedef enum {
+    TASK_PENDING,
+    TASK_RUNNING,
+    TASK_NORMAL,
+    TASK_EXCEPTIONAL,
+} task_status_t;
+
+typedef struct deque_array {
+    int64_t size; /* a power of two */
+    struct deque_array *previous; /* outgrown, freed with the pool */
+    object_t *tasks[];
+} deque_array_t;
+
+typedef struct {
+    int64_t top; /* where the thieves steal */
+    char padding[56]; /* keeps the thieves off the cache line of the owner */
+    int64_t bottom; /* where the owner pushes and takes */
+    deque_array_t *array;
+} deque_t;
+
+typedef struct worker {
+    deque_t deque;
+    struct pool *pool;
+    thread_t thread;
+    u4 seed; /* for picking the victims to steal from */
+} worker_t;
+
+struct pool {
+    u4 parallelism;
+    u4 number; /* of the pool, 0 for the common pool */
+    worker_t **workers;
+    u4 workers_count; /* published as they start */
+    u4 running;       /* tasks the workers have claimed and not done yet */
+    u4 idle;          /* workers waiting for work */
+    pthread_mutex_t lock; /* guards the submissions and the idle workers */
+    pthread_cond_t work;
+    object_t **submissions; /* ring buffer */
+    u4 head, submitted, capacity;
+    bool started;
+    bool shutting_down;
+    struct pool *next;
+};
+
+static __thread worker_t *current_worker;
+
+static pthread_once_t common_once = PTHREAD_ONCE_INIT;
+static pool_t *common_pool;
+static u4 pool_number; /* of the last pool created */
+
+/* Guards the list of the pools */
+static pthread_mutex_t pools_lock = PTHREAD_MUTEX_INITIALIZER;
+static pool_t *pools;
+
+/* Guards the threads other than the workers waiting for tasks to be done */
+static pthread_mutex_t joiners_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t tasks_done = PTHREAD_COND_INITIALIZER;
+static u4 joiners;
+
+static u4 *get_status(object_t *task)
+{
+    return &get_native_part(task)->value[TASK_STATUS].value.int_value;
+}
+
+static variable_t *get_result(object_t *task)
+{
+    return &get_native_part(task)->value[TASK_RESULT];
+}
+
+static void init_deque(deque_t *deque)
+{
+    deque->array = malloc(sizeof(deque_array_t) +
+                          DEQUE_SIZE * sizeof(object_t *));
+    assert(deque->array && "Failed to allocate deque");
+    deque->array->size = DEQUE_SIZE;
+    deque->array->previous = NULL;
+}
+
+/* Double the array of a full deque. The thieves may still read the old one,
+ * which is kept until the pool is freed.
+ */
+static deque_array_t *grow_deque(deque_t *deque,
+                                 deque_array_t *array,
+                                 int64_t top,
+                                 int64_t bottom)
+{
+    int64_t size = 2 * array->size;
+    deque_array_t *grown =
+        malloc(sizeof(deque_array_t) + size * sizeof(object_t *));
+    assert(grown && "Failed to grow deque");
+    grown->size = size;
+    grown->previous = array;
+    for (int64_t i = top; i < bottom; i++)
+        grown->tasks[i & (size - 1)] = __atomic_load_n(
+            &array->tasks[i & (array->size - 1)], __ATOMIC_RELAXED);
+    __atomic_store_n(&deque->array, grown, __ATOMIC_RELEASE);
+    return grown;
+}
+
+/* Push a task at the bottom, by the owner of the deque only */
+static void push_task(deque_t *deque, object_t *task)
+{
+    int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+    int64_t top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+    deque_array_t *array = __atomic_load_n(&deque->array, __ATOMIC_RELAXED);
+    if (bottom - top > array->size - 1)
+        array = grow_deque(deque, array, top, bottom);
+    __atomic_store_n(&array->tasks[bottom & (array->size - 1)], task,
+                     __ATOMIC_RELAXED);
+    /* the thieves see the task, and what it refers to */
+    __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELEASE);
+}
+
+/* Take the task at the bottom, by the owner of the deque only */
+static object_t *take_task(deque_t *deque)
+{
+    int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+    deque_array_t *array = __atomic_load_n(&deque->array, __ATOMIC_RELAXED);
+    __atomic_store_n(&deque->bottom, bottom, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t top = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+    if (top > bottom) {
+        __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    object_t *task = __atomic_load_n(&array->tasks[bottom & (array->size - 1)],
+                                     __ATOMIC_RELAXED);
+    if (top == bottom) {
+        /* the last task, which a thief may be stealing */
+        if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, false,
+                                         __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+            task = NULL;
+        __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+    }
+    return task;
+}
+
+/**
+ * Steal the task at the top of a deque.
+ *
+ * @param deque the deque of another worker
+ * @param contended set when another thread took the task first
+ * @return the task, NULL if the deque is empty or another thread took it
+ */
+static object_t *steal_task(deque_t *deque, bool *contended)
+{
+    int64_t top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+    if (top >= bottom)
+        return NULL;
+
+    deque_array_t *array = __atomic_load_n(&deque->array, __ATOMIC_ACQUIRE);
+    object_t *task = __atomic_load_n(&array->tasks[top & (array->size - 1)],
+                                     __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, false,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+        *contended = true;
+        return NULL;
+    }
+    return task;
+}
+
+static bool deque_empty(deque_t *deque)
+{
+    return __atomic_load_n(&deque->bottom, __ATOMIC_SEQ_CST) <=
+           __atomic_load_n(&deque->top, __ATOMIC_SEQ_CST);
+}
+
+/* Whether any task is queued, with the lock of the pool held */
+static bool has_work(pool_t *pool)
+{
+    if (__atomic_load_n(&pool->submitted, __ATOMIC_SEQ_CST))
+        return true;
+    for (u4 i = 0; i < pool->workers_count; i++) {
+        if (!deque_empty(&pool->workers[i]->deque))
+            return true;
+    }
+    return false;
+}
+
+/* A task was pushed: wake a worker to steal it, if one is idle */
+static void signal_work(pool_t *pool)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&pool->idle, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&pool->lock);
+        pthread_cond_signal(&pool->work);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+/* Run compute() of a task, unless another thread has claimed it */
+static void exec_task(object_t *task)
+{
+    u4 *status = get_status(task);
+    u4 pending = TASK_PENDING;
+    if (!__atomic_compare_exchange_n(status, &pending, TASK_RUNNING, false,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return;
+    pool_t *pool = current_worker ? current_worker->pool : NULL;
+    if (pool)
+        __atomic_add_fetch(&pool->running, 1, __ATOMIC_SEQ_CST);
+
+    /* RecursiveTask.compute() returns the result, RecursiveAction.compute()
+     * none */
+    const char *descriptor =
+        strcmp(get_native_part(task)->native->name,
+               "java/util/concurrent/RecursiveAction")
+            ? "()Ljava/lang/Object;"
+            : "()V";
+    object_t *result = call_method(task, "compute", descriptor);
+    u4 done = TASK_NORMAL;
+    if (pending_exception) {
+        result = pending_exception;
+        pending_exception = NULL;
+        done = TASK_EXCEPTIONAL;
+    }
+    get_result(task)->value.ptr_value = result;
+
+    /* done before it counts as such, see pools_busy() */
+    if (pool)
+        __atomic_sub_fetch(&pool->running, 1, __ATOMIC_SEQ_CST);
+    __atomic_store_n(status, done, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&joiners, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&joiners_lock);
+        pthread_cond_broadcast(&tasks_done);
+        pthread_mutex_unlock(&joiners_lock);
+    }
+}
+
+/* Take the oldest submitted task, if any */
+static object_t *poll_submission(pool_t *pool)
+{
+    if (!__atomic_load_n(&pool->submitted, __ATOMIC_SEQ_CST))
+        return NULL;
+    object_t *task = NULL;
+    pthread_mutex_lock(&pool->lock);
+    if (pool->submitted) {
+        task = pool->submissions[pool->head];
+        pool->head = (pool->head + 1) % pool->capacity;
+        __atomic_store_n(&pool->submitted, pool->submitted - 1,
+                         __ATOMIC_SEQ_CST);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return task;
+}
+
+/* A task submitted, or stolen from the deque of another worker */
+static object_t *find_task(worker_t *worker)
+{
+    pool_t *pool = worker->pool;
+    object_t *task = poll_submission(pool);
+    if (task)
+        return task;
+
+    /* xorshift, so that the thieves spread over the victims */
+    worker->seed ^= worker->seed << 13;
+    worker->seed ^= worker->seed >> 17;
+    worker->seed ^= worker->seed << 5;
+    u4 count = __atomic_load_n(&pool->workers_count, __ATOMIC_ACQUIRE);
+    bool contended;
+    do {
+        contended = false;
+        for (u4 i = 0; i < count; i++) {
+            worker_t *victim = pool->workers[(worker->seed + i) % count];
+            if (victim == worker)
+                continue;
+            task = steal_task(&victim->deque, &contended);
+            if (task)
+                return task;
+        }
+    } while (contended);
+    return NULL;
+}
+
+/* Sleep until a task is queued, return false once the pool shuts down */
+static bool wait_for_task(worker_t *worker)
+{
+    pool_t *pool = worker->pool;
+    enter_blocking();
+    pthread_mutex_lock(&pool->lock);
+    __atomic_add_fetch(&pool->idle, 1, __ATOMIC_SEQ_CST);
+    while (!pool->shutting_down && !has_work(pool))
+        pthread_cond_wait(&pool->work, &pool->lock);
+    __atomic_sub_fetch(&pool->idle, 1, __ATOMIC_SEQ_CST);
+    bool shutting_down = pool->shutting_down;
+    pthread_mutex_unlock(&pool->lock);
+
+    /* ends blocked, as stopping the world need not wait for it */
+    if (shutting_down)
+        return false;
+    leave_blocking();
+    return true;
+}
+
+static void *worker_main(void *arg)
+{
+    worker_t *worker = arg;
+    current_worker = worker;
+    current_thread = &worker->thread;
+    init_lock_owner();
+    init_object_heap();
+    leave_blocking();
+
+    for (;;) {
+        object_t *task = take_task(&worker->deque);
+        if (!task)
+            task = find_task(worker);
+        if (task)
+            exec_task(task);
+        else if (!wait_for_task(worker))
+            break;
+    }
+    return NULL;
+}
+
+/* Start the workers of a pool, the first time it gets a task */
+static void start_workers(pool_t *pool)
+{
+    if (__atomic_load_n(&pool->started, __ATOMIC_ACQUIRE))
+        return;
+    pthread_mutex_lock(&pool->lock);
+    if (pool->started) {
+        pthread_mutex_unlock(&pool->lock);
+        return;
+    }
+
+    pool->workers = calloc(pool->parallelism, sizeof(worker_t *));
+    assert(pool->workers && "Failed to allocate workers");
+    u4 count = 0;
+    for (u4 i = 0; i < pool->parallelism; i++) {
+        worker_t *worker = calloc(1, sizeof(worker_t));
+        assert(worker && "Failed to allocate worker");
+        init_deque(&worker->deque);
+        worker->pool = pool;
+        worker->seed = i + 1;
+        char name[64];
+        if (pool->number)
+            snprintf(name, sizeof(name),
+                     "ForkJoinPool-%" PRIu32 "-worker-%" PRIu32, pool->number,
+                     i + 1);
+        else
+            snprintf(name, sizeof(name),
+                     "ForkJoinPool.commonPool-worker-%" PRIu32, i + 1);
+        worker->thread.name = create_string(name);
+        worker->thread.alive = true;
+        pool->workers[count] = worker;
+        if (pthread_create(&worker->thread.pthread, NULL, worker_main,
+                           worker)) {
+            free(worker->deque.array);
+            free(worker);
+            break;
+        }
+        /* the workers steal from the ones started before them only, until
+         * they all have started */
+        __atomic_store_n(&pool->workers_count, ++count, __ATOMIC_RELEASE);
+    }
+    if (!count) {
+        fprintf(stderr, "Failed to start the workers of a ForkJoinPool\n");
+        exit(1);
+    }
+    __atomic_store_n(&pool->started, true, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* Queue a task from a thread which is not a worker of the pool */
+static void submit_task(pool_t *pool, object_t *task)
+{
+    start_workers(pool);
+    pthread_mutex_lock(&pool->lock);
+    if (pool->submitted == pool->capacity) {
+        u4 capacity = pool->capacity ? 2 * pool->capacity : SUBMISSIONS_SIZE;
+        object_t **submissions = malloc(capacity * sizeof(object_t *));
+        assert(submissions && "Failed to grow submissions");
+        for (u4 i = 0; i < pool->submitted; i++)
+            submissions[i] =
+                pool->submissions[(pool->head + i) % pool->capacity];
+        free(pool->submissions);
+        pool->submissions = submissions;
+        pool->head = 0;
+        pool->capacity = capacity;
+    }
+    pool->submissions[(pool->head + pool->submitted) % pool->capacity] = task;
+    __atomic_store_n(&pool->submitted, pool->submitted + 1, __ATOMIC_SEQ_CST);
+    if (pool->idle)
+        pthread_cond_signal(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static bool is_done(object_t *task)
+{
+    return __atomic_load_n(get_status(task), __ATOMIC_SEQ_CST) >= TASK_NORMAL;
+}
+
+/* Block until a task is done */
+static void wait_task(object_t *task)
+{
+    enter_blocking();
+    pthread_mutex_lock(&joiners_lock);
+    __atomic_add_fetch(&joiners, 1, __ATOMIC_SEQ_CST);
+    while (!is_done(task))
+        pthread_cond_wait(&tasks_done, &joiners_lock);
+    __atomic_sub_fetch(&joiners, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&joiners_lock);
+    leave_blocking();
+}
+
+/* Run the other tasks until a task is done, by a worker */
+static void help_join(worker_t *worker, object_t *task)
+{
+    for (u4 spins = 0; !is_done(task);) {
+        object_t *next = take_task(&worker->deque);
+        if (!next)
+            next = find_task(worker);
+        if (next) {
+            exec_task(next);
+            spins = 0;
+            continue;
+        }
+
+        /* the task runs on another thread, which may fork more */
+        if (++spins == JOIN_SPINS) {
+            wait_task(task);
+            return;
+        }
+        sched_yield();
+        safepoint_poll();
+    }
+}
+
+/* The result of a task done, or NULL with its exception raised */
+static object_t *report(object_t *task)
+{
+    object_t *result = get_result(task)->value.ptr_value;
+    if (__atomic_load_n(get_status(task), __ATOMIC_ACQUIRE) ==
+        TASK_EXCEPTIONAL) {
+        pending_exception = result;
+        return NULL;
+    }
+    return result;
+}
+
+static pool_t *new_pool(u4 parallelism, u4 number)
+{
+    pool_t *pool = calloc(1, sizeof(pool_t));
+    assert(pool && "Failed to allocate pool");
+    pool->parallelism = parallelism;
+    pool->number = number;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_mutex_lock(&pools_lock);
+    pool->next = pools;
+    pools = pool;
+    pthread_mutex_unlock(&pools_lock);
+    return pool;
+}
+
+/**
+ * Create a pool, whose workers start with its first task.
+ *
+ * @param parallelism the number of workers, positive
+ */
+pool_t *create_pool(u4 parallelism)
+{
+    assert(parallelism && "No workers");
+    return new_pool(parallelism,
+                    __atomic_add_fetch(&pool_number, 1, __ATOMIC_RELAXED));
+}
+
+static void init_common_pool()
+{
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    common_pool = new_pool(count > 0 ? count : 1, 0);
+}
+
+/* The pool of the tasks forked outside of any pool */
+pool_t *get_common_pool()
+{
+    pthread_once(&common_once, init_common_pool);
+    return common_pool;
+}
+
+u4 get_parallelism(pool_t *pool)
+{
+    return pool->parallelism;
+}
+
+/* Queue a task to run asynchronously: on the deque of the current worker,
+ * or in the common pool */
+void fork_task(object_t *task)
+{
+    worker_t *worker = current_worker;
+    if (!worker) {
+        submit_task(get_common_pool(), task);
+        return;
+    }
+    push_task(&worker->deque, task);
+    signal_work(worker->pool);
+}
+
+/**
+ * Wait until a task is done, running others meanwhile on a worker.
+ *
+ * @param task the task
+ * @return its result, or NULL with the exception of compute() raised
+ */
+object_t *join_task(object_t *task)
+{
+    if (!is_done(task)) {
+        if (current_worker)
+            help_join(current_worker, task);
+        else
+            wait_task(task);
+    }
+    return report(task);
+}
+
+/* Run a task on the current thread, unless another one runs it already,
+ * and join it */
+object_t *invoke_task(object_t *task)
+{
+    exec_task(task);
+    return join_task(task);
+}
+
+/* Run a task in a pool, and join it */
+object_t *invoke_in_pool(pool_t *pool, object_t *task)
+{
+    if (current_worker && current_worker->pool == pool)
+        return invoke_task(task);
+    submit_task(pool, task);
+    wait_task(task);
+    return report(task);
+}
+
+bool is_task_done(object_t *task)
+{
+    return is_done(task);
+}
+
+/* Whether a worker may still run some Java code: a task is running or
+ * queued. Called on exit, once the other threads have ended.
+ */
+bool pools_busy()
+{
+    bool busy = false;
+    pthread_mutex_lock(&pools_lock);
+    for (pool_t *pool = pools; pool && !busy; pool = pool->next) {
+        pthread_mutex_lock(&pool->lock);
+        busy = __atomic_load_n(&pool->running, __ATOMIC_SEQ_CST) ||
+               has_work(pool);
+        pthread_mutex_unlock(&pool->lock);
+    }
+    pthread_mutex_unlock(&pools_lock);
+    return busy;
+}
+
+/* End the workers, which have no task left, and free the pools */
+void free_pools()
+{
+    while (pools) {
+        pool_t *pool = pools;
+        pthread_mutex_lock(&pool->lock);
+        pool->shutting_down = true;
+        pthread_cond_broadcast(&pool->work);
+        pthread_mutex_unlock(&pool->lock);
+        for (u4 i = 0; i < pool->workers_count; i++) {
+            worker_t *worker = pool->workers[i];
+            pthread_join(worker->thread.pthread, NULL);
+            for (deque_array_t *array = worker->deque.array; array;) {
+                deque_array_t *previous = array->previous;
+                free(array);
+                array = previous;
+            }
+            free(worker);
+        }
+        free(pool->workers);
+        free(pool->submissions);
+        pthread_cond_destroy(&pool->work);
+        pthread_mutex_destroy(&pool->lock);
+        pools = pool->next;
+        free(pool);
+    }
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "object-heap.h"
+
+/* A pool of worker threads running fork/join tasks, see fork-join.c */
+typedef struct pool pool_t;
+
+/* The fields of the part of a java.util.concurrent.ForkJoinTask the VM
+ * implements */
+enum {
+    TASK_STATUS, /* see fork-join.c */
+    TASK_RESULT, /* the result, or the exception compute() threw */
+    TASK_FIELDS_COUNT,
+};
+
+pool_t *create_pool(u4 parallelism);
+pool_t *get_common_pool();
+u4 get_parallelism(pool_t *pool);
+void fork_task(object_t *task);
+object_t *join_task(object_t *task);
+object_t *invoke_task(object_t *task);
+object_t *invoke_in_pool(pool_t *pool, object_t *task);
+bool is_task_done(object_t *task);
+bool pools_busy();
+void free_pools();
@@ -0,0 +1,292 @@
+/* Decoder for raw deflate streams (RFC 1951), as stored in JAR files.
+ *
+ * Huffman codes are decoded one bit at a time using the canonical code
+ * counts, which needs no lookup tables: class files are small and only
+ * decompressed once.
+ */
+
+#include <string.h>
+
+#include "inflate.h"
+
+#define MAX_BITS 15
+#define MAX_LITERAL_CODES 286
+#define MAX_DISTANCE_CODES 30
+#define FIXED_LITERAL_CODES 288
+
+typedef struct {
+    const u1 *src;
+    size_t src_size, src_pos;
+    u1 *dst;
+    size_t dst_size, dst_pos;
+    u4 bit_buffer;
+    int bit_count;
+    bool error;
+} inflate_state_t;
+
+/* A canonical Huffman code: number of codes of each length, and symbols
+ * ordered by code.
+ */
+typedef struct {
+    short count[MAX_BITS + 1];
+    short symbol[FIXED_LITERAL_CODES];
+} huffman_t;
+
+static const short length_base[29] = {
+    3,  4,  5,  6,  7,  8,  9,  10, 11,  13,  15,  17,  19,  23, 27,
+    31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const short length_extra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1,
+                                       1, 1, 2, 2, 2, 2, 3, 3, 3, 3,
+                                       4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const short distance_base[30] = {
+    1,   2,   3,   4,   5,   7,    9,    13,   17,   25,   33,
+    49,  65,  97,  129, 193, 257,  385,  513,  769,  1025, 1537,
+    2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+static const short distance_extra[30] = {0, 0, 0,  0,  1,  1,  2,  2,
+                                         3, 3, 4,  4,  5,  5,  6,  6,
+                                         7, 7, 8,  8,  9,  9,  10, 10,
+                                         11, 11, 12, 12, 13, 13};
+
+/* Read bits least significant first, flagging an error past the input */
+static int get_bits(inflate_state_t *s, int need)
+{
+    u4 value = s->bit_buffer;
+    while (s->bit_count < need) {
+        if (s->src_pos == s->src_size) {
+            s->error = true;
+            return 0;
+        }
+        value |= (u4) s->src[s->src_pos++] << s->bit_count;
+        s->bit_count += 8;
+    }
+    s->bit_buffer = value >> need;
+    s->bit_count -= need;
+    return value & ((1U << need) - 1);
+}
+
+/**
+ * Build a canonical Huffman code from the code length of each symbol.
+ *
+ * @return false if the lengths describe an over-subscribed code
+ */
+static bool build_huffman(huffman_t *h, const short *lengths, int n)
+{
+    memset(h->count, 0, sizeof(h->count));
+    for (int symbol = 0; symbol < n; symbol++)
+        h->count[lengths[symbol]]++;
+
+    /* each length can have at most twice the codes left by the shorter
+     * ones; incomplete codes are allowed
+     */
+    int left = 1;
+    for (int len = 1; len <= MAX_BITS; len++) {
+        left = (left << 1) - h->count[len];
+        if (left < 0)
+            return false;
+    }
+
+    short offsets[MAX_BITS + 1];
+    offsets[1] = 0;
+    for (int len = 1; len < MAX_BITS; len++)
+        offsets[len + 1] = offsets[len] + h->count[len];
+    for (int symbol = 0; symbol < n; symbol++) {
+        if (lengths[symbol])
+            h->symbol[offsets[lengths[symbol]]++] = symbol;
+    }
+    return true;
+}
+
+/* Decode a symbol, or return -1 for a code that is not in the table */
+static int decode(inflate_state_t *s, const huffman_t *h)
+{
+    int code = 0, first = 0, index = 0;
+    for (int len = 1; len <= MAX_BITS; len++) {
+        code |= get_bits(s, 1);
+        int count = h->count[len];
+        if (code - first < count)
+            return h->symbol[index + code - first];
+        index += count;
+        first = (first + count) << 1;
+        code <<= 1;
+    }
+    return -1;
+}
+
+static bool inflate_stored(inflate_state_t *s)
+{
+    /* stored blocks start at a byte boundary */
+    s->bit_buffer = 0;
+    s->bit_count = 0;
+    if (s->src_size - s->src_pos < 4)
+        return false;
+    const u1 *header = s->src + s->src_pos;
+    u2 length = header[0] | header[1] << 8;
+    u2 complement = header[2] | header[3] << 8;
+    s->src_pos += 4;
+    if ((length ^ complement) != 0xffff || s->src_size - s->src_pos < length ||
+        s->dst_size - s->dst_pos < length)
+        return false;
+    memcpy(s->dst + s->dst_pos, s->src + s->src_pos, length);
+    s->src_pos += length;
+    s->dst_pos += length;
+    return true;
+}
+
+static bool inflate_codes(inflate_state_t *s,
+                          const huffman_t *literals,
+                          const huffman_t *distances)
+{
+    for (;;) {
+        int symbol = decode(s, literals);
+        if (s->error || symbol < 0)
+            return false;
+        if (symbol == 256)
+            return true;
+
+        if (symbol < 256) {
+            if (s->dst_pos == s->dst_size)
+                return false;
+            s->dst[s->dst_pos++] = symbol;
+            continue;
+        }
+
+        symbol -= 257;
+        if (symbol >= 29)
+            return false;
+        size_t length =
+            length_base[symbol] + get_bits(s, length_extra[symbol]);
+        symbol = decode(s, distances);
+        if (symbol < 0 || symbol >= 30)
+            return false;
+        size_t distance =
+            distance_base[symbol] + get_bits(s, distance_extra[symbol]);
+        if (s->error || distance > s->dst_pos ||
+            s->dst_size - s->dst_pos < length)
+            return false;
+        /* the copy may overlap the bytes it produces */
+        for (; length; length--, s->dst_pos++)
+            s->dst[s->dst_pos] = s->dst[s->dst_pos - distance];
+    }
+}
+
+static bool inflate_fixed(inflate_state_t *s)
+{
+    short lengths[FIXED_LITERAL_CODES];
+    int symbol = 0;
+    for (; symbol < 144; symbol++)
+        lengths[symbol] = 8;
+    for (; symbol < 256; symbol++)
+        lengths[symbol] = 9;
+    for (; symbol < 280; symbol++)
+        lengths[symbol] = 7;
+    for (; symbol < FIXED_LITERAL_CODES; symbol++)
+        lengths[symbol] = 8;
+    huffman_t literals, distances;
+    build_huffman(&literals, lengths, FIXED_LITERAL_CODES);
+
+    for (symbol = 0; symbol < MAX_DISTANCE_CODES; symbol++)
+        lengths[symbol] = 5;
+    build_huffman(&distances, lengths, MAX_DISTANCE_CODES);
+
+    return inflate_codes(s, &literals, &distances);
+}
+
+static bool inflate_dynamic(inflate_state_t *s)
+{
+    static const u1 order[19] = {16, 17, 18, 0, 8,  7, 9,  6, 10, 5,
+                                 11, 4,  12, 3, 13, 2, 14, 1, 15};
+    int literal_count = get_bits(s, 5) + 257;
+    int distance_count = get_bits(s, 5) + 1;
+    int code_count = get_bits(s, 4) + 4;
+    if (s->error || literal_count > MAX_LITERAL_CODES ||
+        distance_count > MAX_DISTANCE_CODES)
+        return false;
+
+    /* the code lengths are themselves Huffman coded */
+    short lengths[MAX_LITERAL_CODES + MAX_DISTANCE_CODES] = {0};
+    for (int i = 0; i < code_count; i++)
+        lengths[order[i]] = get_bits(s, 3);
+    huffman_t code_lengths;
+    if (s->error || !build_huffman(&code_lengths, lengths, 19))
+        return false;
+
+    for (int i = 0; i < literal_count + distance_count;) {
+        int symbol = decode(s, &code_lengths);
+        if (s->error || symbol < 0)
+            return false;
+        if (symbol < 16) {
+            lengths[i++] = symbol;
+            continue;
+        }
+
+        short length = 0;
+        int repeat;
+        if (symbol == 16) {
+            if (!i)
+                return false;
+            length = lengths[i - 1];
+            repeat = 3 + get_bits(s, 2);
+        } else if (symbol == 17) {
+            repeat = 3 + get_bits(s, 3);
+        } else {
+            repeat = 11 + get_bits(s, 7);
+        }
+        if (i + repeat > literal_count + distance_count)
+            return false;
+        while (repeat--)
+            lengths[i++] = length;
+    }
+
+    /* a block without an end code could never finish */
+    if (!lengths[256])
+        return false;
+
+    huffman_t literals, distances;
+    if (!build_huffman(&literals, lengths, literal_count) ||
+        !build_huffman(&distances, lengths + literal_count, distance_count))
+        return false;
+    return inflate_codes(s, &literals, &distances);
+}
+
+/**
+ * Decompress a raw deflate stream.
+ *
+ * @param src the compressed data
+ * @param src_size size of the compressed data
+ * @param dst the buffer for the decompressed data
+ * @param dst_size expected size of the decompressed data
+ * @return true if the stream is valid and decompresses to exactly dst_size
+ * bytes
+ */
+bool inflate(const u1 *src, size_t src_size, u1 *dst, size_t dst_size)
+{
+    inflate_state_t s = {
+        .src = src,
+        .src_size = src_size,
+        .dst = dst,
+        .dst_size = dst_size,
+    };
+
+    bool last;
+    do {
+        last = get_bits(&s, 1);
+        bool ok;
+        switch (get_bits(&s, 2)) {
+        case 0:
+            ok = inflate_stored(&s);
+            break;
+        case 1:
+            ok = inflate_fixed(&s);
+            break;
+        case 2:
+            ok = inflate_dynamic(&s);
+            break;
+        default:
+            ok = false;
+        }
+        if (!ok || s.error)
+            return false;
+    } while (!last);
+
+    return s.dst_pos == dst_size;
+}
@@ -0,0 +1,8 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "type.h"
+
+bool inflate(const u1 *src, size_t src_size, u1 *dst, size_t dst_size);
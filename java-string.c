@@ -0,0 +1,349 @@
+#include <string.h>
+
+#include "java-string.h"
+#include "object-heap.h"
+
+/* SSE2 is part of x86-64, AVX2 is used when the CPU has it */
+#if defined(__SSE2__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define HAVE_SIMD_KERNELS
+#endif
+
+/* Strings shorter than this are not worth setting up vectors for */
+#define SIMD_MIN_LENGTH 32
+
+/* Decode the character at utf8[*pos] and move past it. Class files encode
+ * strings in modified UTF-8: every UTF-16 code unit on its own, with NUL
+ * taking two bytes.
+ */
+static u2 next_char(const u1 *utf8, size_t size, size_t *pos)
+{
+    size_t i = *pos;
+    u2 c = utf8[i];
+    if (c < 0x80) {
+        *pos = i + 1;
+    } else if ((c & 0xe0) == 0xc0 && i + 1 < size) {
+        c = (c & 0x1f) << 6 | (utf8[i + 1] & 0x3f);
+        *pos = i + 2;
+    } else if ((c & 0xf0) == 0xe0 && i + 2 < size) {
+        c = (c & 0x0f) << 12 | (utf8[i + 1] & 0x3f) << 6 |
+            (utf8[i + 2] & 0x3f);
+        *pos = i + 3;
+    } else {
+        /* malformed, keep the byte as it is */
+        *pos = i + 1;
+    }
+    return c;
+}
+
+/**
+ * Find the length and the coder of the string encoded in modified UTF-8.
+ *
+ * @param utf8 the encoded characters
+ * @param size number of bytes of the encoded characters
+ * @param length the number of characters on return
+ * @param coder the narrowest coder holding all characters on return
+ */
+void measure_utf8(const char *utf8, size_t size, int32_t *length, u1 *coder)
+{
+    const u1 *bytes = (const u1 *) utf8;
+    int32_t count = 0;
+    u2 max = 0;
+    for (size_t pos = 0; pos < size; count++) {
+        /* ASCII, the common case, cannot widen the coder */
+        if (bytes[pos] < 0x80) {
+            pos++;
+            continue;
+        }
+        u2 c = next_char(bytes, size, &pos);
+        if (c > max)
+            max = c;
+    }
+    *length = count;
+    *coder = max > 0xff ? STRING_UTF16 : STRING_LATIN1;
+}
+
+/**
+ * Decode a string encoded in modified UTF-8.
+ *
+ * @param utf8 the encoded characters
+ * @param size number of bytes of the encoded characters
+ * @param str the string receiving the characters, whose length and coder
+ * are already set by measure_utf8()
+ */
+void decode_utf8(const char *utf8, size_t size, string_t *str)
+{
+    const u1 *bytes = (const u1 *) utf8;
+    if (str->coder == STRING_LATIN1 && (size_t) str->length == size) {
+        /* nothing but ASCII */
+        memcpy(str->value, utf8, size);
+        return;
+    }
+
+    size_t pos = 0;
+    for (int32_t i = 0; i < str->length; i++) {
+        u2 c = next_char(bytes, size, &pos);
+        if (str->coder == STRING_LATIN1)
+            str->value[i] = c;
+        else
+            ((u2 *) str->value)[i] = c;
+    }
+}
+
+/**
+ * Create a string object from a constant.
+ *
+ * @param utf8 the NUL-terminated constant, in modified UTF-8
+ * @return the string
+ */
+string_t *create_string(const char *utf8)
+{
+    size_t size = strlen(utf8);
+    int32_t length;
+    u1 coder;
+    measure_utf8(utf8, size, &length, &coder);
+    string_t *str = alloc_string(coder, length);
+    decode_utf8(utf8, size, str);
+    return str;
+}
+
+#ifdef HAVE_SIMD_KERNELS
+static bool has_avx2()
+{
+    static int supported = -1;
+    if (supported < 0)
+        supported = __builtin_cpu_supports("avx2");
+    return supported;
+}
+
+/* 31^n modulo 2^32 */
+static const uint32_t pow31[9] = {
+    1, 31, 961, 29791, 923521, 28629151, 887503681, 1742810335, 2487512833,
+};
+
+/* Hash the leading multiple of 8 characters, returning how many were hashed.
+ * Lane j sums every 8th character times a power of 31^8, so weighting the
+ * lanes by 31^(7-j) at the end gives the polynomial of String.hashCode().
+ */
+__attribute__((target("avx2"))) static int32_t hash_avx2(const u1 *value,
+                                                          int32_t length,
+                                                          u1 coder,
+                                                          uint32_t *hash)
+{
+    const __m256i step = _mm256_set1_epi32(pow31[8]);
+    __m256i acc = _mm256_setzero_si256();
+    int32_t i = 0;
+    for (; i + 8 <= length; i += 8) {
+        __m256i chars =
+            coder == STRING_LATIN1
+                ? _mm256_cvtepu8_epi32(
+                      _mm_loadl_epi64((const __m128i *) (value + i)))
+                : _mm256_cvtepu16_epi32(
+                      _mm_loadu_si128((const __m128i *) (value + 2 * i)));
+        acc = _mm256_add_epi32(_mm256_mullo_epi32(acc, step), chars);
+    }
+
+    const __m256i weights = _mm256_setr_epi32(
+        pow31[7], pow31[6], pow31[5], pow31[4], pow31[3], pow31[2], pow31[1],
+        pow31[0]);
+    uint32_t lanes[8];
+    _mm256_storeu_si256((__m256i *) lanes, _mm256_mullo_epi32(acc, weights));
+    uint32_t sum = 0;
+    for (int j = 0; j < 8; j++)
+        sum += lanes[j];
+    *hash = sum;
+    return i;
+}
+
+__attribute__((target("avx2"))) static int32_t
+index_of_char16_avx2(const u2 *value, int32_t from, int32_t length, u2 c)
+{
+    const __m256i needle = _mm256_set1_epi16((short) c);
+    int32_t i = from;
+    for (; i + 16 <= length; i += 16) {
+        __m256i chars = _mm256_loadu_si256((const __m256i *) (value + i));
+        unsigned mask =
+            _mm256_movemask_epi8(_mm256_cmpeq_epi16(chars, needle));
+        if (mask)
+            return i + __builtin_ctz(mask) / 2;
+    }
+    return i;
+}
+
+static int32_t index_of_char16_sse2(const u2 *value,
+                                    int32_t from,
+                                    int32_t length,
+                                    u2 c)
+{
+    const __m128i needle = _mm_set1_epi16((short) c);
+    int32_t i = from;
+    for (; i + 8 <= length; i += 8) {
+        __m128i chars = _mm_loadu_si128((const __m128i *) (value + i));
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi16(chars, needle));
+        if (mask)
+            return i + __builtin_ctz(mask) / 2;
+    }
+    return i;
+}
+#endif
+
+/* String.hashCode(): s[0] * 31^(n-1) + s[1] * 31^(n-2) + ... + s[n-1] */
+int32_t string_hash(string_t *str)
+{
+    if (str->hash)
+        return str->hash;
+
+    uint32_t hash = 0;
+    int32_t i = 0;
+#ifdef HAVE_SIMD_KERNELS
+    if (str->length >= SIMD_MIN_LENGTH && has_avx2())
+        i = hash_avx2(str->value, str->length, str->coder, &hash);
+#endif
+    if (str->coder == STRING_LATIN1) {
+        for (; i < str->length; i++)
+            hash = 31 * hash + str->value[i];
+    } else {
+        const u2 *value = (const u2 *) str->value;
+        for (; i < str->length; i++)
+            hash = 31 * hash + value[i];
+    }
+    str->hash = (int32_t) hash;
+    return str->hash;
+}
+
+/* String.equals() of two strings */
+bool string_equals(string_t *a, string_t *b)
+{
+    if (a == b)
+        return true;
+    if (a->length != b->length || a->coder != b->coder)
+        return false;
+    /* cached hashes tell most different strings apart */
+    if (a->hash && b->hash && a->hash != b->hash)
+        return false;
+    /* the C library compares with the widest vectors the CPU has */
+    return !memcmp(a->value, b->value, (size_t) a->length << a->coder);
+}
+
+/* Index of the first c at or after from in a string, -1 if there is none */
+static int32_t index_of_char(const string_t *str, u2 c, int32_t from)
+{
+    if (str->coder == STRING_LATIN1) {
+        if (c > 0xff)
+            return -1;
+        /* memchr() is vectorized by the C library */
+        const u1 *found = memchr(str->value + from, c, str->length - from);
+        return found ? found - str->value : -1;
+    }
+
+    const u2 *value = (const u2 *) str->value;
+    int32_t i = from;
+#ifdef HAVE_SIMD_KERNELS
+    if (str->length - from >= SIMD_MIN_LENGTH) {
+        i = has_avx2() ? index_of_char16_avx2(value, i, str->length, c)
+                       : index_of_char16_sse2(value, i, str->length, c);
+    }
+#endif
+    for (; i < str->length; i++) {
+        if (value[i] == c)
+            return i;
+    }
+    return -1;
+}
+
+/**
+ * String.indexOf(int, int): find a character, supplementary ones included.
+ *
+ * @param str the string to search
+ * @param c the code point to look for
+ * @param from the index to start from, clamped to the string
+ * @return the index of the first occurrence, or -1 if there is none
+ */
+int32_t string_index_of_char(const string_t *str, int32_t c, int32_t from)
+{
+    if (from < 0)
+        from = 0;
+    if (from >= str->length || c < 0)
+        return -1;
+    if (c <= 0xffff)
+        return index_of_char(str, c, from);
+    if (c > 0x10ffff)
+        return -1;
+
+    /* a supplementary character is stored as a surrogate pair */
+    u2 high = 0xd800 + ((c - 0x10000) >> 10);
+    u2 low = 0xdc00 + ((c - 0x10000) & 0x3ff);
+    for (int32_t i = from; (i = index_of_char(str, high, i)) >= 0; i++) {
+        if (i + 1 < str->length && string_char_at(str, i + 1) == low)
+            return i;
+    }
+    return -1;
+}
+
+/* Whether the characters of sub appear in str at the given index */
+static bool region_matches(const string_t *str,
+                           int32_t index,
+                           const string_t *sub)
+{
+    if (str->coder == sub->coder) {
+        return !memcmp(str->value + ((size_t) index << str->coder),
+                       sub->value, (size_t) sub->length << sub->coder);
+    }
+    for (int32_t i = 0; i < sub->length; i++) {
+        if (string_char_at(str, index + i) != string_char_at(sub, i))
+            return false;
+    }
+    return true;
+}
+
+/**
+ * String.indexOf(String, int): find a substring.
+ *
+ * @param str the string to search
+ * @param sub the string to look for
+ * @param from the index to start from, clamped to the string
+ * @return the index of the first occurrence, or -1 if there is none
+ */
+int32_t string_index_of(const string_t *str, const string_t *sub, int32_t from)
+{
+    if (from < 0)
+        from = 0;
+    if (sub->length == 0)
+        return from < str->length ? from : str->length;
+    /* a Latin-1 string cannot hold the wider characters of a UTF-16 one */
+    if (sub->coder > str->coder)
+        return -1;
+
+    /* look for the first character, then compare the rest */
+    u2 first = string_char_at(sub, 0);
+    int32_t last = str->length - sub->length;
+    for (int32_t i = from; i <= last; i++) {
+        i = index_of_char(str, first, i);
+        if (i < 0 || i > last)
+            return -1;
+        if (region_matches(str, i, sub))
+            return i;
+    }
+    return -1;
+}
+
+/* String.compareTo(): the difference of the first different characters, or
+ * else of the lengths
+ */
+int32_t string_compare(const string_t *a, const string_t *b)
+{
+    int32_t length = a->length < b->length ? a->length : b->length;
+    if (a->coder == STRING_LATIN1 && b->coder == STRING_LATIN1) {
+        for (int32_t i = 0; i < length; i++) {
+            if (a->value[i] != b->value[i])
+                return a->value[i] - b->value[i];
+        }
+    } else {
+        for (int32_t i = 0; i < length; i++) {
+            u2 c1 = string_char_at(a, i), c2 = string_char_at(b, i);
+            if (c1 != c2)
+                return c1 - c2;
+        }
+    }
+    return a->length - b->length;
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "type.h"
+
+/* Strings are stored compactly, like java.lang.String does: one byte per
+ * character when every character fits in Latin-1, UTF-16 otherwise. As a
+ * string is only stored in UTF-16 when it has to be, equal strings always
+ * have the same coder.
+ */
+typedef enum {
+    STRING_LATIN1 = 0,
+    STRING_UTF16 = 1, /* also the shift from length to size in bytes */
+} string_coder_t;
+
+typedef struct string {
+    lock_word_t lock;
+    u1 kind;        /* HEAP_STRING */
+    u1 coder;       /* see string_coder_t */
+    int32_t length; /* number of UTF-16 code units */
+    int32_t hash;   /* String.hashCode(), computed again while it is 0 */
+    u1 value[];     /* the characters, u1 or u2 each depending on the coder */
+} string_t;
+
+static inline size_t get_string_size(u1 coder, int32_t length)
+{
+    return sizeof(string_t) + ((size_t) length << coder);
+}
+
+static inline u2 string_char_at(const string_t *str, int32_t index)
+{
+    return str->coder == STRING_LATIN1 ? str->value[index]
+                                       : ((const u2 *) str->value)[index];
+}
+
+void measure_utf8(const char *utf8, size_t size, int32_t *length, u1 *coder);
+void decode_utf8(const char *utf8, size_t size, string_t *str);
+string_t *create_string(const char *utf8);
+int32_t string_hash(string_t *str);
+bool string_equals(string_t *a, string_t *b);
+int32_t string_index_of_char(const string_t *str, int32_t c, int32_t from);
+int32_t string_index_of(const string_t *str, const string_t *sub, int32_t from);
+int32_t string_compare(const string_t *a, const string_t *b);
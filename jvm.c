@@ -9,119 +9,27 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "alloc-profile.h"
+#include "bounds-check.h"
+#include "class-archive.h"
 #include "class-heap.h"
+#include "class-path.h"
 #include "classfile.h"
 #include "constant-pool.h"
-#include "list.h"
+#include "exception.h"
+#include "fork-join.h"
+#include "monitor.h"
+#include "native.h"
 #include "object-heap.h"
+#include "opcode.h"
+#include "output.h"
+#include "profile.h"
+#include "sampler.h"
 #include "stack.h"
+#include "string-concat.h"
+#include "thread.h"
+#include "vthread.h"
 
-typedef enum {
-    i_iconst_m1 = 0x2,
-    i_iconst_0 = 0x3,
-    i_iconst_1 = 0x4,
-    i_iconst_2 = 0x5,
-    i_iconst_3 = 0x6,
-    i_iconst_4 = 0x7,
-    i_iconst_5 = 0x8,
-    i_lconst_0 = 0x9,
-    i_lconst_1 = 0xa,
-    i_bipush = 0x10,
-    i_sipush = 0x11,
-    i_ldc = 0x12,
-    i_ldc2_w = 0x14,
-    i_iload = 0x15,
-    i_lload = 0x16,
-    i_aload = 0x19,
-    i_iload_0 = 0x1a,
-    i_iload_1 = 0x1b,
-    i_iload_2 = 0x1c,
-    i_iload_3 = 0x1d,
-    i_lload_0 = 0x1e,
-    i_lload_1 = 0x1f,
-    i_lload_2 = 0x20,
-    i_lload_3 = 0x21,
-    i_aload_0 = 0x2a,
-    i_aload_1 = 0x2b,
-    i_aload_2 = 0x2c,
-    i_aload_3 = 0x2d,
-    i_iaload = 0x2e,
-    i_laload = 0x2f,
-    i_aaload = 0x32,
-    i_baload = 0x33,
-    i_caload = 0x34,
-    i_saload = 0x35,
-    i_istore = 0x36,
-    i_lstore = 0x37,
-    i_astore = 0x3a,
-    i_istore_0 = 0x3b,
-    i_istore_1 = 0x3c,
-    i_istore_2 = 0x3d,
-    i_istore_3 = 0x3e,
-    i_lstore_0 = 0x3f,
-    i_lstore_1 = 0x40,
-    i_lstore_2 = 0x41,
-    i_lstore_3 = 0x42,
-    i_astore_0 = 0x4b,
-    i_astore_1 = 0x4c,
-    i_astore_2 = 0x4d,
-    i_astore_3 = 0x4e,
-    i_iastore = 0x4f,
-    i_lastore = 0x50,
-    i_aastore = 0x53,
-    i_bastore = 0x54,
-    i_castore = 0x55,
-    i_sastore = 0x56,
-    i_pop = 0x57,
-    i_dup = 0x59,
-    i_iadd = 0x60,
-    i_ladd = 0x61,
-    i_isub = 0x64,
-    i_lsub = 0x65,
-    i_imul = 0x68,
-    i_lmul = 0x69,
-    i_idiv = 0x6c,
-    i_ldiv = 0x6d,
-    i_irem = 0x70,
-    i_lrem = 0x71,
-    i_ineg = 0x74,
-    i_iinc = 0x84,
-    i_i2l = 0x85,
-    i_l2i = 0x88,
-    i_lcmp = 0x94,
-    i_ifeq = 0x99,
-    i_ifne = 0x9a,
-    i_iflt = 0x9b,
-    i_ifge = 0x9c,
-    i_ifgt = 0x9d,
-    i_ifle = 0x9e,
-    i_if_icmpeq = 0x9f,
-    i_if_icmpne = 0xa0,
-    i_if_icmplt = 0xa1,
-    i_if_icmpge = 0xa2,
-    i_if_icmpgt = 0xa3,
-    i_if_icmple = 0xa4,
-    i_goto = 0xa7,
-    i_ireturn = 0xac,
-    i_lreturn = 0xad,
-    i_areturn = 0xb0,
-    i_return = 0xb1,
-    i_getstatic = 0xb2,
-    i_putstatic = 0xb3,
-    i_getfield = 0xb4,
-    i_putfield = 0xb5,
-    i_invokevirtual = 0xb6,
-    i_invokespecial = 0xb7,
-    i_invokestatic = 0xb8,
-    i_invokedynamic = 0xba,
-    i_new = 0xbb,
-    i_newarray = 0xbc,
-    i_anewarray = 0xbd,
-    i_multianewarray = 0xc5,
-} jvm_opcode_t;
-
-/* TODO: add -cp arg to achieve class path select */
-static char *prefix = NULL;
 
 static inline void bipush(stack_frame_t *op_stack,
                           uint32_t pc,
@@ -166,20 +74,33 @@ static inline void imul(stack_frame_t *op_stack)
     push_int(op_stack, op1 * op2);
 }
 
-static inline void idiv(stack_frame_t *op_stack)
+/* Division by zero raises ArithmeticException. Dividing the most negative
+ * value by -1 overflows, which Java defines to give the value itself.
+ */
+static inline bool idiv(stack_frame_t *op_stack)
 {
     int32_t op1 = pop_int(op_stack);
     int32_t op2 = pop_int(op_stack);
 
-    push_int(op_stack, op2 / op1);
+    if (!op1) {
+        raise_exception("java/lang/ArithmeticException", "/ by zero");
+        return false;
+    }
+    push_int(op_stack, op1 == -1 ? (int32_t) -(uint32_t) op2 : op2 / op1);
+    return true;
 }
 
-static inline void irem(stack_frame_t *op_stack)
+static inline bool irem(stack_frame_t *op_stack)
 {
     int32_t op1 = pop_int(op_stack);
     int32_t op2 = pop_int(op_stack);
 
-    push_int(op_stack, op2 % op1);
+    if (!op1) {
+        raise_exception("java/lang/ArithmeticException", "/ by zero");
+        return false;
+    }
+    push_int(op_stack, op1 == -1 ? 0 : op2 % op1);
+    return true;
 }
 
 static inline void ineg(stack_frame_t *op_stack)
@@ -194,6 +115,276 @@ static inline void iconst(stack_frame_t *op_stack, uint8_t current)
     push_int(op_stack, current - i_iconst_0);
 }
 
+/**
+ * Check the operands of an array load or store before they are popped.
+ *
+ * @param op_stack the operand stack holding the array reference and index
+ * @param depth number of operands above the index, 1 for stores
+ * @return false if an exception was raised for a null array or an index out
+ * of bounds
+ */
+static inline bool check_array_index(stack_frame_t *op_stack, int depth)
+{
+    stack_entry_t *index = &op_stack->store[op_stack->size - 1 - depth];
+    array_t *arr = (index - 1)->entry.ptr_value;
+    int64_t idx = stack_to_int(&index->entry, get_type_size(index->type));
+
+    if (!arr) {
+        raise_exception("java/lang/NullPointerException", NULL);
+        return false;
+    }
+    if (idx < 0 || idx >= arr->length) {
+        raise_exception("java/lang/ArrayIndexOutOfBoundsException",
+                        "Index %" PRId64 " out of bounds for length %" PRId32,
+                        idx, arr->length);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Resolve a Class constant, loading the class the first time.
+ *
+ * @param clazz the class whose constant pool holds the constant
+ * @param index the constant pool index of the Class
+ * @return the class, or NULL for java.lang.Object and the classes the VM
+ * implements, which have no class file. The resolved entry of the latter
+ * holds the native class.
+ */
+static class_file_t *resolve_class(class_file_t *clazz, uint16_t index)
+{
+    resolved_constant_t *resolved = get_resolved(index, clazz);
+    class_file_t *target_class =
+        __atomic_load_n(&resolved->clazz, __ATOMIC_ACQUIRE);
+    if (target_class ||
+        __atomic_load_n(&resolved->value.native_class, __ATOMIC_RELAXED))
+        return target_class;
+
+    /* threads resolving the constant at once all find the same class */
+    char *class_name = find_class_name_from_index(index, clazz);
+    if (!strcmp(class_name, "java/lang/Object"))
+        return NULL;
+    const native_class_t *native = find_native_class(class_name);
+    if (native) {
+        __atomic_store_n(&resolved->value.native_class, native,
+                         __ATOMIC_RELAXED);
+        return NULL;
+    }
+    find_or_add_class_to_heap(class_name, &target_class);
+    assert(target_class && "Failed to load class");
+    __atomic_store_n(&resolved->clazz, target_class, __ATOMIC_RELEASE);
+    return target_class;
+}
+
+/**
+ * Resolve a MethodRef, looking for the method from the referenced class up
+ * to its superclasses.
+ *
+ * @param clazz the class whose constant pool holds the constant
+ * @param index the constant pool index of the MethodRef
+ * @return the resolved entry, holding the method and the class declaring it,
+ * or only the native method for the methods the VM implements. The method is
+ * stored last, so that a thread seeing it sees the class as well.
+ */
+static resolved_constant_t *resolve_method(class_file_t *clazz,
+                                           uint16_t index)
+{
+    resolved_constant_t *resolved = get_resolved(index, clazz);
+    if (__atomic_load_n(&resolved->value.method, __ATOMIC_ACQUIRE))
+        return resolved;
+
+    char *method_name, *method_descriptor;
+    char *class_name = find_method_info_from_index(index, clazz, &method_name,
+                                                   &method_descriptor);
+    const native_method_t *native =
+        find_native_method(class_name, method_name, method_descriptor);
+    if (native) {
+        __atomic_store_n(&resolved->value.native, native, __ATOMIC_RELEASE);
+        return resolved;
+    }
+    if (find_native_class(class_name)) {
+        fprintf(stderr, "Method %s.%s%s is not supported\n", class_name,
+                method_name, method_descriptor);
+        exit(1);
+    }
+
+    class_file_t *target_class;
+    find_or_add_class_to_heap(class_name, &target_class);
+    assert(target_class && "Failed to load class of method");
+
+    method_t *method;
+    while (!(method = find_method(method_name, method_descriptor,
+                                  target_class))) {
+        /* the methods inherited from a class without class file are native */
+        class_file_t *subclass = target_class;
+        uint16_t super_class = subclass->info->super_class;
+        target_class = resolve_class(subclass, super_class);
+        if (!target_class) {
+            char *super_name =
+                find_class_name_from_index(super_class, subclass);
+            native = find_native_method(super_name, method_name,
+                                        method_descriptor);
+            if (!native) {
+                fprintf(stderr, "Method %s.%s%s is not supported\n",
+                        super_name, method_name, method_descriptor);
+                exit(1);
+            }
+            __atomic_store_n(&resolved->value.native, native,
+                             __ATOMIC_RELEASE);
+            return resolved;
+        }
+    }
+    __atomic_store_n(&resolved->clazz, target_class, __ATOMIC_RELAXED);
+    __atomic_store_n(&resolved->value.method, method, __ATOMIC_RELEASE);
+    return resolved;
+}
+
+/**
+ * Resolve a FieldRef, looking for the field from the referenced class up to
+ * its superclasses.
+ *
+ * @param clazz the class whose constant pool holds the constant
+ * @param index the constant pool index of the FieldRef
+ * @return the resolved entry, holding the field and the class declaring it,
+ * or only the field for the static fields the VM implements
+ */
+static resolved_constant_t *resolve_field(class_file_t *clazz, uint16_t index)
+{
+    resolved_constant_t *resolved = get_resolved(index, clazz);
+    if (__atomic_load_n(&resolved->value.field, __ATOMIC_ACQUIRE))
+        return resolved;
+
+    char *field_name, *field_descriptor;
+    char *class_name = find_field_info_from_index(index, clazz, &field_name,
+                                                  &field_descriptor);
+    field_t *field =
+        find_native_field(class_name, field_name, field_descriptor);
+    if (field) {
+        __atomic_store_n(&resolved->value.field, field, __ATOMIC_RELEASE);
+        return resolved;
+    }
+
+    class_file_t *target_class;
+    find_or_add_class_to_heap(class_name, &target_class);
+    assert(target_class && "Failed to load class of field");
+
+    while (!(field = find_field(field_name, field_descriptor, target_class))) {
+        target_class =
+            resolve_class(target_class, target_class->info->super_class);
+        assert(target_class && "Failed to find field");
+    }
+    __atomic_store_n(&resolved->clazz, target_class, __ATOMIC_RELAXED);
+    __atomic_store_n(&resolved->value.field, field, __ATOMIC_RELEASE);
+    return resolved;
+}
+
+/* Find the slot of a resolved instance field in an object */
+static variable_t *get_field_addr(object_t *obj, resolved_constant_t *resolved)
+{
+    /* the object has a part for each class of its hierarchy */
+    while (obj->class != resolved->clazz)
+        obj = obj->parent;
+    return &obj->value[resolved->value.field - resolved->clazz->fields];
+}
+
+stack_entry_t *execute(method_t *method,
+                       local_variable_t *locals,
+                       class_file_t *clazz);
+
+static stack_entry_t *interpret(method_t *method,
+                                local_variable_t *locals,
+                                class_file_t *clazz,
+                                java_frame_t *frame);
+
+/* Guards the initializer field of the classes. The condition is broadcast
+ * when a class is initialized.
+ */
+static pthread_mutex_t init_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t class_initialized = PTHREAD_COND_INITIALIZER;
+
+/**
+ * Run the static initializer of a class the first time it is used.
+ *
+ * A single thread runs it. The others wait for it to finish, but the thread
+ * running it may use the class meanwhile, as <clinit> itself does.
+ *
+ * @param clazz the class, or NULL for the classes the VM implements, which
+ * have no initializer
+ */
+static void initialize_class(class_file_t *clazz)
+{
+    if (!clazz || __atomic_load_n(&clazz->initialized, __ATOMIC_ACQUIRE))
+        return;
+
+    enter_blocking();
+    pthread_mutex_lock(&init_lock);
+    while (clazz->initializer && clazz->initializer != lock_owner)
+        pthread_cond_wait(&class_initialized, &init_lock);
+    bool run = !clazz->initialized && !clazz->initializer;
+    if (run)
+        clazz->initializer = lock_owner;
+    pthread_mutex_unlock(&init_lock);
+    leave_blocking();
+    if (!run)
+        return;
+
+    /* the initializer is known by its lock_owner until it is done */
+    method_t *method = find_method("<clinit>", "()V", clazz);
+    if (method) {
+        local_variable_t own_locals[method->code.max_locals];
+        pinned++;
+        stack_entry_t *exec_res = execute(method, own_locals, clazz);
+        pinned--;
+        assert(exec_res->type == STACK_ENTRY_NONE &&
+               "<clinit> must not return a value");
+        free(exec_res);
+    }
+
+    pthread_mutex_lock(&init_lock);
+    __atomic_store_n(&clazz->initialized, true, __ATOMIC_RELEASE);
+    clazz->initializer = 0;
+    pthread_cond_broadcast(&class_initialized);
+    pthread_mutex_unlock(&init_lock);
+}
+
+/* Free the operand stack of a returning method and release its monitor */
+static inline void leave_method(stack_frame_t *op_stack, lock_word_t *monitor)
+{
+    if (monitor)
+        monitor_exit(monitor);
+    free(op_stack->store);
+    free(op_stack);
+}
+
+/**
+ * Find the handler of the pending exception in a method.
+ *
+ * The first handler covering the instruction wins, as the exception table
+ * lists the handlers of inner try blocks before the outer ones.
+ *
+ * @param code the code of the method
+ * @param clazz the class file the method belongs to
+ * @param pc the instruction which threw the exception
+ * @return the pc of the handler, or -1 if the method does not catch it
+ */
+static int32_t find_exception_handler(code_t *code,
+                                      class_file_t *clazz,
+                                      uint32_t pc)
+{
+    for (u2 i = 0; i < code->handlers_count; i++) {
+        exception_handler_t *handler = &code->handlers[i];
+        if (pc < handler->start_pc || pc >= handler->end_pc)
+            continue;
+        /* finally blocks catch everything */
+        if (!handler->catch_type ||
+            is_exception_instance(
+                pending_exception,
+                find_class_name_from_index(handler->catch_type, clazz)))
+            return handler->handler_pc;
+    }
+    return -1;
+}
+
 /**
  * Execute the opcode instructions of a method until it returns.
  *
@@ -201,18 +392,32 @@ static inline void iconst(stack_frame_t *op_stack, uint8_t current)
  * @param locals the array of local variables, including the method parameters.
  *               Except for parameters, the locals are uninitialized.
  * @param clazz the class file the method belongs to
+ * @param frame the frame of the call on the current thread
  * @return stack_entry that contain the method return value and its type. Is a
- *         heap-allocated pointer which should be free from the caller
+ *         heap-allocated pointer which should be free from the caller. When
+ *         an exception the method does not catch is thrown, the type is
+ *         STACK_ENTRY_NONE and the exception is left pending.
  *
  */
-stack_entry_t *execute(method_t *method,
-                       local_variable_t *locals,
-                       class_file_t *clazz)
+static stack_entry_t *interpret(method_t *method,
+                                local_variable_t *locals,
+                                class_file_t *clazz,
+                                java_frame_t *frame)
 {
     code_t code = method->code;
     stack_frame_t *op_stack = malloc(sizeof(stack_frame_t));
     init_stack(op_stack, code.max_stack);
 
+    /* a synchronized method holds the monitor of its object, or of its class
+     * when static, until it returns */
+    lock_word_t *monitor = NULL;
+    if (method->access_flags & ACC_SYNCHRONIZED) {
+        monitor = method->access_flags & ACC_STATIC
+                      ? &clazz->lock
+                      : (lock_word_t *) locals[0].entry.ptr_value;
+        monitor_enter(monitor);
+    }
+
     /* position at the program to be run */
     uint32_t pc = 0;
     uint8_t *code_buf = code.code;
@@ -220,7 +425,11 @@ stack_entry_t *execute(method_t *method,
     int loop_count = 0;
     while (pc < code.code_length) {
         loop_count += 1;
+        safepoint_poll();
         uint8_t current = code_buf[pc];
+#ifdef PROFILE
+        count_opcode(current);
+#endif
 
         /* Reference:
          * https://en.wikipedia.org/wiki/Java_bytecode_instruction_listings
@@ -232,8 +441,7 @@ stack_entry_t *execute(method_t *method,
             ret->entry.int_value = (int32_t) pop_int(op_stack);
             ret->type = STACK_ENTRY_INT;
 
-            free(op_stack->store);
-            free(op_stack);
+            leave_method(op_stack, monitor);
 
             return ret;
         }
@@ -244,8 +452,7 @@ stack_entry_t *execute(method_t *method,
             ret->entry.long_value = (int64_t) pop_int(op_stack);
             ret->type = STACK_ENTRY_LONG;
 
-            free(op_stack->store);
-            free(op_stack);
+            leave_method(op_stack, monitor);
 
             return ret;
         }
@@ -256,8 +463,7 @@ stack_entry_t *execute(method_t *method,
             ret->entry.ptr_value = pop_ref(op_stack);
             ret->type = STACK_ENTRY_REF;
 
-            free(op_stack->store);
-            free(op_stack);
+            leave_method(op_stack, monitor);
 
             return ret;
         }
@@ -267,8 +473,7 @@ stack_entry_t *execute(method_t *method,
             stack_entry_t *ret = malloc(sizeof(stack_entry_t));
             ret->type = STACK_ENTRY_NONE;
 
-            free(op_stack->store);
-            free(op_stack);
+            leave_method(op_stack, monitor);
 
             return ret;
         }
@@ -279,39 +484,25 @@ stack_entry_t *execute(method_t *method,
             uint16_t index = ((param1 << 8) | param2);
 
             /* the method to be called */
-            char *method_name, *method_descriptor, *class_name;
-            method_t *own_method = NULL;
-            class_file_t *target_class = NULL;
-
-            /* recursively find method from child to parent */
-            while (!own_method) {
-                if (!target_class)
-                    class_name = find_method_info_from_index(
-                        index, clazz, &method_name, &method_descriptor);
-                else
-                    class_name = find_class_name_from_index(
-                        target_class->info->super_class, target_class);
-                find_or_add_class_to_heap(class_name, prefix, &target_class);
-                assert(target_class &&
-                       "Failed to load class in i_invokestatic");
-                own_method =
-                    find_method(method_name, method_descriptor, target_class);
+            resolved_constant_t *resolved = resolve_method(clazz, index);
+
+            /* methods the VM implements run natively */
+            if (!resolved->clazz) {
+                frame->pc = pc;
+                resolved->value.native->invoke(op_stack);
+                if (pending_exception)
+                    goto exception_thrown;
+                pc += 3;
+                break;
             }
+            method_t *own_method = resolved->value.method;
+            class_file_t *target_class = resolved->clazz;
 
             /* call static initialization. Only the class that contains this
              * method should do static initialization */
-            if (!target_class->initialized) {
-                target_class->initialized = true;
-                method_t *method = find_method("<clinit>", "()V", target_class);
-                if (method) {
-                    local_variable_t own_locals[method->code.max_locals];
-                    stack_entry_t *exec_res =
-                        execute(method, own_locals, target_class);
-                    assert(exec_res->type == STACK_ENTRY_NONE &&
-                           "<clinit> must not return a value");
-                    free(exec_res);
-                }
-            }
+            initialize_class(target_class);
+            if (pending_exception)
+                goto exception_thrown;
 
             uint16_t num_params = get_number_of_parameters(own_method);
             local_variable_t own_locals[own_method->code.max_locals];
@@ -320,6 +511,10 @@ stack_entry_t *execute(method_t *method,
 
             stack_entry_t *exec_res =
                 execute(own_method, own_locals, target_class);
+            if (pending_exception) {
+                free(exec_res);
+                goto exception_thrown;
+            }
             switch (exec_res->type) {
             case STACK_ENTRY_INT:
                 push_int(op_stack, exec_res->entry.int_value);
@@ -508,30 +703,79 @@ stack_entry_t *execute(method_t *method,
             break;
         }
 
+        /* Jump through the table of targets indexed by the key */
+        case i_tableswitch: {
+            /* operands are aligned to four bytes from the start of the code */
+            uint32_t operands = (pc + 4) & ~3U;
+            int32_t key = pop_int(op_stack);
+            int32_t low = read_s4(code_buf, operands + 4);
+            int32_t high = read_s4(code_buf, operands + 8);
+
+            /* the default target comes first */
+            uint32_t target = operands;
+            if (key >= low && key <= high)
+                target += 12 + 4 * ((uint32_t) key - (uint32_t) low);
+            pc += read_s4(code_buf, target);
+            break;
+        }
+
+        /* Jump to the target of the key, found by binary search as the
+         * match-offset pairs are sorted by key */
+        case i_lookupswitch: {
+            uint32_t operands = (pc + 4) & ~3U;
+            int32_t key = pop_int(op_stack);
+            uint32_t pairs = operands + 8;
+
+            int32_t offset = read_s4(code_buf, operands);
+            int32_t low = 0, high = read_s4(code_buf, operands + 4) - 1;
+            while (low <= high) {
+                int32_t mid = low + (high - low) / 2;
+                int32_t match = read_s4(code_buf, pairs + 8 * mid);
+                if (match < key) {
+                    low = mid + 1;
+                } else if (match > key) {
+                    high = mid - 1;
+                } else {
+                    offset = read_s4(code_buf, pairs + 8 * mid + 4);
+                    break;
+                }
+            }
+            pc += offset;
+            break;
+        }
+
         /* Push item from run-time constant pool */
         case i_ldc: {
-            constant_pool_t constant_pool = clazz->constant_pool;
+            constant_pool_t *constant_pool = &clazz->constant_pool;
 
             /* find the parameter which will be the index from which we retrieve
              * constant in the constant pool.
              */
-            int16_t param = code_buf[pc + 1];
+            uint8_t param = code_buf[pc + 1];
 
-            const_pool_info *info = get_constant(&constant_pool, param);
-            switch (info->tag) {
+            switch (get_constant_tag(constant_pool, param)) {
             case CONSTANT_Integer: {
                 push_int(op_stack,
-                         ((CONSTANT_Integer_info *) info->info)->bytes);
+                         get_constant(constant_pool, param)->integer.bytes);
                 break;
             }
             case CONSTANT_String: {
-                char *src =
-                    (char *) get_constant(
-                        &constant_pool,
-                        ((CONSTANT_String_info *) info->info)->string_index)
-                        ->info;
-                char *dest = create_string(clazz, src);
-                push_ref(op_stack, dest);
+                /* every execution pushes the same string object */
+                resolved_constant_t *resolved = get_resolved(param, clazz);
+                string_t *str =
+                    __atomic_load_n(&resolved->value.string, __ATOMIC_ACQUIRE);
+                if (!str) {
+                    char *src = get_string_utf(constant_pool, param);
+                    frame->pc = pc;
+                    string_t *created = create_string(src);
+                    /* the first thread to create it wins */
+                    str = NULL;
+                    if (__atomic_compare_exchange_n(
+                            &resolved->value.string, &str, created, false,
+                            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+                        str = created;
+                }
+                push_ref(op_stack, str);
                 break;
             }
             default:
@@ -547,14 +791,10 @@ stack_entry_t *execute(method_t *method,
             uint8_t param1 = code_buf[pc + 1], param2 = code_buf[pc + 2];
             uint16_t index = ((param1 << 8) | param2);
 
-            uint64_t high = ((CONSTANT_LongOrDouble_info *) get_constant(
-                                 &clazz->constant_pool, index)
-                                 ->info)
-                                ->high_bytes;
-            uint64_t low = ((CONSTANT_LongOrDouble_info *) get_constant(
-                                &clazz->constant_pool, index)
-                                ->info)
-                               ->low_bytes;
+            CONSTANT_LongOrDouble_info *constant =
+                &get_constant(&clazz->constant_pool, index)->long_or_double;
+            uint64_t high = constant->high_bytes;
+            uint64_t low = constant->low_bytes;
             int64_t value = high << 32 | low;
             push_long(op_stack, value);
             pc += 3;
@@ -573,52 +813,85 @@ stack_entry_t *execute(method_t *method,
         }
 
         /* Load int from an array */
-        case i_iaload: {
+        case i_iaload:
+            if (!check_array_index(op_stack, 0))
+                goto exception_thrown;
+            /* fall through */
+        case i_iaload_unchecked: {
             int64_t idx = pop_int(op_stack);
-            int32_t *arr = pop_ref(op_stack);
+            array_t *arr = pop_ref(op_stack);
 
-            push_int(op_stack, arr[idx]);
+            push_int(op_stack, ((int32_t *) arr->data)[idx]);
             pc += 1;
             break;
         }
 
         /* Load long from an array */
-        case i_laload: {
+        case i_laload:
+            if (!check_array_index(op_stack, 0))
+                goto exception_thrown;
+            /* fall through */
+        case i_laload_unchecked: {
             int64_t idx = pop_int(op_stack);
-            int64_t *arr = pop_ref(op_stack);
+            array_t *arr = pop_ref(op_stack);
 
-            push_int(op_stack, arr[idx]);
+            push_long(op_stack, ((int64_t *) arr->data)[idx]);
             pc += 1;
             break;
         }
 
         /* Load reference from array */
-        case i_aaload: {
-            int64_t index = pop_int(op_stack);
-            void **addr = pop_ref(op_stack);
+        case i_aaload:
+            if (!check_array_index(op_stack, 0))
+                goto exception_thrown;
+            /* fall through */
+        case i_aaload_unchecked: {
+            int64_t idx = pop_int(op_stack);
+            array_t *arr = pop_ref(op_stack);
 
-            push_ref(op_stack, *(addr + index));
+            push_ref(op_stack, ((void **) arr->data)[idx]);
             pc += 1;
             break;
         }
 
-        /* Load byte/char from an array */
+        /* Load byte/boolean from an array */
         case i_baload:
-        case i_caload: {
+            if (!check_array_index(op_stack, 0))
+                goto exception_thrown;
+            /* fall through */
+        case i_baload_unchecked: {
+            int64_t idx = pop_int(op_stack);
+            array_t *arr = pop_ref(op_stack);
+
+            push_int(op_stack, ((int8_t *) arr->data)[idx]);
+            pc += 1;
+            break;
+        }
+
+        /* Load char from an array */
+        case i_caload:
+            if (!check_array_index(op_stack, 0))
+                goto exception_thrown;
+            /* fall through */
+        case i_caload_unchecked: {
             int64_t idx = pop_int(op_stack);
-            int8_t *arr = pop_ref(op_stack);
+            array_t *arr = pop_ref(op_stack);
 
-            push_int(op_stack, arr[idx]);
+            push_int(op_stack, ((uint16_t *) arr->data)[idx]);
             pc += 1;
             break;
         }
 
         /* Load short from an array */
-        case i_saload: {
+        case i_saload:
+            if (!check_array_index(op_stack, 0))
+                goto exception_thrown;
+            /* fall through */
+        case i_saload_unchecked: {
             int64_t idx = pop_int(op_stack);
-            int16_t *arr = pop_ref(op_stack);
+            array_t *arr = pop_ref(op_stack);
 
-            push_int(op_stack, arr[idx]);
+            push_int(op_stack, ((int16_t *) arr->data)[idx]);
             pc += 1;
             break;
         }
@@ -711,57 +984,91 @@ stack_entry_t *execute(method_t *method,
         }
 
         /* Store into int array */
-        case i_iastore: {
+        case i_iastore:
+            if (!check_array_index(op_stack, 1))
+                goto exception_thrown;
+            /* fall through */
+        case i_iastore_unchecked: {
             int32_t value = pop_int(op_stack);
             int64_t idx = pop_int(op_stack);
-            int32_t *arr = pop_ref(op_stack);
+            array_t *arr = pop_ref(op_stack);
 
-            arr[idx] = value;
+            ((int32_t *) arr->data)[idx] = value;
             pc += 1;
             break;
         }
 
         /* Store into long array */
-        case i_lastore: {
+        case i_lastore:
+            if (!check_array_index(op_stack, 1))
+                goto exception_thrown;
+            /* fall through */
+        case i_lastore_unchecked: {
             int64_t value = pop_int(op_stack);
             int64_t idx = pop_int(op_stack);
-            int64_t *arr = pop_ref(op_stack);
+            array_t *arr = pop_ref(op_stack);
 
-            arr[idx] = value;
+            ((int64_t *) arr->data)[idx] = value;
             pc += 1;
             break;
         }
 
         /* Store into reference array */
-        case i_aastore: {
+        case i_aastore:
+            if (!check_array_index(op_stack, 1))
+                goto exception_thrown;
+            /* fall through */
+        case i_aastore_unchecked: {
             void *value = pop_ref(op_stack);
             int64_t idx = pop_int(op_stack);
-            void **arr = pop_ref(op_stack);
+            array_t *arr = pop_ref(op_stack);
 
-            arr[idx] = value;
+            ((void **) arr->data)[idx] = value;
             pc += 1;
             break;
         }
 
-        /* Store int byte/char array */
+        /* Store into byte/boolean array */
         case i_bastore:
-        case i_castore: {
+            if (!check_array_index(op_stack, 1))
+                goto exception_thrown;
+            /* fall through */
+        case i_bastore_unchecked: {
+            int64_t value = pop_int(op_stack);
+            int64_t idx = pop_int(op_stack);
+            array_t *arr = pop_ref(op_stack);
+
+            ((int8_t *) arr->data)[idx] = value;
+            pc += 1;
+            break;
+        }
+
+        /* Store into char array */
+        case i_castore:
+            if (!check_array_index(op_stack, 1))
+                goto exception_thrown;
+            /* fall through */
+        case i_castore_unchecked: {
             int64_t value = pop_int(op_stack);
             int64_t idx = pop_int(op_stack);
-            int8_t *arr = pop_ref(op_stack);
+            array_t *arr = pop_ref(op_stack);
 
-            arr[idx] = value;
+            ((uint16_t *) arr->data)[idx] = value;
             pc += 1;
             break;
         }
 
         /* Store into short array */
-        case i_sastore: {
+        case i_sastore:
+            if (!check_array_index(op_stack, 1))
+                goto exception_thrown;
+            /* fall through */
+        case i_sastore_unchecked: {
             int64_t value = pop_int(op_stack);
             int64_t idx = pop_int(op_stack);
-            int16_t *arr = pop_ref(op_stack);
+            array_t *arr = pop_ref(op_stack);
 
-            arr[idx] = value;
+            ((int16_t *) arr->data)[idx] = value;
             pc += 1;
             break;
         }
@@ -914,7 +1221,8 @@ stack_entry_t *execute(method_t *method,
 
         /* Divide int */
         case i_idiv:
-            idiv(op_stack);
+            if (!idiv(op_stack))
+                goto exception_thrown;
             pc += 1;
             break;
 
@@ -923,14 +1231,20 @@ stack_entry_t *execute(method_t *method,
             int64_t op1 = pop_int(op_stack);
             int64_t op2 = pop_int(op_stack);
 
-            push_long(op_stack, op2 / op1);
+            if (!op1) {
+                raise_exception("java/lang/ArithmeticException", "/ by zero");
+                goto exception_thrown;
+            }
+            push_long(op_stack,
+                      op1 == -1 ? (int64_t) -(uint64_t) op2 : op2 / op1);
             pc += 1;
             break;
         }
 
         /* Remainder int */
         case i_irem:
-            irem(op_stack);
+            if (!irem(op_stack))
+                goto exception_thrown;
             pc += 1;
             break;
 
@@ -939,7 +1253,11 @@ stack_entry_t *execute(method_t *method,
             int64_t op1 = pop_int(op_stack);
             int64_t op2 = pop_int(op_stack);
 
-            push_long(op_stack, op2 % op1);
+            if (!op1) {
+                raise_exception("java/lang/ArithmeticException", "/ by zero");
+                goto exception_thrown;
+            }
+            push_long(op_stack, op1 == -1 ? 0 : op2 % op1);
             pc += 1;
             break;
         }
@@ -955,44 +1273,15 @@ stack_entry_t *execute(method_t *method,
             uint8_t param1 = code_buf[pc + 1], param2 = code_buf[pc + 2];
             uint16_t index = ((param1 << 8) | param2);
 
-            char *field_name, *field_descriptor, *class_name;
-            field_t *field = NULL;
-            class_file_t *target_class = NULL;
-
-            class_name = find_field_info_from_index(index, clazz, &field_name,
-                                                    &field_descriptor);
-            /* skip java.lang.System in order to support java print
-             * method */
-            if (!strcmp(class_name, "java/lang/System")) {
-                pc += 3;
-                break;
-            }
-
-            while (!field) {
-                if (target_class)
-                    class_name = find_class_name_from_index(
-                        target_class->info->super_class, target_class);
-
-                find_or_add_class_to_heap(class_name, prefix, &target_class);
-                assert(target_class && "Failed to load class in i_getstatic");
-
-                field = find_field(field_name, field_descriptor, target_class);
-            }
+            resolved_constant_t *resolved = resolve_field(clazz, index);
+            field_t *field = resolved->value.field;
+            char *field_descriptor = field->descriptor;
 
             /* call static initialization. Only the class that contains this
              * field should do static initialization */
-            if (!target_class->initialized) {
-                target_class->initialized = true;
-                method_t *method = find_method("<clinit>", "()V", target_class);
-                if (method) {
-                    local_variable_t own_locals[method->code.max_locals];
-                    stack_entry_t *exec_res =
-                        execute(method, own_locals, target_class);
-                    assert(exec_res->type == STACK_ENTRY_NONE &&
-                           "<clinit> must not return a value");
-                    free(exec_res);
-                }
-            }
+            initialize_class(resolved->clazz);
+            if (pending_exception)
+                goto exception_thrown;
 
             switch (field_descriptor[0]) {
             case 'B':
@@ -1041,44 +1330,15 @@ stack_entry_t *execute(method_t *method,
             uint8_t param1 = code_buf[pc + 1], param2 = code_buf[pc + 2];
             uint16_t index = ((param1 << 8) | param2);
 
-            char *field_name, *field_descriptor, *class_name;
-            field_t *field = NULL;
-            class_file_t *target_class = NULL;
-            class_name = find_field_info_from_index(index, clazz, &field_name,
-                                                    &field_descriptor);
-
-            /* skip java.lang.System in order to support java print
-             * method */
-            if (!strcmp(class_name, "java/lang/System")) {
-                pc += 3;
-                break;
-            }
-
-            while (!field) {
-                if (target_class)
-                    class_name = find_class_name_from_index(
-                        target_class->info->super_class, target_class);
-
-                find_or_add_class_to_heap(class_name, prefix, &target_class);
-                assert(target_class && "Failed to load class in i_putstatic");
-
-                field = find_field(field_name, field_descriptor, target_class);
-            }
+            resolved_constant_t *resolved = resolve_field(clazz, index);
+            field_t *field = resolved->value.field;
+            char *field_descriptor = field->descriptor;
 
             /* call static initialization. Only the class that contains this
              * field should do static initialization */
-            if (!target_class->initialized) {
-                target_class->initialized = true;
-                method_t *method = find_method("<clinit>", "()V", target_class);
-                if (method) {
-                    local_variable_t own_locals[method->code.max_locals];
-                    stack_entry_t *exec_res =
-                        execute(method, own_locals, target_class);
-                    assert(exec_res->type == STACK_ENTRY_NONE &&
-                           "<clinit> must not return a value");
-                    free(exec_res);
-                }
-            }
+            initialize_class(resolved->clazz);
+            if (pending_exception)
+                goto exception_thrown;
 
             switch (field_descriptor[0]) {
             case 'B':
@@ -1135,72 +1395,27 @@ stack_entry_t *execute(method_t *method,
             uint8_t param1 = code_buf[pc + 1], param2 = code_buf[pc + 2];
             uint16_t index = ((param1 << 8) | param2);
 
+            /* FIXME: consider method modifier */
             /* the method to be called */
-            char *method_name, *method_descriptor, *class_name;
-            class_file_t *target_class = NULL;
-            method_t *method = NULL;
-
-            class_name = find_method_info_from_index(index, clazz, &method_name,
-                                                     &method_descriptor);
-
-            /* to handle print method */
-            if (!strcmp(class_name, "java/io/PrintStream")) {
-                stack_entry_t element = top(op_stack);
-
-                switch (element.type) {
-                /* integer */
-                case STACK_ENTRY_INT:
-                case STACK_ENTRY_SHORT:
-                case STACK_ENTRY_BYTE:
-                case STACK_ENTRY_LONG: {
-                    int64_t op = pop_int(op_stack);
-                    printf("%ld\n", op);
-                    break;
-                }
-                /* string */
-                case STACK_ENTRY_REF: {
-                    void *op = pop_ref(op_stack);
-                    if (!op)
-                        printf("null\n");
-                    else
-                        printf("%s\n", (char *) op);
-                    break;
-                }
-                default:
-                    printf("print type (%d) is not supported\n", element.type);
-                    break;
-                }
+            resolved_constant_t *resolved = resolve_method(clazz, index);
+
+            /* methods the VM implements run natively */
+            if (!resolved->clazz) {
+                frame->pc = pc;
+                resolved->value.native->invoke(op_stack);
+                if (pending_exception)
+                    goto exception_thrown;
                 pc += 3;
                 break;
             }
-
-            /* FIXME: consider method modifier */
-            /* recursively find method from child to parent */
-            while (!method) {
-                if (target_class)
-                    class_name = find_class_name_from_index(
-                        target_class->info->super_class, target_class);
-                find_or_add_class_to_heap(class_name, prefix, &target_class);
-                assert(target_class &&
-                       "Failed to load class in i_invokevirtual");
-                method =
-                    find_method(method_name, method_descriptor, target_class);
-            }
+            method_t *method = resolved->value.method;
+            class_file_t *target_class = resolved->clazz;
 
             /* call static initialization. Only the class that contains this
              * method should do static initialization */
-            if (!target_class->initialized) {
-                target_class->initialized = true;
-                method_t *method = find_method("<clinit>", "()V", target_class);
-                if (method) {
-                    local_variable_t own_locals[method->code.max_locals];
-                    stack_entry_t *exec_res =
-                        execute(method, own_locals, target_class);
-                    assert(exec_res->type == STACK_ENTRY_NONE &&
-                           "<clinit> must not return a value");
-                    free(exec_res);
-                }
-            }
+            initialize_class(target_class);
+            if (pending_exception)
+                goto exception_thrown;
 
             uint16_t num_params = get_number_of_parameters(method);
             local_variable_t own_locals[method->code.max_locals];
@@ -1209,12 +1424,20 @@ stack_entry_t *execute(method_t *method,
                 pop_to_local(op_stack, &own_locals[i]);
             }
             object_t *obj = pop_ref(op_stack);
+            if (!obj) {
+                raise_exception("java/lang/NullPointerException", NULL);
+                goto exception_thrown;
+            }
 
             /* first argument is this pointer */
             own_locals[0].entry.ptr_value = obj;
             own_locals[0].type = STACK_ENTRY_REF;
 
             stack_entry_t *exec_res = execute(method, own_locals, target_class);
+            if (pending_exception) {
+                free(exec_res);
+                goto exception_thrown;
+            }
             switch (exec_res->type) {
             case STACK_ENTRY_BYTE:
                 push_int(op_stack, exec_res->entry.char_value);
@@ -1275,17 +1498,14 @@ stack_entry_t *execute(method_t *method,
             uint16_t index = ((param1 << 8) | param2);
 
             object_t *obj = pop_ref(op_stack);
-            char *field_name, *field_descriptor;
-            find_field_info_from_index(index, clazz, &field_name,
-                                       &field_descriptor);
-
-            variable_t *addr = NULL;
-            while (!addr) {
-                addr = find_field_addr(obj, field_name);
-                obj = obj->parent;
+            if (!obj) {
+                raise_exception("java/lang/NullPointerException", NULL);
+                goto exception_thrown;
             }
+            resolved_constant_t *resolved = resolve_field(clazz, index);
+            variable_t *addr = get_field_addr(obj, resolved);
 
-            switch (field_descriptor[0]) {
+            switch (resolved->value.field->descriptor[0]) {
             case 'I':
                 push_int(op_stack, addr->value.int_value);
                 break;
@@ -1330,19 +1550,16 @@ stack_entry_t *execute(method_t *method,
             }
 
             object_t *obj = pop_ref(op_stack);
+            if (!obj) {
+                raise_exception("java/lang/NullPointerException", NULL);
+                goto exception_thrown;
+            }
 
             /* update value into object's field */
-            char *field_name, *field_descriptor;
-            find_field_info_from_index(index, clazz, &field_name,
-                                       &field_descriptor);
-
-            variable_t *var = NULL;
-            while (!var) {
-                var = find_field_addr(obj, field_name);
-                obj = obj->parent;
-            }
+            resolved_constant_t *resolved = resolve_field(clazz, index);
+            variable_t *var = get_field_addr(obj, resolved);
 
-            switch (field_descriptor[0]) {
+            switch (resolved->value.field->descriptor[0]) {
             case 'I':
                 var->value.int_value = (int32_t) value;
                 var->type = VAR_INT;
@@ -1369,44 +1586,55 @@ stack_entry_t *execute(method_t *method,
 
         /* create new object */
         case i_new: {
+            frame->pc = pc;
             uint8_t param1 = code_buf[pc + 1], param2 = code_buf[pc + 2];
             uint16_t index = ((param1 << 8) | param2);
 
-            char *class_name = find_class_name_from_index(index, clazz);
-            class_file_t *target_class;
-
-            class_file_t *list = calloc(1, sizeof(class_file_t));
-            init_list(list);
-
-            while (strcmp(class_name, "java/lang/Object")) {
-                find_or_add_class_to_heap(class_name, prefix, &target_class);
-                assert(target_class && "Failed to load class in i_new");
-                list_add(target_class, list);
-                class_name = find_class_name_from_index(
-                    target_class->info->super_class, target_class);
+            /* StringBuilder and the exceptions have no class file, the VM
+             * implements them */
+            class_file_t *target_class = resolve_class(clazz, index);
+            resolved_constant_t *resolved = get_resolved(index, clazz);
+            if (resolved->value.native_class) {
+                const native_class_t *native = resolved->value.native_class;
+                if (!native->create) {
+                    fprintf(stderr, "Creating %s is not supported\n",
+                            native->name);
+                    exit(1);
+                }
+                push_ref(op_stack, native->create(native));
+                pc += 3;
+                break;
             }
 
-            /* reversely call static initialization if class have not been
-             * initialized */
-            list_for_each (target_class, list) {
-                if (target_class->initialized)
-                    continue;
-                target_class->initialized = true;
-                method_t *method = find_method("<clinit>", "()V", target_class);
-                if (method) {
-                    local_variable_t own_locals[method->code.max_locals];
-                    stack_entry_t *exec_res =
-                        execute(method, own_locals, target_class);
-                    assert(exec_res->type == STACK_ENTRY_NONE &&
-                           "<clinit> must not return a value");
-                    free(exec_res);
-                }
+            /* the superclasses end with java.lang.Object, or with a class
+             * the VM implements. They are listed on the stack, as other
+             * threads may create objects of the same classes meanwhile. */
+            u2 depth = 0;
+            const native_class_t *native_super = NULL;
+            for (class_file_t *subclass = target_class; subclass; depth++) {
+                uint16_t super_class = subclass->info->super_class;
+                class_file_t *super = resolve_class(subclass, super_class);
+                native_super =
+                    get_resolved(super_class, subclass)->value.native_class;
+                subclass = super;
+            }
+            /* none for java.lang.Object itself */
+            class_file_t *classes[depth + 1];
+            classes[0] = target_class;
+            for (u2 i = 1; i < depth; i++)
+                classes[i] = resolve_class(classes[i - 1],
+                                           classes[i - 1]->info->super_class);
+
+            /* run the static initializers, superclasses first, if they have
+             * not run yet */
+            for (u2 i = depth; i-- > 0;) {
+                initialize_class(classes[i]);
+                if (pending_exception)
+                    goto exception_thrown;
             }
 
-            object_t *object = create_object(list);
+            object_t *object = create_object(classes, depth, native_super);
             push_ref(op_stack, object);
-            list_del(list);
-            free(list);
 
             pc += 3;
             break;
@@ -1417,40 +1645,25 @@ stack_entry_t *execute(method_t *method,
             uint8_t param1 = code_buf[pc + 1], param2 = code_buf[pc + 2];
             uint16_t index = ((param1 << 8) | param2);
 
-            /* the method to be called */
-            char *method_name, *method_descriptor, *class_name;
-            class_name = find_method_info_from_index(index, clazz, &method_name,
-                                                     &method_descriptor);
-
-            /* java.lang.Object is the parent for every object, so every object
-             * will finally call java.lang.Object's constructor */
-            if (!strcmp(class_name, "java/lang/Object")) {
-                pop_ref(op_stack);
+            /* find constructor method from class */
+            resolved_constant_t *resolved = resolve_method(clazz, index);
+
+            /* methods the VM implements run natively */
+            if (!resolved->clazz) {
+                frame->pc = pc;
+                resolved->value.native->invoke(op_stack);
+                if (pending_exception)
+                    goto exception_thrown;
                 pc += 3;
                 break;
             }
-
-            class_file_t *target_class;
-            find_or_add_class_to_heap(class_name, prefix, &target_class);
-            assert(target_class && "Failed to load class in i_invokespecial");
+            method_t *constructor = resolved->value.method;
+            class_file_t *target_class = resolved->clazz;
 
             /* call static initialization */
-            if (!target_class->initialized) {
-                target_class->initialized = true;
-                method_t *method = find_method("<clinit>", "()V", target_class);
-                if (method) {
-                    local_variable_t own_locals[method->code.max_locals];
-                    stack_entry_t *exec_res =
-                        execute(method, own_locals, target_class);
-                    assert(exec_res->type == STACK_ENTRY_NONE &&
-                           "<clinit> must not return a value");
-                    free(exec_res);
-                }
-            }
-
-            /* find constructor method from class */
-            method_t *constructor =
-                find_method(method_name, method_descriptor, target_class);
+            initialize_class(target_class);
+            if (pending_exception)
+                goto exception_thrown;
 
             /* prepare local variables */
             uint16_t num_params = get_number_of_parameters(constructor);
@@ -1461,11 +1674,19 @@ stack_entry_t *execute(method_t *method,
 
             /* first argument must be object itself */
             object_t *obj = pop_ref(op_stack);
+            if (!obj) {
+                raise_exception("java/lang/NullPointerException", NULL);
+                goto exception_thrown;
+            }
             own_locals[0].entry.ptr_value = obj;
             own_locals[0].type = STACK_ENTRY_REF;
 
             stack_entry_t *exec_res =
                 execute(constructor, own_locals, target_class);
+            if (pending_exception) {
+                free(exec_res);
+                goto exception_thrown;
+            }
             assert(exec_res->type == STACK_ENTRY_NONE &&
                    "A constructor must not return a value.");
             free(exec_res);
@@ -1476,105 +1697,30 @@ stack_entry_t *execute(method_t *method,
 
         /* Invokes a dynamic method */
         case i_invokedynamic: {
+            frame->pc = pc;
             uint8_t param1 = code_buf[pc + 1], param2 = code_buf[pc + 2];
             uint16_t index = ((param1 << 8) | param2);
 
-            bootmethods_t *bootstrap_method =
-                find_bootstrap_method(index, clazz);
-            CONSTANT_MethodHandle_info *handle = get_method_handle(
-                &clazz->constant_pool, bootstrap_method->bootstrap_method_ref);
-
-            char *method_name, *method_descriptor;
-            find_method_info_from_index(handle->reference_index, clazz,
-                                        &method_name, &method_descriptor);
-
-            if (strcmp(method_name, "makeConcatWithConstants"))
-                assert(0 && "Only support makeConcatWithConstants");
-
-            char *arg = NULL;
-            arg = get_string_utf(&clazz->constant_pool,
-                                 bootstrap_method->bootstrap_arguments[0]);
-
-            /* In the first argument string, there are three types of character
-             * \1 (Unicode point 0001): an ordinary argument.
-             * \2 (Unicode point 0002): a constant.
-             * Any other char value: a single character constant.
-             *
-             * \1 will be replaced by value in the stack
-             * \2 will be replaced by value in other bootstrap arguments
-             */
-            uint16_t num_params = 0;
-            uint16_t num_constant = 0;
-            char *iter = arg;
-            while (*iter != '\0') {
-                if (*iter == 1 || *iter == 2) {
-                    num_params++;
-                }
-                iter++;
-            }
-            num_constant = strlen(arg) - num_params;
-            char **recipe = calloc(sizeof(char *), num_params);
-            size_t max_len = 0;
-
-            iter = arg;
-            int curr = 0,
-                arg_num = bootstrap_method->num_bootstrap_arguments - 1;
-            while (*iter != '\0') {
-                if (*iter == 1) {
-                    stack_entry_t element = top(op_stack);
-                    switch (element.type) {
-                    /* integer */
-                    case STACK_ENTRY_INT:
-                    case STACK_ENTRY_SHORT:
-                    case STACK_ENTRY_BYTE:
-                    case STACK_ENTRY_LONG: {
-                        int64_t value = pop_int(op_stack);
-                        /* 20 is the maximal digits in 64 bits sign integer */
-                        char str[20];
-                        /* integer to string */
-                        snprintf(str, 20, "%ld", value);
-                        char *dest = create_string(clazz, str);
-                        recipe[curr] = dest;
-                        break;
-                    }
-                    /* string */
-                    case STACK_ENTRY_REF: {
-                        recipe[curr] = (char *) pop_ref(op_stack);
-                        break;
-                    }
-                    default: {
-                        printf("unknown stack top type (%d)\n", element.type);
-                        break;
-                    }
-                    }
-                    max_len += strlen(recipe[curr++]);
-                } else if (*iter == 2) {
-                    recipe[curr] = get_string_utf(
-                        &clazz->constant_pool,
-                        bootstrap_method->bootstrap_arguments[arg_num--]);
-                    max_len += strlen(recipe[curr++]);
+            /* the recipe is compiled the first time the call site runs */
+            resolved_constant_t *resolved = get_resolved(index, clazz);
+            concat_plan_t *plan =
+                __atomic_load_n(&resolved->value.plan, __ATOMIC_ACQUIRE);
+            if (!plan) {
+                /* the plan is allocated from the arena of the class */
+                pthread_mutex_lock(&class_arena_lock);
+                plan = resolved->value.plan;
+                if (!plan) {
+                    plan = compile_concat_plan(clazz, index);
+                    __atomic_store_n(&resolved->value.plan, plan,
+                                     __ATOMIC_RELEASE);
                 }
-                iter++;
+                pthread_mutex_unlock(&class_arena_lock);
             }
 
-            max_len += num_constant;
-            char *result = calloc(max_len + 1, sizeof(char));
-
-            iter = arg;
-            while (*iter != '\0') {
-                if (*iter == 1 || *iter == 2) {
-                    strcat(result, recipe[--num_params]);
-                } else {
-                    strncat(result, iter, 1);
-                }
-                iter++;
-            }
-            result[max_len] = '\0';
-
-            char *dest = create_string(clazz, result);
-            push_ref(op_stack, dest);
-            free(recipe);
-            free(result);
+            string_t *str = run_concat_plan(plan, op_stack);
+            if (!str)
+                goto exception_thrown;
+            push_ref(op_stack, str);
 
             /* two bytes values indicate the class in constant pool and the next
              * two bytes are always zero, program counter should plus five.
@@ -1585,36 +1731,16 @@ stack_entry_t *execute(method_t *method,
 
         /* Create new array */
         case i_newarray: {
-            uint8_t index = code_buf[pc + 1];
-
-            size_t element_size = 0;
-            switch (index) {
-            case T_BOOLEN:
-            case T_CHAR:
-            case T_BYTE:
-                element_size = sizeof(int8_t);
-                break;
-            case T_SHORT:
-                element_size = sizeof(int16_t);
-                break;
-            case T_INT:
-                element_size = sizeof(int32_t);
-                break;
-            case T_LONG:
-                element_size = sizeof(int64_t);
-                break;
-            case T_FLOAT:
-                element_size = sizeof(float);
-                break;
-            case T_DOUBLE:
-                element_size = sizeof(double);
-                break;
+            frame->pc = pc;
+            uint8_t type = code_buf[pc + 1];
+
+            int32_t count = pop_int(op_stack);
+            if (count < 0) {
+                raise_exception("java/lang/NegativeArraySizeException",
+                                "%" PRId32, count);
+                goto exception_thrown;
             }
-
-            int count = pop_int(op_stack);
-            int *dimensions = malloc(sizeof(int));
-            dimensions[0] = count;
-            void *arr = create_array(clazz, 1, dimensions, element_size);
+            array_t *arr = create_array(NULL, type, count);
 
             push_ref(op_stack, arr);
             pc += 2;
@@ -1623,79 +1749,148 @@ stack_entry_t *execute(method_t *method,
 
         /* Create new array of reference */
         case i_anewarray: {
+            frame->pc = pc;
             uint8_t param1 = code_buf[pc + 1], param2 = code_buf[pc + 2];
             uint16_t index = ((param1 << 8) | param2);
 
-            int count = pop_int(op_stack);
-            int *dimensions = malloc(sizeof(int));
+            int32_t count = pop_int(op_stack);
+            if (count < 0) {
+                raise_exception("java/lang/NegativeArraySizeException",
+                                "%" PRId32, count);
+                goto exception_thrown;
+            }
             class_file_t *target_class = NULL;
 
-            /* FIXME: if clazz is string, then it cannot be found in the class
-             * heap. */
             char *class_name = find_class_name_from_index(index, clazz);
-            dimensions[0] = count;
 
-            find_or_add_class_to_heap(class_name, prefix, &target_class);
-            void *arr =
-                create_array(target_class, 1, dimensions, sizeof(void *));
+            /* neither the element of an array of arrays nor the classes the
+             * VM implements have a class file */
+            if (class_name[0] != '[' && !find_native_class(class_name))
+                find_or_add_class_to_heap(class_name, &target_class);
+            array_t *arr = create_array(target_class, T_REFERENCE, count);
 
             push_ref(op_stack, arr);
             pc += 3;
             break;
         }
 
+        /* Get length of array */
+        case i_arraylength: {
+            array_t *arr = pop_ref(op_stack);
+            if (!arr) {
+                raise_exception("java/lang/NullPointerException", NULL);
+                goto exception_thrown;
+            }
+
+            push_int(op_stack, arr->length);
+            pc += 1;
+            break;
+        }
+
+        /* Enter monitor for object */
+        case i_monitorenter: {
+            lock_word_t *lock = pop_ref(op_stack);
+            if (!lock) {
+                raise_exception("java/lang/NullPointerException", NULL);
+                goto exception_thrown;
+            }
+            monitor_enter(lock);
+            pc += 1;
+            break;
+        }
+
+        /* Exit monitor for object */
+        case i_monitorexit: {
+            lock_word_t *lock = pop_ref(op_stack);
+            if (!lock) {
+                raise_exception("java/lang/NullPointerException", NULL);
+                goto exception_thrown;
+            }
+            if (!monitor_exit(lock))
+                goto exception_thrown;
+            pc += 1;
+            break;
+        }
+
+        /* Throw exception */
+        case i_athrow: {
+            object_t *exception = pop_ref(op_stack);
+            if (exception)
+                pending_exception = exception;
+            else
+                raise_exception("java/lang/NullPointerException", NULL);
+            goto exception_thrown;
+        }
+
         /* Create new multidimensional array */
         case i_multianewarray: {
+            frame->pc = pc;
             uint8_t param1 = code_buf[pc + 1], param2 = code_buf[pc + 2];
             uint16_t index = ((param1 << 8) | param2);
             uint8_t dimension = code_buf[pc + 3];
-            size_t type_size = 0;
+            class_file_t *target_class = NULL;
+            u1 type;
 
+            /* the class name is an array descriptor such as "[[I", and only
+             * the first `dimension` dimensions are created */
             char *class_name = find_class_name_from_index(index, clazz);
-            char *last = strrchr(class_name, '[') + 1;
+            char *element = class_name + dimension;
 
-            switch (*last) {
+            switch (*element) {
             case 'B':
-            case 'C':
+                type = T_BYTE;
+                break;
             case 'Z':
-                type_size = sizeof(char);
+                type = T_BOOLEN;
+                break;
+            case 'C':
+                type = T_CHAR;
                 break;
             case 'S':
-                type_size = sizeof(short);
+                type = T_SHORT;
                 break;
             case 'I':
-                type_size = sizeof(int);
+                type = T_INT;
                 break;
             case 'J':
-                type_size = sizeof(long);
+                type = T_LONG;
+                break;
+            case 'F':
+                type = T_FLOAT;
+                break;
+            case 'D':
+                type = T_DOUBLE;
                 break;
             case 'L': {
                 /* find class name.
                  * -1 because the last character is ';' */
-                char *class_name = malloc(strlen(last + 1));
-                strncpy(class_name, last + 1, strlen(last + 1) - 1);
-                class_name[strlen(last + 1) - 1] = '\0';
-                class_file_t *target_class = NULL;
+                char *class_name = malloc(strlen(element + 1));
+                strncpy(class_name, element + 1, strlen(element + 1) - 1);
+                class_name[strlen(element + 1) - 1] = '\0';
 
                 /* FIXME: if clazz is string, then it cannot be found in the
                  * class heap. */
-                find_or_add_class_to_heap(class_name, prefix, &target_class);
+                find_or_add_class_to_heap(class_name, &target_class);
                 free(class_name);
 
-                type_size = sizeof(void *);
+                type = T_REFERENCE;
                 break;
             }
+            case '[':
+                type = T_REFERENCE;
+                break;
             default:
-                fprintf(stderr, "Unknown array type %c\n", *last);
+                fprintf(stderr, "Unknown array type %c\n", *element);
                 exit(1);
                 break;
             }
-            int *dimensions = malloc(sizeof(int) * dimension);
+            int32_t lengths[dimension];
             for (int i = dimension - 1; i >= 0; --i) {
-                dimensions[i] = pop_int(op_stack);
+                lengths[i] = pop_int(op_stack);
             }
 
-            void *arr = create_array(clazz, dimension, dimensions, type_size);
+            array_t *arr =
+                create_multi_array(target_class, type, dimension, lengths);
             push_ref(op_stack, arr);
             pc += 4;
             break;
@@ -1705,36 +1900,156 @@ stack_entry_t *execute(method_t *method,
             fprintf(stderr, "Unknown instruction %x\n", current);
             exit(1);
         }
+        continue;
+
+    /* Only reached when an exception is thrown, with pc at the instruction
+     * which threw it. Either this method catches it, or it is left pending
+     * for the caller to look for a handler in turn.
+     */
+    exception_thrown: {
+        int32_t handler = find_exception_handler(&code, clazz, pc);
+        if (handler < 0) {
+            stack_entry_t *ret = malloc(sizeof(stack_entry_t));
+            ret->type = STACK_ENTRY_NONE;
+
+            leave_method(op_stack, monitor);
+
+            return ret;
+        }
+
+        /* the handler starts with only the exception on the stack */
+        op_stack->size = 0;
+        push_ref(op_stack, pending_exception);
+        pending_exception = NULL;
+        pc = handler;
+    }
     }
     return NULL;
 }
 
+/**
+ * Run a method, on the frames of the current thread the sampling profiler
+ * walks, and timed when the execution profiler is built in. See interpret().
+ */
+stack_entry_t *execute(method_t *method,
+                       local_variable_t *locals,
+                       class_file_t *clazz)
+{
+    thread_t *thread = current_thread;
+    java_frame_t frame = {method, clazz, 0, thread->frame};
+    /* complete before a signal handler may walk it */
+    __atomic_store_n(&thread->frame, &frame, __ATOMIC_RELEASE);
+#ifdef PROFILE
+    profile_frame_t profile_frame;
+    if (profiling)
+        enter_profiled(&profile_frame, method, clazz);
+#endif
+
+    stack_entry_t *ret = interpret(method, locals, clazz, &frame);
+
+#ifdef PROFILE
+    if (profiling)
+        leave_profiled(&profile_frame);
+#endif
+    __atomic_store_n(&thread->frame, frame.caller, __ATOMIC_RELAXED);
+    return ret;
+}
+
 int main(int argc, char *argv[])
 {
-    if (argc < 2)
+    bool print_stats = false, print_profile = false;
+    char *profile_path = NULL, *sample_path = NULL;
+    char *archive_path = NULL, *dump_path = NULL, *user_class_path = NULL;
+    int argi = 1;
+    for (; argi < argc && argv[argi][0] == '-'; argi++) {
+        if (!strcmp(argv[argi], "--stats")) {
+            print_stats = true;
+        } else if ((!strcmp(argv[argi], "-cp") ||
+                    !strcmp(argv[argi], "-classpath")) &&
+                   argi + 1 < argc) {
+            user_class_path = argv[++argi];
+        } else if (!strcmp(argv[argi], "--archive") && argi + 1 < argc) {
+            archive_path = argv[++argi];
+        } else if (!strcmp(argv[argi], "--dump-archive") && argi + 1 < argc) {
+            dump_path = argv[++argi];
+        } else if (!strcmp(argv[argi], "--prof")) {
+            print_profile = true;
+        } else if (!strcmp(argv[argi], "--prof-json") && argi + 1 < argc) {
+            profile_path = argv[++argi];
+        } else if (!strcmp(argv[argi], "--sample") && argi + 1 < argc) {
+            sample_path = argv[++argi];
+        } else if (!strcmp(argv[argi], "--alloc-prof")) {
+            profiling_allocations = true;
+        } else {
+            fprintf(stderr, "Unknown option %s\n", argv[argi]);
+            return -1;
+        }
+    }
+    if (argi >= argc)
         return -1;
+    if (print_profile || profile_path) {
+#ifdef PROFILE
+        profiling = true;
+#else
+        fprintf(stderr, "Profiling needs a build with make PROFILE=1\n");
+        return -1;
+#endif
+    }
+    char *path = argv[argi];
+    size_t path_length = strlen(path);
 
-    /* attempt to read given class file */
-    FILE *class_file = fopen(argv[1], "r");
-    assert(class_file && "Failed to open file");
-
-    /* parse the class file */
-    class_file_t *clazz = malloc(sizeof(class_file_t));
-    *clazz = get_class(class_file);
-
-    int error = fclose(class_file);
-    assert(!error && "Failed to close file");
+    /* The main class is either a class file, whose directory goes first on
+     * the class path, or a class name like java does.
+     */
+    char *main_name, *class_path;
+    if (path_length > 6 && !strcmp(path + path_length - 6, ".class")) {
+        char *match = strrchr(path, '/');
+        size_t dir_length = match ? (size_t) (match - path + 1) : 0;
+        main_name = malloc(path_length - dir_length - 6 + 1);
+        memcpy(main_name, path + dir_length, path_length - dir_length - 6);
+        main_name[path_length - dir_length - 6] = '\0';
+
+        class_path = malloc(dir_length + 2 +
+                            (user_class_path ? strlen(user_class_path) : 0));
+        memcpy(class_path, path, dir_length);
+        class_path[dir_length] = '\0';
+        if (user_class_path) {
+            strcat(class_path, ":");
+            strcat(class_path, user_class_path);
+        }
+    } else {
+        main_name = malloc(path_length + 1);
+        for (size_t i = 0; i <= path_length; i++)
+            main_name[i] = path[i] == '.' ? '/' : path[i];
+        class_path = malloc(strlen(user_class_path ? user_class_path : ".") +
+                            1);
+        strcpy(class_path, user_class_path ? user_class_path : ".");
+    }
+    init_class_path(class_path);
+    free(class_path);
 
+    /* classes referenced by the main class start loading in the background */
     init_class_heap();
     init_object_heap();
-
-    add_class(clazz, argv[1]);
-    char *match = strrchr(argv[1], '/');
-    if (match != NULL) {
-        /* get the prefix from path */
-        prefix = malloc((match - argv[1] + 2));
-        strncpy(prefix, argv[1], match - argv[1] + 1);
-        prefix[match - argv[1] + 1] = '\0';
+    init_natives();
+    init_output();
+    init_main_thread();
+
+    if (archive_path && !add_archived_classes(archive_path))
+        fprintf(stderr, "Ignoring unusable class archive %s\n", archive_path);
+
+    class_file_t *clazz;
+    find_or_add_class_to_heap(main_name, &clazz);
+    free(main_name);
+
+    if (dump_path) {
+        bool written = dump_class_heap(dump_path);
+        if (!written)
+            fprintf(stderr, "Failed to write class archive %s\n", dump_path);
+        free_object_heap();
+        free_class_heap();
+        free_class_path();
+        return written ? 0 : 1;
     }
 
     /* execute the main method if found */
@@ -1745,14 +2060,70 @@ int main(int argc, char *argv[])
     /* FIXME: locals[0] contains a reference to String[] args, but right now
      * we lack of the support for java.lang.Object. Leave it uninitialized.
      */
+    if (sample_path && !start_sampling(sample_path)) {
+        fprintf(stderr, "Failed to start sampling\n");
+        sample_path = NULL;
+    }
+    bool reporting = profiling_allocations && start_allocation_reports();
+    if (profiling_allocations && !reporting)
+        fprintf(stderr, "Failed to start allocation reports\n");
+
     local_variable_t locals[main_method->code.max_locals];
     stack_entry_t *result = execute(main_method, locals, clazz);
     assert(result->type == STACK_ENTRY_NONE && "main() should return void");
     free(result);
 
+    int status = 0;
+    if (pending_exception) {
+        lock_output();
+        flush_output();
+        fputs("Exception in thread \"main\" ", stderr);
+        print_exception(pending_exception);
+        unlock_output();
+        status = 1;
+    }
+
+    /* like java, exit once all the threads have ended, but the daemons: the
+     * virtual threads and the workers of the fork/join pools. Those still
+     * running are stopped at a safepoint, and stay so while the VM exits. */
+    join_threads();
+    if (reporting)
+        stop_allocation_reports();
+    if (virtual_threads_alive() || pools_busy()) {
+        leave_blocking();
+        stop_the_world();
+    } else {
+        free_pools();
+        free_virtual_threads();
+    }
+
+    if (sample_path)
+        stop_sampling();
+
+    if (print_stats) {
+        flush_output();
+        fprintf(stderr, "bounds checks eliminated: %" PRIu32 " of %" PRIu32
+                        " array accesses\n",
+                bounds_check_stats.eliminated,
+                bounds_check_stats.array_accesses);
+        if (archive_path)
+            fprintf(stderr,
+                    "archived classes out of date: %" PRIu32 " of %" PRIu32
+                    "\n",
+                    class_archive_stats.out_of_date,
+                    class_archive_stats.classes);
+    }
+#ifdef PROFILE
+    if (profiling)
+        report_profile(print_profile, profile_path);
+#endif
+    if (profiling_allocations)
+        report_allocations();
+
+    free_monitors();
     free_object_heap();
     free_class_heap();
-    free(prefix);
+    free_class_path();
 
-    return 0;
+    return status;
 }
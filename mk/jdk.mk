@@ -9,3 +9,9 @@ JAVAC := $(shell which $(JAVAC))
 ifndef JAVAC
 $(error "javac is required.")
 endif
+
+JAR ?= jar
+JAR := $(shell which $(JAR))
+ifndef JAR
+$(error "jar is required.")
+endif
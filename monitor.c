@@ -0,0 +1,349 @@
+/* Inflated monitors, and the slow paths of the thin locks of monitor.h.
+ *
+ * A thread finding a thin lock held by another one marks it contended, and
+ * sleeps on a condition variable chosen by the address of the lock word. The
+ * owner inflates a contended lock when it next releases it, or waits on it,
+ * and wakes the threads sleeping there, which then block on the mutex of the
+ * monitor. Monitors are never deflated, and are freed when the VM exits.
+ *
+ * A thread sleeping on either is blocked as far as safepoints go, so
+ * stopping the world does not wait for the owner to release a monitor.
+ */
+
+/* for clock_gettime() */
+#define _POSIX_C_SOURCE 200112L
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "exception.h"
+#include "monitor.h"
+#include "thread.h"
+
+typedef struct monitor {
+    pthread_mutex_t mutex; /* held by the owner */
+    pthread_cond_t waiters;
+    lock_word_t owner; /* lock_owner of the owner, 0 when free */
+    u4 count;          /* entries of the owner */
+    struct monitor *next;
+} monitor_t;
+
+/* Where the threads contending for thin locks sleep until they are
+ * inflated, shared by the locks whose words hash alike
+ */
+#define CONTENTION_SLOTS 64
+
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t inflated;
+} contention_slot_t;
+
+__thread lock_word_t lock_owner;
+__thread u4 pinned;
+
+static contention_slot_t contention_slots[CONTENTION_SLOTS];
+static pthread_once_t contention_once = PTHREAD_ONCE_INIT;
+
+static u4 thread_count;
+
+/* every inflated monitor, to be freed on exit */
+static monitor_t *monitors;
+static pthread_mutex_t monitors_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Give the current thread its identity in lock words. Must be called before
+ * the thread enters a monitor.
+ */
+void init_lock_owner()
+{
+    u4 id = __atomic_add_fetch(&thread_count, 1, __ATOMIC_RELAXED);
+    lock_owner = (lock_word_t) id << LOCK_OWNER_SHIFT;
+}
+
+static void init_contention_slots()
+{
+    for (int i = 0; i < CONTENTION_SLOTS; i++) {
+        pthread_mutex_init(&contention_slots[i].mutex, NULL);
+        pthread_cond_init(&contention_slots[i].inflated, NULL);
+    }
+}
+
+static contention_slot_t *get_contention_slot(lock_word_t *lock)
+{
+    pthread_once(&contention_once, init_contention_slots);
+    return &contention_slots[((uintptr_t) lock >> 3) % CONTENTION_SLOTS];
+}
+
+/* Whether a lock word is a thin lock other threads sleep on */
+static inline bool is_contended(lock_word_t word)
+{
+    return (word & (LOCK_INFLATED | LOCK_CONTENDED)) == LOCK_CONTENDED;
+}
+
+/* The lock_owner of the thread holding a thin lock, 0 if it is free */
+static inline lock_word_t get_thin_owner(lock_word_t word)
+{
+    return word & ~(lock_word_t) (LOCK_COUNT_MASK | LOCK_CONTENDED);
+}
+
+/* Other threads read the owner of a monitor without holding it, but only
+ * the current thread can make it equal to its own lock_owner.
+ */
+static inline bool owner_is_current(monitor_t *monitor)
+{
+    return __atomic_load_n(&monitor->owner, __ATOMIC_RELAXED) == lock_owner;
+}
+
+static inline void set_owner(monitor_t *monitor, lock_word_t owner)
+{
+    __atomic_store_n(&monitor->owner, owner, __ATOMIC_RELAXED);
+}
+
+static inline monitor_t *get_monitor(lock_word_t word)
+{
+    return (monitor_t *) (word & ~(lock_word_t) LOCK_INFLATED);
+}
+
+/* Number of times the owner of a thin lock has entered it */
+static inline u4 get_thin_count(lock_word_t word)
+{
+    return ((word & LOCK_COUNT_MASK) >> LOCK_COUNT_SHIFT) + 1;
+}
+
+/**
+ * Turn a thin lock held by the current thread into a monitor it owns.
+ *
+ * @param lock the lock word
+ * @param count number of times the thread has entered the monitor
+ * @return the monitor
+ */
+static monitor_t *inflate(lock_word_t *lock, u4 count)
+{
+    monitor_t *monitor = malloc(sizeof(monitor_t));
+    assert(monitor && "Failed to allocate monitor");
+    pthread_mutex_init(&monitor->mutex, NULL);
+    pthread_cond_init(&monitor->waiters, NULL);
+    pthread_mutex_lock(&monitor->mutex);
+    set_owner(monitor, lock_owner);
+    monitor->count = count;
+
+    pthread_mutex_lock(&monitors_lock);
+    monitor->next = monitors;
+    monitors = monitor;
+    pthread_mutex_unlock(&monitors_lock);
+
+    /* contenders only ever set LOCK_CONTENDED, the owner changes the rest */
+    lock_word_t word = __atomic_exchange_n(
+        lock, (lock_word_t) monitor | LOCK_INFLATED, __ATOMIC_ACQ_REL);
+    if (word & LOCK_CONTENDED) {
+        contention_slot_t *slot = get_contention_slot(lock);
+        pthread_mutex_lock(&slot->mutex);
+        pthread_cond_broadcast(&slot->inflated);
+        pthread_mutex_unlock(&slot->mutex);
+    }
+    return monitor;
+}
+
+/* Mark a thin lock another thread holds as contended, and sleep until its
+ * owner inflates it or releases it
+ */
+static void wait_inflated(lock_word_t *lock, lock_word_t word)
+{
+    if (!(word & LOCK_CONTENDED) &&
+        !__atomic_compare_exchange_n(lock, &word, word | LOCK_CONTENDED,
+                                     false, __ATOMIC_RELAXED,
+                                     __ATOMIC_RELAXED))
+        return;
+
+    contention_slot_t *slot = get_contention_slot(lock);
+    enter_blocking();
+    pthread_mutex_lock(&slot->mutex);
+    while (is_contended(__atomic_load_n(lock, __ATOMIC_ACQUIRE)))
+        pthread_cond_wait(&slot->inflated, &slot->mutex);
+    pthread_mutex_unlock(&slot->mutex);
+    leave_blocking();
+}
+
+static void enter_inflated(monitor_t *monitor)
+{
+    if (owner_is_current(monitor)) {
+        monitor->count++;
+        return;
+    }
+    if (pthread_mutex_trylock(&monitor->mutex)) {
+        enter_blocking();
+        pthread_mutex_lock(&monitor->mutex);
+        leave_blocking();
+    }
+    set_owner(monitor, lock_owner);
+    monitor->count = 1;
+}
+
+/* Enter a monitor which is not free, or which is inflated */
+void monitor_enter_slow(lock_word_t *lock)
+{
+    for (;;) {
+        lock_word_t word = __atomic_load_n(lock, __ATOMIC_ACQUIRE);
+        if (word & LOCK_INFLATED) {
+            enter_inflated(get_monitor(word));
+            return;
+        }
+
+        if (!word) {
+            if (!__atomic_compare_exchange_n(lock, &word, lock_owner, false,
+                                             __ATOMIC_ACQUIRE,
+                                             __ATOMIC_RELAXED))
+                continue;
+            return;
+        }
+
+        if (get_thin_owner(word) == lock_owner) {
+            if ((word & LOCK_COUNT_MASK) != LOCK_COUNT_MASK)
+                __atomic_add_fetch(lock, 1 << LOCK_COUNT_SHIFT,
+                                   __ATOMIC_RELAXED);
+            else
+                inflate(lock, get_thin_count(word) + 1);
+            return;
+        }
+
+        /* held by another thread */
+        wait_inflated(lock, word);
+    }
+}
+
+static bool raise_not_owner()
+{
+    raise_exception("java/lang/IllegalMonitorStateException",
+                    "current thread is not owner");
+    return false;
+}
+
+/**
+ * Get the monitor of a lock owned by the current thread, inflating a thin
+ * lock.
+ *
+ * @return the monitor, or NULL if the thread does not own the lock
+ */
+static monitor_t *get_owned_monitor(lock_word_t *lock)
+{
+    lock_word_t word = __atomic_load_n(lock, __ATOMIC_ACQUIRE);
+    if (word & LOCK_INFLATED) {
+        monitor_t *monitor = get_monitor(word);
+        return owner_is_current(monitor) ? monitor : NULL;
+    }
+    if (!word || get_thin_owner(word) != lock_owner)
+        return NULL;
+    return inflate(lock, get_thin_count(word));
+}
+
+static void exit_inflated(monitor_t *monitor)
+{
+    if (!--monitor->count) {
+        set_owner(monitor, 0);
+        pthread_mutex_unlock(&monitor->mutex);
+    }
+}
+
+/* Release a monitor entered more than once, contended, or inflated */
+bool monitor_exit_slow(lock_word_t *lock)
+{
+    lock_word_t word = __atomic_load_n(lock, __ATOMIC_ACQUIRE);
+    if (word & LOCK_INFLATED) {
+        monitor_t *monitor = get_monitor(word);
+        if (!owner_is_current(monitor))
+            return raise_not_owner();
+        exit_inflated(monitor);
+        return true;
+    }
+
+    if (!word || get_thin_owner(word) != lock_owner)
+        return raise_not_owner();
+    if (word & LOCK_COUNT_MASK) {
+        __atomic_sub_fetch(lock, 1 << LOCK_COUNT_SHIFT, __ATOMIC_RELAXED);
+        return true;
+    }
+    /* the last exit of a contended lock hands it over to the monitor */
+    exit_inflated(inflate(lock, 1));
+    return true;
+}
+
+/**
+ * Object.wait(): release the monitor until notified, then enter it again as
+ * many times as before.
+ *
+ * @param lock the lock word of the object
+ * @param millis the longest time to wait, 0 to wait until notified
+ * @return false if an exception was raised
+ */
+bool monitor_wait(lock_word_t *lock, int64_t millis)
+{
+    if (millis < 0) {
+        raise_exception("java/lang/IllegalArgumentException",
+                        "timeout value is negative");
+        return false;
+    }
+    monitor_t *monitor = get_owned_monitor(lock);
+    if (!monitor)
+        return raise_not_owner();
+
+    u4 count = monitor->count;
+    set_owner(monitor, 0);
+    monitor->count = 0;
+    enter_blocking();
+    if (millis) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += millis / 1000;
+        deadline.tv_nsec += millis % 1000 * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&monitor->waiters, &monitor->mutex, &deadline);
+    } else {
+        pthread_cond_wait(&monitor->waiters, &monitor->mutex);
+    }
+    leave_blocking();
+    set_owner(monitor, lock_owner);
+    monitor->count = count;
+    return true;
+}
+
+/**
+ * Object.notify() and Object.notifyAll().
+ *
+ * @param lock the lock word of the object
+ * @param all whether to wake every waiting thread rather than one
+ * @return false if the thread does not own the monitor
+ */
+bool monitor_notify(lock_word_t *lock, bool all)
+{
+    lock_word_t word = __atomic_load_n(lock, __ATOMIC_ACQUIRE);
+    /* threads only wait on inflated monitors */
+    if (!(word & LOCK_INFLATED)) {
+        if (!word || get_thin_owner(word) != lock_owner)
+            return raise_not_owner();
+        return true;
+    }
+
+    monitor_t *monitor = get_monitor(word);
+    if (!owner_is_current(monitor))
+        return raise_not_owner();
+    if (all)
+        pthread_cond_broadcast(&monitor->waiters);
+    else
+        pthread_cond_signal(&monitor->waiters);
+    return true;
+}
+
+void free_monitors()
+{
+    while (monitors) {
+        monitor_t *next = monitors->next;
+        pthread_cond_destroy(&monitors->waiters);
+        pthread_mutex_destroy(&monitors->mutex);
+        free(monitors);
+        monitors = next;
+    }
+}
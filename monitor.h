@@ -0,0 +1,67 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "type.h"
+
+/* Java monitors as thin locks.
+ *
+ * The lock word of an object is 0 while nobody holds its monitor. A thread
+ * takes a free monitor by storing its lock_owner into the word with a single
+ * compare-and-swap, and releases it by swapping 0 back; entering it again
+ * only counts the entries in the word. A thread finding the monitor held
+ * sets LOCK_CONTENDED in the word and sleeps, which fails that swap: the
+ * owner then inflates the word into a pointer to a monitor_t, tagged with
+ * LOCK_INFLATED, on which the contenders block. The word is also inflated
+ * when a thread waits on it, or when the count overflows.
+ */
+#define LOCK_INFLATED 1
+#define LOCK_COUNT_SHIFT 1
+#define LOCK_COUNT_MASK 0xfe /* entries beyond the first one */
+#define LOCK_CONTENDED 0x100 /* other threads sleep until it is inflated */
+#define LOCK_OWNER_SHIFT 9
+
+/* The lock word of a thin lock held once by the current thread */
+extern __thread lock_word_t lock_owner;
+
+/* Number of monitor entries the current thread holds, and of static
+ * initializers it runs, which also belong to its lock_owner. A virtual thread
+ * stays on its carrier, whose lock_owner it uses, while it is not 0.
+ */
+extern __thread u4 pinned;
+
+void init_lock_owner();
+void free_monitors();
+void monitor_enter_slow(lock_word_t *lock);
+bool monitor_exit_slow(lock_word_t *lock);
+bool monitor_wait(lock_word_t *lock, int64_t millis);
+bool monitor_notify(lock_word_t *lock, bool all);
+
+static inline void monitor_enter(lock_word_t *lock)
+{
+    lock_word_t unlocked = 0;
+    if (!__atomic_compare_exchange_n(lock, &unlocked, lock_owner, false,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        monitor_enter_slow(lock);
+    pinned++;
+}
+
+/**
+ * Release a monitor entered by the current thread.
+ *
+ * @return false if the thread does not own the monitor, having raised
+ * IllegalMonitorStateException
+ */
+static inline bool monitor_exit(lock_word_t *lock)
+{
+    lock_word_t held = lock_owner;
+    if (__atomic_compare_exchange_n(lock, &held, 0, false, __ATOMIC_RELEASE,
+                                    __ATOMIC_RELAXED)) {
+        pinned--;
+        return true;
+    }
+    if (!monitor_exit_slow(lock))
+        return false;
+    pinned--;
+    return true;
+}
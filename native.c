@@ -0,0 +1,1430 @@
+/* Methods and classes the VM implements in C: the console, the clock,
+ * threads, some of java.lang.Math, the hot methods of String and
+ * StringBuilder, and the exception classes the VM throws.
+ *
+ * The registry is keyed by class, name and descriptor. It is consulted once
+ * when a MethodRef is resolved, so an invoke instruction runs the C function
+ * directly, without a frame.
+ */
+
+/* for clock_gettime() */
+#define _POSIX_C_SOURCE 199309L
+
+#include <inttypes.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "exception.h"
+#include "fork-join.h"
+#include "monitor.h"
+#include "native.h"
+#include "object-heap.h"
+#include "output.h"
+#include "thread.h"
+#include "vthread.h"
+
+/* power of two, at least twice the number of native methods */
+#define NATIVE_BUCKETS 256
+
+/* Pop the receiver of a method, raising NullPointerException for null */
+static void *pop_receiver(stack_frame_t *op_stack)
+{
+    void *ref = pop_ref(op_stack);
+    if (!ref)
+        raise_exception("java/lang/NullPointerException", NULL);
+    return ref;
+}
+
+static bool check_string_index(int32_t index, int32_t length)
+{
+    if (index < 0 || index >= length) {
+        raise_exception("java/lang/StringIndexOutOfBoundsException",
+                        "Index %" PRId32 " out of bounds for length %" PRId32,
+                        index, length);
+        return false;
+    }
+    return true;
+}
+
+static void native_object_init(stack_frame_t *op_stack)
+{
+    pop_receiver(op_stack);
+}
+
+/* Every object, array and string starts with its lock word */
+static void native_object_wait(stack_frame_t *op_stack)
+{
+    lock_word_t *lock = pop_receiver(op_stack);
+    if (lock)
+        monitor_wait(lock, 0);
+}
+
+static void native_object_wait_millis(stack_frame_t *op_stack)
+{
+    int64_t millis = pop_int(op_stack);
+    lock_word_t *lock = pop_receiver(op_stack);
+    if (lock)
+        monitor_wait(lock, millis);
+}
+
+static void native_object_notify(stack_frame_t *op_stack)
+{
+    lock_word_t *lock = pop_receiver(op_stack);
+    if (lock)
+        monitor_notify(lock, false);
+}
+
+static void native_object_notify_all(stack_frame_t *op_stack)
+{
+    lock_word_t *lock = pop_receiver(op_stack);
+    if (lock)
+        monitor_notify(lock, true);
+}
+
+/* System.out, the only PrintStream, has no state of its own */
+static object_t system_out_object;
+static variable_t system_out = {
+    .value.ptr_value = &system_out_object,
+    .type = VAR_PTR,
+};
+
+static void native_print_int(stack_frame_t *op_stack)
+{
+    int64_t value = pop_int(op_stack);
+    if (!pop_receiver(op_stack))
+        return;
+    lock_output();
+    output_int(value);
+    unlock_output();
+}
+
+static void native_print_char(stack_frame_t *op_stack)
+{
+    u2 c = pop_int(op_stack);
+    if (!pop_receiver(op_stack))
+        return;
+    lock_output();
+    output_char16(c);
+    unlock_output();
+}
+
+static void native_print_boolean(stack_frame_t *op_stack)
+{
+    bool value = pop_int(op_stack);
+    if (!pop_receiver(op_stack))
+        return;
+    lock_output();
+    output_string(value ? "true" : "false");
+    unlock_output();
+}
+
+#define TO_STRING "()Ljava/lang/String;"
+
+/* The identity hash code of an object, its address as objects never move */
+static u4 identity_hash(const void *ref)
+{
+    return (u4) ((uintptr_t) ref >> 3);
+}
+
+/**
+ * Name the class of an object the way Java does, and describe the object
+ * like Object.toString() does if asked to.
+ *
+ * @param prefix the start of the class name
+ * @param name the binary name, which follows
+ * @param suffix the end of the class name
+ * @param ref the object whose hash code follows the name, or NULL
+ * @return the string
+ */
+static string_t *describe_object(const char *prefix,
+                                 const char *name,
+                                 const char *suffix,
+                                 const void *ref)
+{
+    size_t size = strlen(prefix) + strlen(name) + strlen(suffix) + 10;
+    char *text = malloc(size);
+    assert(text && "Failed to allocate object description");
+    int length = snprintf(text, size, "%s%s%s", prefix, name, suffix);
+    if (ref)
+        snprintf(text + length, size - length, "@%" PRIx32,
+                 identity_hash(ref));
+    for (char *c = text; *c; c++) {
+        if (*c == '/')
+            *c = '.';
+    }
+    string_t *str = create_string(text);
+    free(text);
+    return str;
+}
+
+/* The class name of an array is the descriptor of its elements after [. The
+ * element class of arrays of arrays is not recorded, those are described
+ * as arrays of objects. */
+static string_t *describe_array(const array_t *arr)
+{
+    static const char *descriptors[] = {
+        [T_BOOLEN] = "Z", [T_CHAR] = "C",  [T_FLOAT] = "F", [T_DOUBLE] = "D",
+        [T_BYTE] = "B",   [T_SHORT] = "S", [T_INT] = "I",   [T_LONG] = "J",
+    };
+    if (arr->type != T_REFERENCE)
+        return describe_object("[", descriptors[arr->type], "", arr);
+    const char *name =
+        arr->class ? find_class_name_from_index(arr->class->info->this_class,
+                                                arr->class)
+                   : "java/lang/Object";
+    return describe_object("[L", name, ";", arr);
+}
+
+/* Whether the class of an object, or a class the VM implements that it
+ * extends, declares toString() */
+static bool has_to_string(object_t *obj)
+{
+    for (object_t *part = obj; part; part = part->parent) {
+        if (part->class) {
+            if (find_method("toString", TO_STRING, part->class))
+                return true;
+        } else if (part->native && find_native_method(part->native->name,
+                                                      "toString", TO_STRING)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Convert any reference to a string, like String.valueOf(Object).
+ *
+ * Strings are returned as they are, and builders copied. Other objects are
+ * converted by their toString(), or described like Object.toString() does
+ * when no class of theirs declares one, as are arrays.
+ *
+ * @param ref the reference, which may be null
+ * @return the string, or NULL if toString() threw an exception
+ */
+string_t *string_value_of(void *ref)
+{
+    if (!ref)
+        return create_string("null");
+    switch (get_heap_kind(ref)) {
+    case HEAP_STRING:
+        return ref;
+    case HEAP_BUILDER:
+        return builder_to_string(ref);
+    case HEAP_ARRAY:
+        return describe_array(ref);
+    default:
+        break;
+    }
+
+    object_t *obj = ref;
+    if (!has_to_string(obj))
+        return describe_object("", get_object_class_name(obj), "", obj);
+    string_t *str = call_method(obj, "toString", TO_STRING);
+    if (pending_exception)
+        return NULL;
+    return str ? str : create_string("null");
+}
+
+/* Strings and null, see native_print_object() for any object */
+static void native_print_string(stack_frame_t *op_stack)
+{
+    string_t *str = pop_ref(op_stack);
+    if (!pop_receiver(op_stack))
+        return;
+    lock_output();
+    if (str)
+        output_java_string(str);
+    else
+        output_string("null");
+    unlock_output();
+}
+
+static void native_println(stack_frame_t *op_stack)
+{
+    if (!pop_receiver(op_stack))
+        return;
+    lock_output();
+    output_char('\n');
+    unlock_output();
+}
+
+/* Print the value and the end of line at once, as threads print lines */
+static void println_value(native_fn_t print, stack_frame_t *op_stack)
+{
+    lock_output();
+    print(op_stack);
+    if (!pending_exception)
+        output_char('\n');
+    unlock_output();
+}
+
+static void native_println_int(stack_frame_t *op_stack)
+{
+    println_value(native_print_int, op_stack);
+}
+
+static void native_println_char(stack_frame_t *op_stack)
+{
+    println_value(native_print_char, op_stack);
+}
+
+static void native_println_boolean(stack_frame_t *op_stack)
+{
+    println_value(native_print_boolean, op_stack);
+}
+
+static void native_println_string(stack_frame_t *op_stack)
+{
+    println_value(native_print_string, op_stack);
+}
+
+/* The object is converted before the output is locked, as its toString()
+ * may run for long, or print */
+static void print_object(stack_frame_t *op_stack, bool newline)
+{
+    void *ref = pop_ref(op_stack);
+    if (!pop_receiver(op_stack))
+        return;
+    string_t *str = string_value_of(ref);
+    if (!str)
+        return;
+    lock_output();
+    output_java_string(str);
+    if (newline)
+        output_char('\n');
+    unlock_output();
+}
+
+static void native_print_object(stack_frame_t *op_stack)
+{
+    print_object(op_stack, false);
+}
+
+static void native_println_object(stack_frame_t *op_stack)
+{
+    print_object(op_stack, true);
+}
+
+static int64_t read_clock(clockid_t clock, int64_t unit)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (int64_t) ts.tv_sec * (1000000000 / unit) + ts.tv_nsec / unit;
+}
+
+static void native_current_time_millis(stack_frame_t *op_stack)
+{
+    push_long(op_stack, read_clock(CLOCK_REALTIME, 1000000));
+}
+
+static void native_nano_time(stack_frame_t *op_stack)
+{
+    push_long(op_stack, read_clock(CLOCK_MONOTONIC, 1));
+}
+
+static void native_math_max_int(stack_frame_t *op_stack)
+{
+    int32_t b = pop_int(op_stack), a = pop_int(op_stack);
+    push_int(op_stack, a > b ? a : b);
+}
+
+static void native_math_max_long(stack_frame_t *op_stack)
+{
+    int64_t b = pop_int(op_stack), a = pop_int(op_stack);
+    push_long(op_stack, a > b ? a : b);
+}
+
+static void native_math_min_int(stack_frame_t *op_stack)
+{
+    int32_t b = pop_int(op_stack), a = pop_int(op_stack);
+    push_int(op_stack, a < b ? a : b);
+}
+
+static void native_math_min_long(stack_frame_t *op_stack)
+{
+    int64_t b = pop_int(op_stack), a = pop_int(op_stack);
+    push_long(op_stack, a < b ? a : b);
+}
+
+/* Math.abs() of the most negative value is the value itself */
+static void native_math_abs_int(stack_frame_t *op_stack)
+{
+    uint32_t a = (int32_t) pop_int(op_stack);
+    push_int(op_stack, (int32_t) a < 0 ? (int32_t) -a : (int32_t) a);
+}
+
+static void native_math_abs_long(stack_frame_t *op_stack)
+{
+    uint64_t a = pop_int(op_stack);
+    push_long(op_stack, (int64_t) a < 0 ? (int64_t) -a : (int64_t) a);
+}
+
+static void native_string_length(stack_frame_t *op_stack)
+{
+    string_t *str = pop_receiver(op_stack);
+    if (!str)
+        return;
+    push_int(op_stack, str->length);
+}
+
+static void native_string_char_at(stack_frame_t *op_stack)
+{
+    int32_t index = pop_int(op_stack);
+    string_t *str = pop_receiver(op_stack);
+    if (!str || !check_string_index(index, str->length))
+        return;
+    push_int(op_stack, string_char_at(str, index));
+}
+
+/* Only a string can equal a string, the argument may be any object */
+static void native_string_equals(stack_frame_t *op_stack)
+{
+    void *other = pop_ref(op_stack);
+    string_t *str = pop_receiver(op_stack);
+    if (!str)
+        return;
+    push_int(op_stack, other && get_heap_kind(other) == HEAP_STRING &&
+                           string_equals(str, other));
+}
+
+static void native_string_hash_code(stack_frame_t *op_stack)
+{
+    string_t *str = pop_receiver(op_stack);
+    if (!str)
+        return;
+    push_int(op_stack, string_hash(str));
+}
+
+static void native_string_index_of_char(stack_frame_t *op_stack)
+{
+    int32_t c = pop_int(op_stack);
+    string_t *str = pop_receiver(op_stack);
+    if (!str)
+        return;
+    push_int(op_stack, string_index_of_char(str, c, 0));
+}
+
+static void native_string_index_of_char_from(stack_frame_t *op_stack)
+{
+    int32_t from = pop_int(op_stack);
+    int32_t c = pop_int(op_stack);
+    string_t *str = pop_receiver(op_stack);
+    if (!str)
+        return;
+    push_int(op_stack, string_index_of_char(str, c, from));
+}
+
+static void native_string_index_of(stack_frame_t *op_stack)
+{
+    string_t *sub = pop_receiver(op_stack);
+    string_t *str = pop_receiver(op_stack);
+    if (!sub || !str)
+        return;
+    push_int(op_stack, string_index_of(str, sub, 0));
+}
+
+static void native_string_index_of_from(stack_frame_t *op_stack)
+{
+    int32_t from = pop_int(op_stack);
+    string_t *sub = pop_receiver(op_stack);
+    string_t *str = pop_receiver(op_stack);
+    if (!sub || !str)
+        return;
+    push_int(op_stack, string_index_of(str, sub, from));
+}
+
+static void native_string_compare_to(stack_frame_t *op_stack)
+{
+    string_t *other = pop_receiver(op_stack);
+    string_t *str = pop_receiver(op_stack);
+    if (!other || !str)
+        return;
+    push_int(op_stack, string_compare(str, other));
+}
+
+static void native_string_to_string(stack_frame_t *op_stack)
+{
+    string_t *str = pop_receiver(op_stack);
+    if (!str)
+        return;
+    push_ref(op_stack, str);
+}
+
+static void *new_builder(const native_class_t *clazz)
+{
+    (void) clazz;
+    return create_string_builder();
+}
+
+static void native_builder_init(stack_frame_t *op_stack)
+{
+    pop_receiver(op_stack);
+}
+
+static void native_builder_init_capacity(stack_frame_t *op_stack)
+{
+    int32_t capacity = pop_int(op_stack);
+    string_builder_t *sb = pop_receiver(op_stack);
+    if (!sb)
+        return;
+    if (capacity < 0) {
+        raise_exception("java/lang/NegativeArraySizeException",
+                        "%" PRId32, capacity);
+        return;
+    }
+    sb->value = malloc(capacity ? capacity : 1);
+    sb->capacity = capacity;
+}
+
+static void native_builder_init_string(stack_frame_t *op_stack)
+{
+    string_t *str = pop_receiver(op_stack);
+    string_builder_t *sb = pop_receiver(op_stack);
+    if (!str || !sb)
+        return;
+    builder_append_string(sb, str);
+}
+
+/* The append methods return the builder itself */
+static void native_builder_append_string(stack_frame_t *op_stack)
+{
+    string_t *str = pop_ref(op_stack);
+    string_builder_t *sb = pop_receiver(op_stack);
+    if (!sb)
+        return;
+    builder_append_string(sb, str);
+    push_ref(op_stack, sb);
+}
+
+static void native_builder_append_int(stack_frame_t *op_stack)
+{
+    int64_t value = pop_int(op_stack);
+    string_builder_t *sb = pop_receiver(op_stack);
+    if (!sb)
+        return;
+    builder_append_int(sb, value);
+    push_ref(op_stack, sb);
+}
+
+static void native_builder_append_char(stack_frame_t *op_stack)
+{
+    u2 c = pop_int(op_stack);
+    string_builder_t *sb = pop_receiver(op_stack);
+    if (!sb)
+        return;
+    builder_append_char(sb, c);
+    push_ref(op_stack, sb);
+}
+
+static void native_builder_append_boolean(stack_frame_t *op_stack)
+{
+    bool value = pop_int(op_stack);
+    string_builder_t *sb = pop_receiver(op_stack);
+    if (!sb)
+        return;
+    if (value)
+        builder_append_latin1(sb, "true", 4);
+    else
+        builder_append_latin1(sb, "false", 5);
+    push_ref(op_stack, sb);
+}
+
+static void native_builder_length(stack_frame_t *op_stack)
+{
+    string_builder_t *sb = pop_receiver(op_stack);
+    if (!sb)
+        return;
+    push_int(op_stack, sb->length);
+}
+
+static void native_builder_char_at(stack_frame_t *op_stack)
+{
+    int32_t index = pop_int(op_stack);
+    string_builder_t *sb = pop_receiver(op_stack);
+    if (!sb || !check_string_index(index, sb->length))
+        return;
+    push_int(op_stack, sb->coder == STRING_LATIN1
+                           ? sb->value[index]
+                           : ((u2 *) sb->value)[index]);
+}
+
+static void native_builder_to_string(stack_frame_t *op_stack)
+{
+    string_builder_t *sb = pop_receiver(op_stack);
+    if (!sb)
+        return;
+    push_ref(op_stack, builder_to_string(sb));
+}
+
+static void *new_throwable(const native_class_t *clazz)
+{
+    return create_object(NULL, 0, clazz);
+}
+
+static void native_throwable_init(stack_frame_t *op_stack)
+{
+    pop_receiver(op_stack);
+}
+
+static void native_throwable_init_message(stack_frame_t *op_stack)
+{
+    string_t *message = pop_ref(op_stack);
+    object_t *exception = pop_receiver(op_stack);
+    if (!exception)
+        return;
+    set_exception_message(exception, message);
+}
+
+static void native_throwable_get_message(stack_frame_t *op_stack)
+{
+    object_t *exception = pop_receiver(op_stack);
+    if (!exception)
+        return;
+    push_ref(op_stack, get_exception_message(exception));
+}
+
+/* The class of the exception, then its message if it has one */
+static void native_throwable_to_string(stack_frame_t *op_stack)
+{
+    object_t *exception = pop_receiver(op_stack);
+    if (!exception)
+        return;
+    string_t *name =
+        describe_object("", get_object_class_name(exception), "", NULL);
+    string_t *message = get_exception_message(exception);
+    if (!message) {
+        push_ref(op_stack, name);
+        return;
+    }
+    string_builder_t sb = {.kind = HEAP_BUILDER};
+    builder_append_string(&sb, name);
+    builder_append_latin1(&sb, ": ", 2);
+    builder_append_string(&sb, message);
+    push_ref(op_stack, builder_to_string(&sb));
+    free(sb.value);
+}
+
+/* Without a record of the frames, the trace is only the exception itself */
+static void native_throwable_print_stack_trace(stack_frame_t *op_stack)
+{
+    object_t *exception = pop_receiver(op_stack);
+    if (!exception)
+        return;
+    print_exception(exception);
+}
+
+/* The fields of the part of a java.lang.Thread the VM implements */
+enum {
+    THREAD_HANDLE, /* the thread_t once started */
+    THREAD_TARGET, /* the Runnable to run, if any */
+    THREAD_NAME,
+    THREAD_FIELDS_COUNT,
+};
+
+/* number of the next thread named by default */
+static u4 thread_number;
+
+static void *new_thread(const native_class_t *clazz)
+{
+    return create_object(NULL, 0, clazz);
+}
+
+static variable_t *get_thread_field(object_t *thread, int field)
+{
+    return &get_native_part(thread)->value[field];
+}
+
+static void init_thread(object_t *thread, object_t *target, string_t *name)
+{
+    if (!name) {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "Thread-%" PRIu32,
+                 __atomic_fetch_add(&thread_number, 1, __ATOMIC_RELAXED));
+        name = create_string(buf);
+    }
+    get_thread_field(thread, THREAD_TARGET)->value.ptr_value = target;
+    get_thread_field(thread, THREAD_NAME)->value.ptr_value = name;
+}
+
+static void native_thread_init(stack_frame_t *op_stack)
+{
+    object_t *thread = pop_receiver(op_stack);
+    if (thread)
+        init_thread(thread, NULL, NULL);
+}
+
+static void native_thread_init_target(stack_frame_t *op_stack)
+{
+    object_t *target = pop_ref(op_stack);
+    object_t *thread = pop_receiver(op_stack);
+    if (thread)
+        init_thread(thread, target, NULL);
+}
+
+static void native_thread_init_name(stack_frame_t *op_stack)
+{
+    string_t *name = pop_ref(op_stack);
+    object_t *thread = pop_receiver(op_stack);
+    if (!thread)
+        return;
+    if (!name) {
+        raise_exception("java/lang/NullPointerException",
+                        "name cannot be null");
+        return;
+    }
+    init_thread(thread, NULL, name);
+}
+
+static void native_thread_init_target_name(stack_frame_t *op_stack)
+{
+    string_t *name = pop_ref(op_stack);
+    object_t *target = pop_ref(op_stack);
+    object_t *thread = pop_receiver(op_stack);
+    if (!thread)
+        return;
+    if (!name) {
+        raise_exception("java/lang/NullPointerException",
+                        "name cannot be null");
+        return;
+    }
+    init_thread(thread, target, name);
+}
+
+/**
+ * Start the thread of a Thread object.
+ *
+ * @param obj the Thread
+ * @param is_virtual whether to run it on the carriers, or on a pthread
+ * @return false if an exception was raised
+ */
+static bool start(object_t *obj, bool is_virtual)
+{
+    variable_t *handle = get_thread_field(obj, THREAD_HANDLE);
+    if (handle->value.ptr_value) {
+        raise_exception("java/lang/IllegalThreadStateException", NULL);
+        return false;
+    }
+
+    thread_t *thread = calloc(1, sizeof(thread_t));
+    assert(thread && "Failed to allocate thread");
+    thread->object = obj;
+    thread->name = get_thread_field(obj, THREAD_NAME)->value.ptr_value;
+    /* set first, as the thread may ask for it right away */
+    handle->value.ptr_value = thread;
+    if (!(is_virtual ? start_virtual_thread(thread) : start_thread(thread))) {
+        handle->value.ptr_value = NULL;
+        free(thread);
+        raise_exception("java/lang/OutOfMemoryError",
+                        "unable to create native thread");
+        return false;
+    }
+    return true;
+}
+
+static void native_thread_start(stack_frame_t *op_stack)
+{
+    object_t *obj = pop_receiver(op_stack);
+    if (obj)
+        start(obj, false);
+}
+
+/* Thread.startVirtualThread(): virtual threads have no name by default */
+static void native_thread_start_virtual(stack_frame_t *op_stack)
+{
+    object_t *target = pop_ref(op_stack);
+    if (!target) {
+        raise_exception("java/lang/NullPointerException", NULL);
+        return;
+    }
+    object_t *obj = new_thread(find_native_class("java/lang/Thread"));
+    init_thread(obj, target, create_string(""));
+    if (start(obj, true))
+        push_ref(op_stack, obj);
+}
+
+/* Thread.run() runs the Runnable given to the constructor, unless a
+ * subclass overrides it */
+static void native_thread_run(stack_frame_t *op_stack)
+{
+    object_t *thread = pop_receiver(op_stack);
+    if (!thread)
+        return;
+    object_t *target = get_thread_field(thread, THREAD_TARGET)->value.ptr_value;
+    if (target)
+        call_method(target, "run", "()V");
+}
+
+static void join(stack_frame_t *op_stack, int64_t millis)
+{
+    object_t *obj = pop_receiver(op_stack);
+    if (!obj)
+        return;
+    if (millis < 0) {
+        raise_exception("java/lang/IllegalArgumentException",
+                        "timeout value is negative");
+        return;
+    }
+    /* a thread which was not started is not alive */
+    thread_t *thread = get_thread_field(obj, THREAD_HANDLE)->value.ptr_value;
+    if (thread)
+        join_thread(thread, millis);
+}
+
+static void native_thread_join(stack_frame_t *op_stack)
+{
+    join(op_stack, 0);
+}
+
+static void native_thread_join_millis(stack_frame_t *op_stack)
+{
+    int64_t millis = pop_int(op_stack);
+    join(op_stack, millis);
+}
+
+static void native_thread_is_alive(stack_frame_t *op_stack)
+{
+    object_t *obj = pop_receiver(op_stack);
+    if (!obj)
+        return;
+    thread_t *thread = get_thread_field(obj, THREAD_HANDLE)->value.ptr_value;
+    push_int(op_stack,
+             thread && __atomic_load_n(&thread->alive, __ATOMIC_ACQUIRE));
+}
+
+static void native_thread_is_virtual(stack_frame_t *op_stack)
+{
+    object_t *obj = pop_receiver(op_stack);
+    if (!obj)
+        return;
+    thread_t *thread = get_thread_field(obj, THREAD_HANDLE)->value.ptr_value;
+    push_int(op_stack, thread && thread->vthread);
+}
+
+static void native_thread_get_name(stack_frame_t *op_stack)
+{
+    object_t *thread = pop_receiver(op_stack);
+    if (thread)
+        push_ref(op_stack,
+                 get_thread_field(thread, THREAD_NAME)->value.ptr_value);
+}
+
+/* The main thread gets its object the first time it is asked for */
+static void native_thread_current_thread(stack_frame_t *op_stack)
+{
+    thread_t *thread = current_thread;
+    if (!thread->object) {
+        object_t *obj = new_thread(find_native_class("java/lang/Thread"));
+        init_thread(obj, NULL, thread->name);
+        get_thread_field(obj, THREAD_HANDLE)->value.ptr_value = thread;
+        thread->object = obj;
+    }
+    push_ref(op_stack, thread->object);
+}
+
+static void native_thread_sleep(stack_frame_t *op_stack)
+{
+    int64_t millis = pop_int(op_stack);
+    if (millis < 0) {
+        raise_exception("java/lang/IllegalArgumentException",
+                        "timeout value is negative");
+        return;
+    }
+    if (can_park()) {
+        sleep_virtual(millis);
+        return;
+    }
+    struct timespec ts = {
+        .tv_sec = millis / 1000,
+        .tv_nsec = millis % 1000 * 1000000,
+    };
+    enter_blocking();
+    while (nanosleep(&ts, &ts))
+        ;
+    leave_blocking();
+}
+
+static void native_thread_yield(stack_frame_t *op_stack)
+{
+    (void) op_stack;
+    if (can_park())
+        yield_virtual();
+    else
+        sched_yield();
+}
+
+static void *new_task(const native_class_t *clazz)
+{
+    return create_object(NULL, 0, clazz);
+}
+
+static void native_task_init(stack_frame_t *op_stack)
+{
+    pop_receiver(op_stack);
+}
+
+static void native_task_fork(stack_frame_t *op_stack)
+{
+    object_t *task = pop_receiver(op_stack);
+    if (!task)
+        return;
+    fork_task(task);
+    push_ref(op_stack, task);
+}
+
+static void native_task_join(stack_frame_t *op_stack)
+{
+    object_t *task = pop_receiver(op_stack);
+    if (!task)
+        return;
+    object_t *result = join_task(task);
+    if (!pending_exception)
+        push_ref(op_stack, result);
+}
+
+static void native_task_invoke(stack_frame_t *op_stack)
+{
+    object_t *task = pop_receiver(op_stack);
+    if (!task)
+        return;
+    object_t *result = invoke_task(task);
+    if (!pending_exception)
+        push_ref(op_stack, result);
+}
+
+static void native_task_is_done(stack_frame_t *op_stack)
+{
+    object_t *task = pop_receiver(op_stack);
+    if (task)
+        push_int(op_stack, is_task_done(task));
+}
+
+/* ForkJoinTask.invokeAll(t1, t2) forks the second and runs the first */
+static void native_task_invoke_all(stack_frame_t *op_stack)
+{
+    object_t *second = pop_ref(op_stack);
+    object_t *first = pop_ref(op_stack);
+    if (!first || !second) {
+        raise_exception("java/lang/NullPointerException", NULL);
+        return;
+    }
+    fork_task(second);
+    invoke_task(first);
+    if (!pending_exception)
+        join_task(second);
+}
+
+/* The fields of the part of a java.util.concurrent.ForkJoinPool the VM
+ * implements */
+enum {
+    POOL_HANDLE, /* the pool_t */
+    POOL_FIELDS_COUNT,
+};
+
+/* ForkJoinPool.commonPool() refers to the common pool without a field */
+static object_t common_pool_object;
+
+static void *new_pool(const native_class_t *clazz)
+{
+    return create_object(NULL, 0, clazz);
+}
+
+static pool_t *get_pool(object_t *obj)
+{
+    if (obj == &common_pool_object)
+        return get_common_pool();
+    return get_native_part(obj)->value[POOL_HANDLE].value.ptr_value;
+}
+
+static void native_pool_init(stack_frame_t *op_stack)
+{
+    object_t *obj = pop_receiver(op_stack);
+    if (!obj)
+        return;
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    get_native_part(obj)->value[POOL_HANDLE].value.ptr_value =
+        create_pool(count > 0 ? count : 1);
+}
+
+static void native_pool_init_parallelism(stack_frame_t *op_stack)
+{
+    int32_t parallelism = pop_int(op_stack);
+    object_t *obj = pop_receiver(op_stack);
+    if (!obj)
+        return;
+    if (parallelism <= 0) {
+        raise_exception("java/lang/IllegalArgumentException", NULL);
+        return;
+    }
+    get_native_part(obj)->value[POOL_HANDLE].value.ptr_value =
+        create_pool(parallelism);
+}
+
+static void native_pool_common_pool(stack_frame_t *op_stack)
+{
+    push_ref(op_stack, &common_pool_object);
+}
+
+static void native_pool_invoke(stack_frame_t *op_stack)
+{
+    object_t *task = pop_ref(op_stack);
+    object_t *obj = pop_receiver(op_stack);
+    if (!obj)
+        return;
+    if (!task) {
+        raise_exception("java/lang/NullPointerException", NULL);
+        return;
+    }
+    object_t *result = invoke_in_pool(get_pool(obj), task);
+    if (!pending_exception)
+        push_ref(op_stack, result);
+}
+
+static void native_pool_get_parallelism(stack_frame_t *op_stack)
+{
+    object_t *obj = pop_receiver(op_stack);
+    if (obj)
+        push_int(op_stack, get_parallelism(get_pool(obj)));
+}
+
+/* Runtime.getRuntime(), the only Runtime, has no state of its own */
+static object_t runtime_object;
+
+static void native_runtime_get_runtime(stack_frame_t *op_stack)
+{
+    push_ref(op_stack, &runtime_object);
+}
+
+static void native_runtime_available_processors(stack_frame_t *op_stack)
+{
+    if (!pop_receiver(op_stack))
+        return;
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    push_int(op_stack, count > 0 ? count : 1);
+}
+
+/* The other threads are stopped first, so that nothing is printed after the
+ * output is flushed on exit */
+static void native_system_exit(stack_frame_t *op_stack)
+{
+    int32_t status = pop_int(op_stack);
+    stop_the_world();
+    exit(status);
+}
+
+static array_t *pop_array(stack_frame_t *op_stack)
+{
+    return pop_receiver(op_stack);
+}
+
+/* Pop the value of an array element, whatever its type, as its bits */
+static u8 pop_element(stack_frame_t *op_stack)
+{
+    if (top(op_stack).type == STACK_ENTRY_REF)
+        return (uintptr_t) pop_ref(op_stack);
+    return pop_int(op_stack);
+}
+
+static bool check_array_range(const array_t *arr, int32_t from, int32_t to)
+{
+    if (from > to) {
+        raise_exception("java/lang/IllegalArgumentException",
+                        "fromIndex(%" PRId32 ") > toIndex(%" PRId32 ")", from,
+                        to);
+        return false;
+    }
+    if (from < 0 || to > arr->length) {
+        raise_exception("java/lang/ArrayIndexOutOfBoundsException",
+                        "Range [%" PRId32 ", %" PRId32
+                        ") out of bounds for length %" PRId32,
+                        from, to, arr->length);
+        return false;
+    }
+    return true;
+}
+
+/* System.arraycopy(), which copies as if through a temporary array when the
+ * ranges overlap
+ */
+static void native_arraycopy(stack_frame_t *op_stack)
+{
+    int32_t length = pop_int(op_stack);
+    int32_t dst_pos = pop_int(op_stack);
+    array_t *dst = pop_array(op_stack);
+    int32_t src_pos = pop_int(op_stack);
+    array_t *src = pop_array(op_stack);
+    if (!dst || !src)
+        return;
+
+    if (src->type != dst->type) {
+        raise_exception("java/lang/ArrayStoreException",
+                        "arraycopy: type mismatch");
+        return;
+    }
+    if (length < 0 || src_pos < 0 || dst_pos < 0 ||
+        src_pos > src->length - length || dst_pos > dst->length - length) {
+        raise_exception("java/lang/ArrayIndexOutOfBoundsException",
+                        "arraycopy: range of length %" PRId32 " from %" PRId32
+                        " to %" PRId32 " out of bounds",
+                        length, src_pos, dst_pos);
+        return;
+    }
+
+    size_t size = src->element_size;
+    memmove((u1 *) dst->data + dst_pos * size,
+            (u1 *) src->data + src_pos * size, length * size);
+}
+
+/* Fill count elements of the given size with the value. The C library has
+ * vectorized memset() and memcpy(), so zeros and bytes are set directly and
+ * other values are copied from the part already filled, doubling it each
+ * time.
+ */
+static void fill_elements(u1 *dst, size_t size, int32_t count, u8 value)
+{
+    if (count <= 0)
+        return;
+    if (size == 1 || !value) {
+        memset(dst, (u1) value, count * size);
+        return;
+    }
+
+    u2 value16 = value;
+    u4 value32 = value;
+    switch (size) {
+    case sizeof(u2):
+        memcpy(dst, &value16, size);
+        break;
+    case sizeof(u4):
+        memcpy(dst, &value32, size);
+        break;
+    default:
+        memcpy(dst, &value, size);
+        break;
+    }
+    size_t filled = size, total = count * size;
+    while (filled < total) {
+        size_t chunk = filled < total - filled ? filled : total - filled;
+        memcpy(dst + filled, dst, chunk);
+        filled += chunk;
+    }
+}
+
+static void native_arrays_fill(stack_frame_t *op_stack)
+{
+    u8 value = pop_element(op_stack);
+    array_t *arr = pop_array(op_stack);
+    if (!arr)
+        return;
+    fill_elements((u1 *) arr->data, arr->element_size, arr->length, value);
+}
+
+static void native_arrays_fill_range(stack_frame_t *op_stack)
+{
+    u8 value = pop_element(op_stack);
+    int32_t to = pop_int(op_stack);
+    int32_t from = pop_int(op_stack);
+    array_t *arr = pop_array(op_stack);
+    if (!arr || !check_array_range(arr, from, to))
+        return;
+    fill_elements((u1 *) arr->data + from * arr->element_size,
+                  arr->element_size, to - from, value);
+}
+
+/* Arrays.copyOf(): truncate, or pad with zeros */
+static void native_arrays_copy_of(stack_frame_t *op_stack)
+{
+    int32_t length = pop_int(op_stack);
+    array_t *src = pop_array(op_stack);
+    if (!src)
+        return;
+    if (length < 0) {
+        raise_exception("java/lang/NegativeArraySizeException", "%" PRId32,
+                        length);
+        return;
+    }
+
+    array_t *dst = create_array(src->class, src->type, length);
+    int32_t count = length < src->length ? length : src->length;
+    memcpy(dst->data, src->data, count * src->element_size);
+    push_ref(op_stack, dst);
+}
+
+#define PRINT_STREAM "java/io/PrintStream"
+#define MATH "java/lang/Math"
+#define STRING "java/lang/String"
+#define BUILDER "java/lang/StringBuilder"
+#define SYSTEM "java/lang/System"
+#define ARRAYS "java/util/Arrays"
+#define THROWABLE "java/lang/Throwable"
+#define THREAD "java/lang/Thread"
+#define RUNTIME "java/lang/Runtime"
+#define TASK "java/util/concurrent/ForkJoinTask"
+#define POOL "java/util/concurrent/ForkJoinPool"
+#define OBJECT "Ljava/lang/Object;"
+
+/* Every exception has the single field of Throwable, its message */
+#define EXCEPTION_CLASS(name, super_name) \
+    {"java/lang/" name, "java/lang/" super_name, 1, new_throwable}
+
+static const native_class_t native_classes[] = {
+    {PRINT_STREAM, "java/lang/Object", 0, NULL},
+    {MATH, "java/lang/Object", 0, NULL},
+    {STRING, "java/lang/Object", 0, NULL},
+    {BUILDER, "java/lang/Object", 0, new_builder},
+    {SYSTEM, "java/lang/Object", 0, NULL},
+    {ARRAYS, "java/lang/Object", 0, NULL},
+    {THREAD, "java/lang/Object", THREAD_FIELDS_COUNT, new_thread},
+    {RUNTIME, "java/lang/Object", 0, NULL},
+    {TASK, "java/lang/Object", TASK_FIELDS_COUNT, NULL},
+    {"java/util/concurrent/RecursiveTask", TASK, TASK_FIELDS_COUNT, new_task},
+    {"java/util/concurrent/RecursiveAction", TASK, TASK_FIELDS_COUNT,
+     new_task},
+    {POOL, "java/lang/Object", POOL_FIELDS_COUNT, new_pool},
+    EXCEPTION_CLASS("Throwable", "Object"),
+    EXCEPTION_CLASS("Exception", "Throwable"),
+    EXCEPTION_CLASS("Error", "Throwable"),
+    EXCEPTION_CLASS("OutOfMemoryError", "Error"),
+    EXCEPTION_CLASS("RuntimeException", "Exception"),
+    EXCEPTION_CLASS("InterruptedException", "Exception"),
+    EXCEPTION_CLASS("ArithmeticException", "RuntimeException"),
+    EXCEPTION_CLASS("ArrayStoreException", "RuntimeException"),
+    EXCEPTION_CLASS("ClassCastException", "RuntimeException"),
+    EXCEPTION_CLASS("IllegalArgumentException", "RuntimeException"),
+    EXCEPTION_CLASS("IllegalMonitorStateException", "RuntimeException"),
+    EXCEPTION_CLASS("IllegalStateException", "RuntimeException"),
+    EXCEPTION_CLASS("IllegalThreadStateException",
+                    "IllegalArgumentException"),
+    EXCEPTION_CLASS("IndexOutOfBoundsException", "RuntimeException"),
+    EXCEPTION_CLASS("NegativeArraySizeException", "RuntimeException"),
+    EXCEPTION_CLASS("NullPointerException", "RuntimeException"),
+    EXCEPTION_CLASS("UnsupportedOperationException", "RuntimeException"),
+    EXCEPTION_CLASS("ArrayIndexOutOfBoundsException",
+                    "IndexOutOfBoundsException"),
+    EXCEPTION_CLASS("StringIndexOutOfBoundsException",
+                    "IndexOutOfBoundsException"),
+};
+
+static field_t native_fields[] = {
+    {SYSTEM, "out", "Ljava/io/PrintStream;", &system_out},
+};
+
+static const native_method_t native_methods[] = {
+    {"java/lang/Object", "<init>", "()V", native_object_init},
+    {"java/lang/Object", "wait", "()V", native_object_wait},
+    {"java/lang/Object", "wait", "(J)V", native_object_wait_millis},
+    {"java/lang/Object", "notify", "()V", native_object_notify},
+    {"java/lang/Object", "notifyAll", "()V", native_object_notify_all},
+    {PRINT_STREAM, "print", "(I)V", native_print_int},
+    {PRINT_STREAM, "print", "(J)V", native_print_int},
+    {PRINT_STREAM, "print", "(C)V", native_print_char},
+    {PRINT_STREAM, "print", "(Z)V", native_print_boolean},
+    {PRINT_STREAM, "print", "(Ljava/lang/String;)V", native_print_string},
+    {PRINT_STREAM, "print", "(Ljava/lang/Object;)V", native_print_object},
+    {PRINT_STREAM, "println", "()V", native_println},
+    {PRINT_STREAM, "println", "(I)V", native_println_int},
+    {PRINT_STREAM, "println", "(J)V", native_println_int},
+    {PRINT_STREAM, "println", "(C)V", native_println_char},
+    {PRINT_STREAM, "println", "(Z)V", native_println_boolean},
+    {PRINT_STREAM, "println", "(Ljava/lang/String;)V", native_println_string},
+    {PRINT_STREAM, "println", "(Ljava/lang/Object;)V",
+     native_println_object},
+    {SYSTEM, "currentTimeMillis", "()J", native_current_time_millis},
+    {SYSTEM, "arraycopy", "(" OBJECT "I" OBJECT "II)V", native_arraycopy},
+    {ARRAYS, "fill", "([ZZ)V", native_arrays_fill},
+    {ARRAYS, "fill", "([BB)V", native_arrays_fill},
+    {ARRAYS, "fill", "([CC)V", native_arrays_fill},
+    {ARRAYS, "fill", "([SS)V", native_arrays_fill},
+    {ARRAYS, "fill", "([II)V", native_arrays_fill},
+    {ARRAYS, "fill", "([JJ)V", native_arrays_fill},
+    {ARRAYS, "fill", "([" OBJECT OBJECT ")V", native_arrays_fill},
+    {ARRAYS, "fill", "([ZIIZ)V", native_arrays_fill_range},
+    {ARRAYS, "fill", "([BIIB)V", native_arrays_fill_range},
+    {ARRAYS, "fill", "([CIIC)V", native_arrays_fill_range},
+    {ARRAYS, "fill", "([SIIS)V", native_arrays_fill_range},
+    {ARRAYS, "fill", "([IIII)V", native_arrays_fill_range},
+    {ARRAYS, "fill", "([JIIJ)V", native_arrays_fill_range},
+    {ARRAYS, "fill", "([" OBJECT "II" OBJECT ")V", native_arrays_fill_range},
+    {ARRAYS, "copyOf", "([ZI)[Z", native_arrays_copy_of},
+    {ARRAYS, "copyOf", "([BI)[B", native_arrays_copy_of},
+    {ARRAYS, "copyOf", "([CI)[C", native_arrays_copy_of},
+    {ARRAYS, "copyOf", "([SI)[S", native_arrays_copy_of},
+    {ARRAYS, "copyOf", "([II)[I", native_arrays_copy_of},
+    {ARRAYS, "copyOf", "([JI)[J", native_arrays_copy_of},
+    {ARRAYS, "copyOf", "([" OBJECT "I)[" OBJECT, native_arrays_copy_of},
+    {SYSTEM, "nanoTime", "()J", native_nano_time},
+    {SYSTEM, "exit", "(I)V", native_system_exit},
+    {RUNTIME, "getRuntime", "()L" RUNTIME ";", native_runtime_get_runtime},
+    {RUNTIME, "availableProcessors", "()I",
+     native_runtime_available_processors},
+    {THREAD, "<init>", "()V", native_thread_init},
+    {THREAD, "<init>", "(Ljava/lang/Runnable;)V", native_thread_init_target},
+    {THREAD, "<init>", "(Ljava/lang/String;)V", native_thread_init_name},
+    {THREAD, "<init>", "(Ljava/lang/Runnable;Ljava/lang/String;)V",
+     native_thread_init_target_name},
+    {THREAD, "start", "()V", native_thread_start},
+    {THREAD, "startVirtualThread", "(Ljava/lang/Runnable;)L" THREAD ";",
+     native_thread_start_virtual},
+    {THREAD, "run", "()V", native_thread_run},
+    {THREAD, "join", "()V", native_thread_join},
+    {THREAD, "join", "(J)V", native_thread_join_millis},
+    {THREAD, "isAlive", "()Z", native_thread_is_alive},
+    {THREAD, "isVirtual", "()Z", native_thread_is_virtual},
+    {THREAD, "getName", "()Ljava/lang/String;", native_thread_get_name},
+    {THREAD, "currentThread", "()L" THREAD ";", native_thread_current_thread},
+    {THREAD, "sleep", "(J)V", native_thread_sleep},
+    {THREAD, "yield", "()V", native_thread_yield},
+    {TASK, "<init>", "()V", native_task_init},
+    {TASK, "fork", "()L" TASK ";", native_task_fork},
+    {TASK, "join", "()" OBJECT, native_task_join},
+    {TASK, "invoke", "()" OBJECT, native_task_invoke},
+    {TASK, "isDone", "()Z", native_task_is_done},
+    {TASK, "invokeAll", "(L" TASK ";L" TASK ";)V", native_task_invoke_all},
+    {POOL, "<init>", "()V", native_pool_init},
+    {POOL, "<init>", "(I)V", native_pool_init_parallelism},
+    {POOL, "commonPool", "()L" POOL ";", native_pool_common_pool},
+    {POOL, "invoke", "(L" TASK ";)" OBJECT, native_pool_invoke},
+    {POOL, "getParallelism", "()I", native_pool_get_parallelism},
+    {MATH, "max", "(II)I", native_math_max_int},
+    {MATH, "max", "(JJ)J", native_math_max_long},
+    {MATH, "min", "(II)I", native_math_min_int},
+    {MATH, "min", "(JJ)J", native_math_min_long},
+    {MATH, "abs", "(I)I", native_math_abs_int},
+    {MATH, "abs", "(J)J", native_math_abs_long},
+    {STRING, "length", "()I", native_string_length},
+    {STRING, "charAt", "(I)C", native_string_char_at},
+    {STRING, "equals", "(Ljava/lang/Object;)Z", native_string_equals},
+    {STRING, "hashCode", "()I", native_string_hash_code},
+    {STRING, "indexOf", "(I)I", native_string_index_of_char},
+    {STRING, "indexOf", "(II)I", native_string_index_of_char_from},
+    {STRING, "indexOf", "(Ljava/lang/String;)I", native_string_index_of},
+    {STRING, "indexOf", "(Ljava/lang/String;I)I", native_string_index_of_from},
+    {STRING, "compareTo", "(Ljava/lang/String;)I", native_string_compare_to},
+    {STRING, "toString", "()Ljava/lang/String;", native_string_to_string},
+    {BUILDER, "<init>", "()V", native_builder_init},
+    {BUILDER, "<init>", "(I)V", native_builder_init_capacity},
+    {BUILDER, "<init>", "(Ljava/lang/String;)V", native_builder_init_string},
+    {BUILDER, "append", "(Ljava/lang/String;)L" BUILDER ";",
+     native_builder_append_string},
+    {BUILDER, "append", "(I)L" BUILDER ";", native_builder_append_int},
+    {BUILDER, "append", "(J)L" BUILDER ";", native_builder_append_int},
+    {BUILDER, "append", "(C)L" BUILDER ";", native_builder_append_char},
+    {BUILDER, "append", "(Z)L" BUILDER ";", native_builder_append_boolean},
+    {BUILDER, "length", "()I", native_builder_length},
+    {BUILDER, "charAt", "(I)C", native_builder_char_at},
+    {BUILDER, "toString", "()Ljava/lang/String;", native_builder_to_string},
+    {THROWABLE, "<init>", "()V", native_throwable_init},
+    {THROWABLE, "<init>", "(Ljava/lang/String;)V",
+     native_throwable_init_message},
+    {THROWABLE, "getMessage", "()Ljava/lang/String;",
+     native_throwable_get_message},
+    {THROWABLE, "toString", TO_STRING, native_throwable_to_string},
+    {THROWABLE, "printStackTrace", "()V", native_throwable_print_stack_trace},
+};
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+/* open addressing table of the native methods */
+static const native_method_t *registry[NATIVE_BUCKETS];
+
+/* FNV-1a hash of the class, name and descriptor of a method */
+static uint32_t hash_method(const char *class_name,
+                            const char *name,
+                            const char *descriptor)
+{
+    const char *parts[] = {class_name, name, descriptor};
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < ARRAY_SIZE(parts); i++) {
+        for (const char *c = parts[i]; *c; c++)
+            hash = (hash ^ (u1) *c) * 16777619u;
+        /* separate the parts, so that moving a character across them
+         * changes the hash */
+        hash = (hash ^ '.') * 16777619u;
+    }
+    return hash;
+}
+
+/* Fill the registry. Must be called before any method is resolved. */
+void init_natives()
+{
+    assert(ARRAY_SIZE(native_methods) * 2 <= NATIVE_BUCKETS &&
+           "Too many native methods for the registry");
+    for (size_t i = 0; i < ARRAY_SIZE(native_methods); i++) {
+        const native_method_t *method = &native_methods[i];
+        uint32_t bucket = hash_method(method->class_name, method->name,
+                                      method->descriptor);
+        while (registry[bucket & (NATIVE_BUCKETS - 1)])
+            bucket++;
+        registry[bucket & (NATIVE_BUCKETS - 1)] = method;
+    }
+}
+
+/**
+ * Find a class the VM implements itself.
+ *
+ * @param class_name the binary name of the class
+ * @return the class, or NULL if it is loaded from a class file
+ */
+const native_class_t *find_native_class(const char *class_name)
+{
+    for (size_t i = 0; i < ARRAY_SIZE(native_classes); i++) {
+        if (!strcmp(native_classes[i].name, class_name))
+            return &native_classes[i];
+    }
+    return NULL;
+}
+
+/**
+ * Find the native implementation of a method, looking from the class up to
+ * its superclasses as long as the VM implements them.
+ *
+ * @param class_name the binary name of the class referenced by the call
+ * @param name the method name
+ * @param descriptor the method descriptor
+ * @return the native method, or NULL if the method has none
+ */
+const native_method_t *find_native_method(const char *class_name,
+                                          const char *name,
+                                          const char *descriptor)
+{
+    for (;;) {
+        uint32_t bucket = hash_method(class_name, name, descriptor);
+        const native_method_t *method;
+        for (; (method = registry[bucket & (NATIVE_BUCKETS - 1)]); bucket++) {
+            if (!strcmp(method->name, name) &&
+                !strcmp(method->descriptor, descriptor) &&
+                !strcmp(method->class_name, class_name))
+                return method;
+        }
+
+        /* exceptions inherit the methods of Throwable */
+        const native_class_t *clazz = find_native_class(class_name);
+        if (!clazz || !clazz->super_name)
+            return NULL;
+        class_name = clazz->super_name;
+    }
+}
+
+/**
+ * Find a static field of a class the VM implements.
+ *
+ * @param class_name the binary name of the class declaring the field
+ * @param name the field name
+ * @param descriptor the field descriptor
+ * @return the field, or NULL if it is not native
+ */
+field_t *find_native_field(const char *class_name,
+                           const char *name,
+                           const char *descriptor)
+{
+    for (size_t i = 0; i < ARRAY_SIZE(native_fields); i++) {
+        field_t *field = &native_fields[i];
+        if (!strcmp(field->name, name) &&
+            !strcmp(field->descriptor, descriptor) &&
+            !strcmp(field->class_name, class_name))
+            return field;
+    }
+    return NULL;
+}
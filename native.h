@@ -0,0 +1,39 @@
+#pragma once
+
+#include "classfile.h"
+#include "java-string.h"
+#include "stack.h"
+
+/* A native method pops the arguments of the call from the operand stack, the
+ * receiver included, and pushes the result if there is one.
+ */
+typedef void (*native_fn_t)(stack_frame_t *op_stack);
+
+typedef struct native_method {
+    const char *class_name;
+    const char *name;
+    const char *descriptor;
+    native_fn_t invoke;
+} native_method_t;
+
+/* A class the VM implements instead of loading it. Classes loaded from class
+ * files may extend it, in which case their objects have a part of
+ * fields_count fields for it, like for any other superclass.
+ */
+typedef struct native_class {
+    const char *name;
+    const char *super_name; /* NULL for java.lang.Object */
+    u2 fields_count;
+    /* allocate an instance, NULL if new is unsupported */
+    void *(*create)(const struct native_class *clazz);
+} native_class_t;
+
+void init_natives();
+const native_class_t *find_native_class(const char *class_name);
+const native_method_t *find_native_method(const char *class_name,
+                                          const char *name,
+                                          const char *descriptor);
+field_t *find_native_field(const char *class_name,
+                           const char *name,
+                           const char *descriptor);
+string_t *string_value_of(void *ref);
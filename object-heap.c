@@ -1,145 +1,332 @@
+/* Objects are never freed before the VM exits.
+ *
+ * Every thread allocates from a heap of its own, so allocating takes no lock.
+ * Small objects are bump allocated from the thread-local allocation buffer,
+ * an arena that grows by chunks of TLAB_SIZE bytes. Large ones are allocated
+ * apart, as they would waste most of a chunk. The heaps of the threads that
+ * ended are kept, since their objects live on, and all are freed on exit.
+ */
+
+#include <pthread.h>
+
+#include "alloc-profile.h"
+#include "native.h"
 #include "object-heap.h"
 
-/* FIXME: use dynamic structure to grow heap size dynamically */
-#define MAX_HEAP_SIZE 5000
+#define TLAB_SIZE (64 * 1024)
+#define LARGE_OBJECT_SIZE (TLAB_SIZE / 8)
+
+static __thread object_heap_t *thread_heap;
 
-static object_heap_t object_heap;
+/* every heap, guarded by the lock */
+static object_heap_t *heaps;
+static pthread_mutex_t heaps_lock = PTHREAD_MUTEX_INITIALIZER;
 
+/* Give the calling thread its heap. Must be called before it allocates. */
 void init_object_heap()
 {
-    /* max contain 5000 objects */
-    object_heap.objects = malloc(sizeof(object_t *) * MAX_HEAP_SIZE);
-    object_heap.length = 0;
+    object_heap_t *heap = calloc(1, sizeof(object_heap_t));
+    assert(heap && "Failed to allocate object heap");
+    init_arena(&heap->tlab, TLAB_SIZE);
+
+    pthread_mutex_lock(&heaps_lock);
+    heap->next = heaps;
+    heaps = heap;
+    pthread_mutex_unlock(&heaps_lock);
+    thread_heap = heap;
+}
+
+/* Append a pointer to a table of the heap, which grows as needed */
+static void add_to_table(void ***table,
+                         size_t *length,
+                         size_t *capacity,
+                         void *ptr)
+{
+    if (*length == *capacity) {
+        *capacity = *capacity ? *capacity * 2 : 64;
+        *table = realloc(*table, sizeof(void *) * *capacity);
+        assert(*table && "Failed to grow object heap");
+    }
+    (*table)[(*length)++] = ptr;
+}
+
+/**
+ * Allocate zeroed memory for an object in the heap of the current thread.
+ *
+ * @param size the size of the object in bytes
+ * @return the memory, which lives until the VM exits
+ */
+static void *heap_alloc(size_t size)
+{
+    object_heap_t *heap = thread_heap;
+    if (size <= LARGE_OBJECT_SIZE)
+        return arena_alloc(&heap->tlab, size);
+
+    void *ptr = calloc(1, size);
+    assert(ptr && "Failed to allocate object");
+    add_to_table(&heap->large, &heap->large_length, &heap->large_capacity,
+                 ptr);
+    return ptr;
+}
+
+/* The binary name of a class, which the allocation profiler counts by */
+static const char *get_binary_name(class_file_t *clazz)
+{
+    return find_class_name_from_index(clazz->info->this_class, clazz);
+}
+
+/* Allocate the part of an object holding the fields of one class, adding
+ * its size to the size of the object */
+static object_t *create_object_part(u2 fields_count,
+                                    object_t *parent,
+                                    size_t *size)
+{
+    *size += sizeof(object_t) + sizeof(variable_t) * fields_count;
+    object_t *part = heap_alloc(sizeof(object_t));
+    part->fields_count = fields_count;
+    part->value = heap_alloc(sizeof(variable_t) * fields_count);
+    part->parent = parent;
+    return part;
 }
 
 /**
  * Create an java object.
  *
- * @param clazz the list of classes that contains the created class and all its
- * parent classess
+ * @param classes the created class then its superclasses, or NULL for an
+ * instance of a class the VM implements
+ * @param count the number of classes
+ * @param native the class the VM implements that the classes extend, or NULL
+ * if they only extend java.lang.Object
  * @return the object that wanted to be created
  */
-object_t *create_object(class_file_t *clazz)
+object_t *create_object(class_file_t **classes,
+                        u2 count,
+                        const native_class_t *native)
 {
     object_t *new_obj = NULL, *parent = NULL;
-    class_file_t *pos;
-    list_for_each (pos, clazz) {
-        new_obj = malloc(sizeof(object_t));
-        new_obj->fields_count = pos->fields_count;
-        new_obj->value = calloc(sizeof(variable_t), new_obj->fields_count);
-        new_obj->parent = parent;
-        for (int i = 0; i < pos->fields_count; ++i) {
-            new_obj->value[i].type = VAR_NONE;
-        }
-        new_obj->class = pos;
+    size_t size = 0;
+    if (native) {
+        new_obj = create_object_part(native->fields_count, NULL, &size);
+        new_obj->native = native;
         parent = new_obj;
     }
-    /* only store object that really is needed in object heap */
-    object_heap.objects[object_heap.length++] = new_obj;
+    for (u2 i = count; i-- > 0;) {
+        new_obj = create_object_part(classes[i]->fields_count, parent, &size);
+        new_obj->class = classes[i];
+        parent = new_obj;
+    }
+    /* an instance of java.lang.Object itself, which has no fields */
+    if (!new_obj)
+        new_obj = create_object_part(0, NULL, &size);
 
+    if (profiling_allocations) {
+        const char *name = "java/lang/Object";
+        if (count)
+            name = get_binary_name(classes[0]);
+        else if (native)
+            name = native->name;
+        count_allocation(name, 0, 1, size);
+    }
     return new_obj;
 }
 
-char *create_string(class_file_t *clazz, char *src)
+/**
+ * Create a string object to be filled by the caller.
+ *
+ * @param coder how the characters are stored, see string_coder_t
+ * @param length number of characters of the string
+ * @return the string, whose characters are left to the caller
+ */
+string_t *alloc_string(u1 coder, int32_t length)
 {
-    size_t len = strlen(src);
-    char *dest = calloc((len + 1), sizeof(char));
-    strncpy(dest, src, len);
-
-    object_t *str_obj = malloc(sizeof(object_t));
-    str_obj->value = malloc(sizeof(variable_t));
-    str_obj->value->type = VAR_STR_PTR;
-    str_obj->value->value.ptr_value = dest;
-    str_obj->class = clazz;
-    str_obj->parent = NULL;
-    str_obj->fields_count = 1;
-
-    object_heap.objects[object_heap.length++] = str_obj;
-
-    return dest;
+    assert(length >= 0 && "Negative string length");
+    size_t size = get_string_size(coder, length);
+    string_t *str = heap_alloc(size);
+    str->kind = HEAP_STRING;
+    if (profiling_allocations)
+        count_allocation("java/lang/String", 0, 1, size);
+    str->length = length;
+    str->coder = coder;
+    return str;
 }
 
 /**
- * Build an array recursively.
+ * Create an empty StringBuilder.
  *
- * @param depth the current dfs depth
- * @param dimension number of dimension in the array
- * @param n_elements the array represents number of element in each dimension
- * @param type_size element size of the array
- * @return the array that wanted be created
+ * @return the builder, which allocates its characters on the first append
  */
-void **build_array(uint8_t depth,
-                   int dimension,
-                   int *n_elements,
-                   size_t type_size)
-{
-    void **arr;
-    if (depth == dimension - 1) {
-        arr = calloc(n_elements[depth], type_size);
-    } else {
-        arr = calloc(n_elements[depth], sizeof(void *));
-        for (int i = 0; i < n_elements[depth]; ++i) {
-            *(arr + i) =
-                build_array(depth + 1, dimension, n_elements, type_size);
-        }
+string_builder_t *create_string_builder()
+{
+    object_heap_t *heap = thread_heap;
+    string_builder_t *sb = heap_alloc(sizeof(string_builder_t));
+    sb->kind = HEAP_BUILDER;
+    add_to_table(&heap->builders, &heap->builders_length,
+                 &heap->builders_capacity, sb);
+    /* its characters are not counted, they are allocated apart */
+    if (profiling_allocations)
+        count_allocation("java/lang/StringBuilder", 0, 1,
+                         sizeof(string_builder_t));
+    return sb;
+}
+
+size_t get_array_element_size(u1 type)
+{
+    switch (type) {
+    case T_BOOLEN:
+    case T_BYTE:
+        return sizeof(int8_t);
+    case T_CHAR:
+    case T_SHORT:
+        return sizeof(int16_t);
+    case T_INT:
+        return sizeof(int32_t);
+    case T_LONG:
+        return sizeof(int64_t);
+    case T_FLOAT:
+        return sizeof(float);
+    case T_DOUBLE:
+        return sizeof(double);
+    case T_REFERENCE:
+        return sizeof(void *);
+    default:
+        fprintf(stderr, "Unknown array type %d\n", type);
+        exit(1);
     }
-    return arr;
+}
+
+/* The binary name of the innermost elements of an array, which the
+ * allocation profiler counts by */
+static const char *get_element_name(class_file_t *clazz, u1 type)
+{
+    static const char *names[] = {
+        [T_BOOLEN] = "boolean",
+        [T_CHAR] = "char",
+        [T_FLOAT] = "float",
+        [T_DOUBLE] = "double",
+        [T_BYTE] = "byte",
+        [T_SHORT] = "short",
+        [T_INT] = "int",
+        [T_LONG] = "long",
+        /* or a class the VM implements, or an array */
+        [T_REFERENCE] = "java/lang/Object",
+    };
+    return clazz ? get_binary_name(clazz) : names[type];
+}
+
+/* Size of an array with the given element count, rounded up so that the
+ * header of an array placed right after it stays aligned.
+ */
+static size_t array_size(size_t element_size, int32_t length)
+{
+    size_t size = sizeof(array_t) + element_size * length;
+    return (size + sizeof(u8) - 1) & ~(sizeof(u8) - 1);
+}
+
+static void init_array(array_t *arr,
+                       class_file_t *clazz,
+                       u1 type,
+                       size_t element_size,
+                       int32_t length)
+{
+    arr->kind = HEAP_ARRAY;
+    arr->class = clazz;
+    arr->type = type;
+    arr->element_size = element_size;
+    arr->length = length;
 }
 
 /**
- * Free the array recursively.
+ * Create a one-dimensional array object.
  *
- * @param obj the object that contains the array
- * @param depth the current dfs depth
- * @param dimension number of dimension in the array
- * @return arr the array that will be freed
+ * @param clazz class of the element in the array, but only meaningful when
+ * types are not primitive types
+ * @param type element type of the array, see array_type_t
+ * @param length number of elements in the array
+ * @return the array that wanted be created, with all elements zeroed
  */
-void free_array(object_t *obj, uint8_t depth, int dimension, void **arr)
+array_t *create_array(class_file_t *clazz, u1 type, int32_t length)
 {
-    if (depth != dimension - 1) {
-        for (int i = 0; i < ((int *) (obj->value[1].value.ptr_value))[depth];
-             ++i) {
-            free_array(obj, depth + 1, dimension, *(arr + i));
-        }
-    }
-    free(arr);
+    assert(length >= 0 && "Negative array size");
+    size_t element_size = get_array_element_size(type);
+    size_t size = array_size(element_size, length);
+    array_t *arr = heap_alloc(size);
+    if (profiling_allocations)
+        count_allocation(get_element_name(clazz, type), 1, 1, size);
+    init_array(arr, clazz, type, element_size, length);
+    return arr;
 }
 
 /**
- * Create an array object.
+ * Create a multidimensional array object in a single allocation.
  *
- * @param clazz class of the element in the array, but only meaningful when
+ * The arrays of each dimension are laid out one after another in the block,
+ * dimension by dimension, so the rows of a matrix are adjacent in memory.
+ * Every dimension but the innermost one is an array of references to the
+ * arrays of the next dimension, and every row is a standalone array object.
+ * Only the outermost array owns the block.
+ *
+ * @param clazz class of the innermost elements, but only meaningful when
  * types are not primitive types
+ * @param type element type of the innermost dimension
  * @param dimension number of dimension in the array
- * @param n_elements the array represents number of element in each dimension
- * @param type_size element size of the array
+ * @param lengths the array represents number of element in each dimension
  * @return the array that wanted be created
  */
-void *create_array(class_file_t *clazz,
-                   uint8_t dimension,
-                   int *n_elements,
-                   size_t type_size)
-{
-    void *arr = build_array(0, dimension, n_elements, type_size);
-    object_t *arr_obj = malloc(sizeof(object_t));
-    arr_obj->value = malloc(sizeof(variable_t) * 3);
-    /* element 0: array memory
-     * element 1: number of elements in each dimension
-     * element 2: total dimensions in the array
-     */
-    arr_obj->value[0].type = VAR_ARRAY_PTR;
-    arr_obj->value[0].value.ptr_value = arr;
-    arr_obj->value[1].type = VAR_PTR;
-    arr_obj->value[1].value.ptr_value = n_elements;
-    arr_obj->value[2].type = VAR_BYTE;
-    arr_obj->value[2].value.char_value = dimension;
-    arr_obj->class = clazz;
-    arr_obj->parent = NULL;
-    arr_obj->fields_count = 1;
-
-    object_heap.objects[object_heap.length++] = arr_obj;
-
-    return (void *) arr;
+array_t *create_multi_array(class_file_t *clazz,
+                            u1 type,
+                            uint8_t dimension,
+                            int32_t *lengths)
+{
+    size_t element_size = get_array_element_size(type);
+
+    /* count the arrays in each dimension and the size of the whole block */
+    size_t counts[dimension], strides[dimension], total = 0;
+    for (uint8_t i = 0; i < dimension; ++i) {
+        assert(lengths[i] >= 0 && "Negative array size");
+        counts[i] = i ? counts[i - 1] * lengths[i - 1] : 1;
+        strides[i] = array_size(
+            i == dimension - 1 ? element_size : sizeof(void *), lengths[i]);
+        assert((!counts[i] || strides[i] <= (SIZE_MAX - total) / counts[i]) &&
+               "Array is too large");
+        total += counts[i] * strides[i];
+    }
+
+    u1 *block = heap_alloc(total);
+    if (profiling_allocations) {
+        for (uint8_t i = 0; i < dimension && counts[i]; ++i)
+            count_allocation(get_element_name(clazz, type), dimension - i,
+                             counts[i], counts[i] * strides[i]);
+    }
+
+    /* lay out the arrays of each dimension and link them to their parents */
+    u1 *level = block, *parent_level = NULL;
+    for (uint8_t i = 0; i < dimension; ++i) {
+        bool innermost = i == dimension - 1;
+        for (size_t j = 0; j < counts[i]; ++j) {
+            array_t *arr = (array_t *) (level + j * strides[i]);
+            init_array(arr, clazz, innermost ? type : T_REFERENCE,
+                       innermost ? element_size : sizeof(void *), lengths[i]);
+            if (parent_level) {
+                array_t *parent = (array_t *) (parent_level +
+                                               j / lengths[i - 1] *
+                                                   strides[i - 1]);
+                ((array_t **) parent->data)[j % lengths[i - 1]] = arr;
+            }
+        }
+        parent_level = level;
+        level += counts[i] * strides[i];
+    }
+
+    return (array_t *) block;
+}
+
+/* The part of an object holding the fields of the class the VM implements
+ * that its class extends, such as java.lang.Throwable */
+object_t *get_native_part(object_t *obj)
+{
+    while (!obj->native)
+        obj = obj->parent;
+    return obj;
 }
 
 variable_t *find_field_addr(object_t *obj, char *name)
@@ -153,24 +340,20 @@ variable_t *find_field_addr(object_t *obj, char *name)
     return NULL;
 }
 
+/* Free the heaps of all the threads, which must have ended */
 void free_object_heap()
 {
-    for (int i = 0; i < object_heap.length; ++i) {
-        /* free object and all its parent */
-        for (object_t *cur = object_heap.objects[i], *next; cur; cur = next) {
-            next = cur->parent;
-            if (cur->value) {
-                if (cur->value->type == VAR_STR_PTR) {
-                    free(cur->value->value.ptr_value);
-                } else if (cur->value->type == VAR_ARRAY_PTR) {
-                    free_array(cur, 0, cur->value[2].value.char_value,
-                               cur->value[0].value.ptr_value);
-                    free(cur->value[1].value.ptr_value);
-                }
-            }
-            free(cur->value);
-            free(cur);
-        }
+    while (heaps) {
+        object_heap_t *next = heaps->next;
+        for (size_t i = 0; i < heaps->builders_length; ++i)
+            free(((string_builder_t *) heaps->builders[i])->value);
+        free(heaps->builders);
+        for (size_t i = 0; i < heaps->large_length; ++i)
+            free(heaps->large[i]);
+        free(heaps->large);
+        free_arena(&heaps->tlab);
+        free(heaps);
+        heaps = next;
     }
-    free(object_heap.objects);
-}
\ No newline at end of file
+    thread_heap = NULL;
+}
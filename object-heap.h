@@ -2,32 +2,57 @@
 
 #include <string.h>
 
+#include "arena.h"
 #include "classfile.h"
-#include "list.h"
+#include "java-string.h"
+#include "string-builder.h"
 
 typedef struct object {
+    lock_word_t lock;
+    u1 kind; /* HEAP_OBJECT */
+    u2 fields_count;
     variable_t *value;
-    class_file_t *class;
-    size_t fields_count;
+    class_file_t *class; /* NULL for the part of a class the VM implements */
+    const struct native_class *native; /* set only on that part */
     struct object *parent;
 } object_t;
 
+/* Java array. The elements immediately follow the header, so an array is a
+ * single allocation and array references point at the header.
+ */
 typedef struct {
-    u2 length;
-    object_t **objects;
+    lock_word_t lock;
+    u1 kind;             /* HEAP_ARRAY */
+    u1 type;             /* element type, see array_type_t */
+    u1 element_size;
+    int32_t length;
+    class_file_t *class; /* class of the innermost elements, NULL for
+                          * primitive types */
+    u8 data[];
+} array_t;
+
+/* The objects allocated by a thread. See object-heap.c. */
+typedef struct object_heap {
+    arena_t tlab; /* the thread-local allocation buffer */
+    size_t large_length, large_capacity;
+    void **large; /* allocated apart from the buffer */
+    size_t builders_length, builders_capacity;
+    void **builders; /* string_builder_t, whose characters are apart */
+    struct object_heap *next;
 } object_heap_t;
 
 void init_object_heap();
 void free_object_heap();
-object_t *create_object(class_file_t *clazz);
-char *create_string(class_file_t *clazz, char *src);
-void **build_array(uint8_t depth,
-                   int dimension,
-                   int *n_elements,
-                   size_t type_size);
-void free_array(object_t *obj, uint8_t depth, int dimension, void **arr);
-void *create_array(class_file_t *clazz,
-                   uint8_t dimension,
-                   int *dimensions,
-                   size_t type_size);
+object_t *create_object(class_file_t **classes,
+                        u2 count,
+                        const struct native_class *native);
+string_t *alloc_string(u1 coder, int32_t length);
+string_builder_t *create_string_builder();
+size_t get_array_element_size(u1 type);
+array_t *create_array(class_file_t *clazz, u1 type, int32_t length);
+array_t *create_multi_array(class_file_t *clazz,
+                            u1 type,
+                            uint8_t dimension,
+                            int32_t *lengths);
+object_t *get_native_part(object_t *obj);
 variable_t *find_field_addr(object_t *obj, char *name);
\ No newline at end of file
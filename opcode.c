@@ -0,0 +1,55 @@
+#include "opcode.h"
+
+/* Length in bytes of every fixed-size instruction, including the opcode.
+ * Zero marks variable-length instructions (tableswitch, lookupswitch and
+ * wide) and undefined opcodes. The quickened opcodes 0xcb to 0xd6 are one
+ * byte long like the instructions they replace.
+ */
+static const u1 instruction_lengths[256] = {
+    /* 0x00 */ 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    /* 0x10 */ 2, 3, 2, 3, 3, 2, 2, 2, 2, 2, 1, 1, 1, 1, 1, 1,
+    /* 0x20 */ 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    /* 0x30 */ 1, 1, 1, 1, 1, 1, 2, 2, 2, 2, 2, 1, 1, 1, 1, 1,
+    /* 0x40 */ 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    /* 0x50 */ 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    /* 0x60 */ 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    /* 0x70 */ 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    /* 0x80 */ 1, 1, 1, 1, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    /* 0x90 */ 1, 1, 1, 1, 1, 1, 1, 1, 1, 3, 3, 3, 3, 3, 3, 3,
+    /* 0xa0 */ 3, 3, 3, 3, 3, 3, 3, 3, 3, 2, 0, 0, 1, 1, 1, 1,
+    /* 0xb0 */ 1, 1, 3, 3, 3, 3, 3, 3, 3, 5, 5, 3, 2, 3, 1, 1,
+    /* 0xc0 */ 3, 3, 1, 1, 0, 4, 3, 3, 5, 5, 0, 1, 1, 1, 1, 1,
+    /* 0xd0 */ 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    /* 0xe0 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    /* 0xf0 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+};
+
+/**
+ * Get the length of the instruction at the given position.
+ *
+ * @param code the bytecode of a method
+ * @param pc offset of the instruction in the bytecode
+ * @return the length of the instruction in bytes, or 0 if the opcode is
+ * undefined
+ */
+uint32_t get_instruction_length(const u1 *code, uint32_t pc)
+{
+    switch (code[pc]) {
+    case i_tableswitch: {
+        /* operands are aligned to four bytes from the start of the code */
+        uint32_t operands = (pc + 4) & ~3U;
+        int32_t low = read_s4(code, operands + 4);
+        int32_t high = read_s4(code, operands + 8);
+        return operands - pc + 12 + 4 * (uint32_t) (high - low + 1);
+    }
+    case i_lookupswitch: {
+        uint32_t operands = (pc + 4) & ~3U;
+        int32_t npairs = read_s4(code, operands + 4);
+        return operands - pc + 8 + 8 * (uint32_t) npairs;
+    }
+    case i_wide:
+        return code[pc + 1] == i_iinc ? 6 : 4;
+    default:
+        return instruction_lengths[code[pc]];
+    }
+}
@@ -0,0 +1,156 @@
+#pragma once
+
+#include "type.h"
+
+typedef enum {
+    i_iconst_m1 = 0x2,
+    i_iconst_0 = 0x3,
+    i_iconst_1 = 0x4,
+    i_iconst_2 = 0x5,
+    i_iconst_3 = 0x6,
+    i_iconst_4 = 0x7,
+    i_iconst_5 = 0x8,
+    i_lconst_0 = 0x9,
+    i_lconst_1 = 0xa,
+    i_bipush = 0x10,
+    i_sipush = 0x11,
+    i_ldc = 0x12,
+    i_ldc2_w = 0x14,
+    i_iload = 0x15,
+    i_lload = 0x16,
+    i_fload = 0x17,
+    i_dload = 0x18,
+    i_aload = 0x19,
+    i_iload_0 = 0x1a,
+    i_iload_1 = 0x1b,
+    i_iload_2 = 0x1c,
+    i_iload_3 = 0x1d,
+    i_lload_0 = 0x1e,
+    i_lload_1 = 0x1f,
+    i_lload_2 = 0x20,
+    i_lload_3 = 0x21,
+    i_aload_0 = 0x2a,
+    i_aload_1 = 0x2b,
+    i_aload_2 = 0x2c,
+    i_aload_3 = 0x2d,
+    i_iaload = 0x2e,
+    i_laload = 0x2f,
+    i_aaload = 0x32,
+    i_baload = 0x33,
+    i_caload = 0x34,
+    i_saload = 0x35,
+    i_istore = 0x36,
+    i_lstore = 0x37,
+    i_fstore = 0x38,
+    i_dstore = 0x39,
+    i_astore = 0x3a,
+    i_istore_0 = 0x3b,
+    i_istore_1 = 0x3c,
+    i_istore_2 = 0x3d,
+    i_istore_3 = 0x3e,
+    i_lstore_0 = 0x3f,
+    i_lstore_1 = 0x40,
+    i_lstore_2 = 0x41,
+    i_lstore_3 = 0x42,
+    i_astore_0 = 0x4b,
+    i_astore_1 = 0x4c,
+    i_astore_2 = 0x4d,
+    i_astore_3 = 0x4e,
+    i_iastore = 0x4f,
+    i_lastore = 0x50,
+    i_aastore = 0x53,
+    i_bastore = 0x54,
+    i_castore = 0x55,
+    i_sastore = 0x56,
+    i_pop = 0x57,
+    i_dup = 0x59,
+    i_iadd = 0x60,
+    i_ladd = 0x61,
+    i_isub = 0x64,
+    i_lsub = 0x65,
+    i_imul = 0x68,
+    i_lmul = 0x69,
+    i_idiv = 0x6c,
+    i_ldiv = 0x6d,
+    i_irem = 0x70,
+    i_lrem = 0x71,
+    i_ineg = 0x74,
+    i_iinc = 0x84,
+    i_i2l = 0x85,
+    i_l2i = 0x88,
+    i_lcmp = 0x94,
+    i_ifeq = 0x99,
+    i_ifne = 0x9a,
+    i_iflt = 0x9b,
+    i_ifge = 0x9c,
+    i_ifgt = 0x9d,
+    i_ifle = 0x9e,
+    i_if_icmpeq = 0x9f,
+    i_if_icmpne = 0xa0,
+    i_if_icmplt = 0xa1,
+    i_if_icmpge = 0xa2,
+    i_if_icmpgt = 0xa3,
+    i_if_icmple = 0xa4,
+    i_if_acmpeq = 0xa5,
+    i_if_acmpne = 0xa6,
+    i_goto = 0xa7,
+    i_jsr = 0xa8,
+    i_tableswitch = 0xaa,
+    i_lookupswitch = 0xab,
+    i_ireturn = 0xac,
+    i_lreturn = 0xad,
+    i_areturn = 0xb0,
+    i_return = 0xb1,
+    i_getstatic = 0xb2,
+    i_putstatic = 0xb3,
+    i_getfield = 0xb4,
+    i_putfield = 0xb5,
+    i_invokevirtual = 0xb6,
+    i_invokespecial = 0xb7,
+    i_invokestatic = 0xb8,
+    i_invokedynamic = 0xba,
+    i_new = 0xbb,
+    i_newarray = 0xbc,
+    i_anewarray = 0xbd,
+    i_arraylength = 0xbe,
+    i_athrow = 0xbf,
+    i_monitorenter = 0xc2,
+    i_monitorexit = 0xc3,
+    i_wide = 0xc4,
+    i_multianewarray = 0xc5,
+    i_ifnull = 0xc6,
+    i_ifnonnull = 0xc7,
+    i_goto_w = 0xc8,
+    i_jsr_w = 0xc9,
+
+    /* Quickened forms of the array instructions, rewritten in place by
+     * eliminate_bounds_checks() once the index is proven in bounds. The JVM
+     * specification leaves these opcodes unused.
+     */
+    i_iaload_unchecked = 0xcb,
+    i_laload_unchecked = 0xcc,
+    i_aaload_unchecked = 0xcd,
+    i_baload_unchecked = 0xce,
+    i_caload_unchecked = 0xcf,
+    i_saload_unchecked = 0xd0,
+    i_iastore_unchecked = 0xd1,
+    i_lastore_unchecked = 0xd2,
+    i_aastore_unchecked = 0xd3,
+    i_bastore_unchecked = 0xd4,
+    i_castore_unchecked = 0xd5,
+    i_sastore_unchecked = 0xd6,
+} jvm_opcode_t;
+
+/* Read the big-endian operands of an instruction */
+static inline int16_t read_s2(const u1 *code, uint32_t pc)
+{
+    return (int16_t) (code[pc] << 8 | code[pc + 1]);
+}
+
+static inline int32_t read_s4(const u1 *code, uint32_t pc)
+{
+    return (int32_t) ((u4) code[pc] << 24 | (u4) code[pc + 1] << 16 |
+                      (u4) code[pc + 2] << 8 | code[pc + 3]);
+}
+
+uint32_t get_instruction_length(const u1 *code, uint32_t pc);
@@ -0,0 +1,202 @@
+/* Output of System.out.
+ *
+ * Everything the program prints is gathered in one buffer, written to the
+ * standard output with write(2) when it is full and when the VM exits. A
+ * terminal gets every complete line as soon as it is printed instead.
+ *
+ * Threads printing hold the output lock, for as long as the line or value
+ * they print, so that what they print does not mix.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "output.h"
+
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
+
+static char output_buffer[OUTPUT_BUFFER_SIZE];
+static size_t output_length;
+static bool line_buffered;
+static pthread_mutex_t output_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread int output_lock_depth; /* the lock may be taken again */
+
+void lock_output()
+{
+    if (!output_lock_depth++)
+        pthread_mutex_lock(&output_lock);
+}
+
+void unlock_output()
+{
+    if (!--output_lock_depth)
+        pthread_mutex_unlock(&output_lock);
+}
+
+static void write_all(const char *data, size_t length)
+{
+    while (length) {
+        ssize_t written = write(STDOUT_FILENO, data, length);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            /* like java, carry on when the output is gone */
+            return;
+        }
+        data += written;
+        length -= written;
+    }
+}
+
+void flush_output()
+{
+    write_all(output_buffer, output_length);
+    output_length = 0;
+}
+
+void init_output()
+{
+    line_buffered = isatty(STDOUT_FILENO);
+    /* also covers the runtime errors which exit the VM */
+    atexit(flush_output);
+}
+
+void output_bytes(const char *data, size_t length)
+{
+    if (length > OUTPUT_BUFFER_SIZE - output_length) {
+        flush_output();
+        /* too large to be worth copying */
+        if (length > OUTPUT_BUFFER_SIZE) {
+            write_all(data, length);
+            return;
+        }
+    }
+    memcpy(output_buffer + output_length, data, length);
+    output_length += length;
+    if (line_buffered && memchr(data, '\n', length))
+        flush_output();
+}
+
+void output_string(const char *str)
+{
+    output_bytes(str, strlen(str));
+}
+
+void output_char(char c)
+{
+    if (output_length == OUTPUT_BUFFER_SIZE)
+        flush_output();
+    output_buffer[output_length++] = c;
+    if (line_buffered && c == '\n')
+        flush_output();
+}
+
+/* Encode a code point in UTF-8, returning the number of bytes */
+static size_t encode_utf8(uint32_t c, char *buf)
+{
+    if (c < 0x80) {
+        buf[0] = c;
+        return 1;
+    }
+    if (c < 0x800) {
+        buf[0] = 0xc0 | c >> 6;
+        buf[1] = 0x80 | (c & 0x3f);
+        return 2;
+    }
+    if (c < 0x10000) {
+        buf[0] = 0xe0 | c >> 12;
+        buf[1] = 0x80 | (c >> 6 & 0x3f);
+        buf[2] = 0x80 | (c & 0x3f);
+        return 3;
+    }
+    buf[0] = 0xf0 | c >> 18;
+    buf[1] = 0x80 | (c >> 12 & 0x3f);
+    buf[2] = 0x80 | (c >> 6 & 0x3f);
+    buf[3] = 0x80 | (c & 0x3f);
+    return 4;
+}
+
+void output_char16(u2 c)
+{
+    char buf[4];
+    output_bytes(buf, encode_utf8(c, buf));
+}
+
+/* Read the code point at *index and move past it. Surrogate pairs are joined
+ * into the code point they stand for.
+ */
+static uint32_t next_code_point(const string_t *str, int32_t *index)
+{
+    uint32_t c = string_char_at(str, (*index)++);
+    if (c >= 0xd800 && c < 0xdc00 && *index < str->length) {
+        uint32_t low = string_char_at(str, *index);
+        if (low >= 0xdc00 && low < 0xe000) {
+            c = 0x10000 + ((c - 0xd800) << 10) + (low - 0xdc00);
+            (*index)++;
+        }
+    }
+    return c;
+}
+
+/* Print a string object in UTF-8 */
+void output_java_string(const string_t *str)
+{
+    int32_t i = 0;
+    if (str->coder == STRING_LATIN1) {
+        /* print the ASCII prefix, usually the whole string, at once */
+        while (i < str->length && str->value[i] < 0x80)
+            i++;
+        output_bytes((const char *) str->value, i);
+    }
+
+    char buf[4];
+    while (i < str->length)
+        output_bytes(buf, encode_utf8(next_code_point(str, &i), buf));
+}
+
+/* Write a string object in UTF-8 to a stream other than System.out, such as
+ * the standard error for runtime errors
+ */
+void print_java_string(FILE *stream, const string_t *str)
+{
+    char buf[4];
+    for (int32_t i = 0; i < str->length;)
+        fwrite(buf, 1, encode_utf8(next_code_point(str, &i), buf), stream);
+}
+
+/**
+ * Write an integer in decimal.
+ *
+ * @param value the integer
+ * @param buf the buffer receiving the digits, of at least INT_STRING_SIZE
+ * bytes. It is not NUL-terminated.
+ * @return number of characters written
+ */
+size_t format_int(int64_t value, char *buf)
+{
+    /* negate in unsigned arithmetic, which also holds INT64_MIN */
+    uint64_t magnitude = value < 0 ? -(uint64_t) value : (uint64_t) value;
+    char digits[INT_STRING_SIZE];
+    char *start = digits + sizeof(digits);
+    do {
+        *--start = '0' + magnitude % 10;
+        magnitude /= 10;
+    } while (magnitude);
+    if (value < 0)
+        *--start = '-';
+
+    size_t length = digits + sizeof(digits) - start;
+    memcpy(buf, start, length);
+    return length;
+}
+
+void output_int(int64_t value)
+{
+    if (OUTPUT_BUFFER_SIZE - output_length < INT_STRING_SIZE)
+        flush_output();
+    output_length += format_int(value, output_buffer + output_length);
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "java-string.h"
+
+/* 20 digits and a sign are enough for any 64-bit integer */
+#define INT_STRING_SIZE 21
+
+void init_output();
+void lock_output();
+void unlock_output();
+void flush_output();
+void output_bytes(const char *data, size_t length);
+void output_string(const char *str);
+void output_char(char c);
+void output_char16(u2 c);
+void output_java_string(const string_t *str);
+void print_java_string(FILE *stream, const string_t *str);
+void output_int(int64_t value);
+size_t format_int(int64_t value, char *buf);
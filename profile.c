@@ -0,0 +1,439 @@
+/* The execution profiler of --prof.
+ *
+ * Built with make PROFILE=1 only: the other builds have neither the counting
+ * in the interpreter loop nor the timing around each call. Every thread
+ * counts the instructions it executes by opcode, and the calls, self time
+ * and total time of every method it runs, in counters of its own which the
+ * report adds up on exit. Times are wall-clock, measured with the monotonic
+ * clock around execute(): the time a method waits counts, the time spent in
+ * the methods it calls counts as theirs. The total time of a method only
+ * counts its outermost call on the stack, so that recursion does not count
+ * the same time twice.
+ *
+ * The frames of a thread are linked from its thread_t, rather than from a
+ * thread-local variable, as a virtual thread may resume on another carrier.
+ */
+
+#ifdef PROFILE
+
+#include <assert.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "opcode.h"
+#include "output.h"
+#include "profile.h"
+#include "thread.h"
+
+#define TOP_METHODS 30 /* printed in the report, the JSON has them all */
+
+bool profiling;
+__thread profile_t *current_profile;
+
+/* Guards the methods by id and the list of the profiles */
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct {
+    method_t *method;
+    class_file_t *clazz;
+} *methods;
+static u4 methods_count, methods_capacity;
+static profile_t *profiles;
+
+static const char *opcode_names[256] = {
+    [i_iconst_m1] = "iconst_m1",
+    [i_iconst_0] = "iconst_0",
+    [i_iconst_1] = "iconst_1",
+    [i_iconst_2] = "iconst_2",
+    [i_iconst_3] = "iconst_3",
+    [i_iconst_4] = "iconst_4",
+    [i_iconst_5] = "iconst_5",
+    [i_lconst_0] = "lconst_0",
+    [i_lconst_1] = "lconst_1",
+    [i_bipush] = "bipush",
+    [i_sipush] = "sipush",
+    [i_ldc] = "ldc",
+    [i_ldc2_w] = "ldc2_w",
+    [i_iload] = "iload",
+    [i_lload] = "lload",
+    [i_fload] = "fload",
+    [i_dload] = "dload",
+    [i_aload] = "aload",
+    [i_iload_0] = "iload_0",
+    [i_iload_1] = "iload_1",
+    [i_iload_2] = "iload_2",
+    [i_iload_3] = "iload_3",
+    [i_lload_0] = "lload_0",
+    [i_lload_1] = "lload_1",
+    [i_lload_2] = "lload_2",
+    [i_lload_3] = "lload_3",
+    [i_aload_0] = "aload_0",
+    [i_aload_1] = "aload_1",
+    [i_aload_2] = "aload_2",
+    [i_aload_3] = "aload_3",
+    [i_iaload] = "iaload",
+    [i_laload] = "laload",
+    [i_aaload] = "aaload",
+    [i_baload] = "baload",
+    [i_caload] = "caload",
+    [i_saload] = "saload",
+    [i_istore] = "istore",
+    [i_lstore] = "lstore",
+    [i_fstore] = "fstore",
+    [i_dstore] = "dstore",
+    [i_astore] = "astore",
+    [i_istore_0] = "istore_0",
+    [i_istore_1] = "istore_1",
+    [i_istore_2] = "istore_2",
+    [i_istore_3] = "istore_3",
+    [i_lstore_0] = "lstore_0",
+    [i_lstore_1] = "lstore_1",
+    [i_lstore_2] = "lstore_2",
+    [i_lstore_3] = "lstore_3",
+    [i_astore_0] = "astore_0",
+    [i_astore_1] = "astore_1",
+    [i_astore_2] = "astore_2",
+    [i_astore_3] = "astore_3",
+    [i_iastore] = "iastore",
+    [i_lastore] = "lastore",
+    [i_aastore] = "aastore",
+    [i_bastore] = "bastore",
+    [i_castore] = "castore",
+    [i_sastore] = "sastore",
+    [i_pop] = "pop",
+    [i_dup] = "dup",
+    [i_iadd] = "iadd",
+    [i_ladd] = "ladd",
+    [i_isub] = "isub",
+    [i_lsub] = "lsub",
+    [i_imul] = "imul",
+    [i_lmul] = "lmul",
+    [i_idiv] = "idiv",
+    [i_ldiv] = "ldiv",
+    [i_irem] = "irem",
+    [i_lrem] = "lrem",
+    [i_ineg] = "ineg",
+    [i_iinc] = "iinc",
+    [i_i2l] = "i2l",
+    [i_l2i] = "l2i",
+    [i_lcmp] = "lcmp",
+    [i_ifeq] = "ifeq",
+    [i_ifne] = "ifne",
+    [i_iflt] = "iflt",
+    [i_ifge] = "ifge",
+    [i_ifgt] = "ifgt",
+    [i_ifle] = "ifle",
+    [i_if_icmpeq] = "if_icmpeq",
+    [i_if_icmpne] = "if_icmpne",
+    [i_if_icmplt] = "if_icmplt",
+    [i_if_icmpge] = "if_icmpge",
+    [i_if_icmpgt] = "if_icmpgt",
+    [i_if_icmple] = "if_icmple",
+    [i_if_acmpeq] = "if_acmpeq",
+    [i_if_acmpne] = "if_acmpne",
+    [i_goto] = "goto",
+    [i_jsr] = "jsr",
+    [i_tableswitch] = "tableswitch",
+    [i_lookupswitch] = "lookupswitch",
+    [i_ireturn] = "ireturn",
+    [i_lreturn] = "lreturn",
+    [i_areturn] = "areturn",
+    [i_return] = "return",
+    [i_getstatic] = "getstatic",
+    [i_putstatic] = "putstatic",
+    [i_getfield] = "getfield",
+    [i_putfield] = "putfield",
+    [i_invokevirtual] = "invokevirtual",
+    [i_invokespecial] = "invokespecial",
+    [i_invokestatic] = "invokestatic",
+    [i_invokedynamic] = "invokedynamic",
+    [i_new] = "new",
+    [i_newarray] = "newarray",
+    [i_anewarray] = "anewarray",
+    [i_arraylength] = "arraylength",
+    [i_athrow] = "athrow",
+    [i_monitorenter] = "monitorenter",
+    [i_monitorexit] = "monitorexit",
+    [i_wide] = "wide",
+    [i_multianewarray] = "multianewarray",
+    [i_ifnull] = "ifnull",
+    [i_ifnonnull] = "ifnonnull",
+    [i_goto_w] = "goto_w",
+    [i_jsr_w] = "jsr_w",
+    [i_iaload_unchecked] = "iaload_unchecked",
+    [i_laload_unchecked] = "laload_unchecked",
+    [i_aaload_unchecked] = "aaload_unchecked",
+    [i_baload_unchecked] = "baload_unchecked",
+    [i_caload_unchecked] = "caload_unchecked",
+    [i_saload_unchecked] = "saload_unchecked",
+    [i_iastore_unchecked] = "iastore_unchecked",
+    [i_lastore_unchecked] = "lastore_unchecked",
+    [i_aastore_unchecked] = "aastore_unchecked",
+    [i_bastore_unchecked] = "bastore_unchecked",
+    [i_castore_unchecked] = "castore_unchecked",
+    [i_sastore_unchecked] = "sastore_unchecked",
+};
+
+/* Number the methods the first time they run, from 1 so that 0 is none */
+static u4 get_method_id(method_t *method, class_file_t *clazz)
+{
+    u4 id = __atomic_load_n(&method->profile_id, __ATOMIC_ACQUIRE);
+    if (id)
+        return id - 1;
+
+    pthread_mutex_lock(&profile_lock);
+    if (!method->profile_id) {
+        if (methods_count == methods_capacity) {
+            methods_capacity = methods_capacity ? 2 * methods_capacity : 64;
+            methods = realloc(methods, methods_capacity * sizeof(*methods));
+            assert(methods && "Failed to grow profiled methods");
+        }
+        methods[methods_count].method = method;
+        methods[methods_count].clazz = clazz;
+        __atomic_store_n(&method->profile_id, ++methods_count,
+                         __ATOMIC_RELEASE);
+    }
+    id = method->profile_id;
+    pthread_mutex_unlock(&profile_lock);
+    return id - 1;
+}
+
+static profile_t *get_profile()
+{
+    if (current_profile)
+        return current_profile;
+    profile_t *profile = calloc(1, sizeof(profile_t));
+    assert(profile && "Failed to allocate profile");
+    pthread_mutex_lock(&profile_lock);
+    profile->next = profiles;
+    profiles = profile;
+    pthread_mutex_unlock(&profile_lock);
+    return current_profile = profile;
+}
+
+/**
+ * Start timing a call.
+ *
+ * @param frame the frame of the call, on the stack of execute()
+ * @param method the method called
+ * @param clazz its class
+ */
+void enter_profiled(profile_frame_t *frame,
+                    method_t *method,
+                    class_file_t *clazz)
+{
+    get_profile();
+    frame->id = get_method_id(method, clazz);
+    frame->children = 0;
+    frame->caller = current_thread->profile_frame;
+    current_thread->profile_frame = frame;
+    frame->start = read_monotonic_nanos();
+}
+
+/* Account for a call returning, normally or by an exception */
+void leave_profiled(profile_frame_t *frame)
+{
+    int64_t total = read_monotonic_nanos() - frame->start;
+    current_thread->profile_frame = frame->caller;
+    if (frame->caller)
+        frame->caller->children += total;
+
+    /* the current carrier, if the virtual thread migrated meanwhile */
+    profile_t *profile = get_profile();
+    if (frame->id >= profile->methods_capacity) {
+        u4 capacity = profile->methods_capacity;
+        if (!capacity)
+            capacity = 64;
+        while (capacity <= frame->id)
+            capacity *= 2;
+        profile->methods =
+            realloc(profile->methods, capacity * sizeof(method_profile_t));
+        assert(profile->methods && "Failed to grow method profiles");
+        memset(profile->methods + profile->methods_capacity, 0,
+               (capacity - profile->methods_capacity) *
+                   sizeof(method_profile_t));
+        profile->methods_capacity = capacity;
+    }
+    method_profile_t *counters = &profile->methods[frame->id];
+    counters->calls++;
+    counters->self += total - frame->children;
+    profile_frame_t *outer = frame->caller;
+    while (outer && outer->id != frame->id)
+        outer = outer->caller;
+    if (!outer)
+        counters->total += total;
+}
+
+typedef struct {
+    u4 id;
+    method_profile_t counters;
+} method_entry_t;
+
+typedef struct {
+    u1 opcode;
+    u8 count;
+} opcode_entry_t;
+
+static int compare_methods(const void *a, const void *b)
+{
+    int64_t self_a = ((const method_entry_t *) a)->counters.self;
+    int64_t self_b = ((const method_entry_t *) b)->counters.self;
+    return (self_a < self_b) - (self_a > self_b);
+}
+
+static int compare_opcodes(const void *a, const void *b)
+{
+    u8 count_a = ((const opcode_entry_t *) a)->count;
+    u8 count_b = ((const opcode_entry_t *) b)->count;
+    return (count_a < count_b) - (count_a > count_b);
+}
+
+static const char *get_opcode_name(u1 opcode, char *buf, size_t size)
+{
+    if (opcode_names[opcode])
+        return opcode_names[opcode];
+    snprintf(buf, size, "0x%02x", opcode);
+    return buf;
+}
+
+static const char *get_method_class_name(u4 id)
+{
+    class_file_t *clazz = methods[id].clazz;
+    return find_class_name_from_index(clazz->info->this_class, clazz);
+}
+
+/* Write a JSON string, names in class files may hold any character */
+static void write_json_string(FILE *file, const char *str)
+{
+    fputc('"', file);
+    for (; *str; str++) {
+        unsigned char c = *str;
+        if (c == '"' || c == '\\')
+            fprintf(file, "\\%c", c);
+        else if (c < 0x20)
+            fprintf(file, "\\u%04x", c);
+        else
+            fputc(c, file);
+    }
+    fputc('"', file);
+}
+
+static bool write_json(const char *path,
+                       const opcode_entry_t *opcodes,
+                       u4 opcodes_count,
+                       const method_entry_t *entries,
+                       u4 count)
+{
+    FILE *file = fopen(path, "w");
+    if (!file)
+        return false;
+    fputs("{\n  \"opcodes\": [", file);
+    for (u4 i = 0; i < opcodes_count; i++) {
+        char buf[8];
+        fprintf(file, "%s\n    {\"opcode\": ", i ? "," : "");
+        write_json_string(
+            file, get_opcode_name(opcodes[i].opcode, buf, sizeof(buf)));
+        fprintf(file, ", \"count\": %" PRIu64 "}", opcodes[i].count);
+    }
+    fputs("\n  ],\n  \"methods\": [", file);
+    for (u4 i = 0; i < count; i++) {
+        method_t *method = methods[entries[i].id].method;
+        fprintf(file, "%s\n    {\"class\": ", i ? "," : "");
+        write_json_string(file, get_method_class_name(entries[i].id));
+        fputs(", \"name\": ", file);
+        write_json_string(file, method->name);
+        fputs(", \"descriptor\": ", file);
+        write_json_string(file, method->descriptor);
+        fprintf(file,
+                ", \"calls\": %" PRIu64 ", \"self_ns\": %" PRId64
+                ", \"total_ns\": %" PRId64 "}",
+                entries[i].counters.calls, entries[i].counters.self,
+                entries[i].counters.total);
+    }
+    fputs("\n  ]\n}\n", file);
+    return !fclose(file);
+}
+
+/**
+ * Add up the counters of all the threads, and report them. Called on exit,
+ * once the other threads have ended or are stopped.
+ *
+ * @param print whether to print the report on the standard error
+ * @param json_path the file to write the report into as JSON, or NULL
+ */
+void report_profile(bool print, const char *json_path)
+{
+    opcode_entry_t opcodes[256];
+    u4 opcodes_count = 0;
+    u8 instructions = 0;
+    for (int opcode = 0; opcode < 256; opcode++) {
+        u8 count = 0;
+        for (profile_t *profile = profiles; profile; profile = profile->next)
+            count += profile->opcodes[opcode];
+        if (count) {
+            opcodes[opcodes_count].opcode = opcode;
+            opcodes[opcodes_count++].count = count;
+            instructions += count;
+        }
+    }
+    qsort(opcodes, opcodes_count, sizeof(opcode_entry_t), compare_opcodes);
+
+    method_entry_t *entries = calloc(methods_count, sizeof(method_entry_t));
+    assert((entries || !methods_count) && "Failed to allocate report");
+    u8 calls = 0;
+    for (u4 id = 0; id < methods_count; id++) {
+        entries[id].id = id;
+        for (profile_t *profile = profiles; profile; profile = profile->next) {
+            if (id >= profile->methods_capacity)
+                continue;
+            method_profile_t *counters = &profile->methods[id];
+            entries[id].counters.calls += counters->calls;
+            entries[id].counters.self += counters->self;
+            entries[id].counters.total += counters->total;
+        }
+        calls += entries[id].counters.calls;
+    }
+    qsort(entries, methods_count, sizeof(method_entry_t), compare_methods);
+
+    if (print) {
+        flush_output();
+        fprintf(stderr,
+                "profile: %" PRIu64 " instructions, %" PRIu64 " calls\n",
+                instructions, calls);
+        fprintf(stderr, "%14s %6s  %s\n", "count", "%", "opcode");
+        for (u4 i = 0; i < opcodes_count; i++) {
+            char buf[8];
+            fprintf(stderr, "%14" PRIu64 " %5.1f%%  %s\n", opcodes[i].count,
+                    100.0 * opcodes[i].count / instructions,
+                    get_opcode_name(opcodes[i].opcode, buf, sizeof(buf)));
+        }
+        fprintf(stderr, "%14s %10s %10s  %s\n", "calls", "self ms",
+                "total ms", "method");
+        for (u4 i = 0; i < methods_count && i < TOP_METHODS; i++) {
+            method_t *method = methods[entries[i].id].method;
+            fprintf(stderr, "%14" PRIu64 " %10.3f %10.3f  %s.%s%s\n",
+                    entries[i].counters.calls,
+                    entries[i].counters.self / 1e6,
+                    entries[i].counters.total / 1e6,
+                    get_method_class_name(entries[i].id), method->name,
+                    method->descriptor);
+        }
+    }
+    if (json_path && !write_json(json_path, opcodes, opcodes_count, entries,
+                                 methods_count))
+        fprintf(stderr, "Failed to write profile %s\n", json_path);
+    free(entries);
+
+    while (profiles) {
+        profile_t *next = profiles->next;
+        free(profiles->methods);
+        free(profiles);
+        profiles = next;
+    }
+    current_profile = NULL;
+    free(methods);
+}
+
+#endif
@@ -0,0 +1,52 @@
+#pragma once
+
+/* The execution profiler of --prof, built into the interpreter by make
+ * PROFILE=1 only, see profile.c
+ */
+#ifdef PROFILE
+
+#include <stdbool.h>
+
+#include "classfile.h"
+
+/* A method the current thread executes, on its C stack */
+typedef struct profile_frame {
+    u4 id; /* of the method, see profile.c */
+    int64_t start;
+    int64_t children; /* time spent in the methods it called */
+    struct profile_frame *caller;
+} profile_frame_t;
+
+typedef struct {
+    u8 calls;
+    int64_t self;  /* nanoseconds */
+    int64_t total; /* nanoseconds, but in the recursive calls */
+} method_profile_t;
+
+/* The counters of a thread, added up by report_profile() */
+typedef struct profile {
+    u8 opcodes[256];
+    method_profile_t *methods; /* by id */
+    u4 methods_capacity;
+    struct profile *next;
+} profile_t;
+
+/* NULL until the thread runs a method while profiling */
+extern __thread profile_t *current_profile;
+
+extern bool profiling;
+
+void enter_profiled(profile_frame_t *frame,
+                    method_t *method,
+                    class_file_t *clazz);
+void leave_profiled(profile_frame_t *frame);
+void report_profile(bool print, const char *json_path);
+
+static inline void count_opcode(u1 opcode)
+{
+    profile_t *profile = current_profile;
+    if (profile)
+        profile->opcodes[opcode]++;
+}
+
+#endif
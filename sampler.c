@@ -0,0 +1,315 @@
+/* The sampling profiler of --sample.
+ *
+ * Every SAMPLE_INTERVAL of CPU time used by the VM, the system sends SIGPROF
+ * to a thread which runs, and the handler records the methods on the Java
+ * stack of that thread, innermost first, from the frames execute() links to
+ * the thread. The handler only uses atomics: it claims a slot of a ring
+ * buffer, copies the frames, and publishes the slot. A thread of the
+ * profiler drains the ring a few times a second and counts the samples by
+ * stack, and the stacks are written on exit as collapsed stacks, one line of
+ * frames from the outermost, separated by semicolons, then the count, which
+ * flamegraph.pl reads. When the ring is full, samples are dropped rather
+ * than waited for.
+ *
+ * The frames hold no pc: a flame graph adds the samples up by method, and
+ * keeping the pc of every frame up to date would slow the interpreter down
+ * when it is not sampled.
+ */
+
+/* for setitimer() */
+#define _DEFAULT_SOURCE
+
+#include <assert.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include "sampler.h"
+#include "thread.h"
+
+#define SAMPLE_INTERVAL 10000 /* microseconds, about 1% overhead */
+#define RING_SIZE 1024        /* samples, a power of two */
+#define MAX_DEPTH 128         /* frames kept, the innermost ones */
+#define DRAIN_INTERVAL 50     /* milliseconds */
+#define STACKS_SIZE 256       /* initial capacity of the stack counts */
+
+typedef struct {
+    method_t *method;
+    class_file_t *clazz;
+} sampled_frame_t;
+
+typedef struct {
+    /* the index of the next sample the slot is free for, + 1 once that
+     * sample is written until it is drained */
+    u8 sequence;
+    u4 depth;
+    bool truncated; /* the stack was deeper than MAX_DEPTH */
+    sampled_frame_t frames[MAX_DEPTH];
+} sample_t;
+
+/* The count of the samples of a stack */
+typedef struct {
+    u8 hash;
+    u8 count;
+    u4 depth; /* 0 when the thread ran no Java method */
+    bool truncated;
+    bool used; /* the slot of the hash table holds a stack */
+    sampled_frame_t *frames;
+} sampled_stack_t;
+
+static sample_t ring[RING_SIZE];
+static u8 ring_head; /* next sample to write */
+static u8 ring_tail; /* next sample to drain, by the profiler thread only */
+static u8 dropped;
+
+static bool sampling;
+static bool stopping; /* under stop_lock */
+static pthread_mutex_t stop_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t stop_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t drainer;
+static char *output_path;
+
+/* Owned by the profiler thread, then by stop_sampling() */
+static sampled_stack_t *stacks;
+static u4 stacks_count, stacks_capacity;
+
+/* Record the stack of the interrupted thread, unless it runs no Java code */
+static void record_sample(int signal)
+{
+    (void) signal;
+    thread_t *thread = current_thread;
+    if (!__atomic_load_n(&sampling, __ATOMIC_RELAXED) || !thread)
+        return;
+
+    /* claim a slot, like a bounded multi-producer queue */
+    u8 position = __atomic_load_n(&ring_head, __ATOMIC_RELAXED);
+    sample_t *sample;
+    for (;;) {
+        sample = &ring[position & (RING_SIZE - 1)];
+        u8 sequence = __atomic_load_n(&sample->sequence, __ATOMIC_ACQUIRE);
+        if (sequence < position) {
+            /* not drained yet */
+            __atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        if (sequence == position &&
+            __atomic_compare_exchange_n(&ring_head, &position, position + 1,
+                                        true, __ATOMIC_RELAXED,
+                                        __ATOMIC_RELAXED))
+            break;
+        if (sequence > position)
+            position = __atomic_load_n(&ring_head, __ATOMIC_RELAXED);
+    }
+
+    u4 depth = 0;
+    java_frame_t *frame = __atomic_load_n(&thread->frame, __ATOMIC_ACQUIRE);
+    for (; frame && depth < MAX_DEPTH; frame = frame->caller) {
+        sample->frames[depth].method = frame->method;
+        sample->frames[depth++].clazz = frame->clazz;
+    }
+    sample->depth = depth;
+    sample->truncated = frame;
+    __atomic_store_n(&sample->sequence, position + 1, __ATOMIC_RELEASE);
+}
+
+static u8 hash_sample(const sample_t *sample)
+{
+    /* FNV-1a over the methods */
+    u8 hash = 14695981039346656037ULL;
+    for (u4 i = 0; i < sample->depth; i++) {
+        hash ^= (uintptr_t) sample->frames[i].method;
+        hash *= 1099511628211ULL;
+    }
+    return hash ^ sample->truncated;
+}
+
+static bool same_stack(const sampled_stack_t *stack, const sample_t *sample)
+{
+    return stack->depth == sample->depth &&
+           stack->truncated == sample->truncated &&
+           !memcmp(stack->frames, sample->frames,
+                   sample->depth * sizeof(sampled_frame_t));
+}
+
+static void insert_stack(sampled_stack_t *table,
+                         u4 capacity,
+                         const sampled_stack_t *stack)
+{
+    u4 i = stack->hash & (capacity - 1);
+    while (table[i].used)
+        i = (i + 1) & (capacity - 1);
+    table[i] = *stack;
+}
+
+/* Count a sample in the hash table of the stacks */
+static void count_sample(const sample_t *sample)
+{
+    if (2 * (stacks_count + 1) > stacks_capacity) {
+        u4 capacity = stacks_capacity ? 2 * stacks_capacity : STACKS_SIZE;
+        sampled_stack_t *table = calloc(capacity, sizeof(sampled_stack_t));
+        assert(table && "Failed to grow sampled stacks");
+        for (u4 i = 0; i < stacks_capacity; i++) {
+            if (stacks[i].used)
+                insert_stack(table, capacity, &stacks[i]);
+        }
+        free(stacks);
+        stacks = table;
+        stacks_capacity = capacity;
+    }
+
+    u8 hash = hash_sample(sample);
+    u4 i = hash & (stacks_capacity - 1);
+    for (; stacks[i].used; i = (i + 1) & (stacks_capacity - 1)) {
+        if (stacks[i].hash == hash && same_stack(&stacks[i], sample)) {
+            stacks[i].count++;
+            return;
+        }
+    }
+    sampled_stack_t *stack = &stacks[i];
+    stack->hash = hash;
+    stack->count = 1;
+    stack->depth = sample->depth;
+    stack->truncated = sample->truncated;
+    stack->used = true;
+    stack->frames =
+        malloc((sample->depth ? sample->depth : 1) * sizeof(sampled_frame_t));
+    assert(stack->frames && "Failed to allocate sampled stack");
+    memcpy(stack->frames, sample->frames,
+           sample->depth * sizeof(sampled_frame_t));
+    stacks_count++;
+}
+
+/* Count the samples written so far, and free their slots */
+static void drain_samples()
+{
+    for (;;) {
+        sample_t *sample = &ring[ring_tail & (RING_SIZE - 1)];
+        if (__atomic_load_n(&sample->sequence, __ATOMIC_ACQUIRE) !=
+            ring_tail + 1)
+            return;
+        count_sample(sample);
+        __atomic_store_n(&sample->sequence, ring_tail + RING_SIZE,
+                         __ATOMIC_RELEASE);
+        ring_tail++;
+    }
+}
+
+static void *drainer_main(void *arg)
+{
+    (void) arg;
+    pthread_mutex_lock(&stop_lock);
+    while (!stopping) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += DRAIN_INTERVAL * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&stop_cond, &stop_lock, &deadline);
+        pthread_mutex_unlock(&stop_lock);
+        drain_samples();
+        pthread_mutex_lock(&stop_lock);
+    }
+    pthread_mutex_unlock(&stop_lock);
+    return NULL;
+}
+
+static void write_frame(FILE *file, const sampled_frame_t *frame)
+{
+    fprintf(file, "%s.%s",
+            find_class_name_from_index(frame->clazz->info->this_class,
+                                       frame->clazz),
+            frame->method->name);
+}
+
+static bool write_stacks(const char *path)
+{
+    FILE *file = fopen(path, "w");
+    if (!file)
+        return false;
+    for (u4 i = 0; i < stacks_capacity; i++) {
+        sampled_stack_t *stack = &stacks[i];
+        if (!stack->used)
+            continue;
+        if (stack->truncated)
+            fputs("[truncated];", file);
+        if (!stack->depth)
+            fputs("[vm]", file);
+        for (u4 depth = stack->depth; depth-- > 0;) {
+            write_frame(file, &stack->frames[depth]);
+            if (depth)
+                fputc(';', file);
+        }
+        fprintf(file, " %" PRIu64 "\n", stack->count);
+    }
+    return !fclose(file);
+}
+
+/**
+ * Start sampling the Java stacks of the threads which use the CPU.
+ *
+ * @param path the file to write the collapsed stacks into on exit
+ * @return false if the profiler could not start
+ */
+bool start_sampling(const char *path)
+{
+    for (u4 i = 0; i < RING_SIZE; i++)
+        ring[i].sequence = i;
+    output_path = strdup(path);
+
+    /* the profiler thread is never interrupted */
+    sigset_t set, old_set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGPROF);
+    pthread_sigmask(SIG_BLOCK, &set, &old_set);
+    bool started = !pthread_create(&drainer, NULL, drainer_main, NULL);
+    pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+    if (!started) {
+        free(output_path);
+        return false;
+    }
+
+    struct sigaction action = {.sa_handler = record_sample};
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+    sigaction(SIGPROF, &action, NULL);
+    __atomic_store_n(&sampling, true, __ATOMIC_RELEASE);
+    struct itimerval timer = {
+        .it_interval = {.tv_sec = 0, .tv_usec = SAMPLE_INTERVAL},
+        .it_value = {.tv_sec = 0, .tv_usec = SAMPLE_INTERVAL},
+    };
+    setitimer(ITIMER_PROF, &timer, NULL);
+    return true;
+}
+
+/* Stop sampling, and write the stacks sampled. Called on exit. */
+void stop_sampling()
+{
+    struct itimerval timer = {0};
+    setitimer(ITIMER_PROF, &timer, NULL);
+    /* a signal may still be pending, the handler then ignores it */
+    __atomic_store_n(&sampling, false, __ATOMIC_RELEASE);
+    pthread_mutex_lock(&stop_lock);
+    stopping = true;
+    pthread_cond_signal(&stop_cond);
+    pthread_mutex_unlock(&stop_lock);
+    pthread_join(drainer, NULL);
+    drain_samples();
+
+    if (!write_stacks(output_path))
+        fprintf(stderr, "Failed to write samples %s\n", output_path);
+    u8 lost = __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+    if (lost)
+        fprintf(stderr, "%" PRIu64 " samples dropped\n", lost);
+
+    for (u4 i = 0; i < stacks_capacity; i++)
+        free(stacks[i].frames);
+    free(stacks);
+    free(output_path);
+}
@@ -0,0 +1,6 @@
+#pragma once
+
+#include <stdbool.h>
+
+bool start_sampling(const char *path);
+void stop_sampling();
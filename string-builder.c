@@ -0,0 +1,100 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "object-heap.h"
+#include "output.h"
+#include "string-builder.h"
+
+/* Widen the characters stored so far from Latin-1 to UTF-16 */
+static void inflate(string_builder_t *sb)
+{
+    u2 *value = malloc(sizeof(u2) * (sb->capacity ? sb->capacity : 1));
+    assert(value && "Failed to grow string builder");
+    for (int32_t i = 0; i < sb->length; i++)
+        value[i] = sb->value[i];
+    free(sb->value);
+    sb->value = (u1 *) value;
+    sb->coder = STRING_UTF16;
+}
+
+/* Make room for more characters of the given coder. The capacity doubles,
+ * so appending n characters one at a time copies O(n) of them in total.
+ */
+static void ensure_capacity(string_builder_t *sb, int32_t extra, u1 coder)
+{
+    assert(extra <= INT32_MAX - sb->length && "String builder is too long");
+    if (coder > sb->coder)
+        inflate(sb);
+
+    int32_t needed = sb->length + extra;
+    if (needed <= sb->capacity)
+        return;
+    int32_t capacity = sb->capacity <= (INT32_MAX - 2) / 2
+                           ? sb->capacity * 2 + 2
+                           : INT32_MAX;
+    if (capacity < needed)
+        capacity = needed;
+    sb->value = realloc(sb->value, (size_t) capacity << sb->coder);
+    assert(sb->value && "Failed to grow string builder");
+    sb->capacity = capacity;
+}
+
+/* Append characters that are all Latin-1, such as digits */
+void builder_append_latin1(string_builder_t *sb,
+                           const char *chars,
+                           int32_t length)
+{
+    ensure_capacity(sb, length, STRING_LATIN1);
+    if (sb->coder == STRING_LATIN1) {
+        memcpy(sb->value + sb->length, chars, length);
+    } else {
+        u2 *value = (u2 *) sb->value + sb->length;
+        for (int32_t i = 0; i < length; i++)
+            value[i] = (u1) chars[i];
+    }
+    sb->length += length;
+}
+
+void builder_append_char(string_builder_t *sb, u2 c)
+{
+    ensure_capacity(sb, 1, c > 0xff ? STRING_UTF16 : STRING_LATIN1);
+    if (sb->coder == STRING_LATIN1)
+        sb->value[sb->length++] = c;
+    else
+        ((u2 *) sb->value)[sb->length++] = c;
+}
+
+void builder_append_int(string_builder_t *sb, int64_t value)
+{
+    char digits[INT_STRING_SIZE];
+    builder_append_latin1(sb, digits, format_int(value, digits));
+}
+
+/* StringBuilder.append(String), which appends "null" for a null string */
+void builder_append_string(string_builder_t *sb, const string_t *str)
+{
+    if (!str) {
+        builder_append_latin1(sb, "null", 4);
+        return;
+    }
+    ensure_capacity(sb, str->length, str->coder);
+    if (str->coder == sb->coder) {
+        memcpy(sb->value + ((size_t) sb->length << sb->coder), str->value,
+               (size_t) str->length << str->coder);
+    } else {
+        /* a Latin-1 string appended to a UTF-16 builder */
+        u2 *value = (u2 *) sb->value + sb->length;
+        for (int32_t i = 0; i < str->length; i++)
+            value[i] = str->value[i];
+    }
+    sb->length += str->length;
+}
+
+/* StringBuilder.toString(): a string holding a copy of the characters */
+string_t *builder_to_string(const string_builder_t *sb)
+{
+    string_t *str = alloc_string(sb->coder, sb->length);
+    memcpy(str->value, sb->value, (size_t) sb->length << sb->coder);
+    return str;
+}
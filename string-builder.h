@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "java-string.h"
+
+/* java.lang.StringBuilder, which has no class file: the VM implements it.
+ * Like strings, builders stay Latin-1 until a wider character is appended.
+ */
+typedef struct {
+    lock_word_t lock;
+    u1 kind;          /* HEAP_BUILDER */
+    u1 coder;         /* see string_coder_t */
+    int32_t length;   /* number of UTF-16 code units */
+    int32_t capacity; /* number of characters value has room for */
+    u1 *value;
+} string_builder_t;
+
+void builder_append_latin1(string_builder_t *sb,
+                           const char *chars,
+                           int32_t length);
+void builder_append_char(string_builder_t *sb, u2 c);
+void builder_append_int(string_builder_t *sb, int64_t value);
+void builder_append_string(string_builder_t *sb, const string_t *str);
+string_t *builder_to_string(const string_builder_t *sb);
@@ -0,0 +1,275 @@
+/* String concatenation compiled by javac into invokedynamic calls to
+ * StringConcatFactory.makeConcatWithConstants.
+ *
+ * The recipe of a call site is parsed once into a plan, which is kept in the
+ * resolution cache of the InvokeDynamic constant. Running the plan measures
+ * the result, allocates the string once and fills it in a single pass.
+ */
+
+#include "string-concat.h"
+#include "class-heap.h"
+#include "native.h"
+#include "object-heap.h"
+#include "output.h"
+
+/* Argument segment kind for a field descriptor */
+static u1 get_arg_kind(const char *desc)
+{
+    switch (*desc) {
+    case 'B':
+    case 'S':
+    case 'I':
+    case 'J':
+        return CONCAT_INT;
+    case 'C':
+        return CONCAT_CHAR;
+    case 'Z':
+        return CONCAT_BOOLEAN;
+    case 'L':
+        if (!strncmp(desc, "Ljava/lang/String;", 18))
+            return CONCAT_STRING;
+        return CONCAT_OBJECT;
+    case '[':
+        return CONCAT_OBJECT;
+    default:
+        fprintf(stderr, "Concatenating type %c is not supported\n", *desc);
+        exit(1);
+    }
+}
+
+/* Skip a field descriptor, returning where the next one starts */
+static const char *skip_field_descriptor(const char *desc)
+{
+    while (*desc == '[')
+        desc++;
+    if (*desc == 'L')
+        desc = strchr(desc, ';');
+    return desc + 1;
+}
+
+/**
+ * Compile the recipe of a string concatenation call site.
+ *
+ * In the recipe, \1 (Unicode point 0001) stands for the next argument on the
+ * operand stack, \2 (Unicode point 0002) for the next constant among the
+ * other bootstrap arguments, and any other character for itself. Adjacent
+ * characters and constants are merged into one literal segment.
+ *
+ * @param clazz the class of the call site, whose arena holds the plan
+ * @param index the constant pool index of the InvokeDynamic constant
+ * @return the plan
+ */
+concat_plan_t *compile_concat_plan(class_file_t *clazz, u2 index)
+{
+    constant_pool_t *cp = &clazz->constant_pool;
+    bootmethods_t *bootstrap_method = find_bootstrap_method(index, clazz);
+    CONSTANT_MethodHandle_info *handle =
+        get_method_handle(cp, bootstrap_method->bootstrap_method_ref);
+    char *method_name, *method_descriptor;
+    find_method_info_from_index(handle->reference_index, clazz, &method_name,
+                                &method_descriptor);
+    if (strcmp(method_name, "makeConcatWithConstants"))
+        assert(0 && "Only support makeConcatWithConstants");
+
+    /* the types of the arguments come from the call site descriptor */
+    CONSTANT_NameAndType_info *name_and_type = get_name_and_type(
+        cp, get_constant(cp, index)->invoke_dynamic.name_and_type_index);
+    const char *arg_type = get_utf8(cp, name_and_type->descriptor_index) + 1;
+
+    char *recipe = get_string_utf(cp, bootstrap_method->bootstrap_arguments[0]);
+
+    /* size the plan: at most one literal before each argument and one at
+     * the end, and all the text of the recipe with its constants inlined
+     */
+    u2 arg_count = 0, constant = 1;
+    size_t text_length = 0;
+    for (char *iter = recipe; *iter; iter++) {
+        if (*iter == 1) {
+            arg_count++;
+        } else if (*iter == 2) {
+            assert(constant < bootstrap_method->num_bootstrap_arguments &&
+                   "Missing concatenation constant");
+            text_length += strlen(get_string_utf(
+                cp, bootstrap_method->bootstrap_arguments[constant++]));
+        } else {
+            text_length++;
+        }
+    }
+
+    u2 max_segments = 2 * arg_count + 1;
+    concat_plan_t *plan = arena_alloc(
+        &clazz->arena,
+        sizeof(concat_plan_t) + sizeof(concat_segment_t) * max_segments);
+    plan->arg_count = arg_count;
+
+    /* gather the encoded text of each literal, to be decoded at the end */
+    char *text = malloc(text_length + 1), *end = text;
+    assert(text && "Failed to allocate concatenation recipe");
+    char *literal_starts[max_segments + 1];
+
+    concat_segment_t *segment = NULL;
+    u2 arg = 0;
+    constant = 1;
+    for (char *iter = recipe; *iter; iter++) {
+        if (*iter == 1) {
+            segment = &plan->segments[plan->segment_count++];
+            segment->kind = get_arg_kind(arg_type);
+            segment->arg = arg++;
+            arg_type = skip_field_descriptor(arg_type);
+            segment = NULL;
+            continue;
+        }
+
+        if (!segment) {
+            literal_starts[plan->segment_count] = end;
+            segment = &plan->segments[plan->segment_count++];
+            segment->kind = CONCAT_LITERAL;
+        }
+        if (*iter == 2) {
+            char *value = get_string_utf(
+                cp, bootstrap_method->bootstrap_arguments[constant++]);
+            size_t length = strlen(value);
+            memcpy(end, value, length);
+            end += length;
+        } else {
+            *end++ = *iter;
+        }
+    }
+
+    /* a literal ends where the next one starts */
+    literal_starts[plan->segment_count] = end;
+    for (u2 i = plan->segment_count; i-- > 0;) {
+        segment = &plan->segments[i];
+        if (segment->kind != CONCAT_LITERAL) {
+            literal_starts[i] = literal_starts[i + 1];
+            continue;
+        }
+
+        size_t size = literal_starts[i + 1] - literal_starts[i];
+        int32_t length;
+        u1 coder;
+        measure_utf8(literal_starts[i], size, &length, &coder);
+        segment->literal =
+            arena_alloc(&clazz->arena, get_string_size(coder, length));
+        segment->literal->kind = HEAP_STRING;
+        segment->literal->length = length;
+        segment->literal->coder = coder;
+        decode_utf8(literal_starts[i], size, segment->literal);
+        plan->literal_length += length;
+        plan->literal_coder |= coder;
+    }
+    free(text);
+    return plan;
+}
+
+/**
+ * Concatenate the arguments of a call site into a new string, and pop them.
+ *
+ * References other than strings are converted by their toString() first,
+ * which may throw.
+ *
+ * @param plan the compiled recipe of the call site
+ * @param op_stack the operand stack holding the arguments
+ * @return the string, or NULL if a toString() threw an exception
+ */
+string_t *run_concat_plan(concat_plan_t *plan, stack_frame_t *op_stack)
+{
+    stack_entry_t *args = &op_stack->store[op_stack->size - plan->arg_count];
+
+    /* find the characters of each argument, formatting the integers */
+    u2 count = plan->arg_count ? plan->arg_count : 1;
+    const u1 *values[count];
+    int32_t lengths[count];
+    u1 coders[count];
+    union {
+        char digits[INT_STRING_SIZE];
+        u2 c;
+    } buffers[count];
+
+    int32_t length = plan->literal_length;
+    u1 coder = plan->literal_coder;
+    for (u2 i = 0; i < plan->segment_count; i++) {
+        concat_segment_t *segment = &plan->segments[i];
+        if (segment->kind == CONCAT_LITERAL)
+            continue;
+
+        u2 arg = segment->arg;
+        value_t *value = &args[arg].entry;
+        int64_t number = 0;
+        bool is_ref = segment->kind == CONCAT_STRING ||
+                      segment->kind == CONCAT_OBJECT;
+        if (!is_ref)
+            number = stack_to_int(value, get_type_size(args[arg].type));
+        coders[arg] = STRING_LATIN1;
+        switch (segment->kind) {
+        case CONCAT_INT:
+            values[arg] = (u1 *) buffers[arg].digits;
+            lengths[arg] = format_int(number, buffers[arg].digits);
+            break;
+        case CONCAT_CHAR:
+            buffers[arg].c = (u2) number;
+            values[arg] = (u1 *) &buffers[arg].c;
+            lengths[arg] = 1;
+            if (buffers[arg].c > 0xff)
+                coders[arg] = STRING_UTF16;
+            else
+                buffers[arg].digits[0] = (char) number;
+            break;
+        case CONCAT_BOOLEAN:
+            values[arg] = (u1 *) (number ? "true" : "false");
+            lengths[arg] = number ? 4 : 5;
+            break;
+        default: {
+            string_t *str = value->ptr_value;
+            if (str && segment->kind == CONCAT_OBJECT) {
+                str = string_value_of(str);
+                if (!str) {
+                    op_stack->size -= plan->arg_count;
+                    return NULL;
+                }
+            }
+            if (str) {
+                values[arg] = str->value;
+                lengths[arg] = str->length;
+                coders[arg] = str->coder;
+            } else {
+                values[arg] = (u1 *) "null";
+                lengths[arg] = 4;
+            }
+            break;
+        }
+        }
+        length += lengths[arg];
+        coder |= coders[arg];
+    }
+
+    string_t *result = alloc_string(coder, length);
+    u1 *dest = result->value;
+    for (u2 i = 0; i < plan->segment_count; i++) {
+        concat_segment_t *segment = &plan->segments[i];
+        const u1 *src;
+        int32_t src_length;
+        u1 src_coder;
+        if (segment->kind == CONCAT_LITERAL) {
+            src = segment->literal->value;
+            src_length = segment->literal->length;
+            src_coder = segment->literal->coder;
+        } else {
+            src = values[segment->arg];
+            src_length = lengths[segment->arg];
+            src_coder = coders[segment->arg];
+        }
+
+        if (src_coder == coder) {
+            memcpy(dest, src, (size_t) src_length << coder);
+        } else {
+            /* widen Latin-1 characters into UTF-16 */
+            for (int32_t j = 0; j < src_length; j++)
+                ((u2 *) dest)[j] = src[j];
+        }
+        dest += (size_t) src_length << coder;
+    }
+
+    op_stack->size -= plan->arg_count;
+    return result;
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include "classfile.h"
+#include "java-string.h"
+#include "stack.h"
+
+typedef enum {
+    CONCAT_LITERAL, /* text of the recipe, constants included */
+    CONCAT_INT,
+    CONCAT_CHAR,
+    CONCAT_BOOLEAN,
+    CONCAT_STRING,
+    CONCAT_OBJECT, /* any other reference, converted like String.valueOf() */
+} concat_segment_kind_t;
+
+typedef struct {
+    u1 kind;           /* see concat_segment_kind_t */
+    u2 arg;            /* index of the argument, unless a literal */
+    string_t *literal; /* the text of a literal segment */
+} concat_segment_t;
+
+/* A makeConcatWithConstants recipe compiled for a call site */
+typedef struct concat_plan {
+    u2 arg_count;
+    u2 segment_count;
+    int32_t literal_length; /* total length of the literal segments */
+    u1 literal_coder;       /* the widest coder among the literals */
+    concat_segment_t segments[];
+} concat_plan_t;
+
+concat_plan_t *compile_concat_plan(class_file_t *clazz, u2 index);
+string_t *run_concat_plan(concat_plan_t *plan, stack_frame_t *op_stack);
@@ -0,0 +1,49 @@
+import java.util.Arrays;
+
+public class ArrayCopy {
+    static void print(int[] a)
+    {
+        for (int i = 0; i < a.length; i++) {
+            System.out.print(a[i]);
+            System.out.print(' ');
+        }
+        System.out.println();
+    }
+
+    public static void main(String args[])
+    {
+        int[] a = new int[10];
+        for (int i = 0; i < a.length; i++)
+            a[i] = i;
+        /* test overlapping copies in both directions */
+        System.arraycopy(a, 0, a, 2, 6);
+        print(a);
+        System.arraycopy(a, 3, a, 0, 6);
+        print(a);
+        /* test fills and copies of each element size */
+        long[] l = new long[37];
+        Arrays.fill(l, -5000000000L);
+        System.out.println(l[0]);
+        System.out.println(l[36]);
+        char[] c = new char[9];
+        Arrays.fill(c, '.');
+        Arrays.fill(c, 2, 7, '中');
+        for (int i = 0; i < c.length; i++)
+            System.out.print(c[i]);
+        System.out.println();
+        byte[] b = new byte[5];
+        Arrays.fill(b, (byte) -1);
+        b = Arrays.copyOf(b, 8);
+        for (int i = 0; i < b.length; i++)
+            System.out.print(b[i]);
+        System.out.println();
+        print(Arrays.copyOf(a, 3));
+        String[] s = new String[4];
+        Arrays.fill(s, "x");
+        s[0] = "y";
+        String[] t = new String[6];
+        System.arraycopy(s, 0, t, 1, 4);
+        for (int i = 0; i < t.length; i++)
+            System.out.println(t[i]);
+    }
+}
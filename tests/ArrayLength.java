@@ -0,0 +1,65 @@
+public class ArrayLength {
+    public static int sum(int[] arr) {
+        int s = 0;
+        for (int i = 0; i < arr.length; i++)
+            s += arr[i];
+        return s;
+    }
+
+    /* the index may start negative, so the stores stay checked */
+    public static void fillFrom(int[] arr, boolean before) {
+        try {
+            for (int i = before ? -1 : 0; i < arr.length; i++)
+                arr[i] = i;
+        } catch (ArrayIndexOutOfBoundsException e) {
+            System.out.println(e.getMessage());
+        }
+    }
+
+    /* the body writes the index, so the stores stay checked */
+    public static void fillSkipping(int[] arr) {
+        try {
+            for (int i = 0; i < arr.length; i++) {
+                if (i == 2)
+                    i = arr.length;
+                arr[i] = i;
+            }
+        } catch (ArrayIndexOutOfBoundsException e) {
+            System.out.println(e.getMessage());
+        }
+    }
+
+    public static void store(int[] arr, int index) {
+        try {
+            arr[index] = 1;
+        } catch (ArrayIndexOutOfBoundsException e) {
+            System.out.println(e.getMessage());
+        }
+    }
+
+    public static void main(String[] args) {
+        int[] iarr = new int[10];
+        for (int i = 0; i < iarr.length; i++)
+            iarr[i] = i * i;
+        System.out.println(iarr.length);
+        System.out.println(sum(iarr));
+
+        long[][] larr = new long[3][4];
+        larr[1][3] = 7L;
+        System.out.println(larr.length);
+        System.out.println(larr[2].length);
+        System.out.println(larr[1][3]);
+
+        char[] carr = new char[2];
+        carr[1] = 'A';
+        System.out.println(carr[1] + 1);
+
+        int[] small = new int[4];
+        store(small, small.length);
+        store(small, -1);
+        fillSkipping(small);
+        fillFrom(small, false);
+        System.out.println(sum(small));
+        fillFrom(small, true);
+    }
+}
@@ -0,0 +1,123 @@
+public class Exceptions {
+    static class BadInput extends RuntimeException {
+        int code;
+
+        BadInput(String message, int code)
+        {
+            super(message);
+            this.code = code;
+        }
+    }
+
+    static int divide(int a, int b)
+    {
+        return a / b;
+    }
+
+    static int safeDivide(int a, int b)
+    {
+        try {
+            return divide(a, b);
+        } catch (ArithmeticException e) {
+            System.out.println(e.getMessage());
+            return -1;
+        }
+    }
+
+    static void check(int n)
+    {
+        if (n < 0)
+            throw new BadInput("negative", n);
+        if (n > 100)
+            throw new IllegalArgumentException("too large");
+        if (n == 7) {
+            int[] values = new int[3];
+            values[n] = 1;
+        }
+        if (n == 13) {
+            int[] values = null;
+            values[0] = 1;
+        }
+    }
+
+    static void run(int n)
+    {
+        try {
+            try {
+                check(n);
+                System.out.println("ok " + n);
+            } catch (BadInput e) {
+                System.out.println("bad input " + e.code + " " + e.getMessage());
+            } finally {
+                System.out.println("checked " + n);
+            }
+        } catch (IndexOutOfBoundsException e) {
+            System.out.println("index: " + e.getMessage());
+        } catch (NullPointerException e) {
+            System.out.println("null");
+        } catch (RuntimeException e) {
+            System.out.println("runtime: " + e.getMessage());
+        }
+    }
+
+    static int loop(int[] divisors)
+    {
+        int failures = 0;
+        for (int i = 0; i < divisors.length; i++) {
+            try {
+                divisors[i] = 100 / divisors[i];
+            } catch (ArithmeticException e) {
+                failures++;
+            }
+        }
+        return failures;
+    }
+
+    public static void main(String[] args)
+    {
+        System.out.println(safeDivide(7, 2));
+        System.out.println(safeDivide(1, 0));
+        int min = Integer.MIN_VALUE, minusOne = -1;
+        System.out.println(safeDivide(min, minusOne));
+        System.out.println(min % minusOne);
+
+        run(5);
+        run(-3);
+        run(500);
+        run(7);
+        run(13);
+
+        int[] divisors = {5, 0, 4, 0, 0, 10};
+        System.out.println(loop(divisors));
+        System.out.println(divisors[0] + divisors[2] + divisors[5]);
+
+        try {
+            long zero = 0;
+            System.out.println(1L % zero);
+        } catch (ArithmeticException e) {
+            System.out.println("long " + e.getMessage());
+        }
+
+        try {
+            throw new Error("error");
+        } catch (Exception e) {
+            System.out.println("not an exception");
+        } catch (Throwable e) {
+            System.out.println("throwable: " + e.getMessage());
+        }
+
+        try {
+            check(-1);
+        } catch (BadInput e) {
+            System.out.println(e);
+        }
+        try {
+            divide(3, 0);
+        } catch (ArithmeticException e) {
+            System.out.println(e);
+        }
+        Object error = new IllegalStateException();
+        System.out.print(error);
+        System.out.println();
+    }
+}
@@ -0,0 +1,103 @@
+import java.util.concurrent.ForkJoinPool;
+import java.util.concurrent.RecursiveAction;
+import java.util.concurrent.RecursiveTask;
+
+public class ForkJoin {
+    /* the results are kept in fields, as the VM does not box them */
+    static class Fib extends RecursiveAction {
+        final int n;
+        int result;
+
+        Fib(int n)
+        {
+            this.n = n;
+        }
+
+        protected void compute()
+        {
+            if (n < 2) {
+                result = n;
+                return;
+            }
+            Fib first = new Fib(n - 1);
+            first.fork();
+            Fib second = new Fib(n - 2);
+            second.compute();
+            first.join();
+            result = first.result + second.result;
+        }
+    }
+
+    static class Sum extends RecursiveAction {
+        final int[] array;
+        final int from, to;
+        long sum;
+
+        Sum(int[] array, int from, int to)
+        {
+            this.array = array;
+            this.from = from;
+            this.to = to;
+        }
+
+        protected void compute()
+        {
+            if (to - from <= 1000) {
+                for (int i = from; i < to; i++)
+                    sum += array[i];
+                return;
+            }
+            int middle = (from + to) / 2;
+            Sum left = new Sum(array, from, middle);
+            Sum right = new Sum(array, middle, to);
+            invokeAll(left, right);
+            sum = left.sum + right.sum;
+        }
+    }
+
+    static class Hello extends RecursiveTask<String> {
+        protected String compute()
+        {
+            return "hello";
+        }
+    }
+
+    static class Boom extends RecursiveAction {
+        protected void compute()
+        {
+            throw new IllegalStateException("boom");
+        }
+    }
+
+    public static void main(String[] args)
+    {
+        ForkJoinPool pool = new ForkJoinPool(4);
+        Fib fib = new Fib(20);
+        pool.invoke(fib);
+        System.out.println(fib.result);
+
+        int[] array = new int[100000];
+        for (int i = 0; i < array.length; i++)
+            array[i] = i;
+        Sum sum = new Sum(array, 0, array.length);
+        ForkJoinPool.commonPool().invoke(sum);
+        System.out.println(sum.sum);
+
+        /* forked outside of a pool, it runs in the common pool */
+        Fib forked = new Fib(15);
+        forked.fork();
+        forked.join();
+        System.out.println(forked.result);
+        System.out.println(forked.isDone());
+
+        Object hello = pool.invoke(new Hello());
+        System.out.println(hello);
+
+        try {
+            pool.invoke(new Boom());
+        } catch (IllegalStateException e) {
+            System.out.println(e.getMessage());
+        }
+        System.out.println(pool.getParallelism());
+    }
+}
@@ -0,0 +1,16 @@
+public class Natives {
+    public static void main(String args[])
+    {
+        System.out.println(Math.max(3, -7));
+        System.out.println(Math.min(3, -7));
+        System.out.println(Math.max(5000000000L, -5000000000L));
+        System.out.println(Math.min(5000000000L, -5000000000L));
+        System.out.println(Math.abs(-7));
+        System.out.println(Math.abs(Integer.MIN_VALUE));
+        System.out.println(Math.abs(-5000000000L));
+        /* test the clocks without depending on their values */
+        long start = System.nanoTime();
+        System.out.println(System.currentTimeMillis() > 1600000000000L);
+        System.out.println(System.nanoTime() - start >= 0);
+    }
+}
@@ -0,0 +1,20 @@
+public class Print {
+    public static void main(String args[])
+    {
+        boolean t = true, f = false;
+        char c = 'B';
+        long min = java.lang.Long.MIN_VALUE;
+        /* test print without line break */
+        System.out.print("a");
+        System.out.print(-5);
+        System.out.print(t);
+        System.out.print(c);
+        System.out.println(f);
+        /* test empty line */
+        System.out.println();
+        System.out.println(min);
+        /* test output larger than the buffer */
+        for (int i = 0; i < 20000; i++)
+            System.out.println(i);
+    }
+}
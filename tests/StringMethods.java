@@ -0,0 +1,44 @@
+public class StringMethods {
+    public static void main(String args[])
+    {
+        String hello = "hello";
+        String text = "the quick brown fox jumps over the lazy dog, "
+            + "the quick brown fox jumps over the lazy dog";
+        String wide = "abcdefghijklmnopqrstuvwxyz0123456789中xyzxyzxyz";
+        System.out.println(hello.length());
+        System.out.println(hello.charAt(1));
+        System.out.println(hello.equals("hel" + "lo"));
+        System.out.println(hello.equals("hellp"));
+        /* test equals with objects that are not strings */
+        Object array = new char[] {'h', 'e', 'l', 'l', 'o'};
+        Object builder = new StringBuilder(hello);
+        Object nothing = null;
+        System.out.println(hello.equals(array));
+        System.out.println(hello.equals(builder));
+        System.out.println(hello.equals(new StringMethods()));
+        System.out.println(hello.equals(nothing));
+        /* test hashing and searching strings long enough for vectors */
+        System.out.println(hello.hashCode());
+        System.out.println(text.hashCode());
+        System.out.println(wide.hashCode());
+        System.out.println(text.indexOf('z'));
+        System.out.println(wide.indexOf('中'));
+        System.out.println(wide.indexOf('文'));
+        System.out.println(text.indexOf("lazy"));
+        System.out.println(text.indexOf("the", 10));
+        System.out.println(wide.indexOf("xyzx"));
+        System.out.println(text.indexOf("中"));
+        System.out.println("apple".compareTo("apricot"));
+        System.out.println("app".compareTo("apple"));
+        /* test a builder growing and widening to UTF-16 */
+        StringBuilder sb = new StringBuilder("<");
+        for (int i = 0; i < 300; i++)
+            sb.append(i).append(',');
+        sb.append('中').append(true).append(-5000000000L).append(">");
+        System.out.println(sb.length());
+        System.out.println(sb.charAt(1));
+        System.out.println(sb.toString());
+        String s = new StringBuilder().append("x").append(false).toString();
+        System.out.println(s.equals("xfalse"));
+    }
+}
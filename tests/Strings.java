@@ -1,4 +1,19 @@
 public class Strings {
+    static class Point {
+        int x, y;
+
+        Point(int x, int y)
+        {
+            this.x = x;
+            this.y = y;
+        }
+
+        public String toString()
+        {
+            return "(" + x + ", " + y + ")";
+        }
+    }
+
     public static String f(String x) {
         return x + " abc " + x;
     }
@@ -19,5 +34,11 @@ public class Strings {
         System.out.println("1" + 2 + x + "3" + y + 0.8 + str2);
         /* test invokedynamic arguments */
         System.out.println("prefix \1" + str1 + "suffix \2");
+        /* test concat with references other than strings */
+        Point p = new Point(3, -4);
+        StringBuilder sb = new StringBuilder("built");
+        Object nothing = null;
+        System.out.println("point " + p + ", " + sb + ", " + nothing);
+        System.out.println("error: " + new IllegalStateException("state"));
     }
 }
\ No newline at end of file
@@ -0,0 +1,71 @@
+public class Switch {
+    static int dense(int k)
+    {
+        switch (k) {
+        case -2:
+            return 10;
+        case -1:
+            return 11;
+        case 0:
+            return 12;
+        case 1:
+            return 13;
+        case 3:
+            return 15;
+        default:
+            return 99;
+        }
+    }
+
+    static int sparse(int k)
+    {
+        switch (k) {
+        case Integer.MIN_VALUE:
+            return 1;
+        case -5:
+            return 2;
+        case 7:
+            return 3;
+        case 100:
+            return 4;
+        case 1000000:
+            return 5;
+        case Integer.MAX_VALUE:
+            return 6;
+        default:
+            return 0;
+        }
+    }
+
+    static int keyword(String s)
+    {
+        switch (s) {
+        case "if":
+            return 1;
+        case "else":
+            return 2;
+        case "while":
+            return 3;
+        default:
+            return 0;
+        }
+    }
+
+    public static void main(String args[])
+    {
+        for (int k = -3; k <= 4; k++)
+            System.out.println(dense(k));
+        System.out.println(dense(Integer.MAX_VALUE));
+        System.out.println(dense(Integer.MIN_VALUE));
+        System.out.println(sparse(Integer.MIN_VALUE));
+        System.out.println(sparse(-5));
+        System.out.println(sparse(0));
+        System.out.println(sparse(100));
+        System.out.println(sparse(1000000));
+        System.out.println(sparse(Integer.MAX_VALUE));
+        System.out.println(sparse(Integer.MAX_VALUE - 1));
+        System.out.println(keyword("while"));
+        System.out.println(keyword("else"));
+        System.out.println(keyword("for"));
+    }
+}
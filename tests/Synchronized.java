@@ -0,0 +1,76 @@
+public class Synchronized {
+    int count;
+
+    static synchronized int depth(int n)
+    {
+        return n == 0 ? 0 : 1 + depth(n - 1);
+    }
+
+    synchronized void increment()
+    {
+        count++;
+        notify();
+    }
+
+    synchronized void fail()
+    {
+        throw new IllegalStateException("fail");
+    }
+
+    public static void main(String[] args) throws InterruptedException
+    {
+        /* deep enough to overflow the count of a thin lock */
+        System.out.println(depth(300));
+
+        Synchronized counter = new Synchronized();
+        counter.increment();
+        counter.increment();
+        System.out.println(counter.count);
+
+        Object lock = new Object();
+        int[] values = new int[3];
+        synchronized (lock) {
+            synchronized ("lock") {
+                synchronized (values) {
+                    synchronized (lock) {
+                        lock.wait(1);
+                        values.notifyAll();
+                    }
+                }
+            }
+            lock.notify();
+        }
+        System.out.println("blocks");
+
+        try {
+            lock.notify();
+        } catch (IllegalMonitorStateException e) {
+            System.out.println(e.getMessage());
+        }
+
+        /* the monitor is released when the method throws */
+        try {
+            counter.fail();
+        } catch (IllegalStateException e) {
+            System.out.println(e.getMessage());
+        }
+        try {
+            counter.notify();
+        } catch (IllegalMonitorStateException e) {
+            System.out.println("released");
+        }
+
+        try {
+            synchronized (lock) {
+                values[3] = 1;
+            }
+        } catch (ArrayIndexOutOfBoundsException e) {
+            System.out.println("index");
+        }
+        try {
+            lock.notify();
+        } catch (IllegalMonitorStateException e) {
+            System.out.println("released");
+        }
+    }
+}
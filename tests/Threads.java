@@ -0,0 +1,110 @@
+public class Threads {
+    static int count, lockedCount, slowSum;
+    static boolean signalled;
+    static final Object lock = new Object();
+
+    static class Slow {
+        static int value;
+
+        static {
+            try {
+                Thread.sleep(50);
+            } catch (InterruptedException e) {
+            }
+            value = 42;
+        }
+    }
+
+    static synchronized void add()
+    {
+        count++;
+    }
+
+    static synchronized void addSlow(int value)
+    {
+        slowSum += value;
+    }
+
+    static class Worker extends Thread {
+        public void run()
+        {
+            for (int i = 0; i < 10000; i++) {
+                add();
+                synchronized (lock) {
+                    lockedCount++;
+                }
+                int[] garbage = new int[16];
+                garbage[i & 15] = i;
+            }
+            /* the other workers wait while the first one initializes it */
+            addSlow(Slow.value);
+        }
+    }
+
+    static class Signal extends Thread {
+        public void run()
+        {
+            synchronized (lock) {
+                signalled = true;
+                lock.notifyAll();
+            }
+        }
+    }
+
+    static class Task implements Runnable {
+        public void run()
+        {
+            String name = Thread.currentThread().getName();
+            System.out.println("task ran in " + name);
+        }
+    }
+
+    static class Boom extends Thread {
+        Boom()
+        {
+            super("boomer");
+        }
+
+        public void run()
+        {
+            throw new IllegalStateException("boom");
+        }
+    }
+
+    public static void main(String[] args) throws InterruptedException
+    {
+        System.out.println(Thread.currentThread().getName());
+
+        Signal signal = new Signal();
+        signal.start();
+        synchronized (lock) {
+            while (!signalled)
+                lock.wait();
+        }
+        signal.join();
+        System.out.println("signalled");
+
+        int processors = Runtime.getRuntime().availableProcessors();
+        Worker[] workers = new Worker[processors + 1];
+        for (int i = 0; i < workers.length; i++)
+            workers[i] = new Worker();
+        for (int i = 0; i < workers.length; i++)
+            workers[i].start();
+        for (int i = 0; i < workers.length; i++)
+            workers[i].join();
+        System.out.println(count == 10000 * workers.length);
+        System.out.println(lockedCount == count);
+        System.out.println(slowSum == 42 * workers.length);
+        System.out.println(workers[0].isAlive());
+
+        Thread task = new Thread(new Task(), "task");
+        task.start();
+        task.join();
+
+        /* reported on the standard error, the VM carries on */
+        Boom boom = new Boom();
+        boom.start();
+        boom.join();
+        System.out.println("after boom");
+    }
+}
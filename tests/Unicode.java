@@ -0,0 +1,21 @@
+public class Unicode {
+    public static void main(String args[])
+    {
+        String latin1 = "café";
+        String utf16 = "中文";
+        char c = 'é';
+        char d = '中';
+        /* test printing strings stored in Latin-1 and UTF-16 */
+        System.out.println(latin1);
+        System.out.println(utf16);
+        System.out.println(c);
+        /* test concatenation widening Latin-1 to UTF-16 */
+        System.out.println(latin1 + "-" + d + "-" + utf16);
+        System.out.println(latin1 + c);
+        /* test many strings */
+        String s = "";
+        for (int i = 0; i < 10000; i++)
+            s = latin1 + i;
+        System.out.println(s);
+    }
+}
@@ -0,0 +1,88 @@
+public class VirtualThreads {
+    static int count;
+    static boolean signalled;
+    static final Object lock = new Object();
+
+    static synchronized void add(int value)
+    {
+        count += value;
+    }
+
+    static class Task implements Runnable {
+        public void run()
+        {
+            try {
+                Thread.sleep(10);
+            } catch (InterruptedException e) {
+            }
+            Thread.yield();
+            add(Thread.currentThread().isVirtual() ? 1 : 0);
+            Thread.yield();
+        }
+    }
+
+    static class Joiner implements Runnable {
+        public void run()
+        {
+            try {
+                Thread.startVirtualThread(new Task()).join();
+            } catch (InterruptedException e) {
+            }
+            System.out.println("joined");
+        }
+    }
+
+    static class Signal implements Runnable {
+        public void run()
+        {
+            synchronized (lock) {
+                signalled = true;
+                lock.notifyAll();
+            }
+        }
+    }
+
+    /* waits pinned to its carrier, while the signal is queued behind it */
+    static class Waiter implements Runnable {
+        public void run()
+        {
+            Thread.startVirtualThread(new Signal());
+            synchronized (lock) {
+                while (!signalled) {
+                    try {
+                        lock.wait();
+                    } catch (InterruptedException e) {
+                    }
+                }
+            }
+            System.out.println("signalled");
+        }
+    }
+
+    static class Boom implements Runnable {
+        public void run()
+        {
+            throw new IllegalStateException("boom");
+        }
+    }
+
+    public static void main(String[] args) throws InterruptedException
+    {
+        Thread[] threads = new Thread[1000];
+        for (int i = 0; i < threads.length; i++)
+            threads[i] = Thread.startVirtualThread(new Task());
+        for (int i = 0; i < threads.length; i++)
+            threads[i].join();
+        System.out.println(count);
+
+        Thread.startVirtualThread(new Joiner()).join();
+        Thread.startVirtualThread(new Waiter()).join();
+
+        /* reported on the standard error, the VM carries on */
+        Thread boom = Thread.startVirtualThread(new Boom());
+        boom.join();
+        System.out.println(boom.isAlive());
+        System.out.println(boom.getName().length());
+        System.out.println(Thread.currentThread().isVirtual());
+    }
+}
@@ -0,0 +1,331 @@
+/* Java threads on pthreads, and the safepoints which stop them.
+ *
+ * Every thread has its own interpreter state: the Java stack lives on its C
+ * stack, and the pending exception, the lock owner and the object heap are
+ * thread-local. What the threads share, the class heap and the resolved
+ * constants, is published with locks or atomics where it is created.
+ *
+ * A thread counts as running while it executes Java code. It stops counting
+ * when it blocks, on a monitor, in wait(), join() or sleep(), and when it
+ * reaches a safepoint while the world is being stopped. A thread stopping the
+ * world waits until no other thread runs, and the others only run again once
+ * it resumes the world. A carrier counts as one thread, whichever virtual
+ * thread it runs, see vthread.c.
+ */
+
+/* for clock_gettime() */
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "exception.h"
+#include "monitor.h"
+#include "native.h"
+#include "output.h"
+#include "thread.h"
+#include "vthread.h"
+
+/* A virtual thread parked in join(), on its own stack */
+typedef struct joiner {
+    vthread_t *vthread;
+    struct joiner *next;
+} joiner_t;
+
+__thread thread_t *current_thread;
+int safepoint_requested;
+
+static thread_t main_thread;
+
+/* Guards the list of started threads and the safepoint state. The condition
+ * is broadcast when the world is resumed, and when a thread stops running
+ * while it is being stopped.
+ */
+static pthread_mutex_t threads_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t threads_changed = PTHREAD_COND_INITIALIZER;
+static thread_t *threads; /* started and not joined yet */
+static u4 running_threads;
+static bool world_stopped;
+
+/* Guards the joiners of the threads, and their end */
+static pthread_mutex_t joiners_lock = PTHREAD_MUTEX_INITIALIZER;
+
+stack_entry_t *execute(method_t *method,
+                       local_variable_t *locals,
+                       class_file_t *clazz);
+
+/* The calling thread is the main thread, running already. Its object heap
+ * must be initialized.
+ */
+void init_main_thread()
+{
+    main_thread.pthread = pthread_self();
+    main_thread.alive = true;
+    main_thread.name = create_string("main");
+    current_thread = &main_thread;
+    running_threads = 1;
+    init_lock_owner();
+}
+
+/* The thread blocks, or stops running Java code for good: stopping the world
+ * no longer waits for it
+ */
+void enter_blocking()
+{
+    if (current_vthread)
+        carrier_blocks();
+    pthread_mutex_lock(&threads_lock);
+    running_threads--;
+    if (world_stopped)
+        pthread_cond_broadcast(&threads_changed);
+    pthread_mutex_unlock(&threads_lock);
+}
+
+/* The thread runs Java code again, once the world is no longer stopped */
+void leave_blocking()
+{
+    pthread_mutex_lock(&threads_lock);
+    while (world_stopped)
+        pthread_cond_wait(&threads_changed, &threads_lock);
+    running_threads++;
+    pthread_mutex_unlock(&threads_lock);
+    if (current_vthread)
+        carrier_unblocks();
+}
+
+/* Stop at a safepoint until the world is resumed */
+void enter_safepoint()
+{
+    enter_blocking();
+    leave_blocking();
+}
+
+/**
+ * Wait until every other thread is stopped at a safepoint or blocked, and
+ * keep them so until resume_the_world(). The calling thread must not hold
+ * any lock the other threads may wait for while running.
+ */
+void stop_the_world()
+{
+    pthread_mutex_lock(&threads_lock);
+    /* another thread may be stopping the world, and waits for this one */
+    running_threads--;
+    if (world_stopped)
+        pthread_cond_broadcast(&threads_changed);
+    while (world_stopped)
+        pthread_cond_wait(&threads_changed, &threads_lock);
+    world_stopped = true;
+    __atomic_store_n(&safepoint_requested, 1, __ATOMIC_RELAXED);
+    while (running_threads)
+        pthread_cond_wait(&threads_changed, &threads_lock);
+    pthread_mutex_unlock(&threads_lock);
+}
+
+void resume_the_world()
+{
+    pthread_mutex_lock(&threads_lock);
+    world_stopped = false;
+    __atomic_store_n(&safepoint_requested, 0, __ATOMIC_RELAXED);
+    running_threads++;
+    pthread_cond_broadcast(&threads_changed);
+    pthread_mutex_unlock(&threads_lock);
+}
+
+/**
+ * Call a method without parameters on an object, the one its class
+ * overrides.
+ *
+ * @param obj the receiver
+ * @param name the name of the method
+ * @param descriptor its descriptor, ()V or returning a reference
+ * @return the reference it returns, NULL if none or if it threw
+ */
+void *call_method(object_t *obj, const char *name, const char *descriptor)
+{
+    object_t *part = obj;
+    for (; part && part->class; part = part->parent) {
+        method_t *method = find_method(name, descriptor, part->class);
+        if (method) {
+            local_variable_t locals[method->code.max_locals];
+            locals[0].entry.ptr_value = obj;
+            locals[0].type = STACK_ENTRY_REF;
+            stack_entry_t *ret = execute(method, locals, part->class);
+            void *result =
+                ret->type == STACK_ENTRY_REF && !pending_exception
+                    ? ret->entry.ptr_value
+                    : NULL;
+            free(ret);
+            return result;
+        }
+    }
+
+    /* inherited from a class the VM implements */
+    const native_method_t *native =
+        part && part->native
+            ? find_native_method(part->native->name, name, descriptor)
+            : NULL;
+    if (!native)
+        return NULL;
+    stack_entry_t receiver;
+    stack_frame_t op_stack = {.max_size = 1, .store = &receiver};
+    push_ref(&op_stack, obj);
+    native->invoke(&op_stack);
+    return op_stack.size ? pop_ref(&op_stack) : NULL;
+}
+
+/* Report an exception which ended a thread, the way java does */
+static void report_uncaught(thread_t *thread)
+{
+    lock_output();
+    flush_output();
+    fputs("Exception in thread \"", stderr);
+    print_java_string(stderr, thread->name);
+    fputs("\" ", stderr);
+    print_exception(pending_exception);
+    unlock_output();
+    pending_exception = NULL;
+}
+
+/* Run a started thread until it ends, and wake the threads joining it */
+void run_thread(thread_t *thread)
+{
+    call_method(thread->object, "run", "()V");
+    if (pending_exception)
+        report_uncaught(thread);
+
+    /* the virtual threads joining this one are parked, the others wait on
+     * its monitor */
+    pthread_mutex_lock(&joiners_lock);
+    __atomic_store_n(&thread->alive, false, __ATOMIC_RELEASE);
+    for (joiner_t *joiner = thread->joiners; joiner; joiner = joiner->next)
+        unpark_virtual(joiner->vthread);
+    thread->joiners = NULL;
+    pthread_mutex_unlock(&joiners_lock);
+
+    lock_word_t *lock = &thread->object->lock;
+    monitor_enter(lock);
+    monitor_notify(lock, true);
+    monitor_exit(lock);
+}
+
+static void *thread_main(void *arg)
+{
+    thread_t *thread = arg;
+    current_thread = thread;
+    init_lock_owner();
+    init_object_heap();
+    leave_blocking();
+    run_thread(thread);
+    enter_blocking();
+    return NULL;
+}
+
+/**
+ * Start a thread running the run() method of its object.
+ *
+ * @param thread the thread, whose object and name are set
+ * @return false if the system could not create the thread
+ */
+bool start_thread(thread_t *thread)
+{
+    thread->alive = true;
+    pthread_mutex_lock(&threads_lock);
+    if (pthread_create(&thread->pthread, NULL, thread_main, thread)) {
+        pthread_mutex_unlock(&threads_lock);
+        thread->alive = false;
+        return false;
+    }
+    thread->next = threads;
+    threads = thread;
+    pthread_mutex_unlock(&threads_lock);
+    return true;
+}
+
+int64_t read_monotonic_nanos()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* join() of a virtual thread, which parks rather than wait on the monitor */
+static void join_parked(thread_t *thread, int64_t deadline)
+{
+    joiner_t joiner = {.vthread = current_vthread};
+    pthread_mutex_lock(&joiners_lock);
+    while (__atomic_load_n(&thread->alive, __ATOMIC_ACQUIRE) &&
+           (!deadline || read_monotonic_nanos() < deadline)) {
+        joiner.next = thread->joiners;
+        thread->joiners = &joiner;
+        pthread_mutex_unlock(&joiners_lock);
+        park_virtual(deadline);
+        pthread_mutex_lock(&joiners_lock);
+        /* still there, unless the thread has ended */
+        for (joiner_t **link = &thread->joiners; *link; link = &(*link)->next) {
+            if (*link == &joiner) {
+                *link = joiner.next;
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&joiners_lock);
+}
+
+/**
+ * Thread.join(): wait on the monitor of a thread until it ends, like java
+ * does, or park until then in a virtual thread.
+ *
+ * @param thread the thread to wait for
+ * @param millis the longest time to wait, 0 to wait until it ends
+ */
+void join_thread(thread_t *thread, int64_t millis)
+{
+    int64_t deadline = millis ? read_monotonic_nanos() + millis * 1000000 : 0;
+    if (can_park()) {
+        join_parked(thread, deadline);
+        return;
+    }
+
+    lock_word_t *lock = &thread->object->lock;
+    monitor_enter(lock);
+    while (__atomic_load_n(&thread->alive, __ATOMIC_ACQUIRE)) {
+        int64_t remaining = 0;
+        if (deadline) {
+            remaining = deadline - read_monotonic_nanos();
+            if (remaining <= 0)
+                break;
+            /* rounded up, as 0 would wait until notified */
+            remaining = (remaining + 999999) / 1000000;
+        }
+        monitor_wait(lock, remaining);
+    }
+    monitor_exit(lock);
+}
+
+/* The VM exits once every thread has ended, those started meanwhile too */
+void join_threads()
+{
+    enter_blocking();
+    thread_t *joined = NULL;
+    for (;;) {
+        pthread_mutex_lock(&threads_lock);
+        thread_t *thread = threads;
+        if (thread)
+            threads = thread->next;
+        pthread_mutex_unlock(&threads_lock);
+        if (!thread)
+            break;
+
+        pthread_join(thread->pthread, NULL);
+        thread->next = joined;
+        joined = thread;
+    }
+
+    /* the objects of the threads refer to them until now */
+    while (joined) {
+        thread_t *next = joined->next;
+        free(joined);
+        joined = next;
+    }
+}
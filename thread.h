@@ -0,0 +1,64 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+
+#include "object-heap.h"
+
+/* A method a thread runs, on the C stack of execute(). The sampling profiler
+ * walks them from the thread it interrupts, see sampler.c.
+ */
+typedef struct java_frame {
+    method_t *method;
+    class_file_t *clazz;
+    /* the instruction allocating, or calling a method the VM implements,
+     * which the allocation profiler counts at. Set by those instructions
+     * only, see alloc-profile.c. */
+    u4 pc;
+    struct java_frame *caller;
+} java_frame_t;
+
+/* A thread running Java code: the main thread, one started by Thread.start(),
+ * which runs on a pthread of its own, or a virtual thread.
+ */
+typedef struct thread {
+    object_t *object; /* the java.lang.Thread, created lazily for main */
+    string_t *name;
+    pthread_t pthread;       /* unless virtual */
+    struct vthread *vthread; /* NULL unless virtual */
+    bool alive;
+    struct joiner *joiners; /* virtual threads parked in join() */
+    java_frame_t *frame;    /* its innermost method, NULL if none */
+#ifdef PROFILE
+    struct profile_frame *profile_frame; /* of its innermost call */
+#endif
+    struct thread *next;
+} thread_t;
+
+extern __thread thread_t *current_thread;
+
+/* Set while a thread waits for the others to stop, see stop_the_world() */
+extern int safepoint_requested;
+
+void init_main_thread();
+bool start_thread(thread_t *thread);
+void join_thread(thread_t *thread, int64_t millis);
+void join_threads();
+void run_thread(thread_t *thread);
+void *call_method(object_t *obj, const char *name, const char *descriptor);
+int64_t read_monotonic_nanos();
+
+void enter_blocking();
+void leave_blocking();
+void enter_safepoint();
+void stop_the_world();
+void resume_the_world();
+
+/* Called by the interpreter between instructions, where the thread holds no
+ * lock of the VM and may be stopped.
+ */
+static inline void safepoint_poll()
+{
+    if (__atomic_load_n(&safepoint_requested, __ATOMIC_RELAXED))
+        enter_safepoint();
+}
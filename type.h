@@ -7,6 +7,30 @@ typedef uint16_t u2;
 typedef uint32_t u4;
 typedef uint64_t u8;
 
+/* The first word of every object, array and string, and a word of every
+ * class for its static synchronized methods. See monitor.h.
+ */
+typedef uintptr_t lock_word_t;
+
+/* What a reference points at, recorded right after the lock word */
+typedef enum {
+    HEAP_OBJECT = 0, /* zeroed memory holds an object */
+    HEAP_ARRAY = 1,
+    HEAP_STRING = 2,
+    HEAP_BUILDER = 3,
+} heap_kind_t;
+
+/* The words every object, array, string and builder starts with */
+typedef struct {
+    lock_word_t lock;
+    u1 kind; /* see heap_kind_t */
+} heap_header_t;
+
+static inline u1 get_heap_kind(const void *ref)
+{
+    return ((const heap_header_t *) ref)->kind;
+}
+
 typedef enum {
     VAR_NONE = 0,
     VAR_BYTE = 1,
@@ -39,5 +63,6 @@ typedef enum {
     T_BYTE = 8,
     T_SHORT = 9,
     T_INT = 10,
-    T_LONG = 11
+    T_LONG = 11,
+    T_REFERENCE = 12 /* not a newarray type: array of references */
 } array_type_t;
\ No newline at end of file
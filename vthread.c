@@ -0,0 +1,782 @@
+/* Virtual threads, scheduled M:N on a few carrier threads.
+ *
+ * A virtual thread runs the interpreter on a stack of its own, mapped when
+ * it starts, of which the system only commits the pages it touches: the
+ * stack grows as its calls nest, and a thread which never calls deep costs a
+ * few pages. It is as large as the stack of a platform thread, so that a
+ * virtual thread recurses as deep before it overflows. A virtual thread
+ * parks by saving its registers on that stack and switching to the
+ * scheduler of its carrier, which mounts the next one the same way, without
+ * any system call.
+ *
+ * Every carrier runs the virtual threads of its own run queue, first in
+ * first out. A carrier whose queue is empty steals from the tail of another
+ * one, and sleeps once they all are empty. There are as many carriers as
+ * processors, started as the work needs them, and one more for each carrier
+ * blocked by its virtual thread, so that the others still run.
+ *
+ * Like in java, a virtual thread parks in join() and sleep(), and pins its
+ * carrier while it holds a monitor or runs a static initializer, which belong
+ * to the lock_owner of the carrier: it then blocks the carrier as a platform
+ * thread would, and so it does on a contended monitor and in wait(). Virtual
+ * threads are daemons, which the VM does not wait for on exit.
+ *
+ * The frames of a virtual thread address the thread-local variables of the
+ * carrier it runs on, and the compiler may keep their address, or the thread
+ * pointer, in a register or on the stack across a call. So a virtual thread
+ * stays on the carrier it started on: the others only steal those which have
+ * not started yet. On x86-64, the stack switch is written in assembly, and
+ * elsewhere it switches with ucontext.
+ */
+
+/* for MAP_ANONYMOUS, MAP_NORESERVE and MAP_STACK */
+#define _DEFAULT_SOURCE
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#if !defined(__x86_64__)
+#include <ucontext.h>
+#endif
+
+#include "exception.h"
+#include "vthread.h"
+
+#define STACK_CACHE_SIZE 64 /* stacks of ended threads kept for new ones */
+#define MAX_CARRIERS 256
+#define RUN_QUEUE_SIZE 16 /* initial capacity of a run queue */
+
+typedef enum {
+    VTHREAD_RUNNING, /* mounted, or in a run queue */
+    VTHREAD_PARKED,
+    VTHREAD_NOTIFIED, /* unparked while running: it does not park next time */
+} vthread_state_t;
+
+/* Why a virtual thread switches back to the scheduler of its carrier */
+typedef enum {
+    UNMOUNT_YIELD,
+    UNMOUNT_PARK,
+    UNMOUNT_END,
+} unmount_t;
+
+#if defined(__x86_64__)
+typedef void *context_t; /* the stack pointer, the registers are on the stack */
+#else
+typedef ucontext_t context_t;
+#endif
+
+struct vthread {
+    context_t context; /* saved while unmounted */
+    u1 *stack;         /* the mapping, guard page first */
+    thread_t *thread;
+    struct carrier *carrier; /* where it last ran, NULL until it starts */
+    int state;               /* see vthread_state_t */
+    int64_t deadline;        /* of its timer */
+    u4 timer;                /* its index in the timer heap + 1, or 0 */
+    struct vthread *next;    /* in the list of all the virtual threads */
+};
+
+typedef struct carrier {
+    pthread_t pthread;
+    u4 index;             /* in carriers */
+    pthread_mutex_t lock; /* guards the run queue and the idle state */
+    pthread_cond_t wakeup;
+    vthread_t **queue; /* ring buffer of the runnable virtual threads */
+    u4 head, length, capacity;
+    bool idle; /* waiting for work */
+    bool woken;
+    context_t scheduler; /* saved while a virtual thread runs */
+    int request;         /* of the last one which unmounted, see unmount_t */
+} carrier_t;
+
+__thread vthread_t *current_vthread;
+static __thread carrier_t *current_carrier;
+
+static pthread_once_t scheduler_once = PTHREAD_ONCE_INIT;
+static u4 parallelism;
+static size_t page_size;
+static size_t stack_size; /* reserved for each virtual thread */
+
+/* Guards starting carriers. The array is published by carriers_count, and
+ * read without the lock.
+ */
+static pthread_mutex_t carriers_lock = PTHREAD_MUTEX_INITIALIZER;
+static carrier_t *carriers[MAX_CARRIERS];
+static u4 carriers_count;
+static u4 blocked_carriers;
+static u4 idle_carriers;
+static u4 queued; /* virtual threads queued, which any carrier may run */
+static u4 next_carrier; /* for those queued by the other threads */
+static bool shutting_down;
+
+/* Guards the list of the virtual threads and the stack cache */
+static pthread_mutex_t vthreads_lock = PTHREAD_MUTEX_INITIALIZER;
+static vthread_t *vthreads;
+static u1 *stack_cache[STACK_CACHE_SIZE];
+static u4 cached_stacks;
+
+/* The virtual threads parked until a deadline, in a binary heap */
+static pthread_mutex_t timers_lock = PTHREAD_MUTEX_INITIALIZER;
+static vthread_t **timers;
+static u4 timers_length, timers_capacity;
+static int64_t next_deadline = INT64_MAX; /* of the first timer */
+
+static void vthread_main();
+
+#if defined(__x86_64__)
+/* Save the registers a callee preserves on the current stack, and the stack
+ * pointer into *from, then restore them from the stack saved in *to.
+ */
+void switch_context(context_t *from, context_t *to);
+__asm__(".text\n"
+        ".type switch_context, @function\n"
+        "switch_context:\n"
+        "    pushq %rbp\n"
+        "    pushq %rbx\n"
+        "    pushq %r12\n"
+        "    pushq %r13\n"
+        "    pushq %r14\n"
+        "    pushq %r15\n"
+        "    movq %rsp, (%rdi)\n"
+        "    movq (%rsi), %rsp\n"
+        "    popq %r15\n"
+        "    popq %r14\n"
+        "    popq %r13\n"
+        "    popq %r12\n"
+        "    popq %rbx\n"
+        "    popq %rbp\n"
+        "    ret\n"
+        ".size switch_context, .-switch_context\n");
+
+/* Lay out the stack of a virtual thread as if it had switched away right
+ * when vthread_main() was called
+ */
+static void init_context(vthread_t *vthread)
+{
+    void **sp = (void **) (vthread->stack + stack_size);
+    *--sp = NULL; /* where vthread_main() would return, which it never does */
+    *--sp = (void *) vthread_main;
+    for (int i = 0; i < 6; i++)
+        *--sp = NULL;
+    vthread->context = sp;
+}
+#else
+static void switch_context(context_t *from, context_t *to)
+{
+    swapcontext(from, to);
+}
+
+static void init_context(vthread_t *vthread)
+{
+    getcontext(&vthread->context);
+    vthread->context.uc_stack.ss_sp = vthread->stack + page_size;
+    vthread->context.uc_stack.ss_size = stack_size - page_size;
+    vthread->context.uc_link = NULL;
+    makecontext(&vthread->context, vthread_main, 0);
+}
+#endif
+
+/* Whether a virtual thread may run on any carrier, until it first runs */
+static inline bool can_migrate(vthread_t *vthread)
+{
+    return !vthread->carrier;
+}
+
+static void init_scheduler()
+{
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    parallelism = count > 0 ? count : 1;
+    page_size = sysconf(_SC_PAGESIZE);
+
+    /* the default of the platform threads, which follows ulimit -s */
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_getstacksize(&attr, &stack_size);
+    pthread_attr_destroy(&attr);
+    stack_size = (stack_size + page_size - 1) & ~(page_size - 1);
+}
+
+static u1 *map_stack()
+{
+    pthread_mutex_lock(&vthreads_lock);
+    u1 *stack = cached_stacks ? stack_cache[--cached_stacks] : NULL;
+    pthread_mutex_unlock(&vthreads_lock);
+    if (stack)
+        return stack;
+
+    stack = mmap(NULL, stack_size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1,
+                 0);
+    if (stack == MAP_FAILED)
+        return NULL;
+    /* overflowing the stack faults rather than overwrite what lies below */
+    mprotect(stack, page_size, PROT_NONE);
+    return stack;
+}
+
+static void unmap_stack(u1 *stack)
+{
+    pthread_mutex_lock(&vthreads_lock);
+    if (cached_stacks < STACK_CACHE_SIZE) {
+        stack_cache[cached_stacks++] = stack;
+        stack = NULL;
+    }
+    pthread_mutex_unlock(&vthreads_lock);
+    if (stack)
+        munmap(stack, stack_size);
+}
+
+/* Append a virtual thread to the run queue of a carrier, whose lock is held */
+static void push_queue(carrier_t *carrier, vthread_t *vthread)
+{
+    if (carrier->length == carrier->capacity) {
+        u4 capacity =
+            carrier->capacity ? carrier->capacity * 2 : RUN_QUEUE_SIZE;
+        vthread_t **queue = malloc(capacity * sizeof(vthread_t *));
+        assert(queue && "Failed to allocate run queue");
+        for (u4 i = 0; i < carrier->length; i++)
+            queue[i] = carrier->queue[(carrier->head + i) % carrier->capacity];
+        free(carrier->queue);
+        carrier->queue = queue;
+        carrier->head = 0;
+        carrier->capacity = capacity;
+    }
+    carrier->queue[(carrier->head + carrier->length++) % carrier->capacity] =
+        vthread;
+    if (can_migrate(vthread))
+        __atomic_add_fetch(&queued, 1, __ATOMIC_SEQ_CST);
+}
+
+/* Remove the virtual thread at an index of a run queue, whose lock is held */
+static vthread_t *remove_queue(carrier_t *carrier, u4 index)
+{
+    vthread_t **queue = carrier->queue;
+    u4 capacity = carrier->capacity;
+    vthread_t *vthread = queue[(carrier->head + index) % capacity];
+    if (!index) {
+        carrier->head = (carrier->head + 1) % capacity;
+    } else {
+        for (u4 i = index; i + 1 < carrier->length; i++)
+            queue[(carrier->head + i) % capacity] =
+                queue[(carrier->head + i + 1) % capacity];
+    }
+    carrier->length--;
+    if (can_migrate(vthread))
+        __atomic_sub_fetch(&queued, 1, __ATOMIC_SEQ_CST);
+    return vthread;
+}
+
+static void *carrier_main(void *arg);
+
+/* Start one more carrier, with carriers_lock held */
+static bool start_carrier()
+{
+    carrier_t *carrier = calloc(1, sizeof(carrier_t));
+    assert(carrier && "Failed to allocate carrier");
+    carrier->index = carriers_count;
+    pthread_mutex_init(&carrier->lock, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&carrier->wakeup, &attr);
+    pthread_condattr_destroy(&attr);
+    if (pthread_create(&carrier->pthread, NULL, carrier_main, carrier)) {
+        pthread_cond_destroy(&carrier->wakeup);
+        pthread_mutex_destroy(&carrier->lock);
+        free(carrier);
+        return false;
+    }
+    carriers[carriers_count] = carrier;
+    __atomic_store_n(&carriers_count, carriers_count + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/**
+ * Make sure that some carrier runs the queued virtual threads: wake an idle
+ * carrier, or start one.
+ *
+ * @param start whether to start a carrier when none is idle, unless there
+ * are enough carriers running already
+ */
+static void wake_carrier(bool start)
+{
+    if (__atomic_load_n(&idle_carriers, __ATOMIC_SEQ_CST)) {
+        u4 count = __atomic_load_n(&carriers_count, __ATOMIC_ACQUIRE);
+        for (u4 i = 0; i < count; i++) {
+            carrier_t *carrier = carriers[i];
+            pthread_mutex_lock(&carrier->lock);
+            bool wake = carrier->idle && !carrier->woken;
+            if (wake) {
+                carrier->woken = true;
+                pthread_cond_signal(&carrier->wakeup);
+            }
+            pthread_mutex_unlock(&carrier->lock);
+            if (wake)
+                return;
+        }
+    }
+
+    u4 limit =
+        parallelism + __atomic_load_n(&blocked_carriers, __ATOMIC_RELAXED);
+    if (!start || __atomic_load_n(&carriers_count, __ATOMIC_RELAXED) >= limit)
+        return;
+    pthread_mutex_lock(&carriers_lock);
+    if (carriers_count < limit && carriers_count < MAX_CARRIERS &&
+        !__atomic_load_n(&shutting_down, __ATOMIC_RELAXED))
+        start_carrier();
+    pthread_mutex_unlock(&carriers_lock);
+}
+
+/* Queue a runnable virtual thread, on the current carrier if possible */
+static void make_runnable(vthread_t *vthread)
+{
+    carrier_t *carrier = current_carrier;
+    if (!carrier || !can_migrate(vthread))
+        carrier = vthread->carrier;
+    if (!carrier) {
+        u4 count = __atomic_load_n(&carriers_count, __ATOMIC_ACQUIRE);
+        carrier = carriers[__atomic_fetch_add(&next_carrier, 1,
+                                              __ATOMIC_RELAXED) %
+                           count];
+    }
+
+    pthread_mutex_lock(&carrier->lock);
+    push_queue(carrier, vthread);
+    bool wake = carrier->idle && !carrier->woken;
+    if (wake) {
+        carrier->woken = true;
+        pthread_cond_signal(&carrier->wakeup);
+    }
+    pthread_mutex_unlock(&carrier->lock);
+    if (!wake)
+        wake_carrier(true);
+}
+
+/* Append a virtual thread its carrier has just unmounted to its queue */
+static void requeue(carrier_t *carrier, vthread_t *vthread)
+{
+    pthread_mutex_lock(&carrier->lock);
+    push_queue(carrier, vthread);
+    pthread_mutex_unlock(&carrier->lock);
+}
+
+static void place_timer(u4 index, vthread_t *vthread)
+{
+    timers[index] = vthread;
+    vthread->timer = index + 1;
+}
+
+static void sift_up_timer(u4 index)
+{
+    vthread_t *vthread = timers[index];
+    while (index) {
+        u4 parent = (index - 1) / 2;
+        if (timers[parent]->deadline <= vthread->deadline)
+            break;
+        place_timer(index, timers[parent]);
+        index = parent;
+    }
+    place_timer(index, vthread);
+}
+
+static void sift_down_timer(u4 index)
+{
+    vthread_t *vthread = timers[index];
+    for (;;) {
+        u4 child = 2 * index + 1;
+        if (child >= timers_length)
+            break;
+        if (child + 1 < timers_length &&
+            timers[child + 1]->deadline < timers[child]->deadline)
+            child++;
+        if (vthread->deadline <= timers[child]->deadline)
+            break;
+        place_timer(index, timers[child]);
+        index = child;
+    }
+    place_timer(index, vthread);
+}
+
+/* The timers below all need timers_lock */
+static void update_next_deadline()
+{
+    __atomic_store_n(&next_deadline,
+                     timers_length ? timers[0]->deadline : INT64_MAX,
+                     __ATOMIC_RELAXED);
+}
+
+static void remove_timer_at(u4 index)
+{
+    timers[index]->timer = 0;
+    vthread_t *last = timers[--timers_length];
+    if (index == timers_length)
+        return;
+    timers[index] = last;
+    sift_down_timer(index);
+    sift_up_timer(last->timer - 1);
+}
+
+static void add_timer(vthread_t *vthread, int64_t deadline)
+{
+    pthread_mutex_lock(&timers_lock);
+    if (timers_length == timers_capacity) {
+        timers_capacity = timers_capacity ? timers_capacity * 2 : 16;
+        timers = realloc(timers, timers_capacity * sizeof(vthread_t *));
+        assert(timers && "Failed to allocate timers");
+    }
+    vthread->deadline = deadline;
+    timers[timers_length] = vthread;
+    sift_up_timer(timers_length++);
+    bool first = vthread->timer == 1;
+    update_next_deadline();
+    pthread_mutex_unlock(&timers_lock);
+
+    /* the idle carriers wait for the first timer */
+    if (first)
+        wake_carrier(false);
+}
+
+static void remove_timer(vthread_t *vthread)
+{
+    pthread_mutex_lock(&timers_lock);
+    if (vthread->timer) {
+        remove_timer_at(vthread->timer - 1);
+        update_next_deadline();
+    }
+    pthread_mutex_unlock(&timers_lock);
+}
+
+/* Unpark the virtual threads whose deadline has passed */
+static void fire_timers()
+{
+    int64_t deadline = __atomic_load_n(&next_deadline, __ATOMIC_RELAXED);
+    if (deadline == INT64_MAX)
+        return;
+    int64_t now = read_monotonic_nanos();
+    if (deadline > now)
+        return;
+
+    pthread_mutex_lock(&timers_lock);
+    while (timers_length && timers[0]->deadline <= now) {
+        vthread_t *vthread = timers[0];
+        remove_timer_at(0);
+        unpark_virtual(vthread);
+    }
+    update_next_deadline();
+    pthread_mutex_unlock(&timers_lock);
+}
+
+/* Take a virtual thread another carrier has queued */
+static vthread_t *steal(carrier_t *thief)
+{
+    if (!__atomic_load_n(&queued, __ATOMIC_SEQ_CST))
+        return NULL;
+    u4 count = __atomic_load_n(&carriers_count, __ATOMIC_ACQUIRE);
+    for (u4 i = 1; i < count; i++) {
+        carrier_t *victim = carriers[(thief->index + i) % count];
+        vthread_t *vthread = NULL;
+        pthread_mutex_lock(&victim->lock);
+        for (u4 at = victim->length; at-- > 0;) {
+            if (can_migrate(
+                    victim->queue[(victim->head + at) % victim->capacity])) {
+                vthread = remove_queue(victim, at);
+                break;
+            }
+        }
+        pthread_mutex_unlock(&victim->lock);
+        if (vthread)
+            return vthread;
+    }
+    return NULL;
+}
+
+/**
+ * Sleep until a virtual thread is queued, or until the first timer expires.
+ *
+ * @return false once the carrier is to end
+ */
+static bool wait_for_work(carrier_t *carrier)
+{
+    enter_blocking();
+    pthread_mutex_lock(&carrier->lock);
+    carrier->idle = true;
+    carrier->woken = false;
+    __atomic_add_fetch(&idle_carriers, 1, __ATOMIC_SEQ_CST);
+    while (!carrier->woken &&
+           !__atomic_load_n(&shutting_down, __ATOMIC_RELAXED) &&
+           !__atomic_load_n(&queued, __ATOMIC_SEQ_CST)) {
+        int64_t deadline = __atomic_load_n(&next_deadline, __ATOMIC_RELAXED);
+        if (deadline == INT64_MAX) {
+            pthread_cond_wait(&carrier->wakeup, &carrier->lock);
+            continue;
+        }
+        if (deadline <= read_monotonic_nanos())
+            break;
+        struct timespec ts = {
+            .tv_sec = deadline / 1000000000,
+            .tv_nsec = deadline % 1000000000,
+        };
+        if (pthread_cond_timedwait(&carrier->wakeup, &carrier->lock, &ts) ==
+            ETIMEDOUT)
+            break;
+    }
+    __atomic_sub_fetch(&idle_carriers, 1, __ATOMIC_SEQ_CST);
+    carrier->idle = false;
+    pthread_mutex_unlock(&carrier->lock);
+
+    /* ends blocked, as stopping the world need not wait for it */
+    if (__atomic_load_n(&shutting_down, __ATOMIC_RELAXED))
+        return false;
+    leave_blocking();
+    return true;
+}
+
+/* The next virtual thread the carrier runs, NULL once it is to end */
+static vthread_t *next_vthread(carrier_t *carrier)
+{
+    for (;;) {
+        fire_timers();
+        pthread_mutex_lock(&carrier->lock);
+        vthread_t *vthread =
+            carrier->length ? remove_queue(carrier, 0) : NULL;
+        pthread_mutex_unlock(&carrier->lock);
+        if (!vthread)
+            vthread = steal(carrier);
+        if (vthread) {
+            /* share the rest with the idle carriers */
+            if (__atomic_load_n(&queued, __ATOMIC_SEQ_CST))
+                wake_carrier(true);
+            return vthread;
+        }
+        if (!wait_for_work(carrier))
+            return NULL;
+    }
+}
+
+/* Handle the request of the virtual thread the carrier has just unmounted */
+static void unmounted(carrier_t *carrier, vthread_t *vthread)
+{
+    switch (carrier->request) {
+    case UNMOUNT_YIELD:
+        requeue(carrier, vthread);
+        break;
+    case UNMOUNT_PARK: {
+        /* only now can an unpark() requeue it */
+        int running = VTHREAD_RUNNING;
+        if (!__atomic_compare_exchange_n(&vthread->state, &running,
+                                         VTHREAD_PARKED, false,
+                                         __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+            /* unparked before it was parked */
+            __atomic_store_n(&vthread->state, VTHREAD_RUNNING,
+                             __ATOMIC_RELAXED);
+            requeue(carrier, vthread);
+        }
+        break;
+    }
+    case UNMOUNT_END:
+        unmap_stack(vthread->stack);
+        vthread->stack = NULL;
+        break;
+    }
+}
+
+static void *carrier_main(void *arg)
+{
+    carrier_t *carrier = arg;
+    current_carrier = carrier;
+    init_lock_owner();
+    init_object_heap();
+    leave_blocking();
+
+    for (vthread_t *vthread; (vthread = next_vthread(carrier));) {
+        vthread->carrier = carrier;
+        current_vthread = vthread;
+        current_thread = vthread->thread;
+        switch_context(&carrier->scheduler, &vthread->context);
+        current_vthread = NULL;
+        current_thread = NULL;
+        unmounted(carrier, vthread);
+    }
+    return NULL;
+}
+
+/* Switch from the current virtual thread to the scheduler of its carrier */
+static void unmount(unmount_t request)
+{
+    carrier_t *carrier = current_carrier;
+    carrier->request = request;
+    switch_context(&current_vthread->context, &carrier->scheduler);
+}
+
+static void vthread_main()
+{
+    run_thread(current_vthread->thread);
+    unmount(UNMOUNT_END);
+}
+
+/**
+ * Start a thread running the run() method of its object on the carriers.
+ *
+ * @param thread the thread, whose object and name are set
+ * @return false if the system could not map its stack, or start a carrier
+ */
+bool start_virtual_thread(thread_t *thread)
+{
+    pthread_once(&scheduler_once, init_scheduler);
+    vthread_t *vthread = calloc(1, sizeof(vthread_t));
+    assert(vthread && "Failed to allocate virtual thread");
+    vthread->stack = map_stack();
+    if (!vthread->stack) {
+        free(vthread);
+        return false;
+    }
+
+    pthread_mutex_lock(&carriers_lock);
+    bool started = carriers_count || start_carrier();
+    pthread_mutex_unlock(&carriers_lock);
+    if (!started) {
+        unmap_stack(vthread->stack);
+        free(vthread);
+        return false;
+    }
+
+    vthread->thread = thread;
+    init_context(vthread);
+    thread->vthread = vthread;
+    thread->alive = true;
+    pthread_mutex_lock(&vthreads_lock);
+    vthread->next = vthreads;
+    vthreads = vthread;
+    pthread_mutex_unlock(&vthreads_lock);
+    make_runnable(vthread);
+    return true;
+}
+
+/**
+ * Park the current virtual thread until it is unparked. It may return
+ * earlier, so the caller checks what it waits for again.
+ *
+ * @param deadline when to return at the latest, in nanoseconds on the
+ * monotonic clock, 0 to wait until unparked
+ */
+void park_virtual(int64_t deadline)
+{
+    vthread_t *vthread = current_vthread;
+    assert(can_park() && !pending_exception && "Cannot park thread");
+    int notified = VTHREAD_NOTIFIED;
+    if (__atomic_compare_exchange_n(&vthread->state, &notified,
+                                    VTHREAD_RUNNING, false, __ATOMIC_SEQ_CST,
+                                    __ATOMIC_SEQ_CST))
+        return;
+    if (deadline)
+        add_timer(vthread, deadline);
+    unmount(UNMOUNT_PARK);
+    if (deadline)
+        remove_timer(vthread);
+}
+
+/* Make a parked virtual thread runnable, or the next park of a running one
+ * return at once
+ */
+void unpark_virtual(vthread_t *vthread)
+{
+    int state = __atomic_load_n(&vthread->state, __ATOMIC_SEQ_CST);
+    for (;;) {
+        if (state == VTHREAD_NOTIFIED)
+            return;
+        int next =
+            state == VTHREAD_PARKED ? VTHREAD_RUNNING : VTHREAD_NOTIFIED;
+        if (__atomic_compare_exchange_n(&vthread->state, &state, next, false,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+            break;
+    }
+    if (state == VTHREAD_PARKED)
+        make_runnable(vthread);
+}
+
+/* Thread.sleep() of a virtual thread, which parks rather than block */
+void sleep_virtual(int64_t millis)
+{
+    int64_t deadline = read_monotonic_nanos() + millis * 1000000;
+    while (read_monotonic_nanos() < deadline)
+        park_virtual(deadline);
+}
+
+/* Thread.yield() of a virtual thread: let the others queued run first */
+void yield_virtual()
+{
+    assert(can_park() && !pending_exception && "Cannot yield thread");
+    unmount(UNMOUNT_YIELD);
+}
+
+/* The virtual thread of the current carrier is about to block it. Another
+ * carrier takes its place meanwhile, to run the threads queued behind.
+ */
+void carrier_blocks()
+{
+    carrier_t *carrier = current_carrier;
+    __atomic_add_fetch(&blocked_carriers, 1, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&carrier->lock);
+    bool waiting = carrier->length;
+    pthread_mutex_unlock(&carrier->lock);
+    if (waiting)
+        wake_carrier(true);
+}
+
+void carrier_unblocks()
+{
+    __atomic_sub_fetch(&blocked_carriers, 1, __ATOMIC_RELAXED);
+}
+
+/* Whether a virtual thread has not ended yet. Called on exit, once the
+ * platform threads have ended.
+ */
+bool virtual_threads_alive()
+{
+    pthread_mutex_lock(&vthreads_lock);
+    bool alive = false;
+    for (vthread_t *vthread = vthreads; vthread; vthread = vthread->next)
+        alive |= __atomic_load_n(&vthread->thread->alive, __ATOMIC_ACQUIRE);
+    pthread_mutex_unlock(&vthreads_lock);
+    return alive;
+}
+
+/* End the carriers, once the virtual threads have all ended, and free them */
+void free_virtual_threads()
+{
+    if (!__atomic_load_n(&carriers_count, __ATOMIC_ACQUIRE))
+        return;
+
+    /* no carrier starts from now on */
+    pthread_mutex_lock(&carriers_lock);
+    __atomic_store_n(&shutting_down, true, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&carriers_lock);
+    for (u4 i = 0; i < carriers_count; i++) {
+        carrier_t *carrier = carriers[i];
+        pthread_mutex_lock(&carrier->lock);
+        pthread_cond_signal(&carrier->wakeup);
+        pthread_mutex_unlock(&carrier->lock);
+    }
+    for (u4 i = 0; i < carriers_count; i++) {
+        carrier_t *carrier = carriers[i];
+        pthread_join(carrier->pthread, NULL);
+        pthread_cond_destroy(&carrier->wakeup);
+        pthread_mutex_destroy(&carrier->lock);
+        free(carrier->queue);
+        free(carrier);
+    }
+
+    while (vthreads) {
+        vthread_t *next = vthreads->next;
+        free(vthreads->thread);
+        free(vthreads);
+        vthreads = next;
+    }
+    while (cached_stacks)
+        munmap(stack_cache[--cached_stacks], stack_size);
+    free(timers);
+}
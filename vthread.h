@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "monitor.h"
+#include "thread.h"
+
+/* A virtual thread, run by the carrier threads, see vthread.c */
+typedef struct vthread vthread_t;
+
+/* The virtual thread the current carrier runs, NULL on the other threads */
+extern __thread vthread_t *current_vthread;
+
+bool start_virtual_thread(thread_t *thread);
+void park_virtual(int64_t deadline);
+void unpark_virtual(vthread_t *vthread);
+void sleep_virtual(int64_t millis);
+void yield_virtual();
+void carrier_blocks();
+void carrier_unblocks();
+bool virtual_threads_alive();
+void free_virtual_threads();
+
+/* Whether the current thread is a virtual thread free to leave its carrier
+ * while it waits, rather than to block it
+ */
+static inline bool can_park()
+{
+    return current_vthread && !pinned;
+}